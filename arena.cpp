@@ -0,0 +1,108 @@
+#include "arena.h"
+
+namespace honeybase
+{
+
+static const size_t ARENA_ALIGNMENT     = sizeof(u64);
+
+static size_t
+AlignUp(const size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Arena
+///////////////////////////////////////////////////////////////////////////////
+Arena::Arena()
+: m_First(NULL)
+, m_Pos(NULL)
+, m_End(NULL)
+{
+}
+
+Arena::~Arena()
+{
+    FreeBlocks(m_First);
+}
+
+void*
+Arena::Alloc(const size_t size)
+{
+    const size_t alignedSize = AlignUp(size);
+
+    if((size_t)(m_End - m_Pos) < alignedSize)
+    {
+        Block* block = AllocBlock(alignedSize);
+        if(!block)
+        {
+            return NULL;
+        }
+
+        if(m_First)
+        {
+            block->m_Next = m_First->m_Next;
+            m_First->m_Next = block;
+        }
+        else
+        {
+            m_First = block;
+        }
+
+        m_Pos = (byte*)block + AlignUp(sizeof(Block));
+        m_End = (byte*)block + block->m_Size;
+    }
+
+    void* mem = m_Pos;
+    m_Pos += alignedSize;
+    return mem;
+}
+
+void
+Arena::Reset()
+{
+    if(m_First)
+    {
+        //Most commands fit in the first block, so there's usually
+        //nothing to free.
+        FreeBlocks(m_First->m_Next);
+        m_First->m_Next = NULL;
+
+        m_Pos = (byte*)m_First + AlignUp(sizeof(Block));
+        m_End = (byte*)m_First + m_First->m_Size;
+    }
+}
+
+//private:
+
+Arena::Block*
+Arena::AllocBlock(const size_t minSize)
+{
+    size_t size = AlignUp(sizeof(Block)) + minSize;
+    if(size < BLOCK_SIZE)
+    {
+        size = BLOCK_SIZE;
+    }
+
+    Block* block = (Block*) Heap::Alloc(size, HEAPTAG_COMMAND);
+    if(block)
+    {
+        block->m_Next = NULL;
+        block->m_Size = size;
+    }
+
+    return block;
+}
+
+void
+Arena::FreeBlocks(Block* block)
+{
+    while(block)
+    {
+        Block* next = block->m_Next;
+        Heap::Free(block, HEAPTAG_COMMAND);
+        block = next;
+    }
+}
+
+}   //namespace honeybase
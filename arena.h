@@ -0,0 +1,56 @@
+#ifndef __HB_ARENA_H__
+#define __HB_ARENA_H__
+
+#include "hb.h"
+
+namespace honeybase
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//  Arena
+//
+//  Bump allocator for memory that lives only as long as one command.
+//  Nothing is freed individually; Reset() releases everything at once
+//  and keeps the first block for the next command.
+///////////////////////////////////////////////////////////////////////////////
+class Arena
+{
+public:
+
+    static const size_t BLOCK_SIZE  = 4096;
+
+    Arena();
+    ~Arena();
+
+    //Returns memory aligned for any of the types stored in the arena,
+    //or NULL if a new block couldn't be allocated.
+    void* Alloc(const size_t size);
+
+    void Reset();
+
+private:
+
+    class Block
+    {
+    public:
+        Block* m_Next;
+        size_t m_Size;
+    };
+
+    Block* AllocBlock(const size_t minSize);
+
+    void FreeBlocks(Block* block);
+
+    //m_First is the block kept across resets.  Blocks added after it
+    //are linked from m_First->m_Next, newest first.
+    Block* m_First;
+    byte* m_Pos;
+    byte* m_End;
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_ARENA_H__
@@ -1,6 +1,6 @@
 #include "btree.h"
 
-#include <new.h>
+#include <new>
 #include <string.h>
 
 #include "skiplist.h"
@@ -129,7 +129,7 @@ BTree::BTree(const ValueType keyType)
 BTree*
 BTree::Create(const ValueType keyType)
 {
-    BTree* btree = (BTree*) Heap::ZAlloc(sizeof(BTree));
+    BTree* btree = (BTree*) Heap::ZAlloc(sizeof(BTree), HEAPTAG_BTREE);
     if(btree)
     {
         new (btree) BTree(keyType);
@@ -144,7 +144,7 @@ BTree::Destroy(BTree* btree)
     if(btree)
     {
         btree->DeleteAll();
-        Heap::Free(btree);
+        Heap::Free(btree, HEAPTAG_BTREE);
     }
 }
 
@@ -736,6 +736,12 @@ BTree::GetUtilization() const
     return (m_Capacity > 0 ) ? (double)m_Count/m_Capacity : 0;
 }
 
+size_t
+BTree::Defrag()
+{
+    return m_Nodes ? DefragNode(&m_Nodes, 0) : 0;
+}
+
 void
 BTree::Validate() const
 {
@@ -1245,10 +1251,74 @@ BTree::ValidateNode(const int depth, BTreeNode* node) const
 
 #endif  //HB_ASSERT
 
+size_t
+BTree::DefragNode(BTreeNode** pnode, const int depth)
+{
+    size_t numMoved = 0;
+    const bool isLeaf = (depth == m_Depth-1);
+
+    BTreeNode* node = *pnode;
+    if(Heap::ShouldMove(node))
+    {
+        BTreeNode* moved = (BTreeNode*) Heap::Move(node);
+        if(moved)
+        {
+            if(isLeaf)
+            {
+                //Fix up the linked list of leaves.
+                if(moved->m_Prev)
+                {
+                    moved->m_Prev->m_Items[moved->m_Prev->m_MaxKeys].m_Node = moved;
+                }
+                else
+                {
+                    hbassert(m_Leaves == node);
+                    m_Leaves = moved;
+                }
+
+                BTreeNode* next = moved->m_Items[moved->m_MaxKeys].m_Node;
+                if(next)
+                {
+                    next->m_Prev = moved;
+                }
+            }
+
+            *pnode = node = moved;
+            ++numMoved;
+        }
+    }
+
+    if(isLeaf)
+    {
+        for(int i = 0; i < node->m_NumKeys; ++i)
+        {
+            BTreeItem* item = &node->m_Items[i];
+            if(VALUETYPE_BLOB == item->m_ValueType && !item->m_IsDup)
+            {
+                Blob* value = Blob::Move(item->m_Value.m_Blob);
+                if(value != item->m_Value.m_Blob)
+                {
+                    item->m_Value.m_Blob = value;
+                    ++numMoved;
+                }
+            }
+        }
+    }
+    else
+    {
+        for(int i = 0; i <= node->m_NumKeys; ++i)
+        {
+            numMoved += DefragNode(&node->m_Items[i].m_Node, depth+1);
+        }
+    }
+
+    return numMoved;
+}
+
 BTreeNode*
 BTree::AllocNode()
 {
-    BTreeNode* node = (BTreeNode*)Heap::ZAlloc(sizeof(BTreeNode));
+    BTreeNode* node = (BTreeNode*)Heap::ZAlloc(sizeof(BTreeNode), HEAPTAG_BTREE);
     if(node)
     {
         const_cast<int&>(node->m_MaxKeys) = BTreeNode::MAX_KEYS;
@@ -1264,7 +1334,7 @@ BTree::FreeNode(BTreeNode* node)
     if(node)
     {
         m_Capacity -= node->m_MaxKeys+1;
-        Heap::Free(node);
+        Heap::Free(node, HEAPTAG_BTREE);
     }
 }
 
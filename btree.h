@@ -111,6 +111,12 @@ public:
 
     double GetUtilization() const;
 
+    //Moves nodes, and Blob values nothing else references, out of
+    //heap spans that are emptier than most.  Where AUTO_DEFRAG packs
+    //keys into fewer nodes, this packs the nodes and values into fewer
+    //spans.  Returns the number of allocations moved.
+    size_t Defrag();
+
     void Validate() const;
 
 private:
@@ -134,6 +140,9 @@ private:
 
     void TrimNode(BTreeNode* node, const int depth);
 
+    //Defrag() for the subtree whose root *pnode points at.
+    size_t DefragNode(BTreeNode** pnode, const int depth);
+
     void ValidateNode(const int depth, BTreeNode* node) const;
 
     BTreeNode* AllocNode();
@@ -3,11 +3,130 @@
 #include "dict.h"
 #include "error.h"
 
+#include <stdio.h>
 #include <string.h>
 
 namespace honeybase
 {
 
+bool Command::sm_FastParse = true;
+
+//Returns the first '\r' in [p, end), or end if there isn't one.
+static const u8*
+FindCR(const u8* p, const u8* end)
+{
+#if HB_SSE2
+    const __m128i cr = _mm_set1_epi8('\r');
+    for(; end - p >= 16; p += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, cr));
+        if(mask)
+        {
+            return p + LowestBit(mask);
+        }
+    }
+#endif
+
+    for(; p < end; ++p)
+    {
+        if('\r' == *p)
+        {
+            break;
+        }
+    }
+
+    return p;
+}
+
+//Parses a positive decimal number terminated by CRLF, such as the
+//argument count or an argument length, and advances *pp past the CRLF.
+//Returns false if the line is incomplete or malformed.
+static bool
+ParseNumberLine(const u8** pp, const u8* end, int* value)
+{
+    const u8* p = *pp;
+    const u8* cr = FindCR(p, end);
+
+    //At most 9 digits, so the value can't overflow.
+    const ptrdiff_t numDigits = cr - p;
+    if(numDigits <= 0 || numDigits > 9 || end - cr < 2 || '\n' != cr[1])
+    {
+        return false;
+    }
+
+    int n = 0;
+    for(; p < cr; ++p)
+    {
+        const unsigned digit = *p - '0';
+        if(digit > 9)
+        {
+            return false;
+        }
+
+        n = (n * 10) + digit;
+    }
+
+    *value = n;
+    *pp = cr + 2;
+    return n > 0;
+}
+
+//Longest value APPEND and SETRANGE will make.
+static const size_t MAX_VALUE_LEN = 512*1024*1024;
+
+//Parses a non-negative decimal argument such as an offset.
+static bool
+ParseOffset(const Blob* arg, size_t* value)
+{
+    const byte* data;
+    const size_t len = arg->GetData(&data);
+
+    //At most 9 digits, so the value can't overflow.
+    if(0 == len || len > 9)
+    {
+        return false;
+    }
+
+    size_t n = 0;
+    for(size_t i = 0; i < len; ++i)
+    {
+        const unsigned digit = data[i] - '0';
+        if(digit > 9)
+        {
+            return false;
+        }
+
+        n = (n * 10) + digit;
+    }
+
+    *value = n;
+    return true;
+}
+
+//True if arg is the lower case word, in any case.
+static bool
+IsWord(const Blob* arg, const char* word)
+{
+    const byte* data;
+    const size_t len = arg->GetData(&data);
+    if(len != strlen(word))
+    {
+        return false;
+    }
+
+    //Letters only, so setting 0x20 folds case.
+    for(size_t i = 0; i < len; ++i)
+    {
+        if((data[i] | 0x20) != (byte)word[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 Command::Command()
 : m_State(STATE_ASTERISK)
 , m_NextState(STATE_ASTERISK)
@@ -21,6 +140,8 @@ Command::Command()
 , m_ResultC(0)
 , m_ResultV(NULL)
 , m_ResultT(NULL)
+, m_ResultBlob(NULL)
+, m_Spec(NULL)
 {
 }
 
@@ -34,28 +155,39 @@ Command::Reset()
 {
     if(m_ArgV)
     {
-        for(int i = 0; i < m_CurArg; ++i)
-        {
-            m_ArgV[i]->Unref();
-        }
-
-        delete [] m_ArgV;
-    }
+        //Include an argument that's been created but not filled in.
+        const bool argStarted =
+            STATE_ARG == m_State || (STATE_LF == m_State && STATE_ARG == m_NextState);
+        const int numArgs = argStarted ? m_CurArg + 1 : m_CurArg;
 
-    if(m_ResultV && &m_SingleResultValue != m_ResultV)
-    {
-        for(int i = 0; i < m_ResultC; ++i)
+        for(int i = 0; i < numArgs; ++i)
         {
-            if(VALUETYPE_BLOB == m_ResultT[i])
+            //NULL if it couldn't be allocated.
+            if(!m_ArgV[i])
             {
-                m_ResultV[i].m_Blob->Unref();
+                continue;
+            }
+
+            if(IsArenaArg(i, m_ArgV[i]->Length()))
+            {
+                //Nothing may keep an arena argument.
+                hbassert(1 == m_ArgV[i]->NumRefs());
+            }
+            else
+            {
+                m_ArgV[i]->Unref();
             }
         }
+    }
 
-        delete [] m_ResultV;
-        delete [] m_ResultT;
+    if(m_ResultBlob)
+    {
+        m_ResultBlob->Unref();
+        m_ResultBlob = NULL;
     }
 
+    m_Arena.Reset();
+
     m_State = STATE_ASTERISK;
     m_NextState = STATE_ASTERISK;
     m_ArgC = 0;
@@ -69,6 +201,7 @@ Command::Reset()
     m_ResultC = 0;
     m_ResultV = NULL;
     m_ResultT = NULL;
+    m_Spec = NULL;
 }
 
 size_t
@@ -78,6 +211,15 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
     const u8* end = cmdStr + len;
     err->SetSucceeded();
 
+    if(STATE_ASTERISK == m_State && sm_FastParse)
+    {
+        const size_t bytesConsumed = ParseWhole(cmdStr, len);
+        if(bytesConsumed > 0)
+        {
+            return bytesConsumed;
+        }
+    }
+
     while(p < end)
     {
         switch(m_State)
@@ -142,6 +284,12 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
                 const int n = *p - '0';
                 if(n >= 0 && n <= 9)
                 {
+                    if(m_ArgC > (MAX_ARGS - n) / 10)
+                    {
+                        err->SetFailed(ERROR_INVALID_ARGUMENT, "more than %d arguments", MAX_ARGS);
+                        return 0;
+                    }
+
                     m_ArgC = (m_ArgC * 10) + n;
                 }
                 else if(0 == m_ArgC)
@@ -151,10 +299,16 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
                 }
                 else if('\r' == *p)
                 {
+                    m_ArgV = (Blob**) m_Arena.Alloc(m_ArgC * sizeof(Blob*));
+                    if(!m_ArgV)
+                    {
+                        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+                        return 0;
+                    }
+
                     m_State = STATE_LF;
                     m_NextState = STATE_DOLLAR;
                     m_CurArg = 0;
-                    m_ArgV = new Blob*[m_ArgC];
                     ++p;
                     break;
                 }
@@ -186,6 +340,12 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
                 const int n = *p - '0';
                 if(n >= 0 && n <= 9)
                 {
+                    if(m_ArgLen > (MAX_ARG_LEN - n) / 10)
+                    {
+                        err->SetFailed(ERROR_INVALID_ARGUMENT, "argument longer than %d bytes", MAX_ARG_LEN);
+                        return 0;
+                    }
+
                     m_ArgLen = (m_ArgLen * 10) + n;
                 }
                 else if(0 == m_ArgLen)
@@ -198,7 +358,13 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
                     m_State = STATE_LF;
                     m_NextState = STATE_ARG;
                     m_ArgOffset = 0;
-                    m_ArgV[m_CurArg] = m_CurBlob = Blob::Create(m_ArgLen);
+                    m_ArgV[m_CurArg] = m_CurBlob = CreateArg(NULL, m_ArgLen);
+                    if(!m_CurBlob)
+                    {
+                        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+                        return 0;
+                    }
+
                     m_CurBlob->GetData(&m_BlobData);
                     ++p;
                     break;
@@ -230,18 +396,7 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
 
             if(m_ArgOffset == m_ArgLen)
             {
-                ++m_CurArg;
-                if(m_CurArg < m_ArgC)
-                {
-                    m_ArgOffset = m_ArgLen = 0;
-                    m_State = STATE_CR;
-                    m_NextState = STATE_DOLLAR;
-                }
-                else
-                {
-                    m_State = STATE_CR;
-                    m_NextState = STATE_COMPLETE;
-                }
+                EndArg();
             }
 
             break;
@@ -255,64 +410,646 @@ Command::Parse(const u8* cmdStr, const size_t len, Error* err)
     return p - cmdStr;
 }
 
+int
+Command::GetNumKeys() const
+{
+    if(STATE_COMPLETE != m_State
+        || !m_Spec
+        || m_Spec->m_FirstKey <= 0
+        || m_Spec->m_FirstKey >= m_ArgC)
+    {
+        return 0;
+    }
+
+    int lastKey = (m_Spec->m_LastKey < 0) ? m_ArgC + m_Spec->m_LastKey : m_Spec->m_LastKey;
+    if(lastKey >= m_ArgC)
+    {
+        lastKey = m_ArgC - 1;
+    }
+
+    return (lastKey < m_Spec->m_FirstKey)
+            ? 0
+            : (lastKey - m_Spec->m_FirstKey) / m_Spec->m_KeyStep + 1;
+}
+
+const Blob*
+Command::GetKey(const int index) const
+{
+    hbassert(index >= 0 && index < GetNumKeys());
+
+    return m_ArgV[m_Spec->m_FirstKey + index * m_Spec->m_KeyStep];
+}
+
+byte*
+Command::GetArgSpace(size_t* len)
+{
+    if(STATE_ARG == m_State && m_ArgOffset < m_ArgLen)
+    {
+        *len = m_ArgLen - m_ArgOffset;
+        return &m_BlobData[m_ArgOffset];
+    }
+
+    *len = 0;
+    return NULL;
+}
+
+void
+Command::CommitArg(const size_t len)
+{
+    hbassert(STATE_ARG == m_State);
+    hbassert(m_ArgOffset + len <= (size_t)m_ArgLen);
+
+    m_ArgOffset += (int)len;
+    if(m_ArgOffset == m_ArgLen)
+    {
+        EndArg();
+    }
+}
+
 CommandExecResult
 Command::Exec(HashTable* dict, Error* err)
 {
-    if(STATE_COMPLETE == m_State)
+    if(STATE_COMPLETE != m_State)
+    {
+        return EXECRESULT_ERROR;
+    }
+
+    if(!m_Spec)
     {
-        const Blob* blob = m_ArgV[0];
-        if(!blob->Compare((const byte*)"set", sizeof("set")-1))
+        u8 command[128];
+        const u8* tmp;
+        size_t len = m_ArgV[0]->GetData(&tmp);
+        if(len >= sizeof(command)){len = sizeof(command)-1;}
+        memcpy(command, tmp, len);
+        command[len] = '\0';
+        err->SetFailed(ERROR_UNRECOGNIZED_COMMAND, "%s", command);
+        return EXECRESULT_ERROR;
+    }
+
+    if(m_Spec->m_Arity >= 0 ? m_ArgC != m_Spec->m_Arity : m_ArgC < -m_Spec->m_Arity)
+    {
+        err->SetFailed(ERROR_WRONG_ARGUMENT_COUNT,
+                        "wrong number of arguments for '%s'", m_Spec->m_Name);
+        return EXECRESULT_ERROR;
+    }
+
+    return (this->*m_Spec->m_Handler)(dict, err);
+}
+
+//private:
+
+//Parses a command in one pass when all of it is in the buffer.
+//Returns the number of bytes consumed, or 0 if the command is
+//incomplete or malformed, in which case nothing has changed and the
+//state machine takes over.
+size_t
+Command::ParseWhole(const u8* cmdStr, const size_t len)
+{
+    const u8* p = cmdStr;
+    const u8* end = cmdStr + len;
+
+    if(end - p < 4 || '*' != *p)
+    {
+        return 0;
+    }
+
+    ++p;
+
+    int argC;
+    if(!ParseNumberLine(&p, end, &argC) || argC > MAX_FAST_PARSE_ARGS)
+    {
+        return 0;
+    }
+
+    //Find every argument before allocating anything.  Zeroed since the
+    //compiler can't tell there's always at least one.
+    const u8* argData[MAX_FAST_PARSE_ARGS] = {NULL};
+    int argLen[MAX_FAST_PARSE_ARGS] = {0};
+
+    for(int i = 0; i < argC; ++i)
+    {
+        if(p >= end || '$' != *p)
         {
-            if(3 == m_ArgC)
-            {
-                Value key; Value value;
-                key.m_Blob = m_ArgV[1];
-                value.m_Blob = m_ArgV[2];
-                dict->Set(key, VALUETYPE_BLOB, value, VALUETYPE_BLOB);
-                m_ResultV = &m_SingleResultValue;
-                m_ResultT = &m_SingleResultType;
-                m_ResultC = 1;
-                m_ResultV[0].m_Int = 1;
-                m_ResultT[0] = VALUETYPE_INT;
-                err->SetSucceeded();
-                return EXECRESULT_OK;
-            }
+            return 0;
         }
-        else if(!blob->Compare((const byte*)"get", sizeof("get")-1))
+
+        ++p;
+
+        if(!ParseNumberLine(&p, end, &argLen[i])
+            || end - p < argLen[i] + 2
+            || '\r' != p[argLen[i]]
+            || '\n' != p[argLen[i] + 1])
         {
-            if(m_ArgC == 2)
-            {
-                Value key;
-                key.m_Blob = m_ArgV[1];
-                if(dict->Find(key, VALUETYPE_BLOB, &m_SingleResultValue, &m_SingleResultType))
-                {
-                    m_ResultV = &m_SingleResultValue;
-                    m_ResultT = &m_SingleResultType;
-                    m_ResultC = 1;
-                }
-                else
-                {
-                    m_ResultC = 0;
-                }
+            return 0;
+        }
 
-                err->SetSucceeded();
+        argData[i] = p;
+        p += argLen[i] + 2;
+    }
 
-                return EXECRESULT_BULK;
-            }
+    m_Spec = CommandSpec::Find(argData[0], argLen[0]);
+
+    m_ArgC = argC;
+    m_ArgV = (Blob**) m_Arena.Alloc(argC * sizeof(Blob*));
+    if(!m_ArgV)
+    {
+        Reset();
+        return 0;
+    }
+
+    for(m_CurArg = 0; m_CurArg < argC; ++m_CurArg)
+    {
+        m_ArgV[m_CurArg] = CreateArg(argData[m_CurArg], argLen[m_CurArg]);
+
+        //Let the state machine fail the command.
+        if(!m_ArgV[m_CurArg])
+        {
+            Reset();
+            return 0;
+        }
+    }
+
+    m_State = m_NextState = STATE_COMPLETE;
+
+    return p - cmdStr;
+}
+
+Blob*
+Command::CreateArg(const byte* bytes, const size_t len)
+{
+    const bool isKey = IsKeyArg(m_CurArg);
+
+    if(!IsArenaArg(m_CurArg, len))
+    {
+        return isKey ? Blob::CreateHashed(bytes, len) : Blob::Create(bytes, len);
+    }
+
+    const size_t size = isKey ? Blob::HashedSize(len) : Blob::Size(len);
+    byte* mem = (byte*) m_Arena.Alloc(size);
+    if(!mem)
+    {
+        return NULL;
+    }
+
+    return isKey
+            ? Blob::EncodeHashed(bytes, len, mem, size)
+            : Blob::Encode(bytes, len, mem, size);
+}
+
+bool
+Command::IsArenaArg(const int index, const size_t len) const
+{
+    return 0 == index
+            || !m_Spec
+            || !(m_Spec->m_Flags & CMDFLAG_KEEPARGS)
+            || len <= HashTable::MAX_INLINE_LEN;
+}
+
+bool
+Command::IsKeyArg(const int index) const
+{
+    if(!m_Spec || m_Spec->m_FirstKey <= 0 || index < m_Spec->m_FirstKey)
+    {
+        return false;
+    }
+
+    const int lastKey = (m_Spec->m_LastKey < 0) ? m_ArgC + m_Spec->m_LastKey : m_Spec->m_LastKey;
+
+    return index <= lastKey
+            && 0 == (index - m_Spec->m_FirstKey) % m_Spec->m_KeyStep;
+}
+
+bool
+Command::AllocResults(const int count)
+{
+    m_ResultV = (Value*) m_Arena.Alloc(count * sizeof(Value));
+    m_ResultT = (ValueType*) m_Arena.Alloc(count * sizeof(ValueType));
+    m_ResultC = 0;
+    return m_ResultV && m_ResultT;
+}
+
+void
+Command::EndArg()
+{
+    if(0 == m_CurArg)
+    {
+        m_Spec = CommandSpec::Find(m_BlobData, m_ArgLen);
+    }
+    else if(IsKeyArg(m_CurArg))
+    {
+        m_CurBlob->CacheHash();
+    }
+
+    ++m_CurArg;
+    if(m_CurArg < m_ArgC)
+    {
+        m_ArgOffset = m_ArgLen = 0;
+        m_State = STATE_CR;
+        m_NextState = STATE_DOLLAR;
+    }
+    else
+    {
+        m_State = STATE_CR;
+        m_NextState = STATE_COMPLETE;
+    }
+}
+
+CommandExecResult
+Command::ExecSet(HashTable* dict, Error* err)
+{
+    Value key; Value value;
+    key.m_Blob = m_ArgV[1];
+    value.m_Blob = m_ArgV[2];
+    dict->Set(key, VALUETYPE_BLOB, value, VALUETYPE_BLOB);
+    m_ResultV = &m_SingleResultValue;
+    m_ResultT = &m_SingleResultType;
+    m_ResultC = 1;
+    m_ResultV[0].m_Int = 1;
+    m_ResultT[0] = VALUETYPE_INT;
+    err->SetSucceeded();
+    return EXECRESULT_OK;
+}
+
+CommandExecResult
+Command::ExecGet(HashTable* dict, Error* err)
+{
+    Value key;
+    key.m_Blob = m_ArgV[1];
+    if(dict->Find(key, VALUETYPE_BLOB, &m_SingleResultValue, &m_SingleResultType))
+    {
+        m_ResultV = &m_SingleResultValue;
+        m_ResultT = &m_SingleResultType;
+        m_ResultC = 1;
+    }
+    else
+    {
+        m_ResultC = 0;
+    }
+
+    err->SetSucceeded();
+
+    return EXECRESULT_BULK;
+}
+
+CommandExecResult
+Command::ExecMSet(HashTable* dict, Error* err)
+{
+    if(0 == (m_ArgC & 1))
+    {
+        err->SetFailed(ERROR_WRONG_ARGUMENT_COUNT,
+                        "wrong number of arguments for '%s'", m_Spec->m_Name);
+        return EXECRESULT_ERROR;
+    }
+
+    const int numKeys = (m_ArgC - 1) / 2;
+    Value* keys = (Value*) m_Arena.Alloc(numKeys * sizeof(Value));
+    Value* values = (Value*) m_Arena.Alloc(numKeys * sizeof(Value));
+    if(!keys || !values)
+    {
+        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+        return EXECRESULT_ERROR;
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i].m_Blob = m_ArgV[1 + i*2];
+        values[i].m_Blob = m_ArgV[2 + i*2];
+    }
+
+    if(!dict->SetMany(numKeys, keys, VALUETYPE_BLOB, values, VALUETYPE_BLOB))
+    {
+        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+        return EXECRESULT_ERROR;
+    }
+
+    err->SetSucceeded();
+    return EXECRESULT_OK;
+}
+
+CommandExecResult
+Command::ExecMGet(HashTable* dict, Error* err)
+{
+    const int numKeys = m_ArgC - 1;
+    Value* keys = (Value*) m_Arena.Alloc(numKeys * sizeof(Value));
+    bool* found = (bool*) m_Arena.Alloc(numKeys * sizeof(bool));
+    if(!keys || !found || !AllocResults(numKeys))
+    {
+        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+        return EXECRESULT_ERROR;
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i].m_Blob = m_ArgV[1 + i];
+    }
+
+    dict->FindMany(numKeys, keys, VALUETYPE_BLOB, m_ResultV, m_ResultT, found);
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        if(!found[i])
+        {
+            m_ResultV[i].m_Blob = NULL;
+            m_ResultT[i] = VALUETYPE_BLOB;
+        }
+    }
+
+    m_ResultC = numKeys;
+
+    err->SetSucceeded();
+    return EXECRESULT_MULTIBULK;
+}
+
+CommandExecResult
+Command::ExecAppend(HashTable* dict, Error* err)
+{
+    Value key;
+    key.m_Blob = m_ArgV[1];
+
+    Value value;
+    ValueType valueType;
+    const size_t len =
+        dict->Find(key, VALUETYPE_BLOB, &value, &valueType) ? value.m_Blob->Length() : 0;
+
+    return ExecPatch(dict, len, 2, len + m_ArgV[2]->Length(), err);
+}
+
+CommandExecResult
+Command::ExecSetRange(HashTable* dict, Error* err)
+{
+    size_t offset;
+    if(!ParseOffset(m_ArgV[2], &offset))
+    {
+        err->SetFailed(ERROR_INVALID_ARGUMENT, "offset is out of range");
+        return EXECRESULT_ERROR;
+    }
+
+    Value key;
+    key.m_Blob = m_ArgV[1];
+
+    Value value;
+    ValueType valueType;
+    const size_t len =
+        dict->Find(key, VALUETYPE_BLOB, &value, &valueType) ? value.m_Blob->Length() : 0;
+
+    const size_t patchLen = m_ArgV[3]->Length();
+
+    //An empty value doesn't create the key or pad it out to offset.
+    if(0 == patchLen)
+    {
+        return ExecPatch(dict, offset, 3, len, err);
+    }
+
+    return ExecPatch(dict, offset, 3, (offset + patchLen > len) ? offset + patchLen : len, err);
+}
+
+CommandExecResult
+Command::ExecMemStats(HashTable* dict, Error* err)
+{
+    if(3 == m_ArgC && IsWord(m_ArgV[1], "samplerate"))
+    {
+        size_t rate;
+        if(!ParseOffset(m_ArgV[2], &rate))
+        {
+            err->SetFailed(ERROR_INVALID_ARGUMENT, "sample rate is out of range");
+            return EXECRESULT_ERROR;
+        }
+
+        Heap::SetSampleRate(rate);
+
+        err->SetSucceeded();
+        return EXECRESULT_OK;
+    }
+
+    if(1 != m_ArgC)
+    {
+        err->SetFailed(ERROR_INVALID_ARGUMENT, "syntax error");
+        return EXECRESULT_ERROR;
+    }
+
+    //The report can grow between sizing it and writing it, so retry
+    //until it fits.  The slack leaves room for the dict's lines.  Each
+    //part returns the length it needed, so a report that doesn't fit
+    //sizes the next try.
+    size_t len = Heap::FormatStats(NULL, 0);
+    for(;;)
+    {
+        const size_t bufSize = len + 1024;
+        char* buf = (char*) m_Arena.Alloc(bufSize);
+        if(!buf)
+        {
+            err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+            return EXECRESULT_ERROR;
+        }
+
+        len = Heap::FormatStats(buf, bufSize);
+        if(len < bufSize)
+        {
+            InternPool::Stats stats;
+            dict->GetInternStats(&stats);
+            len += snprintf(buf + len, bufSize - len,
+                            "intern_blobs:%llu intern_bytes:%llu intern_hits:%llu intern_misses:%llu\n",
+                            (unsigned long long) stats.m_NumBlobs,
+                            (unsigned long long) stats.m_NumBytes,
+                            (unsigned long long) stats.m_NumHits,
+                            (unsigned long long) stats.m_NumMisses);
+        }
+
+        if(len < bufSize)
+        {
+            HashTable::DefragStats defragStats;
+            dict->GetDefragStats(&defragStats);
+            len += snprintf(buf + len, bufSize - len,
+                            "dict_defrag_passes:%llu dict_defrag_items:%llu dict_defrag_blobs:%llu\n",
+                            (unsigned long long) defragStats.m_NumPasses,
+                            (unsigned long long) defragStats.m_ItemsMoved,
+                            (unsigned long long) defragStats.m_BlobsMoved);
         }
-        else
+
+        if(len < bufSize)
         {
-            u8 command[128];
-            const u8* tmp;
-            size_t len = blob->GetData(&tmp);
-            if(len >= sizeof(command)){len = sizeof(command-1);}
-            memcpy(command, tmp, len);
-            command[len] = '\0';
-            err->SetFailed(ERROR_UNRECOGNIZED_COMMAND, "%s", command);
+            m_ResultBlob = Blob::Create((const byte*)buf, len);
+            break;
         }
     }
 
-    return EXECRESULT_ERROR;
+    if(!m_ResultBlob)
+    {
+        err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+        return EXECRESULT_ERROR;
+    }
+
+    m_ResultV = &m_SingleResultValue;
+    m_ResultT = &m_SingleResultType;
+    m_ResultC = 1;
+    m_ResultV[0].m_Blob = m_ResultBlob;
+    m_ResultT[0] = VALUETYPE_BLOB;
+
+    err->SetSucceeded();
+    return EXECRESULT_BULK;
+}
+
+CommandExecResult
+Command::ExecPatch(HashTable* dict,
+                    const size_t offset,
+                    const int valueIndex,
+                    const size_t newLen,
+                    Error* err)
+{
+    if(newLen > MAX_VALUE_LEN)
+    {
+        err->SetFailed(ERROR_INVALID_ARGUMENT, "value would be longer than %u bytes", (unsigned)MAX_VALUE_LEN);
+        return EXECRESULT_ERROR;
+    }
+
+    if(m_ArgV[valueIndex]->Length() > 0)
+    {
+        Value key;
+        key.m_Blob = m_ArgV[1];
+        const Blob* patch = m_ArgV[valueIndex];
+
+        if(!dict->Patch(key, VALUETYPE_BLOB, 1, &patch, &offset))
+        {
+            err->SetFailed(ERROR_OUT_OF_MEMORY, "out of memory");
+            return EXECRESULT_ERROR;
+        }
+    }
+
+    m_ResultV = &m_SingleResultValue;
+    m_ResultT = &m_SingleResultType;
+    m_ResultC = 1;
+    m_ResultV[0].m_Int = (s64)newLen;
+    m_ResultT[0] = VALUETYPE_INT;
+
+    err->SetSucceeded();
+    return EXECRESULT_INTEGER;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  CommandTable
+//
+//  Perfect hash of the command names.  When the program starts it
+//  searches for a seed under which no two names share a slot, so a
+//  lookup is one hash of the name and one compare no matter how many
+//  commands there are.
+///////////////////////////////////////////////////////////////////////////////
+class CommandTable
+{
+public:
+
+    CommandTable();
+
+    const CommandSpec* Find(const byte* name, const size_t len) const;
+
+private:
+
+    //Must be a power of 2, and is kept at least 4 times the number of
+    //commands so a seed is found quickly.
+    static const unsigned TABLE_SIZE        = 64;
+
+    static const size_t MAX_NAME_LEN        = 16;
+
+    static const CommandSpec sm_Specs[];
+
+    static unsigned Hash(const byte* name, const size_t len, const u32 seed);
+
+    u32 m_Seed;
+    const CommandSpec* m_Slots[TABLE_SIZE];
+};
+
+//Names are lower case.  Keep the table at most a quarter full when
+//adding commands.
+const CommandSpec CommandTable::sm_Specs[] =
+{
+    {"get",     2, 1,  1, 1, CMDFLAG_READ,                      &Command::ExecGet},
+    {"set",     3, 1,  1, 1, CMDFLAG_WRITE|CMDFLAG_KEEPARGS,    &Command::ExecSet},
+    {"mget",   -2, 1, -1, 1, CMDFLAG_READ,                      &Command::ExecMGet},
+    {"mset",   -3, 1, -1, 2, CMDFLAG_WRITE|CMDFLAG_KEEPARGS,    &Command::ExecMSet},
+    {"append",  3, 1,  1, 1, CMDFLAG_WRITE|CMDFLAG_KEEPARGS,    &Command::ExecAppend},
+    {"setrange",4, 1,  1, 1, CMDFLAG_WRITE|CMDFLAG_KEEPARGS,    &Command::ExecSetRange},
+    {"memstats",-1, 0, 0, 0, CMDFLAG_READ,                      &Command::ExecMemStats},
+};
+
+static const CommandTable s_CommandTable;
+
+CommandTable::CommandTable()
+: m_Seed(0)
+{
+    hb_static_assert(hbarraylen(sm_Specs) * 4 <= TABLE_SIZE);
+
+    for(u32 seed = 0; ; ++seed)
+    {
+        memset(m_Slots, 0, sizeof(m_Slots));
+
+        bool collided = false;
+        for(int i = 0; i < (int)hbarraylen(sm_Specs) && !collided; ++i)
+        {
+            const CommandSpec* spec = &sm_Specs[i];
+            const size_t len = strlen(spec->m_Name);
+            hbassert(len <= MAX_NAME_LEN);
+
+            const unsigned slot = Hash((const byte*)spec->m_Name, len, seed);
+            collided = (NULL != m_Slots[slot]);
+            m_Slots[slot] = spec;
+        }
+
+        if(!collided)
+        {
+            m_Seed = seed;
+            break;
+        }
+    }
+}
+
+const CommandSpec*
+CommandTable::Find(const byte* name, const size_t len) const
+{
+    if(len > MAX_NAME_LEN)
+    {
+        return NULL;
+    }
+
+    const CommandSpec* spec = m_Slots[Hash(name, len, m_Seed)];
+    if(!spec)
+    {
+        return NULL;
+    }
+
+    //Command names are letters only, so setting 0x20 folds case.
+    const char* specName = spec->m_Name;
+    for(size_t i = 0; i < len; ++i)
+    {
+        if(!specName[i] || (name[i] | 0x20) != (byte)specName[i])
+        {
+            return NULL;
+        }
+    }
+
+    return ('\0' == specName[len]) ? spec : NULL;
+}
+
+//private:
+
+//FNV-1a of the case folded name.
+unsigned
+CommandTable::Hash(const byte* name, const size_t len, const u32 seed)
+{
+    u32 h = 2166136261u ^ seed;
+    for(size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (name[i] | 0x20)) * 16777619u;
+    }
+
+    return (h ^ (h >> 16)) & (TABLE_SIZE - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  CommandSpec
+///////////////////////////////////////////////////////////////////////////////
+const CommandSpec*
+CommandSpec::Find(const byte* name, const size_t len)
+{
+    return s_CommandTable.Find(name, len);
 }
 
 }   //namespace honeybase
\ No newline at end of file
@@ -1,11 +1,13 @@
 #ifndef __HB_COMMAND_H__
 #define __HB_COMMAND_H__
 
+#include "arena.h"
 #include "hb.h"
 
 namespace honeybase
 {
 
+class Command;
 class Error;
 class HashTable;
 
@@ -18,6 +20,56 @@ enum CommandExecResult
     EXECRESULT_MULTIBULK
 };
 
+enum CommandFlags
+{
+    CMDFLAG_READ        = 0x01,
+    CMDFLAG_WRITE       = 0x02,
+
+    //The dict may keep references to the arguments after the first.
+    //It copies arguments up to HashTable::MAX_INLINE_LEN long instead.
+    CMDFLAG_KEEPARGS    = 0x04
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  CommandSpec
+//
+//  Describes one command in the dispatch table.
+///////////////////////////////////////////////////////////////////////////////
+class CommandSpec
+{
+public:
+
+    typedef CommandExecResult (Command::*Handler)(HashTable* dict, Error* err);
+
+    const char* m_Name;
+
+    //Number of arguments including the command name.  A negative
+    //arity means at least -m_Arity arguments.
+    int m_Arity;
+
+    //Index of the argument that holds the first key, or 0 if there's
+    //none.
+    int m_FirstKey;
+
+    //Index of the last key.  Negative counts back from the end, so -1
+    //is the last argument.
+    int m_LastKey;
+
+    //Distance between keys.
+    int m_KeyStep;
+
+    unsigned m_Flags;
+
+    Handler m_Handler;
+
+    //Returns the spec for the named command, matched case
+    //insensitively, or NULL if there's no such command.
+    static const CommandSpec* Find(const byte* name, const size_t len);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Command
+///////////////////////////////////////////////////////////////////////////////
 class Command
 {
 public:
@@ -50,6 +102,20 @@ public:
 
     CommandExecResult Exec(HashTable* dict, Error* err);
 
+    //Returns the number of keys a complete command operates on.
+    int GetNumKeys() const;
+
+    //Returns key index, 0 <= index < GetNumKeys().
+    const Blob* GetKey(const int index) const;
+
+    //While an argument is being parsed returns where the rest of its
+    //bytes go, so they can be read straight into its Blob.  Returns
+    //NULL otherwise.
+    byte* GetArgSpace(size_t* len);
+
+    //Accounts for len bytes written to the space from GetArgSpace().
+    void CommitArg(const size_t len);
+
     State m_State;
     State m_NextState;
     int m_ArgC;
@@ -60,12 +126,84 @@ public:
     Blob* m_CurBlob;
     byte* m_BlobData;
 
+    //Results point into the dict, so they're only good until it's
+    //changed.  A NULL Blob in a multi bulk result is a missing value.
     int m_ResultC;
     Value* m_ResultV;
     ValueType* m_ResultT;
 
     Value m_SingleResultValue;
     ValueType m_SingleResultType;
+
+    //A result the command made itself rather than found in the dict.
+    //Reset() releases it, though a reply may still hold a reference.
+    Blob* m_ResultBlob;
+
+    //Looked up once the command name has been parsed.
+    const CommandSpec* m_Spec;
+
+    //Holds the argument and result arrays, and the arguments nothing
+    //keeps past the end of the command.  Reset() empties it.
+    Arena m_Arena;
+
+    //When false Parse() always uses the incremental state machine.
+    //For benchmarking.
+    static bool sm_FastParse;
+
+private:
+
+    friend class CommandTable;
+
+    //Commands with more arguments than this always take the
+    //incremental path.
+    static const int MAX_FAST_PARSE_ARGS    = 16;
+
+    //Longer commands and arguments are rejected before anything is
+    //allocated for them.
+    static const int MAX_ARGS               = 1024*1024;
+    static const int MAX_ARG_LEN            = 512*1024*1024;
+
+    size_t ParseWhole(const u8* cmdStr, const size_t len);
+
+    //Allocates argument m_CurArg, in the arena unless the command may
+    //keep it.  A key gets room for its hash, which is computed here if
+    //bytes isn't NULL and by EndArg() otherwise, so it's hashed once
+    //for the whole request.
+    Blob* CreateArg(const byte* bytes, const size_t len);
+
+    bool IsArenaArg(const int index, const size_t len) const;
+
+    bool IsKeyArg(const int index) const;
+
+    //Points m_ResultV and m_ResultT at count results in the arena.
+    bool AllocResults(const int count);
+
+    void EndArg();
+
+    CommandExecResult ExecSet(HashTable* dict, Error* err);
+
+    CommandExecResult ExecGet(HashTable* dict, Error* err);
+
+    CommandExecResult ExecMSet(HashTable* dict, Error* err);
+
+    CommandExecResult ExecMGet(HashTable* dict, Error* err);
+
+    CommandExecResult ExecAppend(HashTable* dict, Error* err);
+
+    CommandExecResult ExecSetRange(HashTable* dict, Error* err);
+
+    //MEMSTATS replies with the heap's stats report.
+    //MEMSTATS SAMPLERATE n samples 1 in n allocations, or none if n is 0.
+    //The rate is process wide, so it covers every shard and connection.
+    CommandExecResult ExecMemStats(HashTable* dict, Error* err);
+
+    //Writes the argument at valueIndex into the key's value at offset
+    //and replies with the value's new length, which is passed in.
+    CommandExecResult ExecPatch(HashTable* dict,
+                                const size_t offset,
+                                const int valueIndex,
+                                const size_t newLen,
+                                Error* err);
 };
 
 }   //namespace honeybase
@@ -0,0 +1,660 @@
+#include "connection.h"
+
+#include "dict.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace honeybase
+{
+
+//Arguments with at least this many bytes left are read straight into
+//their Blob instead of through the read buffer.
+static const size_t DIRECT_READ_MIN_LEN = 4096;
+
+///////////////////////////////////////////////////////////////////////////////
+//  ReplyBuffer
+///////////////////////////////////////////////////////////////////////////////
+ReplyBuffer::ReplyBuffer()
+: m_Head(NULL)
+, m_Tail(NULL)
+, m_Spare(NULL)
+, m_Pos(0)
+, m_Len(0)
+, m_Failed(false)
+{
+}
+
+ReplyBuffer::~ReplyBuffer()
+{
+    Clear();
+
+    if(m_Spare)
+    {
+        Heap::Free(m_Spare, HEAPTAG_NETWORK);
+        m_Spare = NULL;
+    }
+}
+
+void
+ReplyBuffer::Clear()
+{
+    while(m_Head)
+    {
+        Chunk* next = m_Head->m_Next;
+        FreeChunk(m_Head);
+        m_Head = next;
+    }
+
+    m_Tail = NULL;
+    m_Pos = m_Len = 0;
+    m_Failed = false;
+}
+
+void
+ReplyBuffer::QueueReply(const Command& cmd, const CommandExecResult result, const Error& err)
+{
+    char buf[64];
+
+    switch(result)
+    {
+    case EXECRESULT_ERROR:
+        QueueError(err);
+        break;
+    case EXECRESULT_OK:
+        QueueString("+OK\r\n");
+        break;
+    case EXECRESULT_INTEGER:
+        snprintf(buf, sizeof(buf), ":%" PRId64 "\r\n", cmd.m_ResultV[0].m_Int);
+        QueueString(buf);
+        break;
+    case EXECRESULT_BULK:
+        if(1 == cmd.m_ResultC)
+        {
+            QueueBulk(cmd.m_ResultV[0], cmd.m_ResultT[0]);
+        }
+        else
+        {
+            QueueString("$-1\r\n");
+        }
+        break;
+    case EXECRESULT_MULTIBULK:
+        snprintf(buf, sizeof(buf), "*%d\r\n", cmd.m_ResultC);
+        QueueString(buf);
+        for(int i = 0; i < cmd.m_ResultC; ++i)
+        {
+            if(VALUETYPE_BLOB == cmd.m_ResultT[i] && !cmd.m_ResultV[i].m_Blob)
+            {
+                QueueString("$-1\r\n");
+            }
+            else
+            {
+                QueueBulk(cmd.m_ResultV[i], cmd.m_ResultT[i]);
+            }
+        }
+        break;
+    }
+}
+
+void
+ReplyBuffer::QueueError(const Error& err)
+{
+    QueueString("-ERR ");
+    QueueString(err.GetText());
+    QueueString("\r\n");
+}
+
+void
+ReplyBuffer::Append(ReplyBuffer* that)
+{
+    if(!that->m_Head)
+    {
+        return;
+    }
+
+    //Only buffers that were never sent from can be appended.
+    hbassert(0 == that->m_Pos);
+
+    if(m_Tail)
+    {
+        m_Tail->m_Next = that->m_Head;
+    }
+    else
+    {
+        m_Head = that->m_Head;
+    }
+
+    m_Tail = that->m_Tail;
+    m_Len += that->m_Len;
+    m_Failed = m_Failed || that->m_Failed;
+
+    that->m_Head = that->m_Tail = NULL;
+    that->m_Len = 0;
+    that->m_Failed = false;
+}
+
+size_t
+ReplyBuffer::GetData(const size_t offset, const byte** data) const
+{
+    size_t pos = m_Pos + offset;
+    for(const Chunk* chunk = m_Head; chunk; chunk = chunk->m_Next)
+    {
+        if(pos < chunk->m_Len)
+        {
+            *data = &chunk->m_Bytes[pos];
+            return chunk->m_Len - pos;
+        }
+
+        pos -= chunk->m_Len;
+    }
+
+    *data = NULL;
+    return 0;
+}
+
+void
+ReplyBuffer::Consume(const size_t len)
+{
+    hbassert(len <= m_Len);
+
+    m_Len -= len;
+    m_Pos += len;
+
+    while(m_Head && m_Pos >= m_Head->m_Len)
+    {
+        //Keep a partially filled tail chunk for the next reply.
+        if(m_Head == m_Tail && !m_Head->m_Blob && m_Head->m_Len < CHUNK_SIZE)
+        {
+            if(m_Pos == m_Head->m_Len)
+            {
+                m_Head->m_Len = m_Pos = 0;
+            }
+            break;
+        }
+
+        Chunk* next = m_Head->m_Next;
+        m_Pos -= m_Head->m_Len;
+        FreeChunk(m_Head);
+        m_Head = next;
+    }
+
+    if(!m_Head)
+    {
+        m_Tail = NULL;
+    }
+}
+
+//private:
+
+ReplyBuffer::Chunk*
+ReplyBuffer::AllocChunk()
+{
+    Chunk* chunk = m_Spare;
+    if(chunk)
+    {
+        m_Spare = NULL;
+    }
+    else
+    {
+        chunk = (Chunk*) Heap::Alloc(sizeof(Chunk), HEAPTAG_NETWORK);
+    }
+
+    if(chunk)
+    {
+        chunk->m_Next = NULL;
+        chunk->m_Len = 0;
+        chunk->m_Bytes = chunk->m_Data;
+        chunk->m_Blob = NULL;
+    }
+
+    return chunk;
+}
+
+void
+ReplyBuffer::FreeChunk(Chunk* chunk)
+{
+    if(chunk->m_Blob)
+    {
+        chunk->m_Blob->Unref();
+        Heap::Free(chunk, HEAPTAG_NETWORK);
+    }
+    else if(!m_Spare)
+    {
+        m_Spare = chunk;
+    }
+    else
+    {
+        Heap::Free(chunk, HEAPTAG_NETWORK);
+    }
+}
+
+void
+ReplyBuffer::QueueBytes(const void* bytes, const size_t len)
+{
+    const byte* src = (const byte*) bytes;
+    size_t remaining = len;
+
+    while(remaining > 0)
+    {
+        if(!m_Tail || m_Tail->m_Blob || CHUNK_SIZE == m_Tail->m_Len)
+        {
+            Chunk* chunk = AllocChunk();
+            if(!chunk)
+            {
+                //Fail the connection rather than send a truncated stream.
+                m_Failed = true;
+                return;
+            }
+
+            LinkChunk(chunk);
+        }
+
+        size_t cpyLen = CHUNK_SIZE - m_Tail->m_Len;
+        if(cpyLen > remaining)
+        {
+            cpyLen = remaining;
+        }
+
+        memcpy(&m_Tail->m_Data[m_Tail->m_Len], src, cpyLen);
+        m_Tail->m_Len += cpyLen;
+        m_Len += cpyLen;
+        src += cpyLen;
+        remaining -= cpyLen;
+    }
+}
+
+void
+ReplyBuffer::QueueBlob(Blob* blob)
+{
+    Chunk* chunk = (Chunk*) Heap::Alloc(offsetof(Chunk, m_Data), HEAPTAG_NETWORK);
+    if(!chunk)
+    {
+        m_Failed = true;
+        return;
+    }
+
+    blob->Ref();
+    chunk->m_Next = NULL;
+    chunk->m_Len = blob->GetData(&chunk->m_Bytes);
+    chunk->m_Blob = blob;
+
+    LinkChunk(chunk);
+    m_Len += chunk->m_Len;
+}
+
+void
+ReplyBuffer::LinkChunk(Chunk* chunk)
+{
+    if(m_Tail)
+    {
+        m_Tail->m_Next = chunk;
+    }
+    else
+    {
+        m_Head = chunk;
+    }
+
+    m_Tail = chunk;
+}
+
+void
+ReplyBuffer::QueueString(const char* str)
+{
+    QueueBytes(str, strlen(str));
+}
+
+void
+ReplyBuffer::QueueBulk(const Value& value, const ValueType valueType)
+{
+    //Blobs short enough to live in a dict item are always copied.
+    hb_static_assert(MIN_REF_LEN > HashTable::MAX_INLINE_LEN);
+
+    char valBuf[64];
+    char lenBuf[64];
+    const byte* data;
+    size_t len;
+
+    switch(valueType)
+    {
+    case VALUETYPE_INT:
+        len = snprintf(valBuf, sizeof(valBuf), "%" PRId64, value.m_Int);
+        data = (const byte*)valBuf;
+        break;
+    case VALUETYPE_DOUBLE:
+        len = snprintf(valBuf, sizeof(valBuf), "%f", value.m_Double);
+        data = (const byte*)valBuf;
+        break;
+    case VALUETYPE_BLOB:
+        len = value.m_Blob->Length();
+        data = NULL;
+        break;
+    default:
+        hbassert(false);
+        return;
+    }
+
+    snprintf(lenBuf, sizeof(lenBuf), "$%u\r\n", (unsigned)len);
+    QueueString(lenBuf);
+
+    if(VALUETYPE_BLOB == valueType)
+    {
+        //A segmented value is queued a segment at a time, so it's sent
+        //without being made contiguous.
+        Blob* blob = value.m_Blob;
+        const size_t numSegments = blob->NumSegments();
+        for(size_t i = 0; i < numSegments; ++i)
+        {
+            Blob* segment = blob->GetSegment(i);
+            const size_t segLen = segment->GetData(&data);
+
+            if(segLen >= MIN_REF_LEN)
+            {
+                QueueBlob(segment);
+            }
+            else
+            {
+                QueueBytes(data, segLen);
+            }
+        }
+    }
+    else
+    {
+        QueueBytes(data, len);
+    }
+
+    QueueString("\r\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  ReadBufferPool
+///////////////////////////////////////////////////////////////////////////////
+ReadBufferPool::ReadBufferPool()
+{
+    for(int i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        m_FreeLists[i] = NULL;
+        m_NumFree[i] = 0;
+    }
+}
+
+ReadBufferPool::~ReadBufferPool()
+{
+    for(int i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        while(m_FreeLists[i])
+        {
+            FreeBuffer* next = m_FreeLists[i]->m_Next;
+            Heap::Free(m_FreeLists[i], HEAPTAG_NETWORK);
+            m_FreeLists[i] = next;
+        }
+    }
+}
+
+byte*
+ReadBufferPool::Alloc(const size_t minSize, size_t* size)
+{
+    const int sizeClass = GetSizeClass(minSize);
+    *size = MIN_BUFFER_SIZE << (2 * sizeClass);
+
+    FreeBuffer* buf = m_FreeLists[sizeClass];
+    if(buf)
+    {
+        m_FreeLists[sizeClass] = buf->m_Next;
+        --m_NumFree[sizeClass];
+        return (byte*) buf;
+    }
+
+    return (byte*) Heap::Alloc(*size, HEAPTAG_NETWORK);
+}
+
+void
+ReadBufferPool::Free(byte* buf, const size_t size)
+{
+    const int sizeClass = GetSizeClass(size);
+    hbassert(size == MIN_BUFFER_SIZE << (2 * sizeClass));
+
+    if(m_NumFree[sizeClass] >= MAX_FREE_BUFFERS)
+    {
+        Heap::Free(buf, HEAPTAG_NETWORK);
+        return;
+    }
+
+    FreeBuffer* freeBuf = (FreeBuffer*) buf;
+    freeBuf->m_Next = m_FreeLists[sizeClass];
+    m_FreeLists[sizeClass] = freeBuf;
+    ++m_NumFree[sizeClass];
+}
+
+//private:
+
+int
+ReadBufferPool::GetSizeClass(const size_t size)
+{
+    int sizeClass = 0;
+    size_t classSize = MIN_BUFFER_SIZE;
+    while(classSize < size && sizeClass < NUM_SIZE_CLASSES - 1)
+    {
+        classSize <<= 2;
+        ++sizeClass;
+    }
+
+    return sizeClass;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Connection
+///////////////////////////////////////////////////////////////////////////////
+Connection::Connection()
+: m_Pool(NULL)
+, m_ReadBuf(NULL)
+, m_ReadBufSize(0)
+, m_ReadPos(0)
+, m_BufLen(0)
+, m_ReadSpace(0)
+, m_Failed(false)
+, m_DirectRead(false)
+, m_GrowReadBuf(false)
+{
+}
+
+Connection::~Connection()
+{
+    ReleaseReadBuf();
+}
+
+void
+Connection::Reset()
+{
+    m_Cmd.Reset();
+    ReleaseReadBuf();
+    m_Replies.Clear();
+    m_ForwardReplies.Clear();
+    m_Failed = false;
+    m_DirectRead = false;
+    m_GrowReadBuf = false;
+}
+
+byte*
+Connection::GetReadSpace(size_t* len)
+{
+    if(0 == m_BufLen)
+    {
+        size_t argLen;
+        byte* argSpace = m_Cmd.GetArgSpace(&argLen);
+        if(argSpace && argLen >= DIRECT_READ_MIN_LEN)
+        {
+            m_DirectRead = true;
+            m_ReadSpace = *len = argLen;
+            return argSpace;
+        }
+    }
+
+    m_DirectRead = false;
+
+    if(!m_ReadBuf
+        || (m_GrowReadBuf && m_ReadBufSize < ReadBufferPool::MAX_BUFFER_SIZE))
+    {
+        //A failure to grow isn't fatal as long as there's a buffer.
+        if(!ResizeReadBuf(m_ReadBuf ? m_ReadBufSize + 1 : 0) && !m_ReadBuf)
+        {
+            m_Failed = true;
+            m_ReadSpace = *len = 0;
+            return NULL;
+        }
+
+        m_GrowReadBuf = false;
+    }
+
+    if(m_ReadPos > 0 && m_ReadPos + m_BufLen == m_ReadBufSize)
+    {
+        memmove(m_ReadBuf, &m_ReadBuf[m_ReadPos], m_BufLen);
+        m_ReadPos = 0;
+    }
+
+    m_ReadSpace = *len = m_ReadBufSize - m_ReadPos - m_BufLen;
+    return &m_ReadBuf[m_ReadPos + m_BufLen];
+}
+
+void
+Connection::CommitRead(const size_t len)
+{
+    hbassert(len <= m_ReadSpace);
+
+    if(m_DirectRead)
+    {
+        m_Cmd.CommitArg(len);
+        m_DirectRead = false;
+        return;
+    }
+
+    m_BufLen += len;
+    m_GrowReadBuf = (len == m_ReadSpace);
+}
+
+void
+Connection::OnIdle()
+{
+    if(0 == m_BufLen)
+    {
+        ReleaseReadBuf();
+    }
+}
+
+bool
+Connection::ParseNext()
+{
+    if(m_Cmd.IsComplete())
+    {
+        return true;
+    }
+
+    if(m_Failed || 0 == m_BufLen)
+    {
+        return false;
+    }
+
+    Error err;
+    const size_t bytesConsumed = m_Cmd.Parse(&m_ReadBuf[m_ReadPos], m_BufLen, &err);
+    if(!err.Succeeded())
+    {
+        m_Replies.QueueError(err);
+        m_Failed = true;
+        return false;
+    }
+
+    //The remaining bytes stay put until the space after them runs out.
+    m_BufLen -= bytesConsumed;
+    m_ReadPos = (m_BufLen > 0) ? m_ReadPos + bytesConsumed : 0;
+
+    return m_Cmd.IsComplete();
+}
+
+void
+Connection::Exec(HashTable* dict)
+{
+    Exec(dict, &m_Replies);
+}
+
+void
+Connection::Reject(const Error& err)
+{
+    hbassert(m_Cmd.IsComplete());
+
+    m_Replies.QueueError(err);
+    m_Cmd.Reset();
+}
+
+void
+Connection::ExecForwarded(HashTable* dict)
+{
+    Exec(dict, &m_ForwardReplies);
+}
+
+void
+Connection::CompleteForward()
+{
+    //The owner released the command's arguments and results when it
+    //ran it, so no reference it may have shared is dropped here.
+    hbassert(0 == m_Cmd.m_CurArg && NULL == m_Cmd.m_ResultBlob);
+
+    m_Replies.Append(&m_ForwardReplies);
+}
+
+//private:
+
+void
+Connection::Exec(HashTable* dict, ReplyBuffer* replies)
+{
+    hbassert(m_Cmd.IsComplete());
+
+    Error err;
+    const CommandExecResult result = m_Cmd.Exec(dict, &err);
+    replies->QueueReply(m_Cmd, result, err);
+    m_Cmd.Reset();
+}
+
+//Moves the unparsed bytes to a buffer of at least minSize bytes.
+bool
+Connection::ResizeReadBuf(const size_t minSize)
+{
+    hbassert(m_Pool);
+
+    size_t newSize;
+    byte* newBuf = m_Pool->Alloc(minSize, &newSize);
+    if(!newBuf)
+    {
+        return false;
+    }
+
+    hbassert(newSize >= m_BufLen);
+    if(m_BufLen > 0)
+    {
+        memcpy(newBuf, &m_ReadBuf[m_ReadPos], m_BufLen);
+    }
+
+    if(m_ReadBuf)
+    {
+        m_Pool->Free(m_ReadBuf, m_ReadBufSize);
+    }
+
+    m_ReadBuf = newBuf;
+    m_ReadBufSize = newSize;
+    m_ReadPos = 0;
+    return true;
+}
+
+void
+Connection::ReleaseReadBuf()
+{
+    if(m_ReadBuf)
+    {
+        m_Pool->Free(m_ReadBuf, m_ReadBufSize);
+        m_ReadBuf = NULL;
+        m_ReadBufSize = 0;
+    }
+
+    m_ReadPos = m_BufLen = 0;
+}
+
+}   //namespace honeybase
@@ -0,0 +1,280 @@
+#ifndef __HB_CONNECTION_H__
+#define __HB_CONNECTION_H__
+
+#include "command.h"
+
+namespace honeybase
+{
+
+class Error;
+class HashTable;
+
+///////////////////////////////////////////////////////////////////////////////
+//  ReplyBuffer
+//
+//  Queue of reply bytes kept in fixed size chunks that are never
+//  reallocated, so queued bytes stay put while an asynchronous send
+//  is in flight.
+//
+//  Large Blob values aren't copied.  The buffer takes a reference to
+//  the Blob and its bytes are sent straight from it, so the value
+//  stays valid even if the dict replaces it before the send is done.
+//  A segmented Blob is referenced a segment at a time.  Reference
+//  counts are atomic, so a reply built by the shard that owns the key
+//  can be sent and released by another.
+///////////////////////////////////////////////////////////////////////////////
+class ReplyBuffer
+{
+public:
+
+    static const size_t CHUNK_SIZE  = 4096;
+
+    //Blob values at least this long are referenced instead of copied.
+    static const size_t MIN_REF_LEN = 1024;
+
+    ReplyBuffer();
+    ~ReplyBuffer();
+
+    void Clear();
+
+    void QueueReply(const Command& cmd, const CommandExecResult result, const Error& err);
+
+    void QueueError(const Error& err);
+
+    //Moves all of that's bytes to the end of this buffer.
+    void Append(ReplyBuffer* that);
+
+    //Returns the contiguous run of unsent bytes that starts offset
+    //bytes past the first unsent byte, or 0 if there are none.
+    size_t GetData(const size_t offset, const byte** data) const;
+
+    //Releases len bytes from the front of the buffer.
+    void Consume(const size_t len);
+
+    size_t GetLength() const
+    {
+        return m_Len;
+    }
+
+    //True if a reply couldn't be queued for lack of memory.
+    bool HasFailed() const
+    {
+        return m_Failed;
+    }
+
+private:
+
+    class Chunk
+    {
+    public:
+        Chunk* m_Next;
+        size_t m_Len;
+
+        //Points at m_Data, or at the bytes of m_Blob.
+        const byte* m_Bytes;
+
+        //Set for a chunk that refers to a Blob instead of holding bytes.
+        //Such chunks are allocated without m_Data.
+        Blob* m_Blob;
+
+        byte m_Data[CHUNK_SIZE];
+    };
+
+    Chunk* AllocChunk();
+
+    void FreeChunk(Chunk* chunk);
+
+    void LinkChunk(Chunk* chunk);
+
+    void QueueBytes(const void* bytes, const size_t len);
+
+    void QueueBlob(Blob* blob);
+
+    void QueueString(const char* str);
+
+    void QueueBulk(const Value& value, const ValueType valueType);
+
+    Chunk* m_Head;
+    Chunk* m_Tail;
+    Chunk* m_Spare;
+    size_t m_Pos;
+    size_t m_Len;
+
+    bool m_Failed;
+
+    ReplyBuffer(const ReplyBuffer&);
+    ReplyBuffer& operator=(const ReplyBuffer&);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  ReadBufferPool
+//
+//  Free lists of read buffers in a few size classes, shared by the
+//  connections of one network thread.  Not thread safe; each network
+//  thread keeps its own.
+///////////////////////////////////////////////////////////////////////////////
+class ReadBufferPool
+{
+public:
+
+    //Each size class is four times the size of the one before it.
+    static const size_t MIN_BUFFER_SIZE = 1024;
+    static const int NUM_SIZE_CLASSES   = 4;
+    static const size_t MAX_BUFFER_SIZE = MIN_BUFFER_SIZE << (2 * (NUM_SIZE_CLASSES - 1));
+
+    ReadBufferPool();
+    ~ReadBufferPool();
+
+    //Returns a buffer of at least minSize bytes, capped at
+    //MAX_BUFFER_SIZE.  Its actual size is returned in size.
+    byte* Alloc(const size_t minSize, size_t* size);
+
+    void Free(byte* buf, const size_t size);
+
+private:
+
+    //Buffers beyond this many per size class go back to the heap.
+    static const int MAX_FREE_BUFFERS   = 64;
+
+    class FreeBuffer
+    {
+    public:
+        FreeBuffer* m_Next;
+    };
+
+    static int GetSizeClass(const size_t size);
+
+    FreeBuffer* m_FreeLists[NUM_SIZE_CLASSES];
+    int m_NumFree[NUM_SIZE_CLASSES];
+
+    ReadBufferPool(const ReadBufferPool&);
+    ReadBufferPool& operator=(const ReadBufferPool&);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Connection
+//
+//  Protocol state for one client connection, independent of the socket
+//  API used to move the bytes.  The network backend reads into the space
+//  returned by GetReadSpace(), calls ParseNext() and Exec() to run
+//  commands, and sends whatever GetWriteData() returns.
+//
+//  A parsed command can instead be handed to the thread that owns its
+//  key, which calls ExecForwarded().  Until the owner is done the
+//  connection belongs to that thread; the originating thread then calls
+//  CompleteForward() to queue the reply.
+//
+//  The read buffer comes from a ReadBufferPool.  It grows while reads
+//  keep filling it and goes back to the pool when the connection is
+//  idle.  The rest of a large argument is read straight into its Blob.
+///////////////////////////////////////////////////////////////////////////////
+class Connection
+{
+public:
+
+    Connection();
+    ~Connection();
+
+    //Must be called before the first read.
+    void SetReadBufferPool(ReadBufferPool* pool)
+    {
+        m_Pool = pool;
+    }
+
+    void Reset();
+
+    //Returns NULL if a read buffer couldn't be allocated.
+    byte* GetReadSpace(size_t* len);
+
+    void CommitRead(const size_t len);
+
+    //Call when the socket has no more input.  Returns the read buffer
+    //to the pool if everything in it has been parsed.
+    void OnIdle();
+
+    //Parses the read buffer.  Returns true if it holds a complete
+    //command, false when more input is needed or the stream is
+    //invalid (see HasFailed()).
+    bool ParseNext();
+
+    const Command& GetCommand() const
+    {
+        return m_Cmd;
+    }
+
+    //Executes the parsed command and queues its reply.
+    void Exec(HashTable* dict);
+
+    //Queues err as the reply to the parsed command without running it.
+    void Reject(const Error& err);
+
+    //Executes the parsed command on the thread that owns its key.
+    void ExecForwarded(HashTable* dict);
+
+    //Queues the reply produced by ExecForwarded().
+    void CompleteForward();
+
+    bool HasFailed() const
+    {
+        return m_Failed || m_Replies.HasFailed();
+    }
+
+    size_t GetWriteData(const size_t offset, const byte** data) const
+    {
+        return m_Replies.GetData(offset, data);
+    }
+
+    void CommitWrite(const size_t len)
+    {
+        m_Replies.Consume(len);
+    }
+
+    size_t GetPendingWriteLen() const
+    {
+        return m_Replies.GetLength();
+    }
+
+    bool HasPendingWrite() const
+    {
+        return m_Replies.GetLength() > 0;
+    }
+
+private:
+
+    void Exec(HashTable* dict, ReplyBuffer* replies);
+
+    bool ResizeReadBuf(const size_t minSize);
+
+    void ReleaseReadBuf();
+
+    Command m_Cmd;
+
+    ReadBufferPool* m_Pool;
+    byte* m_ReadBuf;
+    size_t m_ReadBufSize;
+
+    //Unparsed bytes start at m_ReadPos.
+    size_t m_ReadPos;
+    size_t m_BufLen;
+
+    //Size of the space returned by the last GetReadSpace().
+    size_t m_ReadSpace;
+
+    ReplyBuffer m_Replies;
+    ReplyBuffer m_ForwardReplies;
+
+    bool m_Failed       : 1;
+
+    //The last GetReadSpace() returned space in the current argument.
+    bool m_DirectRead   : 1;
+
+    //The last read filled the buffer, so there's likely more waiting.
+    bool m_GrowReadBuf  : 1;
+
+    Connection(const Connection&);
+    Connection& operator=(const Connection&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_CONNECTION_H__
@@ -1,6 +1,8 @@
 #include "dict.h"
 
-#include <new.h>
+#include "hash.h"
+
+#include <new>
 #include <string.h>
 
 namespace honeybase
@@ -8,6 +10,15 @@ namespace honeybase
 
 static Log s_Log("dict");
 
+//For int and double keys.  Blob keys are hashed by Blob::Hash().
+static const u64 HASH_SALT = 0x811c9dc5;
+
+//Old slots moved per write while the table is being resized.
+static const int MOVE_INCREMENT = 256;
+
+//Slots DefragFor() looks at between checks of the clock.
+static const size_t DEFRAG_INCREMENT = 256;
+
 #define FNV1_32_INIT ((u32)0x811c9dc5)
 //#define NO_FNV_GCC_OPTIMIZATION
 //#define FNV_32_PRIME 16777619
@@ -118,94 +129,175 @@ static inline void Move(T* dst, const T* src, const size_t count)
     }
 }
 
-static size_t s_NumDictItems;
+static volatile size_t s_NumDictItems;
+
+//Inline Blobs start at multiples of this from their item, so their
+//reference counts are aligned for atomic updates.
+static const size_t BLOB_ALIGNMENT = sizeof(s32);
+
+static inline size_t
+AlignBlob(const size_t size)
+{
+    return (size + BLOB_ALIGNMENT - 1) & ~(BLOB_ALIGNMENT - 1);
+}
+
+//Set by HashTable::SetInternValues().
+static bool s_InternValues;
 
 ///////////////////////////////////////////////////////////////////////////////
 //  HtItem
 ///////////////////////////////////////////////////////////////////////////////
 HtItem*
-HtItem::Create(const Value& key, const ValueType keyType, const u32 hash)
+HtItem::Create(const Value& key, const ValueType keyType,
+                const Value& value, const ValueType valueType,
+                const u64 hash)
 {
-    HtItem* item = (HtItem*) Heap::ZAlloc(sizeof(HtItem));
-
+    //Length() because the value may be segmented.
+    const size_t valueLen =
+        (VALUETYPE_BLOB == valueType) ? value.m_Blob->Length() : 0;
+    const bool inlineValue = VALUETYPE_BLOB == valueType && valueLen <= HashTable::MAX_INLINE_LEN;
+    const size_t valueSize = inlineValue ? Blob::Size(valueLen) : 0;
+
+    byte* valueSpace;
+    HtItem* item = Alloc(key, keyType, valueSize, hash, &valueSpace);
     if(item)
     {
-        new(item) HtItem();
-        ++s_NumDictItems;
-
-        item->m_KeyType = keyType;
-        item->m_Hash = hash;
+        item->m_ValueType = valueType;
 
-        if(VALUETYPE_BLOB == keyType)
+        if(inlineValue)
         {
-            key.m_Blob->Ref();
+            const byte* valueData;
+            value.m_Blob->GetData(&valueData);
+            item->m_Value.m_Blob = Blob::Encode(valueData, valueLen, valueSpace, valueSize);
+            item->m_InlineValue = true;
         }
+        else
+        {
+            if(VALUETYPE_BLOB == valueType)
+            {
+                value.m_Blob->Ref();
+            }
 
-        item->m_Key = key;
+            item->m_Value = value;
+        }
     }
 
     return item;
 }
 
-HtItem*
-HtItem::Create(const Value& key, const ValueType keyType,
-                const Value& value, const ValueType valueType,
-                const u32 hash)
+void
+HtItem::Destroy(HtItem* item)
 {
-    HtItem* item = Create(key, keyType, hash);
     if(item)
     {
-        item->m_ValueType = valueType;
-
-        if(VALUETYPE_BLOB == valueType)
+        if(VALUETYPE_BLOB == item->m_KeyType && !item->m_InlineKey)
         {
-            value.m_Blob->Ref();
+            item->m_Key.m_Blob->Unref();
         }
 
-        item->m_Value = value;
-    }
+        item->ReleaseValue();
 
-    return item;
+        item->~HtItem();
+        Heap::Free(item, HEAPTAG_DICT);
+        AtomicDecrement(&s_NumDictItems);
+    }
 }
 
 HtItem*
-HtItem::CreateBlob(const Value& key, const ValueType keyType, const size_t len, const u32 hash)
+HtItem::Alloc(const Value& key, const ValueType keyType,
+                const size_t valueSize, const u64 hash,
+                byte** valueSpace)
 {
-    HtItem* item = Create(key, keyType, hash);
+    const byte* keyData = NULL;
+    const size_t keyLen =
+        (VALUETYPE_BLOB == keyType) ? key.m_Blob->GetData(&keyData) : 0;
+    const bool inlineKey = VALUETYPE_BLOB == keyType && keyLen <= HashTable::MAX_INLINE_LEN;
+    const size_t keySize = inlineKey ? AlignBlob(Blob::Size(keyLen)) : 0;
+    const size_t itemSize = AlignBlob(sizeof(HtItem));
+
+    HtItem* item = (HtItem*) Heap::Alloc(itemSize + keySize + valueSize, HEAPTAG_DICT);
+
     if(item)
     {
-        item->m_ValueType = VALUETYPE_BLOB;
-        if(NULL == (item->m_Value.m_Blob = Blob::Create(len)))
+        new(item) HtItem();
+        AtomicIncrement(&s_NumDictItems);
+
+        item->m_KeyType = keyType;
+        item->m_Hash = hash;
+
+        byte* space = (byte*) item + itemSize;
+
+        if(inlineKey)
         {
-            Destroy(item);
-            item = NULL;
+            item->m_Key.m_Blob = Blob::Encode(keyData, keyLen, space, keySize);
+            item->m_InlineKey = true;
+            space += keySize;
         }
+        else
+        {
+            if(VALUETYPE_BLOB == keyType)
+            {
+                key.m_Blob->Ref();
+            }
+
+            item->m_Key = key;
+        }
+
+        *valueSpace = space;
     }
 
     return item;
 }
 
 void
-HtItem::Destroy(HtItem* item)
+HtItem::SetValue(const Value& value, const ValueType valueType)
 {
-    if(item)
+    //Ref first in case it's the same Blob.
+    if(VALUETYPE_BLOB == valueType)
     {
-        if(VALUETYPE_BLOB == item->m_KeyType)
-        {
-            item->m_Key.m_Blob->Unref();
-            item->m_Key.m_Blob = NULL;
-        }
+        value.m_Blob->Ref();
+    }
 
-        if(VALUETYPE_BLOB == item->m_ValueType)
-        {
-            item->m_Value.m_Blob->Unref();
-            item->m_Value.m_Blob = NULL;
-        }
+    ReleaseValue();
 
-        item->~HtItem();
-        Heap::Free(item);
-        --s_NumDictItems;
+    m_Value = value;
+    m_ValueType = valueType;
+}
+
+HtItem*
+HtItem::Move(HtItem* item)
+{
+    HtItem* moved = (HtItem*) Heap::Move(item);
+    if(!moved)
+    {
+        return NULL;
+    }
+
+    //Inline Blobs are at the same offsets in the new allocation.
+    if(moved->m_InlineKey)
+    {
+        moved->m_Key.m_Blob = (Blob*) ((byte*) moved + ((byte*) moved->m_Key.m_Blob - (byte*) item));
+    }
+
+    if(moved->m_InlineValue)
+    {
+        moved->m_Value.m_Blob = (Blob*) ((byte*) moved + ((byte*) moved->m_Value.m_Blob - (byte*) item));
     }
+
+    return moved;
+}
+
+void
+HtItem::ReleaseValue()
+{
+    if(VALUETYPE_BLOB == m_ValueType && !m_InlineValue)
+    {
+        m_Value.m_Blob->Unref();
+    }
+
+    m_Value.m_Blob = NULL;
+    m_ValueType = VALUETYPE_INT;
+    m_InlineValue = false;
 }
 
 //private:
@@ -214,6 +306,8 @@ HtItem::HtItem()
     : m_Next(0)
     , m_KeyType(VALUETYPE_INT)
     , m_ValueType(VALUETYPE_INT)
+    , m_InlineKey(false)
+    , m_InlineValue(false)
 {
 }
 
@@ -225,12 +319,19 @@ HtItem::~HtItem()
 //  HashTable
 ///////////////////////////////////////////////////////////////////////////////
 HashTable::HashTable()
-    : m_Count(0)
+    : m_SlotToMove(0)
+    , m_Count(0)
     , m_NumSlots(0)
+    , m_NumOldSlots(0)
+    , m_MinNumSlots(INITIAL_NUM_SLOTS)
+    , m_DefragSlot(0)
+    , m_InternPool(NULL)
     , m_RefCount(1)
-    , m_HashSalt(FNV1_32_INIT)
+    , m_HashSalt(HASH_SALT)
 {
     m_Slots[0] = m_Slots[1] = NULL;
+    memset(&m_RehashStats, 0, sizeof(m_RehashStats));
+    memset(&m_DefragStats, 0, sizeof(m_DefragStats));
 }
 
 HashTable::~HashTable()
@@ -240,16 +341,22 @@ HashTable::~HashTable()
 HashTable*
 HashTable::Create()
 {
-    HashTable* ht = (HashTable*) Heap::ZAlloc(sizeof(HashTable));
+    HashTable* ht = (HashTable*) Heap::ZAlloc(sizeof(HashTable), HEAPTAG_DICT);
     if(ht)
     {
         new (ht) HashTable();
-        ht->m_Slots[0] = (Slot*) Heap::ZAlloc(INITIAL_NUM_SLOTS * sizeof(Slot));
+        ht->m_Slots[0] = (Slot*) Heap::ZAlloc(INITIAL_NUM_SLOTS * sizeof(Slot), HEAPTAG_DICT);
         if(ht->m_Slots[0])
         {
             ht->m_NumSlots = INITIAL_NUM_SLOTS;
         }
-        else
+
+        if(s_InternValues)
+        {
+            ht->m_InternPool = InternPool::Create();
+        }
+
+        if(!ht->m_Slots[0] || (s_InternValues && !ht->m_InternPool))
         {
             ht->Unref();
             ht = NULL;
@@ -259,11 +366,27 @@ HashTable::Create()
     return ht;
 }
 
+void
+HashTable::SetInternValues(const bool intern)
+{
+    s_InternValues = intern;
+}
+
 bool
 HashTable::Set(const Value& key, const ValueType keyType,
                 const Value& value, const ValueType valueType)
 {
-    HtItem* item = HtItem::Create(key, keyType, value, valueType, this->HashKey(key, keyType));
+    return Set(key, keyType, value, valueType, HashKey(key, keyType));
+}
+
+bool
+HashTable::Set(const Value& key, const ValueType keyType,
+                const Value& value, const ValueType valueType,
+                const u64 hash)
+{
+    hbassert(HashKey(key, keyType) == hash);
+
+    HtItem* item = HtItem::Create(key, keyType, Intern(value, valueType), valueType, hash);
     if(item)
     {
         Set(item);
@@ -276,12 +399,20 @@ HashTable::Set(const Value& key, const ValueType keyType,
 bool
 HashTable::Clear(const Value& key, const ValueType keyType)
 {
+    return Clear(key, keyType, HashKey(key, keyType));
+}
+
+bool
+HashTable::Clear(const Value& key, const ValueType keyType, const u64 hash)
+{
+    hbassert(HashKey(key, keyType) == hash);
+
     Slot* slot;
-    u32 hash;
-    HtItem** item = Find(key, keyType, &slot, &hash);
+    HtItem** item = Find(key, keyType, hash, &slot);
     if(*item)
     {
         HtItem* next = (*item)->m_Next;
+        Unintern(*item);
         HtItem::Destroy(*item);
         *item = next;
 
@@ -290,6 +421,8 @@ HashTable::Clear(const Value& key, const ValueType keyType)
         --m_Count;
         hbassert(m_Count >= 0);
 
+        Rehash();
+
         return true;
     }
 
@@ -300,9 +433,17 @@ bool
 HashTable::Find(const Value& key, const ValueType keyType,
                 Value* value, ValueType* valueType)
 {
+    return Find(key, keyType, HashKey(key, keyType), value, valueType);
+}
+
+bool
+HashTable::Find(const Value& key, const ValueType keyType, const u64 hash,
+                Value* value, ValueType* valueType)
+{
+    hbassert(HashKey(key, keyType) == hash);
+
     Slot* slot;
-    u32 hash;
-    HtItem** item = const_cast<HashTable*>(this)->Find(key, keyType, &slot, &hash);
+    HtItem** item = Find(key, keyType, hash, &slot);
 
     if(*item)
     {
@@ -314,105 +455,357 @@ HashTable::Find(const Value& key, const ValueType keyType,
     return false;
 }
 
+//Number of keys FindMany() and SetMany() hash and prefetch before
+//walking their chains.  Enough to cover memory latency, few enough that
+//the prefetched lines are still cached when they're used.
+static const size_t PREFETCH_BATCH_SIZE = 16;
+
+size_t
+HashTable::FindMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    Value* values, ValueType* valueTypes,
+                    bool* found)
+{
+    u64 hashes[PREFETCH_BATCH_SIZE];
+    size_t numFound = 0;
+
+    for(size_t first = 0; first < numKeys; first += PREFETCH_BATCH_SIZE)
+    {
+        const size_t count = (numKeys - first < PREFETCH_BATCH_SIZE)
+                            ? numKeys - first
+                            : PREFETCH_BATCH_SIZE;
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = HashKey(keys[first+i], keyType);
+            PrefetchSlot(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            PrefetchItem(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            PrefetchKey(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            const size_t k = first + i;
+            Slot* slot;
+            HtItem** item = Find(keys[k], keyType, hashes[i], &slot);
+
+            if(*item)
+            {
+                values[k] = (*item)->m_Value;
+                valueTypes[k] = (*item)->m_ValueType;
+                found[k] = true;
+                ++numFound;
+            }
+            else
+            {
+                found[k] = false;
+            }
+        }
+    }
+
+    return numFound;
+}
+
+bool
+HashTable::SetMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    const Value* values, const ValueType valueType)
+{
+    u64 hashes[PREFETCH_BATCH_SIZE];
+
+    for(size_t first = 0; first < numKeys; first += PREFETCH_BATCH_SIZE)
+    {
+        const size_t count = (numKeys - first < PREFETCH_BATCH_SIZE)
+                            ? numKeys - first
+                            : PREFETCH_BATCH_SIZE;
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = HashKey(keys[first+i], keyType);
+            PrefetchSlot(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            PrefetchItem(hashes[i]);
+        }
+
+        //A set can grow the table part way through the batch, which
+        //only makes the remaining prefetches miss.
+        for(size_t i = 0; i < count; ++i)
+        {
+            const size_t k = first + i;
+            HtItem* item = HtItem::Create(keys[k], keyType, Intern(values[k], valueType), valueType, hashes[i]);
+            if(!item)
+            {
+                return false;
+            }
+
+            Set(item);
+        }
+    }
+
+    return true;
+}
+
+bool
+HashTable::Reserve(const size_t numItems)
+{
+    //Enough slots for an average of one item each.
+    size_t numSlots = INITIAL_NUM_SLOTS;
+    while(numSlots < numItems)
+    {
+        numSlots *= 2;
+    }
+
+    m_MinNumSlots = numSlots;
+
+    if(numSlots <= m_NumSlots)
+    {
+        return true;
+    }
+
+    //The caller is about to add the items, so move everything now
+    //rather than a little on each write.
+    if(m_Slots[1])
+    {
+        m_RehashStats.m_SlotsMovedByWrites += MoveSlots(m_NumOldSlots);
+    }
+
+    if(!StartResize(numSlots))
+    {
+        return false;
+    }
+
+    m_RehashStats.m_SlotsMovedByWrites += MoveSlots(m_NumOldSlots);
+
+    return true;
+}
+
+bool
+HashTable::LoadMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    const Value* values, const ValueType valueType)
+{
+    u64 hashes[PREFETCH_BATCH_SIZE];
+
+    for(size_t first = 0; first < numKeys; first += PREFETCH_BATCH_SIZE)
+    {
+        const size_t count = (numKeys - first < PREFETCH_BATCH_SIZE)
+                            ? numKeys - first
+                            : PREFETCH_BATCH_SIZE;
+
+        //Only the slots are read, so there's no need to prefetch the
+        //items in them.
+        for(size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = HashKey(keys[first+i], keyType);
+            PrefetchSlot(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            const size_t k = first + i;
+
+            HB_ASSERTONLY(Slot* slot);
+            hbassert(!*Find(keys[k], keyType, hashes[i], &slot));
+
+            HtItem* item = HtItem::Create(keys[k], keyType, Intern(values[k], valueType), valueType, hashes[i]);
+            if(!item)
+            {
+                return false;
+            }
+
+            Insert(item);
+        }
+    }
+
+    return true;
+}
+
 bool
 HashTable::Patch(const Value& key, const ValueType keyType,
                 const size_t numPatches,
                 const Blob** patches,
                 const size_t* offsets)
 {
+    hbassert(numPatches > 0);
+
     Slot* slot;
-    u32 hash;
-    HtItem* pOldItem = *Find(key, keyType, &slot, &hash);
+    u64 hash;
+    HtItem** pitem = Find(key, keyType, &slot, &hash);
+    HtItem* item = *pitem;
 
-    size_t patchNum = 0;
+    Blob* oldBlob = NULL;
+    if(item)
+    {
+        if(!hbverify(VALUETYPE_BLOB == item->m_ValueType))
+        {
+            return false;
+        }
 
-again:
+        oldBlob = item->m_Value.m_Blob;
+    }
 
-    if(pOldItem)
+    //Patches after the first that needs a new Blob go into that Blob.
+    Blob* blob = oldBlob;
+    for(size_t i = 0; i < numPatches; ++i)
     {
-        if(hbverify(VALUETYPE_BLOB == pOldItem->m_ValueType))
+        Blob* patched = Blob::Patch(blob, patches[i], offsets[i]);
+        if(!patched)
         {
-            byte* oldData;
-            const byte* patchData;
-            const size_t oldLen = pOldItem->m_Value.m_Blob->GetData(&oldData);
-
-            for(; patchNum < numPatches; ++patchNum)
+            if(blob != oldBlob)
             {
-                const Blob* patch = patches[patchNum];
-                const size_t offset = offsets[patchNum];
-
-                const size_t patchLen = patch->GetData(&patchData);
-                if(offset + patchLen <= oldLen)
-                {
-                    //New data will be patched within the bounds of
-                    //the old data.
+                blob->Unref();
+            }
 
-                    //Use memmove because value and oldItem could be
-                    //the same item.
-                    memmove(&oldData[offset], patchData, patchLen);
-                }
-                else
-                {
-                    //New data extends past the end of the old data.
-
-                    const size_t newLen = offset + patchLen;
-                    Blob* newStr = Blob::Create(newLen);
-                    if(newStr)
-                    {
-                        byte* newData;
-                        newStr->GetData(&newData);
-                        if(offset < oldLen)
-                        {
-                            memcpy(newData, oldData, offset);
-                        }
-                        else
-                        {
-                            memcpy(newData, oldData, oldLen);
-                        }
-
-                        memcpy(&newData[offset], patchData, patchLen);
-
-                        pOldItem->m_Value.m_Blob->Unref();
-                        pOldItem->m_Value.m_Blob = newStr;
-                    }
-                }
+            return false;
+        }
 
-                return true;
-            }
+        if(blob != oldBlob && patched != blob)
+        {
+            blob->Unref();
         }
+
+        blob = patched;
     }
-    else
+
+    if(blob == oldBlob)
+    {
+        return true;
+    }
+
+    Value value;
+    value.m_Blob = blob;
+
+    if(item)
+    {
+        Unintern(item);
+        item->SetValue(value, VALUETYPE_BLOB);
+        blob->Unref();
+        return true;
+    }
+
+    item = HtItem::Create(key, keyType, value, VALUETYPE_BLOB, hash);
+    blob->Unref();
+    if(!item)
     {
-        //Item doesn't exist yet, create it.
+        return false;
+    }
+
+    bool replaced;
+    Set(item, pitem, slot, &replaced);
+    return true;
+}
 
-        const byte* patchData;
-        const size_t patchLen = patches[patchNum]->GetData(&patchData);
-        const size_t newLen = offsets[patchNum] + patchLen;
+size_t
+HashTable::Count() const
+{
+    return m_Count;
+}
 
-        HtItem* newItem = pOldItem = HtItem::CreateBlob(key, keyType, newLen, HashKey(key, keyType));
+bool
+HashTable::IsRehashing() const
+{
+    return NULL != m_Slots[1];
+}
 
-        if(newItem)
+bool
+HashTable::RehashFor(const unsigned microseconds)
+{
+    if(!m_Slots[1])
+    {
+        return false;
+    }
+
+    //Checking the clock after every MOVE_INCREMENT slots keeps the
+    //overrun to about what a write would spend.
+    const double seconds = microseconds / 1000000.0;
+    StopWatch sw;
+    sw.Start();
+
+    do
+    {
+        m_RehashStats.m_SlotsMovedByRehashFor += MoveSlots(MOVE_INCREMENT);
+    }
+    while(m_Slots[1] && sw.GetElapsed() < seconds);
+
+    return NULL != m_Slots[1];
+}
+
+void
+HashTable::GetRehashStats(RehashStats* stats) const
+{
+    *stats = m_RehashStats;
+    stats->m_SlotsRemaining = m_Slots[1] ? m_NumOldSlots - m_SlotToMove : 0;
+}
+
+bool
+HashTable::DefragFor(const unsigned microseconds)
+{
+    if(m_Slots[1])
+    {
+        return false;
+    }
+
+    //The table may have shrunk since the last call.
+    if(m_DefragSlot >= m_NumSlots)
+    {
+        m_DefragSlot = 0;
+    }
+
+    const double seconds = microseconds / 1000000.0;
+    StopWatch sw;
+    sw.Start();
+
+    do
+    {
+        const size_t end = (m_NumSlots - m_DefragSlot > DEFRAG_INCREMENT)
+                            ? m_DefragSlot + DEFRAG_INCREMENT
+                            : m_NumSlots;
+
+        for(; m_DefragSlot < end; ++m_DefragSlot)
         {
-            byte* newData;
-            newItem->m_Value.m_Blob->GetData(&newData);
-            memcpy(&newData[offsets[patchNum]], patchData, patchLen);
-            Set(newItem);
-            patchNum = 1;
-            goto again;
+            DefragSlot(&m_Slots[0][m_DefragSlot]);
         }
-        else
+
+        if(m_DefragSlot == m_NumSlots)
         {
+            m_DefragSlot = 0;
+            ++m_DefragStats.m_NumPasses;
             return false;
         }
     }
+    while(sw.GetElapsed() < seconds);
 
-    return false;
+    return true;
 }
 
-size_t
-HashTable::Count() const
+void
+HashTable::GetDefragStats(DefragStats* stats) const
 {
-    return m_Count;
+    *stats = m_DefragStats;
+}
+
+void
+HashTable::GetInternStats(InternPool::Stats* stats) const
+{
+    if(m_InternPool)
+    {
+        m_InternPool->GetStats(stats);
+    }
+    else
+    {
+        memset(stats, 0, sizeof(*stats));
+    }
 }
 
 void
@@ -442,10 +835,10 @@ HashTable::Destroy(HashTable* dict)
     {
         hbassert(0 == dict->m_RefCount);
 
-        size_t numSlots = dict->m_NumSlots;
-        for(int i = 0; i < hbarraylen(dict->m_Slots); ++i, numSlots /= 2)
+        for(size_t i = 0; i < hbarraylen(dict->m_Slots); ++i)
         {
             Slot* slots = dict->m_Slots[i];
+            const size_t numSlots = i ? dict->m_NumOldSlots : dict->m_NumSlots;
 
             if(!slots)
             {
@@ -463,24 +856,24 @@ HashTable::Destroy(HashTable* dict)
                 }
             }
 
-            Heap::Free(slots);
+            Heap::Free(slots, HEAPTAG_DICT);
             dict->m_Slots[i] = NULL;
         }
 
+        InternPool::Destroy(dict->m_InternPool);
+
         dict->~HashTable();
-        Heap::Free(dict);
+        Heap::Free(dict, HEAPTAG_DICT);
     }
 }
 
-u32
+u64
 HashTable::HashBytes(const byte* bytes, const size_t len) const
 {
-    //return FnvHashBufInitVal(bytes, len, m_HashSalt);
-
-    return MurmurHash2(bytes, len, m_HashSalt);
+    return Hash64(bytes, len, m_HashSalt);
 }
 
-u32
+u64
 HashTable::HashKey(const Value& key, const ValueType keyType) const
 {
     switch(keyType)
@@ -491,11 +884,7 @@ HashTable::HashKey(const Value& key, const ValueType keyType) const
         return HashBytes((const byte*)&key.m_Int, sizeof(key.m_Int));
         break;
     case VALUETYPE_BLOB:
-        {
-            const byte* keyData;
-            const size_t keylen = key.m_Blob->GetData(&keyData);
-            return HashBytes(keyData, keylen);
-        }
+        return key.m_Blob->Hash();
         break;
     }
 
@@ -503,8 +892,6 @@ HashTable::HashKey(const Value& key, const ValueType keyType) const
     return 0;
 }
 
-static const int MOVE_INCREMENT = 256;
-
 void
 HashTable::Set(HtItem* newItem)
 {
@@ -534,6 +921,9 @@ HashTable::Set(HtItem* newItem, HtItem** pitem, Slot* slot, bool* replaced)
     }
     else
     {
+        //Keep the rest of the chain.
+        newItem->m_Next = (*pitem)->m_Next;
+        Unintern(*pitem);
         HtItem::Destroy(*pitem);
         *replaced = true;
     }
@@ -546,75 +936,229 @@ HashTable::Set(HtItem* newItem, HtItem** pitem, Slot* slot, bool* replaced)
 void
 HashTable::Rehash()
 {
-    if(m_Count >= m_NumSlots*2)
+    //Grow at an average of 2 items per slot and shrink below 1 per 8
+    //slots, so a table that's grown won't shrink again until most of
+    //its items are gone, and vice versa.
+    if(!m_Slots[1])
     {
-        Slot* newSlots = (Slot*) Heap::ZAlloc(m_NumSlots * 2 * sizeof(Slot));
-        if(newSlots)
+        if(m_Count >= m_NumSlots*2)
+        {
+            StartResize(m_NumSlots * 2);
+        }
+        else if(m_NumSlots > m_MinNumSlots && m_Count < m_NumSlots/8)
         {
-            m_Slots[1] = m_Slots[0];
-            m_Slots[0] = newSlots;
-            m_NumSlots *= 2;
-            m_SlotToMove = 0;
+            //Shrink to between 2 and 4 slots per item, in one go after
+            //a mass delete.
+            size_t newNumSlots = m_MinNumSlots;
+            while(newNumSlots < m_Count*2)
+            {
+                newNumSlots *= 2;
+            }
 
-            /*Slot* oldSlots = m_Slots[0];
-            m_Slots[0] = newSlots;
-            const unsigned oldNumSlots = m_NumSlots;
-            m_NumSlots *= 2;
+            StartResize(newNumSlots);
+        }
+    }
 
-            for(int i = 0; i < (int)oldNumSlots; ++i)
-            {
-                HtItem* item = oldSlots[i].m_Item;
-                while(item)
-                {
-                    HtItem* next = item->m_Next;
-                    item->m_Next = NULL;
+    if(m_Slots[1])
+    {
+        m_RehashStats.m_SlotsMovedByWrites += MoveSlots(MOVE_INCREMENT);
+    }
+}
 
-                    bool replaced;
-                    this->Set(item, &replaced);
-                    hbassert(!replaced);
+bool
+HashTable::StartResize(const size_t newNumSlots)
+{
+    hbassert(!m_Slots[1]);
 
-                    item = next;
-                }
-            }
+    Slot* newSlots = (Slot*) Heap::ZAlloc(newNumSlots * sizeof(Slot), HEAPTAG_DICT);
+    if(!newSlots)
+    {
+        return false;
+    }
+
+    m_Slots[1] = m_Slots[0];
+    m_Slots[0] = newSlots;
+    m_NumOldSlots = m_NumSlots;
+    m_SlotToMove = 0;
+
+    if(newNumSlots > m_NumSlots)
+    {
+        ++m_RehashStats.m_NumGrows;
+    }
+    else
+    {
+        ++m_RehashStats.m_NumShrinks;
+    }
+
+    m_NumSlots = newNumSlots;
+
+    return true;
+}
+
+size_t
+HashTable::MoveSlots(const size_t numSlots)
+{
+    hbassert(m_Slots[1]);
+
+    const size_t start = m_SlotToMove;
+    for(size_t i = 0; i < numSlots && m_SlotToMove < m_NumOldSlots; ++i, ++m_SlotToMove)
+    {
+        Slot* srcSlot = &m_Slots[1][m_SlotToMove];
+        HtItem** item = &srcSlot->m_Item;
+
+        m_RehashStats.m_ItemsMoved += srcSlot->m_Count;
 
-            Heap::Free(oldSlots);*/
+        while(*item)
+        {
+            HtItem* tmp = (*item);
+            *item = tmp->m_Next;
+
+            const size_t idx = tmp->m_Hash & (m_NumSlots-1);
+            Slot* dstSlot = &m_Slots[0][idx];
+            tmp->m_Next = dstSlot->m_Item;
+            dstSlot->m_Item = tmp;
+            ++dstSlot->m_Count;
         }
+
+        srcSlot->m_Count = 0;
     }
 
-    if(m_Slots[1])
+    const size_t numMoved = m_SlotToMove - start;
+
+    if(m_SlotToMove >= m_NumOldSlots)
+    {
+        Heap::Free(m_Slots[1], HEAPTAG_DICT);
+        m_Slots[1] = NULL;
+        m_NumOldSlots = 0;
+        m_SlotToMove = 0;
+    }
+
+    return numMoved;
+}
+
+void
+HashTable::DefragSlot(Slot* slot)
+{
+    for(HtItem** pitem = &slot->m_Item; *pitem; pitem = &(*pitem)->m_Next)
     {
-        const size_t numOldSlots = m_NumSlots/2;
-        for(int i = 0; i < MOVE_INCREMENT && m_SlotToMove < numOldSlots; ++i, ++m_SlotToMove)
+        HtItem* item = *pitem;
+        if(Heap::ShouldMove(item))
         {
-            Slot* srcSlot = &m_Slots[1][m_SlotToMove];
-            HtItem** item = &srcSlot->m_Item;
+            HtItem* moved = HtItem::Move(item);
+            if(moved)
+            {
+                *pitem = item = moved;
+                ++m_DefragStats.m_ItemsMoved;
+            }
+        }
 
-            while(*item)
+        if(VALUETYPE_BLOB == item->m_KeyType && !item->m_InlineKey)
+        {
+            Blob* key = Blob::Move(item->m_Key.m_Blob);
+            if(key != item->m_Key.m_Blob)
             {
-                HtItem* tmp = (*item);
-                *item = tmp->m_Next;
-
-                const unsigned idx = tmp->m_Hash & (m_NumSlots-1);
-                Slot* dstSlot = &m_Slots[0][idx];
-                tmp->m_Next = dstSlot->m_Item;
-                dstSlot->m_Item = tmp;
-                ++dstSlot->m_Count;
+                item->m_Key.m_Blob = key;
+                ++m_DefragStats.m_BlobsMoved;
             }
+        }
 
-            srcSlot->m_Count = 0;
+        if(VALUETYPE_BLOB == item->m_ValueType && !item->m_InlineValue)
+        {
+            Blob* value = Blob::Move(item->m_Value.m_Blob);
+            if(value != item->m_Value.m_Blob)
+            {
+                item->m_Value.m_Blob = value;
+                ++m_DefragStats.m_BlobsMoved;
+            }
         }
+    }
+}
+
+Value
+HashTable::Intern(const Value& value, const ValueType valueType)
+{
+    Value interned = value;
+
+    //Length() because the value may be segmented.
+    if(m_InternPool
+        && VALUETYPE_BLOB == valueType
+        && value.m_Blob->Length() > MAX_INLINE_LEN)
+    {
+        interned.m_Blob = m_InternPool->Intern(value.m_Blob);
+    }
+
+    return interned;
+}
+
+void
+HashTable::Unintern(const HtItem* item)
+{
+    //The other reference would be the pool's, if it has one.
+    if(m_InternPool
+        && VALUETYPE_BLOB == item->m_ValueType
+        && !item->m_InlineValue
+        && 2 == item->m_Value.m_Blob->NumRefs())
+    {
+        m_InternPool->Release(item->m_Value.m_Blob);
+    }
+}
+
+void
+HashTable::Insert(HtItem* item)
+{
+    //New items always go in the new table.
+    Slot* slot = &m_Slots[0][item->m_Hash & (m_NumSlots-1)];
+    item->m_Next = slot->m_Item;
+    slot->m_Item = item;
+    ++slot->m_Count;
+    ++m_Count;
 
-        if(m_SlotToMove >= numOldSlots)
+    Rehash();
+}
+
+void
+HashTable::PrefetchSlot(const u64 hash) const
+{
+    //Slots in the old table below m_SlotToMove have already been moved.
+    if(m_Slots[1] && (hash & (m_NumOldSlots-1)) >= m_SlotToMove)
+    {
+        hbprefetch(&m_Slots[1][hash & (m_NumOldSlots-1)]);
+    }
+
+    hbprefetch(&m_Slots[0][hash & (m_NumSlots-1)]);
+}
+
+void
+HashTable::PrefetchItem(const u64 hash) const
+{
+    if(m_Slots[1] && (hash & (m_NumOldSlots-1)) >= m_SlotToMove)
+    {
+        const HtItem* item = m_Slots[1][hash & (m_NumOldSlots-1)].m_Item;
+        if(item)
         {
-            Heap::Free(m_Slots[1]);
-            m_Slots[1] = NULL;
-            m_SlotToMove = 0;
+            hbprefetch(item);
         }
     }
+
+    const HtItem* item = m_Slots[0][hash & (m_NumSlots-1)].m_Item;
+    if(item)
+    {
+        hbprefetch(item);
+    }
+}
+
+void
+HashTable::PrefetchKey(const u64 hash) const
+{
+    const HtItem* item = m_Slots[0][hash & (m_NumSlots-1)].m_Item;
+    if(item && hash == item->m_Hash && VALUETYPE_BLOB == item->m_KeyType)
+    {
+        hbprefetch(item->m_Key.m_Blob);
+    }
 }
 
 HtItem**
-HashTable::Find(const Value& key, const ValueType keyType, Slot** slot, u32* hash)
+HashTable::Find(const Value& key, const ValueType keyType, Slot** slot, u64* hash)
 {
     *hash = HashKey(key, keyType);
 
@@ -622,17 +1166,17 @@ HashTable::Find(const Value& key, const ValueType keyType, Slot** slot, u32* has
 }
 
 HtItem**
-HashTable::Find(const Value& key, const ValueType keyType, const u32 hash, Slot** slot)
+HashTable::Find(const Value& key, const ValueType keyType, const u64 hash, Slot** slot)
 {
     HtItem** item = NULL;
-    size_t numSlots = m_NumSlots/2;
-    for(int i = 1; i >= 0; --i, numSlots *= 2)
+    for(int i = 1; i >= 0; --i)
     {
         if(!m_Slots[i])
         {
             continue;
         }
-        const unsigned idx = hash & (numSlots-1);
+        const size_t numSlots = i ? m_NumOldSlots : m_NumSlots;
+        const size_t idx = hash & (numSlots-1);
         *slot = &m_Slots[i][idx];
         item = &(*slot)->m_Item;
 
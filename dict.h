@@ -2,38 +2,61 @@
 #define __HB_DICT_H__
 
 #include "hb.h"
+#include "internpool.h"
 
 namespace honeybase
 {
 
 class SortedSet;
 
+unsigned int MurmurHash2(const void* key, int len, unsigned int seed);
+
+//Blob keys and values no longer than HashTable::MAX_INLINE_LEN are
+//copied into the item's own allocation rather than referenced, so a
+//short key and value cost a single allocation and sit next to the
+//item in memory.  m_Key and m_Value still point at Blobs either way.
 class HtItem
 {
     friend class HashTable;
     friend class SortedSet;
 private:
 
-    static HtItem* Create(const Value& key,
-                            const ValueType keyType,
-                            const u32 hash);
     static HtItem* Create(const Value& key, const ValueType keyType,
                             const Value& value, const ValueType valueType,
-                            const u32 hash);
-    static HtItem* CreateBlob(const Value& key,
-                                const ValueType keyType,
-                                const size_t len,
-                                const u32 hash);
+                            const u64 hash);
+
     static void Destroy(HtItem* item);
 
+    //Allocates an item holding key, with valueSize bytes of space
+    //after it for an inline value.
+    static HtItem* Alloc(const Value& key,
+                            const ValueType keyType,
+                            const size_t valueSize,
+                            const u64 hash,
+                            byte** valueSpace);
+
+    //Replaces the value.  A Blob value is referenced, not copied.
+    void SetValue(const Value& value, const ValueType valueType);
+
+    //Moves the item to a fuller heap span, repointing its inline Blobs,
+    //and returns its new address, or NULL if it stayed put.  See
+    //Heap::Move().
+    static HtItem* Move(HtItem* item);
+
+    void ReleaseValue();
+
     Value m_Key;
     Value m_Value;
     HtItem* m_Next;
-    u32 m_Hash;
+    u64 m_Hash;
 
     ValueType m_KeyType     : 4;
     ValueType m_ValueType   : 4;
 
+    //The Blob lives in this item's allocation, so it's never released.
+    bool m_InlineKey        : 1;
+    bool m_InlineValue      : 1;
+
 private:
 
     HtItem();
@@ -49,8 +72,20 @@ class HashTable
 
 public:
 
+    //Blob keys and values up to this long are copied into the table's
+    //items.  Find() returns Blobs that live in the item, so a caller
+    //that keeps a value this short past the next change to the table
+    //must copy it rather than reference it.
+    static const size_t MAX_INLINE_LEN  = 64;
+
     static HashTable* Create();
 
+    //Tables created while this is set share equal Blob values through
+    //an InternPool of their own, so a dataset that repeats its values
+    //keeps one copy of each.  Values short enough to be inline, and
+    //those written by Patch(), aren't shared.  Off by default.
+    static void SetInternValues(const bool intern);
+
     bool Set(const Value& key, const ValueType keyType,
             const Value& value, const ValueType valueType);
 
@@ -59,13 +94,114 @@ public:
     bool Find(const Value& key, const ValueType keyType,
                 Value* value, ValueType* valueType);
 
+    //Hash of a key, for the overloads below, so a caller that looks up
+    //the same key more than once hashes it once.  A Blob key's hash is
+    //cached if it was made by Blob::CreateHashed().
+    u64 HashKey(const Value& key, const ValueType keyType) const;
+
+    bool Set(const Value& key, const ValueType keyType,
+            const Value& value, const ValueType valueType,
+            const u64 hash);
+
+    bool Clear(const Value& key, const ValueType keyType, const u64 hash);
+
+    bool Find(const Value& key, const ValueType keyType, const u64 hash,
+                Value* value, ValueType* valueType);
+
+    //Looks up numKeys keys at once.  Every key in a batch is hashed and
+    //its slot prefetched before any chain is walked, so the cache misses
+    //for different keys overlap.  found[i] tells whether keys[i] was
+    //found.  Returns the number of keys found.
+    size_t FindMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    Value* values, ValueType* valueTypes,
+                    bool* found);
+
+    //Sets numKeys keys at once, prefetching like FindMany().  Returns
+    //false if an item couldn't be allocated, in which case the keys
+    //before it were set.
+    bool SetMany(const size_t numKeys,
+                const Value* keys, const ValueType keyType,
+                const Value* values, const ValueType valueType);
+
     bool Patch(const Value& key, const ValueType keyType,
                 const size_t numPatches,
                 const Blob** patches,
                 const size_t* offsets);
 
+    //Sizes the table for numItems items at once, finishing any resize
+    //that's under way, so loading them doesn't resize it again.  The
+    //table won't shrink below that size until Reserve() is called with
+    //a smaller count.  Returns false if the slots couldn't be allocated.
+    bool Reserve(const size_t numItems);
+
+    //Like SetMany(), but the keys must be distinct and not already in
+    //the table.  They're linked in without looking for an existing
+    //item, for restoring or importing a dataset.
+    bool LoadMany(const size_t numKeys,
+                const Value* keys, const ValueType keyType,
+                const Value* values, const ValueType valueType);
+
     size_t Count() const;
 
+    //Work done resizing the table since it was created.
+    class RehashStats
+    {
+    public:
+        u64 m_NumGrows;
+        u64 m_NumShrinks;
+
+        //Old slots emptied by Set() and Clear().
+        u64 m_SlotsMovedByWrites;
+
+        //Old slots emptied by RehashFor().
+        u64 m_SlotsMovedByRehashFor;
+
+        u64 m_ItemsMoved;
+
+        //Old slots still to be emptied, 0 unless IsRehashing().
+        u64 m_SlotsRemaining;
+    };
+
+    //True while items are being moved to a resized table, during which
+    //lookups may search both tables.
+    bool IsRehashing() const;
+
+    //Moves items to the resized table for about the given time, so a
+    //table that isn't being written still finishes resizing.  Returns
+    //IsRehashing().
+    bool RehashFor(const unsigned microseconds);
+
+    void GetRehashStats(RehashStats* stats) const;
+
+    //Work done defragmenting the table since it was created.
+    class DefragStats
+    {
+    public:
+        //Passes over every slot finished.
+        u64 m_NumPasses;
+
+        u64 m_ItemsMoved;
+
+        //Non inline keys and values moved.
+        u64 m_BlobsMoved;
+    };
+
+    //Moves items, and the Blobs only they reference, out of heap spans
+    //that are emptier than most, for about the given time.  Each call
+    //carries on a pass over the table from where the last one stopped.
+    //Blobs are only moved if nothing else references them, so whatever
+    //else points at a value must hold a reference to it.  Like any
+    //change to the table it invalidates inline Blobs returned by
+    //Find().  Does nothing while the table is being resized.  Returns
+    //true if the pass isn't finished.
+    bool DefragFor(const unsigned microseconds);
+
+    void GetDefragStats(DefragStats* stats) const;
+
+    //Zero if the table doesn't intern its values.
+    void GetInternStats(InternPool::Stats* stats) const;
+
     void Ref() const;
     void Unref();
 
@@ -86,18 +222,49 @@ private:
 
     static void Destroy(HashTable* dict);
 
-	u32 HashBytes(const byte* bytes, const size_t len) const ;
-	u32 HashKey(const Value& key, const ValueType keyType) const;
+	u64 HashBytes(const byte* bytes, const size_t len) const ;
 
     void Set(HtItem* item);
     void Set(HtItem* item, bool* replaced);
     void Set(HtItem* item, HtItem**pitem, Slot* slot, bool* replaced);
 
+    //Starts growing or shrinking the slots when there are too many or
+    //too few items, then moves the next MOVE_INCREMENT old slots.
     void Rehash();
+
+    //Allocates newNumSlots slots and starts moving the items to them.
+    bool StartResize(const size_t newNumSlots);
+
+    //Moves up to numSlots old slots.  Returns the number moved.
+    size_t MoveSlots(const size_t numSlots);
+
+    //Moves what should be moved of the slot's items and Blobs.
+    void DefragSlot(Slot* slot);
+
+    //Returns what to store for value, which is the pooled Blob equal to
+    //it if values are interned.
+    Value Intern(const Value& value, const ValueType valueType);
+
+    //Call before item lets go of its value.  If the pool will then be
+    //all that references the value, drops it from the pool.
+    void Unintern(const HtItem* item);
+
+    //Links in an item whose key isn't in the table.
+    void Insert(HtItem* item);
+
+    //Prefetches the slot hash maps to, in whichever table holds it.
+    void PrefetchSlot(const u64 hash) const;
+
+    //Prefetches the first item in the slot hash maps to.
+    void PrefetchItem(const u64 hash) const;
+
+    //Prefetches the Blob key of the first item in the slot, if its
+    //hash matches.  The item should have been prefetched already.
+    void PrefetchKey(const u64 hash) const;
     
-    HtItem** Find(const Value& key, const ValueType keyType, Slot** slot, u32* hash);
+    HtItem** Find(const Value& key, const ValueType keyType, Slot** slot, u64* hash);
 
-    HtItem** Find(const Value& key, const ValueType keyType, const u32 hash, Slot** slot);
+    HtItem** Find(const Value& key, const ValueType keyType, const u64 hash, Slot** slot);
 
 	static const int INITIAL_NUM_SLOTS	= (1<<8);
 
@@ -107,8 +274,24 @@ private:
 
     size_t m_Count;
     size_t m_NumSlots;
+
+    //Size of m_Slots[1] while items are being moved out of it.
+    size_t m_NumOldSlots;
+
+    //Set by Reserve().
+    size_t m_MinNumSlots;
+
+    RehashStats m_RehashStats;
+
+    //Next slot DefragFor() looks at.
+    size_t m_DefragSlot;
+    DefragStats m_DefragStats;
+
+    //NULL unless values are interned.
+    InternPool* m_InternPool;
+
     mutable int m_RefCount;
-	u32 m_HashSalt;
+	u64 m_HashSalt;
 
     HashTable();
     ~HashTable();
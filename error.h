@@ -10,6 +10,9 @@ enum ErrorCode
     ERROR_OUT_OF_MEMORY,
     ERROR_UNRECOGNIZED_COMMAND,
     ERROR_UNEXPECTED_TOKEN,
+    ERROR_WRONG_ARGUMENT_COUNT,
+    ERROR_CROSS_SHARD_KEYS,
+    ERROR_INVALID_ARGUMENT,
     ERROR_UNKNOWN
 };
 
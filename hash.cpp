@@ -0,0 +1,338 @@
+#include "hash.h"
+
+#include <string.h>
+#include <time.h>
+
+#if _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__GNUC__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HB_CRC32C 1
+#include <nmmintrin.h>
+#endif
+
+//Lets GCC emit SSE4.2 instructions in a function without requiring
+//them everywhere.  MSVC doesn't need it.
+#if HB_CRC32C && defined(__GNUC__)
+#define HB_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define HB_TARGET_SSE42
+#endif
+
+namespace honeybase
+{
+
+typedef u64 (*HashFunc)(const void* data, const size_t len, const u64 seed);
+
+static inline u64
+Read64(const byte* p)
+{
+    u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u64
+Read32(const byte* p)
+{
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//Full 64x64 bit product, low half in *a and high half in *b.
+static inline void
+Multiply128(u64* a, u64* b)
+{
+#if defined(__SIZEOF_INT128__)
+    const unsigned __int128 r = (unsigned __int128)*a * *b;
+    *a = (u64)r;
+    *b = (u64)(r >> 64);
+#elif _MSC_VER && defined(_M_X64)
+    *a = _umul128(*a, *b, b);
+#else
+    const u64 ha = *a >> 32, hb = *b >> 32, la = (u32)*a, lb = (u32)*b;
+    const u64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    const u64 t = rl + (rm0 << 32);
+    u64 c = t < rl;
+    const u64 lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline u64
+Mix(u64 a, u64 b)
+{
+    Multiply128(&a, &b);
+    return a ^ b;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  wyhash
+//
+//  wyhash final version 4 by Wang Yi, released into the public domain.
+///////////////////////////////////////////////////////////////////////////////
+static const u64 WY_SECRET[4] =
+{
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static u64
+WyHash(const void* data, const size_t len, u64 seed)
+{
+    const byte* p = (const byte*) data;
+    u64 a, b;
+
+    seed ^= Mix(seed ^ WY_SECRET[0], WY_SECRET[1]);
+
+    if(len <= 16)
+    {
+        if(len >= 4)
+        {
+            a = (Read32(p) << 32) | Read32(p + ((len >> 3) << 2));
+            b = (Read32(p + len - 4) << 32) | Read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(len > 0)
+        {
+            a = ((u64)p[0] << 16) | ((u64)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if(i > 48)
+        {
+            u64 seed1 = seed, seed2 = seed;
+            do
+            {
+                seed = Mix(Read64(p) ^ WY_SECRET[1], Read64(p + 8) ^ seed);
+                seed1 = Mix(Read64(p + 16) ^ WY_SECRET[2], Read64(p + 24) ^ seed1);
+                seed2 = Mix(Read64(p + 32) ^ WY_SECRET[3], Read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            }
+            while(i > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
+
+        while(i > 16)
+        {
+            seed = Mix(Read64(p) ^ WY_SECRET[1], Read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = Read64(p + i - 16);
+        b = Read64(p + i - 8);
+    }
+
+    a ^= WY_SECRET[1];
+    b ^= seed;
+    Multiply128(&a, &b);
+    return Mix(a ^ WY_SECRET[0] ^ len, b ^ WY_SECRET[1]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  CRC32C
+///////////////////////////////////////////////////////////////////////////////
+#if HB_CRC32C
+
+//Two independent lanes so consecutive CRC instructions don't wait on
+//each other.  The lanes only give 64 bits of linear hash, so they're
+//finished with a multiply, which also makes the result depend on the
+//seed in more than its low bits.
+static HB_TARGET_SSE42 u64
+Crc32cHash(const void* data, const size_t len, const u64 seed)
+{
+    const byte* p = (const byte*) data;
+    size_t i = len;
+    u64 a = (u32)seed;
+    u64 b = seed >> 32;
+
+    for(; i >= 16; i -= 16, p += 16)
+    {
+        a = _mm_crc32_u64(a, Read64(p));
+        b = _mm_crc32_u64(b, Read64(p + 8));
+    }
+
+    if(i >= 8)
+    {
+        a = _mm_crc32_u64(a, Read64(p));
+        p += 8;
+        i -= 8;
+    }
+
+    //The tail is read as whole words, overlapping bytes that were
+    //already hashed when the key is long enough.  The length goes into
+    //the finish, so keys differing only in padding don't collide.
+    if(i >= 4)
+    {
+        b = _mm_crc32_u64(b, (Read32(p) << 32) | Read32(p + i - 4));
+    }
+    else if(i > 0)
+    {
+        b = _mm_crc32_u64(b, ((u64)p[0] << 16) | ((u64)p[i >> 1] << 8) | p[i - 1]);
+    }
+
+    return Mix(((a << 32) | b) ^ WY_SECRET[0], seed ^ len ^ WY_SECRET[1]);
+}
+
+static bool
+CpuHasSse42()
+{
+#if _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return 0 != (info[2] & (1 << 20));
+#else
+    __builtin_cpu_init();
+    return 0 != __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif  //HB_CRC32C
+
+///////////////////////////////////////////////////////////////////////////////
+//  HashDispatch
+//
+//  Picks the kernel and the seed when the program starts.
+///////////////////////////////////////////////////////////////////////////////
+class HashDispatch
+{
+public:
+
+    HashDispatch();
+
+    HashFunc m_Funcs[HASHKERNEL_COUNT];
+    HashKernel m_Kernel;
+    HashFunc m_Func;
+    u64 m_Seed;
+
+private:
+
+    static u64 RandomSeed();
+};
+
+static HashDispatch s_Hash;
+
+HashDispatch::HashDispatch()
+{
+    m_Funcs[HASHKERNEL_WYHASH] = &WyHash;
+    m_Funcs[HASHKERNEL_CRC32C] = NULL;
+
+#if HB_CRC32C
+    if(CpuHasSse42())
+    {
+        m_Funcs[HASHKERNEL_CRC32C] = &Crc32cHash;
+    }
+#endif
+
+    //wyhash measured faster than CRC32C on our key lengths, and its
+    //collisions depend on the seed, so it's the default either way.
+    m_Kernel = HASHKERNEL_WYHASH;
+    m_Func = m_Funcs[m_Kernel];
+    m_Seed = RandomSeed();
+}
+
+//Not cryptographic, just unpredictable enough that keys can't be
+//chosen ahead of time to collide.
+u64
+HashDispatch::RandomSeed()
+{
+    u64 seed = 0;
+
+#if _MSC_VER
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    seed = (u64)counter.QuadPart ^ ((u64)GetCurrentProcessId() << 32);
+#elif defined(__GNUC__)
+    const int fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0)
+    {
+        if(sizeof(seed) != read(fd, &seed, sizeof(seed)))
+        {
+            seed = 0;
+        }
+
+        close(fd);
+    }
+
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed ^= ((u64)ts.tv_sec << 32) ^ (u64)ts.tv_nsec ^ ((u64)getpid() << 16);
+#endif
+
+    //Where the stack is, in case there's address randomization.
+    seed ^= (u64)(size_t)&seed ^ (u64)time(NULL);
+
+    return Mix(seed ^ WY_SECRET[2], WY_SECRET[3]);
+}
+
+u64
+Hash64(const void* data, const size_t len, const u64 salt)
+{
+    return s_Hash.m_Func(data, len, s_Hash.m_Seed ^ salt);
+}
+
+u64
+Hash64(const HashKernel kernel, const void* data, const size_t len, const u64 salt)
+{
+    hbassert(IsHashKernelSupported(kernel));
+
+    return s_Hash.m_Funcs[kernel](data, len, s_Hash.m_Seed ^ salt);
+}
+
+bool
+IsHashKernelSupported(const HashKernel kernel)
+{
+    return kernel >= 0 && kernel < HASHKERNEL_COUNT && NULL != s_Hash.m_Funcs[kernel];
+}
+
+HashKernel
+GetHashKernel()
+{
+    return s_Hash.m_Kernel;
+}
+
+bool
+SetHashKernel(const HashKernel kernel)
+{
+    if(!IsHashKernelSupported(kernel))
+    {
+        return false;
+    }
+
+    s_Hash.m_Kernel = kernel;
+    s_Hash.m_Func = s_Hash.m_Funcs[kernel];
+    return true;
+}
+
+const char*
+GetHashKernelName(const HashKernel kernel)
+{
+    switch(kernel)
+    {
+    case HASHKERNEL_WYHASH:
+        return "wyhash";
+    case HASHKERNEL_CRC32C:
+        return "crc32c";
+    default:
+        return "unknown";
+    }
+}
+
+}   //namespace honeybase
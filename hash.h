@@ -0,0 +1,52 @@
+#ifndef __HB_HASH_H__
+#define __HB_HASH_H__
+
+#include "hb.h"
+
+namespace honeybase
+{
+
+//64 bit hashes of byte strings, for the hash tables and for picking a
+//key's shard.
+//
+//Every hash is mixed with a seed chosen at random when the process
+//starts, so the hash of a key can't be known ahead of time.  Callers
+//pass their own salt as well; different salts give unrelated hashes of
+//the same bytes.
+//
+//Two kernels are available:
+//
+//  HASHKERNEL_WYHASH   wyhash, which is portable and whose collisions
+//                      depend on the seed.  The default.
+//  HASHKERNEL_CRC32C   Two lanes of the SSE4.2 CRC32C instruction with
+//                      a multiplicative finish.  Only available when the
+//                      CPU supports it.  CRC is linear, so which keys of
+//                      equal length collide doesn't depend on the seed;
+//                      don't use it where clients can choose the keys.
+
+enum HashKernel
+{
+    HASHKERNEL_WYHASH,
+    HASHKERNEL_CRC32C,
+    HASHKERNEL_COUNT
+};
+
+u64 Hash64(const void* data, const size_t len, const u64 salt);
+
+//Hashes with a specific kernel, for benchmarking.  The kernel must be
+//supported.
+u64 Hash64(const HashKernel kernel, const void* data, const size_t len, const u64 salt);
+
+bool IsHashKernelSupported(const HashKernel kernel);
+
+HashKernel GetHashKernel();
+
+//Returns false if the CPU doesn't support kernel.  Must be called
+//before anything has been hashed, since existing hashes would change.
+bool SetHashKernel(const HashKernel kernel);
+
+const char* GetHashKernelName(const HashKernel kernel);
+
+}   //namespace honeybase
+
+#endif  //__HB_HASH_H__
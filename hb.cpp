@@ -1,13 +1,23 @@
 #include "hb.h"
 
+#include "hash.h"
+
 #include <malloc.h>
-#include <new.h>
+#include <new>
 #include <stdarg.h>
 #include <stdio.h>
 
 #if _MSC_VER
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#elif defined(__GNUC__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#endif
 #endif
 
 namespace honeybase
@@ -126,9 +136,11 @@ Log::Debug(const char* fmt, ...)
     vsnprintf(buf, sizeof(buf)-1, fmt, args);
     snprintf(prefix, sizeof(prefix), "DBG[%s]: ", m_Channel);
     fprintf(stdout, "%s%s\n", prefix, buf);
+#if _MSC_VER
     OutputDebugString(prefix);
     OutputDebugString(buf);
     OutputDebugString("\n");
+#endif
 }
 
 void
@@ -141,296 +153,2563 @@ Log::Error(const char* fmt, ...)
     vsnprintf(buf, sizeof(buf)-1, fmt, args);
     snprintf(prefix, sizeof(prefix), "ERR[%s]: ", m_Channel);
     fprintf(stdout, "%s%s\n", prefix, buf);
+#if _MSC_VER
     OutputDebugString(prefix);
     OutputDebugString(buf);
     OutputDebugString("\n");
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Heap
 ///////////////////////////////////////////////////////////////////////////////
 
-//static byte* s_Heap = (byte*)malloc(1024*1024*1024);
-//static byte* s_Heap = (byte*)VirtualAlloc(NULL, 1024*1024*1024, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
-//static size_t s_NextAlloc = 0;
+static Log s_Log("heap");
+
+#if _MSC_VER
+#define HB_THREADLOCAL __declspec(thread)
+#else
+#define HB_THREADLOCAL __thread
+#endif
+
+static const size_t SPAN_SHIFT      = 16;
+static const size_t SPAN_SIZE       = size_t(1) << SPAN_SHIFT;
+
+//Address space reserved for spans.  Reserving it doesn't use memory;
+//a span's pages are only backed once they're touched.
+#if defined(_WIN64) || defined(__LP64__)
+static const size_t SLAB_RESERVE    = size_t(64) << 30;
+#else
+static const size_t SLAB_RESERVE    = size_t(256) << 20;
+#endif
+
+//Address space for huge blocks when Reserve() isn't called.
+#if defined(_WIN64) || defined(__LP64__)
+static const size_t HUGE_RESERVE    = size_t(256) << 30;
+#else
+static const size_t HUGE_RESERVE    = size_t(512) << 20;
+#endif
+
+//Empty spans kept ready for reuse.  Past this many, an empty span's
+//memory is given back to the OS.
+static const size_t MAX_FREE_SPANS  = 64;
 
-/*static int InitHeap()
+//Most objects moved between a thread's cache and the shared lists at
+//once.  A thread caches up to twice this many of each size.
+static const size_t MAX_BATCH       = 32;
+
+//Spans with free objects Move() looks through for the fullest.
+static const size_t MAX_MOVE_SCAN   = 16;
+
+static const u16 CLASS_SIZES[Heap::NUM_SIZE_CLASSES] =
 {
-    memset(s_Heap, 0, 1024*1024*1024);
-    return 1;
-}*/
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192
+};
 
-//static const int FOO = InitHeap();
+class FreeObject
+{
+public:
+    FreeObject* m_Next;
+};
 
-void*
-Heap::ZAlloc(size_t size)
+//Kept apart from the span's memory, so objects can use all of it and
+//an empty span's memory can be given back.
+class Span
 {
-    void* p = malloc(size);
-    /*void* p = &s_Heap[s_NextAlloc];
-    s_NextAlloc += size;*/
-    if(p)
+public:
+    //Links in its size's list of spans with free objects, or in a list
+    //of empty spans.
+    Span* m_Next;
+    Span* m_Prev;
+
+    FreeObject* m_FreeList;
+
+    //Objects past the first m_NumCarved have never been handed out, so
+    //a new span isn't touched until it's used.
+    u32 m_NumCarved;
+    u32 m_NumUsed;
+    u32 m_NumObjects;
+    u32 m_SizeClass;
+
+    bool m_Decommitted;
+};
+
+class SizeClass
+{
+public:
+    volatile long m_Lock;
+
+    //Spans of this size with free objects.
+    Span* m_Partial;
+
+    size_t m_NumSpans;
+    size_t m_NumUsed;
+
+    u64 m_NumMoved;
+    u64 m_NumSpansEmptied;
+};
+
+class HeapCounters
+{
+public:
+    //Signed, since a thread can free memory another thread allocated.
+    s64 m_Bytes[HEAPTAG_COUNT];
+    s64 m_NumAllocs[HEAPTAG_COUNT];
+
+    u64 m_TotalAllocs[HEAPTAG_COUNT];
+    u64 m_SizeBuckets[Heap::NUM_SIZE_BUCKETS];
+
+    void Add(const HeapCounters& that)
     {
-        memset(p, 0, size);
+        for(size_t i = 0; i < HEAPTAG_COUNT; ++i)
+        {
+            m_Bytes[i] += that.m_Bytes[i];
+            m_NumAllocs[i] += that.m_NumAllocs[i];
+            m_TotalAllocs[i] += that.m_TotalAllocs[i];
+        }
+
+        for(size_t i = 0; i < Heap::NUM_SIZE_BUCKETS; ++i)
+        {
+            m_SizeBuckets[i] += that.m_SizeBuckets[i];
+        }
     }
+};
 
-    return p;
-}
-void*
-Heap::Alloc(size_t size)
+class ThreadCache
 {
-    /*void* p = &s_Heap[s_NextAlloc];
-    s_NextAlloc += size;
-    return p;*/
+public:
+    FreeObject* m_Lists[Heap::NUM_SIZE_CLASSES];
+    size_t m_Counts[Heap::NUM_SIZE_CLASSES];
 
-    return malloc(size);
-}
+    //Only written by the owning thread.  Others read them, without a
+    //lock, to add up the totals.
+    HeapCounters m_Counters;
 
-void
-Heap::Free(void* mem)
-{
-	free(mem);
-}
+    //Allocations since the last sample.
+    size_t m_SinceSample;
 
-///////////////////////////////////////////////////////////////////////////////
-//  Blob
-///////////////////////////////////////////////////////////////////////////////
-static size_t s_NumBlobs = 0;
+    //Links in the list of threads whose counters are added up.
+    ThreadCache* m_NextThread;
+    ThreadCache* m_PrevThread;
+    bool m_Registered;
+};
 
-StopWatch Blob::sm_StopWatch;
+//All zero before any constructor runs, so the heap works during static
+//initialization.
+static HB_THREADLOCAL ThreadCache s_ThreadCache;
+static SizeClass s_Classes[Heap::NUM_SIZE_CLASSES];
 
-Blob*
-Blob::Create(const size_t len)
+//Guards the list of threads and the counters of threads that have
+//exited.
+static volatile long s_ThreadsLock;
+static ThreadCache* s_Threads;
+static HeapCounters s_ExitedCounters;
+
+//Calls OnThreadExit() when a thread that has used the heap exits.
+static bool s_HaveThreadKey;
+#if _MSC_VER
+static DWORD s_ThreadKey;
+#else
+static pthread_key_t s_ThreadKey;
+#endif
+
+static volatile size_t s_SampleRate;
+
+//Guards the ring of samples.
+static volatile long s_SampleLock;
+static HeapSample s_Samples[Heap::MAX_SAMPLES];
+static u64 s_NumSamples;
+
+static const char* const TAG_NAMES[HEAPTAG_COUNT] =
 {
-    return Create(NULL, len);
-}
+    "other",
+    "blob",
+    "dict",
+    "btree",
+    "skiplist",
+    "sortedset",
+    "command",
+    "network"
+};
 
-Blob*
-Blob::Create(const byte* bytes, const size_t len)
+//Guards everything below.
+static volatile long s_SpanLock;
+
+static bool s_SlabReserved;
+static byte* s_SlabBase;
+static size_t s_SlabSize;
+static Span* s_Spans;
+static size_t s_NumCarved;
+static Span* s_FreeSpans;
+static size_t s_NumFreeSpans;
+static Span* s_DecommittedSpans;
+
+//Guards the huge block state below.
+static volatile long s_HugeLock;
+
+static bool s_HugeReserved;
+static bool s_HugeExplicit;
+static byte* s_HugeBase;
+static size_t s_HugeSize;
+
+//A bit per huge page, set if it's allocated.
+static u32* s_HugeUsed;
+
+//Pages in the block starting at each page.
+static u32* s_HugeBlockPages;
+
+#if HB_ASSERT
+//Debug builds remember the tag of every allocation, so Free() can check
+//it's given the same one.  Slab objects have a byte per smallest object
+//in a table ahead of the spans, huge blocks a byte per page, and
+//malloc'd blocks a header.
+static u8* s_SlabTags;
+static u8* s_HugeBlockTags;
+static const size_t MALLOC_HEADER_SIZE = 16;
+#else
+static const size_t MALLOC_HEADER_SIZE = 0;
+#endif
+
+static void
+SpinLock(volatile long* lock)
 {
-    const size_t size = Size(len);
-    Blob* blob = (Blob*) Heap::Alloc(size);
-    if(blob)
+    for(int spins = 0;; ++spins)
     {
-        new(blob) Blob();
-        Init(blob, bytes, len);
-        ++s_NumBlobs;
+#if _MSC_VER
+        if(0 == _InterlockedExchange(lock, 1))
+#else
+        if(0 == __sync_lock_test_and_set(lock, 1))
+#endif
+        {
+            return;
+        }
+
+        //Let the holder run if it was preempted.
+        if(spins >= 64)
+        {
+#if _MSC_VER
+            SwitchToThread();
+#else
+            sched_yield();
+#endif
+            spins = 0;
+        }
+#if HB_SSE2
+        else
+        {
+            _mm_pause();
+        }
+#endif
     }
+}
 
-    return blob;
+static void
+SpinUnlock(volatile long* lock)
+{
+#if _MSC_VER
+    _InterlockedExchange(lock, 0);
+#else
+    __sync_lock_release(lock);
+#endif
 }
 
-/*Blob*
-Blob::Encode(const byte* src, const size_t srcLen,
-                byte* dst, const size_t dstSize)
+static bool
+CommitMemory(void* mem, const size_t size)
 {
-    const size_t size = Size(srcLen);
-    if(hbverify(size <= dstSize))
-    {
-        Init((Blob*)dst, src, srcLen);
-        return (Blob*)dst;
-    }
+#if _MSC_VER
+    return NULL != VirtualAlloc(mem, size, MEM_COMMIT, PAGE_READWRITE);
+#else
+    //The reservation is mapped read/write without reserving swap, so
+    //there's nothing to do.
+    (void)mem;
+    (void)size;
+    return true;
+#endif
+}
 
-    return NULL;
-}*/
+static void
+DecommitMemory(void* mem, const size_t size)
+{
+#if _MSC_VER
+    VirtualFree(mem, size, MEM_DECOMMIT);
+#else
+    madvise(mem, size, MADV_DONTNEED);
+#endif
+}
 
-size_t
-Blob::Size(const size_t len)
+//Reserves the span headers, and in debug builds the tags, followed by
+//the spans.  Called once, with s_SpanLock held.
+static void
+ReserveSlab()
 {
-    size_t size = len;
-    size_t tmpLen = len;
+    s_SlabReserved = true;
+
+    const size_t maxSpans = SLAB_RESERVE / SPAN_SIZE;
+    const size_t headerSize = (maxSpans * sizeof(Span) + SPAN_SIZE - 1) & ~(SPAN_SIZE - 1);
+#if HB_ASSERT
+    const size_t tagsSize = SLAB_RESERVE / CLASS_SIZES[0];
+#else
+    const size_t tagsSize = 0;
+#endif
 
-    for(++size, tmpLen >>= 7; tmpLen; ++size, tmpLen >>= 7)
+    //A span more, so the spans can be aligned to their size.
+    const size_t size = headerSize + tagsSize + SLAB_RESERVE + SPAN_SIZE;
+
+#if _MSC_VER
+    byte* mem = (byte*) VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+#else
+    byte* mem = (byte*) mmap(NULL, size, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(MAP_FAILED == mem)
     {
+        mem = NULL;
     }
+#endif
 
-    return size + sizeof(Blob) - 1;
+    if(mem)
+    {
+        s_Spans = (Span*) mem;
+        HB_ASSERTONLY(s_SlabTags = mem + headerSize);
+        s_SlabBase = (byte*) (((size_t)mem + headerSize + tagsSize + SPAN_SIZE - 1) & ~(SPAN_SIZE - 1));
+        s_SlabSize = SLAB_RESERVE;
+
+        //Spans are carved in order, so the pages holding them fill up.
+#if defined(MADV_HUGEPAGE)
+        madvise(s_SlabBase, s_SlabSize, MADV_HUGEPAGE);
+#endif
+    }
 }
 
-size_t
-Blob::GetData(const byte** data) const
+//Sets aside size bytes, a multiple of Heap::HUGE_PAGE_SIZE, for huge
+//blocks.  Called once, with s_HugeLock held.
+static void
+ReserveHuge(const size_t size, const bool explicitHugePages)
 {
-    size_t len = 0;
-    const byte* p = bytes;
-    int shift = 0;
-
-    while(*p & 0x80)
+    s_HugeReserved = true;
+
+    const size_t numPages = size / Heap::HUGE_PAGE_SIZE;
+    u32* used = (u32*) calloc((numPages + 31) / 32, sizeof(u32));
+    u32* blockPages = (u32*) calloc(numPages, sizeof(u32));
+#if HB_ASSERT
+    u8* blockTags = (u8*) calloc(numPages, sizeof(u8));
+    if(!blockTags)
     {
-        len |= (*p++ & 0x7F) << shift;
-        shift += 7;
+        free(blockPages);
+        blockPages = NULL;
     }
+#endif
+    byte* mem = NULL;
 
-    len |= (*p & 0x7F) << shift;
+    if(used && blockPages && explicitHugePages)
+    {
+#if _MSC_VER
+        mem = (byte*) VirtualAlloc(NULL, size,
+                                    MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES,
+                                    PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+        mem = (byte*) mmap(NULL, size, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(MAP_FAILED == mem)
+        {
+            mem = NULL;
+        }
+#endif
 
-    *data = ++p;
+        if(mem)
+        {
+            s_HugeExplicit = true;
+            s_HugeBase = mem;
+        }
+        else
+        {
+            s_Log.Error("No explicit huge pages for %u MB, using ordinary pages",
+                        (unsigned) (size >> 20));
+        }
+    }
 
-    return len;
-}
+    if(used && blockPages && !mem)
+    {
+        //A page more, so the blocks can be aligned to huge pages.
+        const size_t reserveSize = size + Heap::HUGE_PAGE_SIZE;
 
-size_t
-Blob::GetData(byte** data)
-{
-    return GetData((const byte**) data);
-}
+#if _MSC_VER
+        mem = (byte*) VirtualAlloc(NULL, reserveSize, MEM_RESERVE, PAGE_READWRITE);
+#else
+        mem = (byte*) mmap(NULL, reserveSize, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(MAP_FAILED == mem)
+        {
+            mem = NULL;
+        }
+#endif
 
-size_t
-Blob::CopyData(byte* dst, const size_t dstSize) const
-{
-    const byte* data;
-    const size_t len = GetData(&data);
-    size_t cpyLen = (len > dstSize ? dstSize : len);
-    memcpy(dst, data, cpyLen);
-    return len;
-}
+        if(mem)
+        {
+            const size_t align = Heap::HUGE_PAGE_SIZE - 1;
+            s_HugeBase = (byte*) (((size_t)mem + align) & ~align);
 
-size_t
-Blob::Length() const
-{
-    size_t len = 0;
-    const byte* p = bytes;
-    int shift = 0;
+#if defined(MADV_HUGEPAGE)
+            madvise(s_HugeBase, size, MADV_HUGEPAGE);
+#endif
+        }
+    }
 
-    while(*p & 0x80)
+    if(mem)
     {
-        len |= (*p++ & 0x7F) << shift;
-        shift += 7;
+        s_HugeUsed = used;
+        s_HugeBlockPages = blockPages;
+        HB_ASSERTONLY(s_HugeBlockTags = blockTags);
+        s_HugeSize = size;
+    }
+    else
+    {
+        free(used);
+        free(blockPages);
+        HB_ASSERTONLY(free(blockTags));
     }
-
-    len |= (*p & 0x7F) << shift;
-
-    return len;
 }
 
-/*Blob*
-Blob::Dup() const
+static inline bool
+IsHuge(const void* mem)
 {
-    return Dup(this);
-}*/
+    return (size_t)mem - (size_t)s_HugeBase < s_HugeSize;
+}
 
-void
-Blob::Ref() const
+static inline bool
+IsHugePageUsed(const size_t page)
 {
-    hbassert(m_RefCount > 0);
-    hbassert(m_RefCount < 127);
-    ++m_RefCount;
+    return 0 != (s_HugeUsed[page >> 5] & (1u << (page & 31)));
 }
 
-void
-Blob::Unref()
+static void
+MarkHugePages(const size_t first, const size_t numPages, const bool used)
 {
-    hbassert(m_RefCount > 0);
-    --m_RefCount;
-    if(0 == m_RefCount)
+    for(size_t page = first; page < first + numPages; ++page)
     {
-        Destroy(this);
+        if(used)
+        {
+            s_HugeUsed[page >> 5] |= 1u << (page & 31);
+        }
+        else
+        {
+            s_HugeUsed[page >> 5] &= ~(1u << (page & 31));
+        }
     }
 }
 
-int
-Blob::NumRefs() const
-{
-    return m_RefCount;
-}
-
-int
-Blob::Compare(const byte* thatData, const size_t thatLen) const
+//Returns a block of whole huge pages, or NULL if the range has no run
+//of free pages long enough.
+static void*
+AllocHuge(const size_t size, const bool zero)
 {
-    //DO NOT SUBMIT
-    //sm_StopWatch.Start();
-
-    const byte* myData;
-    const size_t myLen = GetData(&myData);
+    const size_t numPages = (size + Heap::HUGE_PAGE_SIZE - 1) / Heap::HUGE_PAGE_SIZE;
 
-    /*const size_t cmpLen = myLen < thatLen ? myLen : thatLen;
-    const int result = memcmp(myData, thatData, cmpLen);
+    SpinLock(&s_HugeLock);
 
-    return (0 == result) ? myLen - thatLen : result;*/
+    if(!s_HugeReserved)
+    {
+        ReserveHuge(HUGE_RESERVE, false);
+    }
 
-    if(myLen < thatLen)
+    //First fit, which keeps the blocks packed at the front of the range.
+    const size_t maxPages = s_HugeSize / Heap::HUGE_PAGE_SIZE;
+    size_t first = 0;
+    size_t runLen = 0;
+    for(size_t page = 0; page < maxPages && runLen < numPages; ++page)
     {
-        if(myLen > 0)
+        if(0 == (page & 31) && 0xFFFFFFFF == s_HugeUsed[page >> 5])
         {
-            const int result = memcmp(myData, thatData, myLen);
-            return (0 == result) ? -1 : result;
+            page += 31;
+            runLen = 0;
         }
-        else
+        else if(IsHugePageUsed(page))
         {
-            return -1;
+            runLen = 0;
+        }
+        else if(0 == runLen++)
+        {
+            first = page;
         }
     }
-    else if(thatLen < myLen)
+
+    byte* mem = NULL;
+    if(runLen == numPages)
     {
-        if(thatLen > 0)
+        mem = s_HugeBase + first * Heap::HUGE_PAGE_SIZE;
+
+        //Only explicit pages are committed up front.
+        if(s_HugeExplicit || CommitMemory(mem, numPages * Heap::HUGE_PAGE_SIZE))
         {
-            const int result = memcmp(myData, thatData, thatLen);
-            return (0 == result) ? 1 : result;
+            MarkHugePages(first, numPages, true);
+            s_HugeBlockPages[first] = (u32) numPages;
         }
         else
         {
-            return 1;
+            mem = NULL;
         }
     }
-    else
+
+    SpinUnlock(&s_HugeLock);
+
+    //Ordinary pages are given back when a block is freed, so they're
+    //zero when they're allocated again.
+    if(mem && zero && s_HugeExplicit)
     {
-        return myLen > 0 ? memcmp(myData, thatData, myLen): 0;
+        memset(mem, 0, size);
     }
 
-    //DO NOT SUBMIT
-    //sm_StopWatch.Stop();
+    return mem;
 }
 
-size_t
-Blob::GlobalBlobCount()
+//Returns the size of the block.
+static size_t
+FreeHuge(void* mem)
 {
-    return s_NumBlobs;
-}
+    const size_t first = ((size_t)mem - (size_t)s_HugeBase) / Heap::HUGE_PAGE_SIZE;
 
-//protected:
+    SpinLock(&s_HugeLock);
 
-void
-Blob::Init(Blob* blob, const byte* bytes, const size_t len)
-{
-    byte* p = blob->bytes;
+    const size_t numPages = s_HugeBlockPages[first];
+    hbassert(numPages > 0 && IsHugePageUsed(first));
 
-    size_t tmpLen = len;
-    while(tmpLen > 0x7F)
+    if(!s_HugeExplicit)
     {
-        *p++ = 0x80 | (tmpLen & 0x7F);
-        tmpLen >>= 7;
+        DecommitMemory(mem, numPages * Heap::HUGE_PAGE_SIZE);
     }
 
-    *p++ = tmpLen & 0x7F;
+    MarkHugePages(first, numPages, false);
+    s_HugeBlockPages[first] = 0;
 
-    if(bytes)
-    {
-        memcpy(p, bytes, len);
-    }
+    SpinUnlock(&s_HugeLock);
+
+    return numPages * Heap::HUGE_PAGE_SIZE;
 }
 
-//private:
+//Bytes malloc really gave a block, which is what it costs.
+static inline size_t
+MallocSize(void* mem)
+{
+#if _MSC_VER
+    return _msize(mem);
+#else
+    return malloc_usable_size(mem);
+#endif
+}
 
-/*Blob*
-Blob::Dup(const Blob* blob)
+//malloc() with room for the header.  Sets *allocSize to the bytes the
+//block really takes.
+static void*
+AllocMalloc(const size_t size, const bool zero, size_t* allocSize)
 {
-    Blob* newBlob = (Blob*) Heap::Alloc(Blob::Size(blob->Length()));
-    if(newBlob)
+    byte* mem = (byte*) (zero
+                        ? calloc(1, size + MALLOC_HEADER_SIZE)
+                        : malloc(size + MALLOC_HEADER_SIZE));
+    if(!mem)
     {
-        new(newBlob) Blob();
-        const byte* bytes;
-        const size_t len = blob->GetData(&bytes);
-        Init(newBlob, bytes, len);
+        *allocSize = 0;
+        return NULL;
     }
 
-    return newBlob;
-}*/
+    *allocSize = MallocSize(mem);
+    return mem + MALLOC_HEADER_SIZE;
+}
 
-void
+//Returns the bytes the block took.
+static size_t
+FreeMalloc(void* mem)
+{
+    byte* block = (byte*) mem - MALLOC_HEADER_SIZE;
+    const size_t size = MallocSize(block);
+    free(block);
+    return size;
+}
+
+//Blocks too big for a span.  Sets *allocSize to the bytes the block
+//really takes.
+static void*
+AllocLarge(const size_t size, const bool zero, size_t* allocSize)
+{
+    if(size >= Heap::HUGE_PAGE_SIZE)
+    {
+        void* mem = AllocHuge(size, zero);
+        if(mem)
+        {
+            *allocSize = (size + Heap::HUGE_PAGE_SIZE - 1) & ~(Heap::HUGE_PAGE_SIZE - 1);
+            return mem;
+        }
+    }
+
+    return AllocMalloc(size, zero, allocSize);
+}
+
+static inline bool
+IsSlab(const void* mem)
+{
+    return (size_t)mem - (size_t)s_SlabBase < s_SlabSize;
+}
+
+static inline Span*
+GetSpan(const void* mem)
+{
+    return &s_Spans[((size_t)mem - (size_t)s_SlabBase) >> SPAN_SHIFT];
+}
+
+static inline byte*
+GetSpanMemory(const Span* span)
+{
+    return s_SlabBase + ((size_t)(span - s_Spans) << SPAN_SHIFT);
+}
+
+#if HB_ASSERT
+
+static inline u8*
+GetSpanTags(const Span* span)
+{
+    return s_SlabTags + (((size_t)(span - s_Spans) << SPAN_SHIFT) / CLASS_SIZES[0]);
+}
+
+static u8*
+GetTagSlot(const void* mem)
+{
+    if(IsSlab(mem))
+    {
+        return &s_SlabTags[((size_t)mem - (size_t)s_SlabBase) / CLASS_SIZES[0]];
+    }
+
+    if(IsHuge(mem))
+    {
+        return &s_HugeBlockTags[((size_t)mem - (size_t)s_HugeBase) / Heap::HUGE_PAGE_SIZE];
+    }
+
+    return (u8*) mem - MALLOC_HEADER_SIZE;
+}
+
+static inline void
+SetTag(const void* mem, const HeapTag tag)
+{
+    *GetTagSlot(mem) = (u8) tag;
+}
+
+static inline HeapTag
+GetTag(const void* mem)
+{
+    return (HeapTag) *GetTagSlot(mem);
+}
+
+#endif
+
+static inline size_t
+GetSizeClass(const size_t size)
+{
+    if(size <= 128)
+    {
+        return size ? (size - 1) >> 4 : 0;
+    }
+
+    //Four sizes between each power of 2.
+    const unsigned shift = HighestBit((u32)(size - 1));
+    return 8 + ((shift - 7) << 2) + (((size - 1) >> (shift - 2)) & 3);
+}
+
+static inline size_t
+GetBatchSize(const size_t sizeClass)
+{
+    const size_t batch = SPAN_SIZE / CLASS_SIZES[sizeClass] / 2;
+    return (batch < MAX_BATCH) ? batch : MAX_BATCH;
+}
+
+static void
+LinkSpan(Span** list, Span* span)
+{
+    span->m_Prev = NULL;
+    span->m_Next = *list;
+    if(*list)
+    {
+        (*list)->m_Prev = span;
+    }
+
+    *list = span;
+}
+
+static void
+UnlinkSpan(Span** list, Span* span)
+{
+    if(span->m_Prev)
+    {
+        span->m_Prev->m_Next = span->m_Next;
+    }
+    else
+    {
+        *list = span->m_Next;
+    }
+
+    if(span->m_Next)
+    {
+        span->m_Next->m_Prev = span->m_Prev;
+    }
+}
+
+//Returns an empty span, or NULL if the reservation is used up.
+static Span*
+AllocSpan()
+{
+    SpinLock(&s_SpanLock);
+
+    if(!s_SlabReserved)
+    {
+        ReserveSlab();
+    }
+
+    Span* span = s_FreeSpans;
+    if(span)
+    {
+        UnlinkSpan(&s_FreeSpans, span);
+        --s_NumFreeSpans;
+    }
+    else if(NULL != (span = s_DecommittedSpans))
+    {
+        if(CommitMemory(GetSpanMemory(span), SPAN_SIZE))
+        {
+            UnlinkSpan(&s_DecommittedSpans, span);
+            span->m_Decommitted = false;
+        }
+        else
+        {
+            span = NULL;
+        }
+    }
+    else if(s_NumCarved < s_SlabSize / SPAN_SIZE)
+    {
+        span = &s_Spans[s_NumCarved];
+        if(CommitMemory(span, sizeof(*span))
+            HB_ASSERTONLY(&& CommitMemory(GetSpanTags(span), SPAN_SIZE / CLASS_SIZES[0]))
+            && CommitMemory(GetSpanMemory(span), SPAN_SIZE))
+        {
+            ++s_NumCarved;
+        }
+        else
+        {
+            span = NULL;
+        }
+    }
+
+    SpinUnlock(&s_SpanLock);
+
+    return span;
+}
+
+static void
+FreeSpan(Span* span)
+{
+    SpinLock(&s_SpanLock);
+
+    if(s_NumFreeSpans < MAX_FREE_SPANS)
+    {
+        LinkSpan(&s_FreeSpans, span);
+        ++s_NumFreeSpans;
+    }
+    else
+    {
+        DecommitMemory(GetSpanMemory(span), SPAN_SIZE);
+        span->m_Decommitted = true;
+        LinkSpan(&s_DecommittedSpans, span);
+    }
+
+    SpinUnlock(&s_SpanLock);
+}
+
+//Takes a free object from a span with one.  The class must be locked.
+static FreeObject*
+TakeObject(SizeClass* sc, Span* span, const size_t objectSize)
+{
+    hbassert(span->m_NumUsed < span->m_NumObjects);
+
+    FreeObject* obj = span->m_FreeList;
+    if(obj)
+    {
+        span->m_FreeList = obj->m_Next;
+    }
+    else
+    {
+        obj = (FreeObject*) (GetSpanMemory(span) + span->m_NumCarved * objectSize);
+        ++span->m_NumCarved;
+    }
+
+    if(++span->m_NumUsed == span->m_NumObjects)
+    {
+        UnlinkSpan(&sc->m_Partial, span);
+    }
+
+    return obj;
+}
+
+//Puts an object back in its span, freeing the span if it's empty, and
+//returns whether it was.  The class must be locked.
+static bool
+ReturnObject(SizeClass* sc, FreeObject* obj)
+{
+    Span* span = GetSpan(obj);
+    hbassert(sc == &s_Classes[span->m_SizeClass]);
+    hbassert(span->m_NumUsed > 0);
+
+    if(span->m_NumUsed == span->m_NumObjects)
+    {
+        LinkSpan(&sc->m_Partial, span);
+    }
+
+    obj->m_Next = span->m_FreeList;
+    span->m_FreeList = obj;
+
+    if(0 == --span->m_NumUsed)
+    {
+        UnlinkSpan(&sc->m_Partial, span);
+        --sc->m_NumSpans;
+        FreeSpan(span);
+        return true;
+    }
+
+    return false;
+}
+
+//Takes up to a batch of objects from the shared lists and returns how
+//many were taken.
+static size_t
+FetchObjects(const size_t sizeClass, FreeObject** list)
+{
+    SizeClass* sc = &s_Classes[sizeClass];
+    const size_t objectSize = CLASS_SIZES[sizeClass];
+    const size_t batch = GetBatchSize(sizeClass);
+    FreeObject* head = NULL;
+    size_t count = 0;
+
+    SpinLock(&sc->m_Lock);
+
+    while(count < batch)
+    {
+        Span* span = sc->m_Partial;
+        if(!span)
+        {
+            span = AllocSpan();
+            if(!span)
+            {
+                break;
+            }
+
+            span->m_FreeList = NULL;
+            span->m_NumCarved = 0;
+            span->m_NumUsed = 0;
+            span->m_NumObjects = (u32) (SPAN_SIZE / objectSize);
+            span->m_SizeClass = (u32) sizeClass;
+            LinkSpan(&sc->m_Partial, span);
+            ++sc->m_NumSpans;
+        }
+
+        for(; count < batch && span->m_NumUsed < span->m_NumObjects; ++count)
+        {
+            FreeObject* obj = TakeObject(sc, span, objectSize);
+            obj->m_Next = head;
+            head = obj;
+        }
+    }
+
+    sc->m_NumUsed += count;
+
+    SpinUnlock(&sc->m_Lock);
+
+    *list = head;
+    return count;
+}
+
+//Returns count objects, linked through m_Next, to the shared lists.
+static void
+ReleaseObjects(const size_t sizeClass, FreeObject* list, const size_t count)
+{
+    SizeClass* sc = &s_Classes[sizeClass];
+
+    SpinLock(&sc->m_Lock);
+
+    while(list)
+    {
+        FreeObject* obj = list;
+        list = list->m_Next;
+
+        ReturnObject(sc, obj);
+    }
+
+    sc->m_NumUsed -= count;
+
+    SpinUnlock(&sc->m_Lock);
+}
+
+#if _MSC_VER
+static void WINAPI
+OnThreadExit(void* data)
+#else
+static void
+OnThreadExit(void* data)
+#endif
+{
+    ThreadCache* cache = (ThreadCache*) data;
+
+    //Runs on the exiting thread, so its cache is still s_ThreadCache.
+    hbassert(cache == &s_ThreadCache);
+
+    Heap::FlushThreadCache();
+
+    SpinLock(&s_ThreadsLock);
+
+    s_ExitedCounters.Add(cache->m_Counters);
+    memset(&cache->m_Counters, 0, sizeof(cache->m_Counters));
+
+    if(cache->m_PrevThread)
+    {
+        cache->m_PrevThread->m_NextThread = cache->m_NextThread;
+    }
+    else
+    {
+        s_Threads = cache->m_NextThread;
+    }
+
+    if(cache->m_NextThread)
+    {
+        cache->m_NextThread->m_PrevThread = cache->m_PrevThread;
+    }
+
+    cache->m_NextThread = cache->m_PrevThread = NULL;
+
+    //If something else the thread runs at exit uses the heap, it's
+    //registered again, and this is called again.
+    cache->m_Registered = false;
+
+    SpinUnlock(&s_ThreadsLock);
+}
+
+static void
+RegisterThread(ThreadCache* cache)
+{
+    SpinLock(&s_ThreadsLock);
+
+    if(!s_HaveThreadKey)
+    {
+#if _MSC_VER
+        s_ThreadKey = FlsAlloc(OnThreadExit);
+        s_HaveThreadKey = (FLS_OUT_OF_INDEXES != s_ThreadKey);
+#else
+        s_HaveThreadKey = (0 == pthread_key_create(&s_ThreadKey, OnThreadExit));
+#endif
+
+        if(!s_HaveThreadKey)
+        {
+            s_Log.Error("Can't watch for threads exiting, only counting the first thread's allocations");
+        }
+    }
+
+    //Without the key the thread's counters would outlive it in the
+    //list, so only the first thread is counted.
+    const bool watched = s_HaveThreadKey;
+    if(watched || !s_Threads)
+    {
+        cache->m_NextThread = s_Threads;
+        cache->m_PrevThread = NULL;
+        if(s_Threads)
+        {
+            s_Threads->m_PrevThread = cache;
+        }
+
+        s_Threads = cache;
+    }
+
+    cache->m_Registered = true;
+
+    SpinUnlock(&s_ThreadsLock);
+
+    if(watched)
+    {
+#if _MSC_VER
+        FlsSetValue(s_ThreadKey, cache);
+#else
+        pthread_setspecific(s_ThreadKey, cache);
+#endif
+    }
+}
+
+static void
+RecordSample(const HeapTag tag, const size_t size)
+{
+    void* frames[HeapSample::MAX_FRAMES];
+    size_t numFrames = 0;
+#if _MSC_VER
+    numFrames = CaptureStackBackTrace(0, HeapSample::MAX_FRAMES, frames, NULL);
+#elif defined(__GLIBC__)
+    numFrames = backtrace(frames, HeapSample::MAX_FRAMES);
+#endif
+
+    SpinLock(&s_SampleLock);
+
+    HeapSample* sample = &s_Samples[s_NumSamples % Heap::MAX_SAMPLES];
+    ++s_NumSamples;
+
+    sample->m_Size = size;
+    sample->m_Tag = tag;
+    sample->m_NumFrames = numFrames;
+    memcpy(sample->m_Frames, frames, numFrames * sizeof(frames[0]));
+
+    SpinUnlock(&s_SampleLock);
+}
+
+static inline size_t
+GetSizeBucket(const size_t size)
+{
+    if(size <= 1)
+    {
+        return 0;
+    }
+
+    if(size > (size_t(1) << (Heap::NUM_SIZE_BUCKETS - 1)))
+    {
+        return Heap::NUM_SIZE_BUCKETS - 1;
+    }
+
+    return HighestBit((u32)(size - 1)) + 1;
+}
+
+static inline void
+CountAlloc(ThreadCache* cache, const HeapTag tag, const size_t size, const size_t allocSize)
+{
+    hbassert(tag < HEAPTAG_COUNT);
+
+    if(!cache->m_Registered)
+    {
+        RegisterThread(cache);
+    }
+
+    HeapCounters* counters = &cache->m_Counters;
+    counters->m_Bytes[tag] += allocSize;
+    ++counters->m_NumAllocs[tag];
+    ++counters->m_TotalAllocs[tag];
+    ++counters->m_SizeBuckets[GetSizeBucket(size)];
+
+    const size_t sampleRate = s_SampleRate;
+    if(sampleRate && ++cache->m_SinceSample >= sampleRate)
+    {
+        cache->m_SinceSample = 0;
+        RecordSample(tag, size);
+    }
+}
+
+static inline void
+CountFree(ThreadCache* cache, const HeapTag tag, const size_t allocSize)
+{
+    hbassert(tag < HEAPTAG_COUNT);
+
+    if(!cache->m_Registered)
+    {
+        RegisterThread(cache);
+    }
+
+    cache->m_Counters.m_Bytes[tag] -= allocSize;
+    --cache->m_Counters.m_NumAllocs[tag];
+}
+
+static inline void*
+AllocSlab(ThreadCache* cache, const size_t size, size_t* allocSize)
+{
+    const size_t sizeClass = GetSizeClass(size);
+    FreeObject* obj = cache->m_Lists[sizeClass];
+
+    if(!obj)
+    {
+        cache->m_Counts[sizeClass] = FetchObjects(sizeClass, &obj);
+        if(!obj)
+        {
+            return AllocMalloc(size, false, allocSize);
+        }
+    }
+
+    cache->m_Lists[sizeClass] = obj->m_Next;
+    --cache->m_Counts[sizeClass];
+
+    *allocSize = CLASS_SIZES[sizeClass];
+    return obj;
+}
+
+void*
+Heap::ZAlloc(size_t size, const HeapTag tag)
+{
+    if(size > MAX_SLAB_SIZE)
+    {
+        size_t allocSize;
+        void* mem = AllocLarge(size, true, &allocSize);
+        if(mem)
+        {
+            HB_ASSERTONLY(SetTag(mem, tag));
+            CountAlloc(&s_ThreadCache, tag, size, allocSize);
+        }
+
+        return mem;
+    }
+
+    void* p = Alloc(size, tag);
+    if(p)
+    {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+void*
+Heap::Alloc(size_t size, const HeapTag tag)
+{
+    ThreadCache* cache = &s_ThreadCache;
+    size_t allocSize;
+    void* mem = (size > MAX_SLAB_SIZE)
+                ? AllocLarge(size, false, &allocSize)
+                : AllocSlab(cache, size, &allocSize);
+
+    if(mem)
+    {
+        HB_ASSERTONLY(SetTag(mem, tag));
+        CountAlloc(cache, tag, size, allocSize);
+    }
+
+    return mem;
+}
+
+void
+Heap::Free(void* mem, const HeapTag tag)
+{
+    if(!mem)
+    {
+        return;
+    }
+
+    //Freeing with another tag than the allocation's would move its
+    //bytes from one tag's count to the other's.
+    hbassert(GetTag(mem) == tag);
+
+    ThreadCache* cache = &s_ThreadCache;
+
+    if(!IsSlab(mem))
+    {
+        if(IsHuge(mem))
+        {
+            CountFree(cache, tag, FreeHuge(mem));
+        }
+        else
+        {
+            CountFree(cache, tag, FreeMalloc(mem));
+        }
+
+        return;
+    }
+
+    const size_t sizeClass = GetSpan(mem)->m_SizeClass;
+    CountFree(cache, tag, CLASS_SIZES[sizeClass]);
+
+    FreeObject* obj = (FreeObject*) mem;
+    obj->m_Next = cache->m_Lists[sizeClass];
+    cache->m_Lists[sizeClass] = obj;
+
+    const size_t batch = GetBatchSize(sizeClass);
+    if(++cache->m_Counts[sizeClass] > 2 * batch)
+    {
+        //Keep the most recently freed objects, which are likely still
+        //in the CPU cache.
+        FreeObject* last = obj;
+        for(size_t i = 1; i < batch; ++i)
+        {
+            last = last->m_Next;
+        }
+
+        FreeObject* released = last->m_Next;
+        last->m_Next = NULL;
+        cache->m_Counts[sizeClass] = batch;
+
+        ReleaseObjects(sizeClass, released, batch + 1);
+    }
+}
+
+bool
+Heap::Reserve(const size_t size, const bool explicitHugePages)
+{
+    SpinLock(&s_HugeLock);
+
+    bool reserved = false;
+    if(!s_HugeReserved)
+    {
+        ReserveHuge((size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1), explicitHugePages);
+        reserved = s_HugeSize > 0;
+    }
+
+    SpinUnlock(&s_HugeLock);
+
+    return reserved;
+}
+
+bool
+Heap::HasExplicitHugePages()
+{
+    return s_HugeExplicit;
+}
+
+void
+Heap::FlushThreadCache()
+{
+    ThreadCache* cache = &s_ThreadCache;
+
+    for(size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        if(cache->m_Lists[i])
+        {
+            ReleaseObjects(i, cache->m_Lists[i], cache->m_Counts[i]);
+            cache->m_Lists[i] = NULL;
+            cache->m_Counts[i] = 0;
+        }
+    }
+}
+
+void
+Heap::GetClassStats(const size_t sizeClass, HeapClassStats* stats)
+{
+    hbassert(sizeClass < NUM_SIZE_CLASSES);
+
+    SizeClass* sc = &s_Classes[sizeClass];
+
+    SpinLock(&sc->m_Lock);
+
+    stats->m_ObjectSize = CLASS_SIZES[sizeClass];
+    stats->m_NumSpans = sc->m_NumSpans;
+    stats->m_NumObjects = sc->m_NumSpans * (SPAN_SIZE / CLASS_SIZES[sizeClass]);
+    stats->m_NumUsed = sc->m_NumUsed;
+    stats->m_NumMoved = sc->m_NumMoved;
+    stats->m_NumSpansEmptied = sc->m_NumSpansEmptied;
+
+    SpinUnlock(&sc->m_Lock);
+}
+
+double
+Heap::GetFragmentation()
+{
+    size_t numSpans = 0;
+    size_t usedBytes = 0;
+
+    for(size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        HeapClassStats stats;
+        GetClassStats(i, &stats);
+        numSpans += stats.m_NumSpans;
+        usedBytes += stats.m_NumUsed * stats.m_ObjectSize;
+    }
+
+    SpinLock(&s_SpanLock);
+    numSpans += s_NumFreeSpans;
+    SpinUnlock(&s_SpanLock);
+
+    return numSpans ? 1.0 - (double)usedBytes / (double)(numSpans * SPAN_SIZE) : 0;
+}
+
+size_t
+Heap::GetFragmentedBytes()
+{
+    size_t freeBytes = 0;
+
+    for(size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        HeapClassStats stats;
+        GetClassStats(i, &stats);
+        freeBytes += stats.m_NumSpans * SPAN_SIZE - stats.m_NumUsed * stats.m_ObjectSize;
+    }
+
+    return freeBytes;
+}
+
+bool
+Heap::ShouldMove(const void* mem)
+{
+    if(!IsSlab(mem))
+    {
+        return false;
+    }
+
+    //Read without the lock, since it's only a hint.  Below the average
+    //means the objects are better off packed into the fuller spans.
+    const Span* span = GetSpan(mem);
+    const SizeClass* sc = &s_Classes[span->m_SizeClass];
+    return span->m_NumUsed < span->m_NumObjects
+            && (u64) span->m_NumUsed * sc->m_NumSpans < sc->m_NumUsed;
+}
+
+void*
+Heap::Move(void* mem)
+{
+    if(!IsSlab(mem))
+    {
+        return NULL;
+    }
+
+    Span* from = GetSpan(mem);
+    const size_t sizeClass = from->m_SizeClass;
+    const size_t objectSize = CLASS_SIZES[sizeClass];
+    SizeClass* sc = &s_Classes[sizeClass];
+
+    hbassert(0 == ((byte*) mem - GetSpanMemory(from)) % objectSize);
+
+    SpinLock(&sc->m_Lock);
+
+    //The fullest of the first few spans with room.  Emptier ones are
+    //what's being drained.
+    Span* to = NULL;
+    size_t numScanned = 0;
+    for(Span* span = sc->m_Partial; span && numScanned < MAX_MOVE_SCAN; span = span->m_Next, ++numScanned)
+    {
+        if(span != from
+            && span->m_NumUsed > from->m_NumUsed
+            && (!to || span->m_NumUsed > to->m_NumUsed))
+        {
+            to = span;
+        }
+    }
+
+    void* moved = NULL;
+    if(to)
+    {
+        moved = TakeObject(sc, to, objectSize);
+        memcpy(moved, mem, objectSize);
+        HB_ASSERTONLY(SetTag(moved, GetTag(mem)));
+
+        ++sc->m_NumMoved;
+        if(ReturnObject(sc, (FreeObject*) mem))
+        {
+            ++sc->m_NumSpansEmptied;
+        }
+    }
+
+    SpinUnlock(&sc->m_Lock);
+
+    return moved;
+}
+
+//Adds up the counters of every thread, living or not.  A running
+//thread's may be a few allocations behind.
+static void
+GetCounters(HeapCounters* counters)
+{
+    SpinLock(&s_ThreadsLock);
+
+    *counters = s_ExitedCounters;
+    for(const ThreadCache* cache = s_Threads; cache; cache = cache->m_NextThread)
+    {
+        counters->Add(cache->m_Counters);
+    }
+
+    SpinUnlock(&s_ThreadsLock);
+}
+
+static void
+GetTagStats(const HeapCounters& counters, const HeapTag tag, HeapTagStats* stats)
+{
+    //Threads' counters are read at slightly different times, so the sum
+    //can briefly miss an allocation whose free it has seen.
+    stats->m_Bytes = counters.m_Bytes[tag] > 0 ? (size_t) counters.m_Bytes[tag] : 0;
+    stats->m_NumAllocs = counters.m_NumAllocs[tag] > 0 ? (size_t) counters.m_NumAllocs[tag] : 0;
+    stats->m_TotalAllocs = counters.m_TotalAllocs[tag];
+}
+
+void
+Heap::GetTagStats(const HeapTag tag, HeapTagStats* stats)
+{
+    hbassert(tag < HEAPTAG_COUNT);
+
+    HeapCounters counters;
+    GetCounters(&counters);
+
+    honeybase::GetTagStats(counters, tag, stats);
+}
+
+const char*
+Heap::GetTagName(const HeapTag tag)
+{
+    hbassert(tag < HEAPTAG_COUNT);
+
+    return TAG_NAMES[tag];
+}
+
+void
+Heap::GetSizeHistogram(u64 counts[NUM_SIZE_BUCKETS])
+{
+    HeapCounters counters;
+    GetCounters(&counters);
+
+    memcpy(counts, counters.m_SizeBuckets, sizeof(counters.m_SizeBuckets));
+}
+
+void
+Heap::SetSampleRate(const size_t rate)
+{
+    s_SampleRate = rate;
+}
+
+size_t
+Heap::GetSampleRate()
+{
+    return s_SampleRate;
+}
+
+size_t
+Heap::GetSamples(HeapSample* samples, const size_t maxSamples)
+{
+    SpinLock(&s_SampleLock);
+
+    size_t count = maxSamples;
+    if(count > MAX_SAMPLES)
+    {
+        count = MAX_SAMPLES;
+    }
+
+    if(count > s_NumSamples)
+    {
+        count = (size_t) s_NumSamples;
+    }
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        samples[i] = s_Samples[(s_NumSamples - 1 - i) % MAX_SAMPLES];
+    }
+
+    SpinUnlock(&s_SampleLock);
+
+    return count;
+}
+
+//Appends lines to the report written by Heap::FormatStats(), counting
+//the length of the whole report after buf is full.
+class StatsWriter
+{
+public:
+
+    StatsWriter(char* buf, const size_t bufSize)
+    : m_Buf(buf)
+    , m_BufSize(bufSize)
+    , m_Len(0)
+    {
+        if(m_BufSize)
+        {
+            m_Buf[0] = '\0';
+        }
+    }
+
+    void Write(const char* fmt, ...)
+    {
+        char line[512];
+        va_list args;
+        va_start(args, fmt);
+        const int len = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+
+        if(len <= 0)
+        {
+            return;
+        }
+
+        const size_t lineLen = ((size_t) len < sizeof(line)) ? (size_t) len : sizeof(line) - 1;
+        if(m_Len + 1 < m_BufSize)
+        {
+            const size_t room = m_BufSize - 1 - m_Len;
+            const size_t numCopied = (lineLen < room) ? lineLen : room;
+            memcpy(&m_Buf[m_Len], line, numCopied);
+            m_Buf[m_Len + numCopied] = '\0';
+        }
+
+        m_Len += lineLen;
+    }
+
+    size_t Length() const
+    {
+        return m_Len;
+    }
+
+private:
+
+    char* m_Buf;
+    size_t m_BufSize;
+    size_t m_Len;
+};
+
+size_t
+Heap::FormatStats(char* buf, const size_t bufSize)
+{
+    StatsWriter writer(buf, bufSize);
+
+    HeapCounters counters;
+    GetCounters(&counters);
+
+    for(size_t i = 0; i < HEAPTAG_COUNT; ++i)
+    {
+        HeapTagStats stats;
+        honeybase::GetTagStats(counters, (HeapTag) i, &stats);
+
+        writer.Write("tag:%s bytes:%" PRIu64 " allocs:%" PRIu64 " total_allocs:%" PRIu64 "\n",
+                        TAG_NAMES[i],
+                        (u64) stats.m_Bytes,
+                        (u64) stats.m_NumAllocs,
+                        (u64) stats.m_TotalAllocs);
+    }
+
+    u64 numMoved = 0;
+    u64 bytesMoved = 0;
+    u64 numSpansEmptied = 0;
+    for(size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        HeapClassStats stats;
+        GetClassStats(i, &stats);
+        if(stats.m_NumSpans)
+        {
+            writer.Write("class:%u spans:%" PRIu64 " objects:%" PRIu64 " used:%" PRIu64 " moved:%" PRIu64 "\n",
+                            (unsigned) stats.m_ObjectSize,
+                            (u64) stats.m_NumSpans,
+                            (u64) stats.m_NumObjects,
+                            (u64) stats.m_NumUsed,
+                            stats.m_NumMoved);
+        }
+
+        numMoved += stats.m_NumMoved;
+        bytesMoved += stats.m_NumMoved * stats.m_ObjectSize;
+        numSpansEmptied += stats.m_NumSpansEmptied;
+    }
+
+    writer.Write("fragmentation:%.4f\n", GetFragmentation());
+    writer.Write("fragmented_bytes:%" PRIu64 "\n", (u64) GetFragmentedBytes());
+    writer.Write("defrag_moved:%" PRIu64 " defrag_moved_bytes:%" PRIu64 " defrag_reclaimed_bytes:%" PRIu64 "\n",
+                    numMoved,
+                    bytesMoved,
+                    numSpansEmptied * SPAN_SIZE);
+    writer.Write("explicit_huge_pages:%d\n", HasExplicitHugePages() ? 1 : 0);
+
+    for(size_t i = 0; i < NUM_SIZE_BUCKETS; ++i)
+    {
+        if(counters.m_SizeBuckets[i])
+        {
+            writer.Write("size:%" PRIu64 " allocs:%" PRIu64 "\n",
+                            (u64) (u64(1) << i),
+                            (u64) counters.m_SizeBuckets[i]);
+        }
+    }
+
+    writer.Write("sample_rate:%" PRIu64 "\n", (u64) GetSampleRate());
+
+    HeapSample* samples = (HeapSample*) malloc(MAX_SAMPLES * sizeof(HeapSample));
+    const size_t numSamples = samples ? GetSamples(samples, MAX_SAMPLES) : 0;
+    for(size_t i = 0; i < numSamples; ++i)
+    {
+        char frames[HeapSample::MAX_FRAMES * 20 + 1];
+        size_t framesLen = 0;
+        frames[0] = '\0';
+        for(size_t j = 0; j < samples[i].m_NumFrames; ++j)
+        {
+            framesLen += snprintf(&frames[framesLen], sizeof(frames) - framesLen,
+                                    j ? ",%p" : "%p", samples[i].m_Frames[j]);
+        }
+
+        writer.Write("sample:%s size:%" PRIu64 " stack:%s\n",
+                        TAG_NAMES[samples[i].m_Tag],
+                        (u64) samples[i].m_Size,
+                        frames);
+    }
+
+    free(samples);
+
+    return writer.Length();
+}
+
+size_t
+AtomicIncrement(volatile size_t* value)
+{
+#if _MSC_VER && defined(_WIN64)
+    return (size_t) InterlockedIncrement64((volatile LONGLONG*)value);
+#elif _MSC_VER
+    return (size_t) InterlockedIncrement((volatile LONG*)value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+size_t
+AtomicDecrement(volatile size_t* value)
+{
+#if _MSC_VER && defined(_WIN64)
+    return (size_t) InterlockedDecrement64((volatile LONGLONG*)value);
+#elif _MSC_VER
+    return (size_t) InterlockedDecrement((volatile LONG*)value);
+#else
+    return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+s32
+AtomicIncrement(volatile s32* value)
+{
+#if _MSC_VER
+    return (s32) InterlockedIncrement((volatile LONG*)value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+s32
+AtomicDecrement(volatile s32* value)
+{
+#if _MSC_VER
+    return (s32) InterlockedDecrement((volatile LONG*)value);
+#else
+    return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Blob
+///////////////////////////////////////////////////////////////////////////////
+static volatile size_t s_NumBlobs = 0;
+
+//A Blob extended by Patch() gets room to double, up to this much.
+static const size_t MAX_SLACK = 1024*1024;
+
+StopWatch Blob::sm_StopWatch;
+
+//See SHARD_HASH_SALT in netshard.cpp.
+static const u64 BLOB_HASH_SALT = 0x811c9dc5;
+
+static size_t
+VarintSize(size_t value)
+{
+    size_t size = 1;
+    for(value >>= 7; value; value >>= 7)
+    {
+        ++size;
+    }
+
+    return size;
+}
+
+//Writes value in exactly size bytes, padding with continuation bytes.
+static byte*
+EncodeVarint(byte* p, size_t value, const size_t size)
+{
+    hbassert(size >= VarintSize(value));
+
+    for(size_t i = 1; i < size; ++i)
+    {
+        *p++ = 0x80 | (value & 0x7F);
+        value >>= 7;
+    }
+
+    *p++ = (byte)value;
+
+    return p;
+}
+
+static const byte*
+DecodeVarint(const byte* p, size_t* value)
+{
+    size_t v = 0;
+    int shift = 0;
+
+    while(*p & 0x80)
+    {
+        v |= (size_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+
+    v |= (size_t)(*p++ & 0x7F) << shift;
+
+    *value = v;
+    return p;
+}
+
+Blob*
+Blob::Create(const size_t len)
+{
+    return Create(NULL, len);
+}
+
+Blob*
+Blob::Create(const byte* bytes, const size_t len)
+{
+    const size_t size = Size(len);
+    Blob* blob = (Blob*) Heap::Alloc(size, HEAPTAG_BLOB);
+    if(blob)
+    {
+        new(blob) Blob();
+        Init(blob, bytes, len);
+        AtomicIncrement(&s_NumBlobs);
+    }
+
+    return blob;
+}
+
+Blob*
+Blob::Create(const byte* bytes, const size_t len, const size_t capacity)
+{
+    hbassert(len <= capacity);
+
+    const size_t capSize = VarintSize(capacity);
+    Blob* blob = (Blob*) Heap::Alloc(2*capSize + capacity + sizeof(Blob) - 1, HEAPTAG_BLOB);
+    if(blob)
+    {
+        new(blob) Blob();
+        blob->m_HasCapacity = 1;
+
+        byte* p = EncodeVarint(blob->bytes, capacity, capSize);
+        p = EncodeVarint(p, len, capSize);
+
+        if(bytes)
+        {
+            memcpy(p, bytes, len);
+        }
+
+        AtomicIncrement(&s_NumBlobs);
+    }
+
+    return blob;
+}
+
+Blob*
+Blob::Encode(const byte* src, const size_t srcLen,
+                byte* dst, const size_t dstSize)
+{
+    const size_t size = Size(srcLen);
+    if(hbverify(size <= dstSize))
+    {
+        Blob* blob = new(dst) Blob();
+        Init(blob, src, srcLen);
+        return blob;
+    }
+
+    return NULL;
+}
+
+size_t
+Blob::Size(const size_t len)
+{
+    return VarintSize(len) + len + sizeof(Blob) - 1;
+}
+
+Blob*
+Blob::CreateHashed(const byte* bytes, const size_t len)
+{
+    Blob* blob = (Blob*) Heap::Alloc(HashedSize(len), HEAPTAG_BLOB);
+    if(blob)
+    {
+        new(blob) Blob();
+        blob->m_HasHash = 1;
+        Init(blob, bytes, len);
+        AtomicIncrement(&s_NumBlobs);
+    }
+
+    return blob;
+}
+
+Blob*
+Blob::EncodeHashed(const byte* src, const size_t srcLen,
+                    byte* dst, const size_t dstSize)
+{
+    if(hbverify(HashedSize(srcLen) <= dstSize))
+    {
+        Blob* blob = new(dst) Blob();
+        blob->m_HasHash = 1;
+        Init(blob, src, srcLen);
+        return blob;
+    }
+
+    return NULL;
+}
+
+size_t
+Blob::HashedSize(const size_t len)
+{
+    return Size(len) + sizeof(u64);
+}
+
+Blob*
+Blob::Patch(Blob* blob, const Blob* patch, const size_t offset)
+{
+    const byte* patchData;
+    const size_t patchLen = patch->GetData(&patchData);
+
+    if(blob && blob->m_IsSegmented)
+    {
+        return PatchSegmented(blob, patchData, patchLen, offset);
+    }
+
+    byte* data = NULL;
+    const size_t len = blob ? blob->GetData(&data) : 0;
+    const size_t end = offset + patchLen;
+
+    //A Blob with other references may be in the middle of being sent
+    //as a reply, so it's never changed.
+    if(blob && 1 == blob->NumRefs() && end <= blob->Capacity())
+    {
+        if(end > len)
+        {
+            blob->SetLength(end);
+        }
+
+        if(offset > len)
+        {
+            memset(&data[len], 0, offset - len);
+        }
+
+        //Use memmove because the patch could be the Blob itself.
+        memmove(&data[offset], patchData, patchLen);
+
+        if(blob->m_HasHash)
+        {
+            blob->CacheHash();
+        }
+
+        return blob;
+    }
+
+    //Copying a large value once to split it up saves copying it again
+    //on later patches.
+    if(((end > len) ? end : len) >= SEGMENTED_MIN_LEN)
+    {
+        return PatchSegmented(blob, patchData, patchLen, offset);
+    }
+
+    Blob* newBlob;
+    if(end > len)
+    {
+        const size_t slack = (end < MAX_SLACK) ? end : MAX_SLACK;
+        newBlob = Create(NULL, end, end + slack);
+    }
+    else
+    {
+        newBlob = Create(len);
+    }
+
+    if(newBlob)
+    {
+        byte* newData;
+        newBlob->GetData(&newData);
+        if(len > 0)
+        {
+            memcpy(newData, data, len);
+        }
+
+        if(offset > len)
+        {
+            memset(&newData[len], 0, offset - len);
+        }
+
+        memcpy(&newData[offset], patchData, patchLen);
+    }
+
+    return newBlob;
+}
+
+size_t
+Blob::GetData(const byte** data) const
+{
+    hbassert(!m_IsSegmented);
+
+    const byte* p = GetHeader();
+    size_t len;
+
+    if(m_HasCapacity)
+    {
+        p = DecodeVarint(p, &len);
+    }
+
+    *data = DecodeVarint(p, &len);
+
+    return len;
+}
+
+size_t
+Blob::GetData(byte** data)
+{
+    return GetData((const byte**) data);
+}
+
+size_t
+Blob::CopyData(byte* dst, const size_t dstSize) const
+{
+    if(m_IsSegmented)
+    {
+        const SegmentIndex* index = GetIndex();
+        size_t pos = 0;
+        for(size_t i = 0; i < index->m_NumSegments && pos < dstSize; ++i)
+        {
+            pos += index->m_Segments[i]->CopyData(&dst[pos], dstSize - pos);
+        }
+
+        return index->m_Len;
+    }
+
+    const byte* data;
+    const size_t len = GetData(&data);
+    size_t cpyLen = (len > dstSize ? dstSize : len);
+    memcpy(dst, data, cpyLen);
+    return len;
+}
+
+size_t
+Blob::Length() const
+{
+    if(m_IsSegmented)
+    {
+        return GetIndex()->m_Len;
+    }
+
+    const byte* data;
+    return GetData(&data);
+}
+
+size_t
+Blob::Capacity() const
+{
+    if(m_IsSegmented)
+    {
+        return GetIndex()->m_MaxSegments * SEGMENT_SIZE;
+    }
+
+    size_t capacity;
+    if(m_HasCapacity)
+    {
+        DecodeVarint(GetHeader(), &capacity);
+        return capacity;
+    }
+
+    return Length();
+}
+
+bool
+Blob::IsSegmented() const
+{
+    return 0 != m_IsSegmented;
+}
+
+size_t
+Blob::NumSegments() const
+{
+    return m_IsSegmented ? GetIndex()->m_NumSegments : 1;
+}
+
+Blob*
+Blob::GetSegment(const size_t index)
+{
+    if(m_IsSegmented)
+    {
+        hbassert(index < GetIndex()->m_NumSegments);
+        return GetIndex()->m_Segments[index];
+    }
+
+    hbassert(0 == index);
+    return this;
+}
+
+Blob*
+Blob::Move(Blob* blob)
+{
+    //A segmented Blob's index is aligned from the Blob's address, so
+    //it's left where it is.  Its segments are too big for spans.
+    if(1 != blob->m_RefCount || blob->m_IsSegmented || !Heap::ShouldMove(blob))
+    {
+        return blob;
+    }
+
+    Blob* moved = (Blob*) Heap::Move(blob);
+    return moved ? moved : blob;
+}
+
+u64
+Blob::Hash() const
+{
+    if(m_HasHash)
+    {
+        u64 hash;
+        memcpy(&hash, bytes, sizeof(hash));
+        return hash;
+    }
+
+    const byte* data;
+    const size_t len = GetData(&data);
+    return Hash64(data, len, BLOB_HASH_SALT);
+}
+
+void
+Blob::CacheHash()
+{
+    hbassert(m_HasHash);
+
+    const byte* data;
+    const size_t len = GetData(&data);
+    const u64 hash = Hash64(data, len, BLOB_HASH_SALT);
+    memcpy(bytes, &hash, sizeof(hash));
+}
+
+/*Blob*
+Blob::Dup() const
+{
+    return Dup(this);
+}*/
+
+void
+Blob::Ref() const
+{
+    hbassert(m_RefCount > 0);
+    AtomicIncrement(&m_RefCount);
+}
+
+void
+Blob::Unref()
+{
+    hbassert(m_RefCount > 0);
+    if(0 == AtomicDecrement(&m_RefCount))
+    {
+        Destroy(this);
+    }
+}
+
+int
+Blob::NumRefs() const
+{
+    return m_RefCount;
+}
+
+int
+Blob::Compare(const byte* thatData, const size_t thatLen) const
+{
+    //DO NOT SUBMIT
+    //sm_StopWatch.Start();
+
+    const byte* myData;
+    const size_t myLen = GetData(&myData);
+
+    /*const size_t cmpLen = myLen < thatLen ? myLen : thatLen;
+    const int result = memcmp(myData, thatData, cmpLen);
+
+    return (0 == result) ? myLen - thatLen : result;*/
+
+    if(myLen < thatLen)
+    {
+        if(myLen > 0)
+        {
+            const int result = memcmp(myData, thatData, myLen);
+            return (0 == result) ? -1 : result;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    else if(thatLen < myLen)
+    {
+        if(thatLen > 0)
+        {
+            const int result = memcmp(myData, thatData, thatLen);
+            return (0 == result) ? 1 : result;
+        }
+        else
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        return myLen > 0 ? memcmp(myData, thatData, myLen): 0;
+    }
+
+    //DO NOT SUBMIT
+    //sm_StopWatch.Stop();
+}
+
+size_t
+Blob::GlobalBlobCount()
+{
+    return s_NumBlobs;
+}
+
+//protected:
+
+void
+Blob::Init(Blob* blob, const byte* bytes, const size_t len)
+{
+    byte* p = EncodeVarint((byte*) blob->GetHeader(), len, VarintSize(len));
+
+    if(bytes)
+    {
+        memcpy(p, bytes, len);
+
+        if(blob->m_HasHash)
+        {
+            blob->CacheHash();
+        }
+    }
+}
+
+//private:
+
+/*Blob*
+Blob::Dup(const Blob* blob)
+{
+    Blob* newBlob = (Blob*) Heap::Alloc(Blob::Size(blob->Length()), HEAPTAG_BLOB);
+    if(newBlob)
+    {
+        new(newBlob) Blob();
+        const byte* bytes;
+        const size_t len = blob->GetData(&bytes);
+        Init(newBlob, bytes, len);
+    }
+
+    return newBlob;
+}*/
+
+void
+Blob::SetLength(const size_t len)
+{
+    hbassert(m_HasCapacity);
+
+    size_t capacity;
+    byte* p = (byte*) DecodeVarint(GetHeader(), &capacity);
+    hbassert(len <= capacity);
+
+    EncodeVarint(p, len, VarintSize(capacity));
+}
+
+void
 Blob::Destroy(Blob* blob)
 {
     hbassert(0 == blob->m_RefCount);
 
+    if(blob->m_IsSegmented)
+    {
+        SegmentIndex* index = blob->GetIndex();
+        for(size_t i = 0; i < index->m_NumSegments; ++i)
+        {
+            index->m_Segments[i]->Unref();
+        }
+    }
+
     blob->~Blob();
-    Heap::Free(blob);
-    --s_NumBlobs;
+    Heap::Free(blob, HEAPTAG_BLOB);
+    AtomicDecrement(&s_NumBlobs);
+}
+
+Blob*
+Blob::CreateSegmented(const size_t maxSegments)
+{
+    hbassert(maxSegments > 0);
+
+    //Room to align the index past the header.
+    const size_t size = sizeof(Blob) + sizeof(size_t)
+                        + sizeof(SegmentIndex) + (maxSegments - 1) * sizeof(Blob*);
+
+    Blob* blob = (Blob*) Heap::Alloc(size, HEAPTAG_BLOB);
+    if(blob)
+    {
+        new(blob) Blob();
+        blob->m_IsSegmented = 1;
+
+        SegmentIndex* index = blob->GetIndex();
+        index->m_Len = 0;
+        index->m_NumSegments = 0;
+        index->m_MaxSegments = maxSegments;
+
+        AtomicIncrement(&s_NumBlobs);
+    }
+
+    return blob;
+}
+
+Blob*
+Blob::PatchSegmented(Blob* blob,
+                    const byte* patchData, const size_t patchLen,
+                    const size_t offset)
+{
+    const size_t len = blob ? blob->Length() : 0;
+    const size_t end = offset + patchLen;
+    const size_t newLen = (end > len) ? end : len;
+    const size_t numSegments = (newLen + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+    Blob* newBlob = blob;
+
+    //A new index shares the old one's segments, so only the segments
+    //the patch touches are copied.
+    if(!blob
+        || !blob->m_IsSegmented
+        || blob->NumRefs() > 1
+        || numSegments > blob->GetIndex()->m_MaxSegments)
+    {
+        //Room for the index to double, so a run of appends copies it a
+        //logarithmic number of times.
+        newBlob = CreateSegmented(2 * numSegments);
+        if(!newBlob)
+        {
+            return NULL;
+        }
+
+        if(blob && blob->m_IsSegmented)
+        {
+            const SegmentIndex* index = blob->GetIndex();
+            SegmentIndex* newIndex = newBlob->GetIndex();
+
+            for(size_t i = 0; i < index->m_NumSegments; ++i)
+            {
+                index->m_Segments[i]->Ref();
+                newIndex->m_Segments[i] = index->m_Segments[i];
+            }
+
+            newIndex->m_NumSegments = index->m_NumSegments;
+            newIndex->m_Len = index->m_Len;
+        }
+        else if(blob)
+        {
+            const byte* data;
+            blob->GetData(&data);
+            if(!newBlob->WriteSegments(0, data, len))
+            {
+                newBlob->Unref();
+                return NULL;
+            }
+        }
+    }
+
+    if((offset > len && !newBlob->WriteSegments(len, NULL, offset - len))
+        || !newBlob->WriteSegments(offset, patchData, patchLen))
+    {
+        if(newBlob != blob)
+        {
+            newBlob->Unref();
+        }
+
+        return NULL;
+    }
+
+    return newBlob;
+}
+
+const byte*
+Blob::GetHeader() const
+{
+    return m_HasHash ? &bytes[sizeof(u64)] : bytes;
+}
+
+Blob::SegmentIndex*
+Blob::GetIndex() const
+{
+    hbassert(m_IsSegmented);
+
+    const size_t align = sizeof(size_t) - 1;
+    return (SegmentIndex*) (((size_t)bytes + align) & ~align);
+}
+
+bool
+Blob::WriteSegments(size_t offset, const byte* src, size_t len)
+{
+    SegmentIndex* index = GetIndex();
+    hbassert(offset <= index->m_Len);
+
+    while(len > 0)
+    {
+        const size_t segIndex = offset / SEGMENT_SIZE;
+        const size_t segOffset = offset % SEGMENT_SIZE;
+        const size_t writeLen =
+            (len < SEGMENT_SIZE - segOffset) ? len : SEGMENT_SIZE - segOffset;
+
+        hbassert(segIndex < index->m_MaxSegments);
+
+        Blob* segment =
+            (segIndex < index->m_NumSegments) ? index->m_Segments[segIndex] : NULL;
+        byte* data = NULL;
+        const size_t segLen = segment ? segment->GetData(&data) : 0;
+
+        //A segment with other references may be in the middle of being
+        //sent as a reply, so it's copied.
+        if(!segment || segment->NumRefs() > 1)
+        {
+            Blob* newSegment = Create(data, segLen, SEGMENT_SIZE);
+            if(!newSegment)
+            {
+                return false;
+            }
+
+            if(segment)
+            {
+                segment->Unref();
+            }
+            else
+            {
+                ++index->m_NumSegments;
+            }
+
+            index->m_Segments[segIndex] = segment = newSegment;
+            segment->GetData(&data);
+        }
+
+        if(segOffset + writeLen > segLen)
+        {
+            segment->SetLength(segOffset + writeLen);
+        }
+
+        if(src)
+        {
+            //Use memmove because the patch could be one of the segments.
+            memmove(&data[segOffset], src, writeLen);
+            src += writeLen;
+        }
+        else
+        {
+            memset(&data[segOffset], 0, writeLen);
+        }
+
+        offset += writeLen;
+        len -= writeLen;
+
+        if(offset > index->m_Len)
+        {
+            index->m_Len = offset;
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  HeapTest
+///////////////////////////////////////////////////////////////////////////////
+void
+HeapTest::Test()
+{
+    //Every size up to MAX_SLAB_SIZE maps to the smallest class it fits.
+    for(size_t size = 0; size <= Heap::MAX_SLAB_SIZE; ++size)
+    {
+        const size_t sizeClass = GetSizeClass(size);
+        hbassert(sizeClass < Heap::NUM_SIZE_CLASSES);
+        hbassert(size <= CLASS_SIZES[sizeClass]);
+        hbassert(0 == sizeClass || size > CLASS_SIZES[sizeClass - 1]);
+    }
+
+    Heap::FlushThreadCache();
+
+    size_t numUsedBefore[Heap::NUM_SIZE_CLASSES];
+    for(size_t i = 0; i < Heap::NUM_SIZE_CLASSES; ++i)
+    {
+        HeapClassStats stats;
+        Heap::GetClassStats(i, &stats);
+        numUsedBefore[i] = stats.m_NumUsed;
+    }
+
+    //Allocations of every size, each filled with a pattern that's
+    //checked before it's freed to catch overlapping objects.
+    const int NUM_ALLOCS = 20000;
+    byte** allocs = (byte**) malloc(NUM_ALLOCS * sizeof(byte*));
+    size_t* sizes = (size_t*) malloc(NUM_ALLOCS * sizeof(size_t));
+
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(int i = 0; i < NUM_ALLOCS; ++i)
+        {
+            sizes[i] = (i % 8) ? Rand(1, 512) : Rand(1, 2 * Heap::MAX_SLAB_SIZE);
+            allocs[i] = (byte*) Heap::Alloc(sizes[i]);
+            hbassert(allocs[i]);
+            hbassert(0 == ((size_t)allocs[i] & 15));
+            memset(allocs[i], (byte)i, sizes[i]);
+        }
+
+        //Free every other one, then reallocate them, so freed objects
+        //get reused.
+        for(int i = 0; i < NUM_ALLOCS; i += 2)
+        {
+            Heap::Free(allocs[i]);
+            allocs[i] = (byte*) Heap::ZAlloc(sizes[i]);
+            for(size_t j = 0; j < sizes[i]; ++j)
+            {
+                hbassert(0 == allocs[i][j]);
+            }
+            memset(allocs[i], (byte)i, sizes[i]);
+        }
+
+        for(int i = 0; i < NUM_ALLOCS; ++i)
+        {
+            for(size_t j = 0; j < sizes[i]; ++j)
+            {
+                hbassert((byte)i == allocs[i][j]);
+            }
+
+            Heap::Free(allocs[i]);
+        }
+    }
+
+    free(allocs);
+    free(sizes);
+
+    //Everything is back in the shared lists once this thread's cache
+    //is flushed.
+    Heap::FlushThreadCache();
+
+    for(size_t i = 0; i < Heap::NUM_SIZE_CLASSES; ++i)
+    {
+        HeapClassStats stats;
+        Heap::GetClassStats(i, &stats);
+        hbassert(numUsedBefore[i] == stats.m_NumUsed);
+        hbassert(stats.m_NumUsed <= stats.m_NumObjects);
+    }
+
+    const double fragmentation = Heap::GetFragmentation();
+    hbassert(fragmentation >= 0 && fragmentation <= 1);
+
+    //Emptying the spans that hold the first half of some objects moves
+    //those objects into the fuller spans holding the second half.
+    const size_t moveSize = 1000;
+    const size_t moveClass = GetSizeClass(moveSize);
+    const int NUM_MOVE_ALLOCS = (int)(32 * (SPAN_SIZE / CLASS_SIZES[moveClass]));
+    byte** moveAllocs = (byte**) malloc(NUM_MOVE_ALLOCS * sizeof(byte*));
+
+    for(int i = 0; i < NUM_MOVE_ALLOCS; ++i)
+    {
+        moveAllocs[i] = (byte*) Heap::Alloc(moveSize);
+        memset(moveAllocs[i], (byte)i, moveSize);
+    }
+
+    for(int i = 0; i < NUM_MOVE_ALLOCS; ++i)
+    {
+        if((i < NUM_MOVE_ALLOCS/2) ? (i % 8) : (i % 2))
+        {
+            Heap::Free(moveAllocs[i]);
+            moveAllocs[i] = NULL;
+        }
+    }
+
+    Heap::FlushThreadCache();
+
+    HeapClassStats moveBefore;
+    Heap::GetClassStats(moveClass, &moveBefore);
+
+    int numMoved = 0;
+    for(int i = 0; i < NUM_MOVE_ALLOCS; ++i)
+    {
+        if(moveAllocs[i] && Heap::ShouldMove(moveAllocs[i]))
+        {
+            byte* moved = (byte*) Heap::Move(moveAllocs[i]);
+            if(moved)
+            {
+                hbassert(moved != moveAllocs[i]);
+                moveAllocs[i] = moved;
+                ++numMoved;
+            }
+        }
+    }
+
+    HeapClassStats moveAfter;
+    Heap::GetClassStats(moveClass, &moveAfter);
+    hbassert(numMoved > 0);
+    hbassert(moveBefore.m_NumMoved + numMoved == moveAfter.m_NumMoved);
+    hbassert(moveAfter.m_NumSpansEmptied > moveBefore.m_NumSpansEmptied);
+    hbassert(moveBefore.m_NumUsed == moveAfter.m_NumUsed);
+
+    //Not slab objects.
+    void* notSlab = Heap::Alloc(2 * Heap::MAX_SLAB_SIZE);
+    hbassert(!Heap::ShouldMove(notSlab));
+    hbassert(NULL == Heap::Move(notSlab));
+    Heap::Free(notSlab);
+
+    for(int i = 0; i < NUM_MOVE_ALLOCS; ++i)
+    {
+        if(moveAllocs[i])
+        {
+            for(size_t j = 0; j < moveSize; ++j)
+            {
+                hbassert((byte)i == moveAllocs[i][j]);
+            }
+
+            Heap::Free(moveAllocs[i]);
+        }
+    }
+
+    free(moveAllocs);
+
+    //Huge blocks are aligned to huge pages and zeroed when reused.
+    const size_t hugeSize = 2 * Heap::HUGE_PAGE_SIZE + 100;
+    byte* huge = (byte*) Heap::ZAlloc(hugeSize);
+    hbassert(huge && 0 == ((size_t)huge & (Heap::HUGE_PAGE_SIZE - 1)));
+    hbassert(0 == huge[0] && 0 == huge[hugeSize - 1]);
+    memset(huge, 0xFF, hugeSize);
+
+    byte* huge2 = (byte*) Heap::Alloc(Heap::HUGE_PAGE_SIZE);
+    hbassert(huge2 && huge2 >= huge + 3 * Heap::HUGE_PAGE_SIZE);
+    Heap::Free(huge);
+
+    byte* huge3 = (byte*) Heap::ZAlloc(hugeSize);
+    hbassert(huge3 == huge);
+    hbassert(0 == huge3[0] && 0 == huge3[hugeSize - 1]);
+    Heap::Free(huge3);
+    Heap::Free(huge2);
+
+    //Too late to size the range.
+    hbassert(!Heap::Reserve(Heap::HUGE_PAGE_SIZE, false));
+
+    //Allocations count against their tag until they're freed, at the
+    //size they really take.
+    HeapTagStats before;
+    Heap::GetTagStats(HEAPTAG_SKIPLIST, &before);
+    u64 bucketsBefore[Heap::NUM_SIZE_BUCKETS];
+    Heap::GetSizeHistogram(bucketsBefore);
+
+    void* small = Heap::Alloc(100, HEAPTAG_SKIPLIST);
+    void* large = Heap::ZAlloc(3 * Heap::MAX_SLAB_SIZE, HEAPTAG_SKIPLIST);
+    void* huge4 = Heap::Alloc(Heap::HUGE_PAGE_SIZE + 1, HEAPTAG_SKIPLIST);
+
+    HeapTagStats during;
+    Heap::GetTagStats(HEAPTAG_SKIPLIST, &during);
+    hbassert(before.m_NumAllocs + 3 == during.m_NumAllocs);
+    hbassert(before.m_TotalAllocs + 3 == during.m_TotalAllocs);
+    hbassert(during.m_Bytes >= before.m_Bytes + 112 + 3 * Heap::MAX_SLAB_SIZE + 2 * Heap::HUGE_PAGE_SIZE);
+
+    u64 buckets[Heap::NUM_SIZE_BUCKETS];
+    Heap::GetSizeHistogram(buckets);
+    hbassert(bucketsBefore[7] + 1 == buckets[7]);
+    hbassert(bucketsBefore[15] + 1 == buckets[15]);
+    hbassert(bucketsBefore[22] + 1 == buckets[22]);
+
+    Heap::Free(small, HEAPTAG_SKIPLIST);
+    Heap::Free(large, HEAPTAG_SKIPLIST);
+    Heap::Free(huge4, HEAPTAG_SKIPLIST);
+
+    HeapTagStats after;
+    Heap::GetTagStats(HEAPTAG_SKIPLIST, &after);
+    hbassert(before.m_Bytes == after.m_Bytes);
+    hbassert(before.m_NumAllocs == after.m_NumAllocs);
+    hbassert(before.m_TotalAllocs + 3 == after.m_TotalAllocs);
+
+    //With a rate of 1 every allocation is sampled.
+    Heap::SetSampleRate(1);
+    void* sampled = Heap::Alloc(200, HEAPTAG_SORTEDSET);
+    Heap::SetSampleRate(0);
+    Heap::Free(sampled, HEAPTAG_SORTEDSET);
+
+    HeapSample sample;
+    hbverify(1 == Heap::GetSamples(&sample, 1));
+    hbassert(HEAPTAG_SORTEDSET == sample.m_Tag && 200 == sample.m_Size);
+    hbassert(sample.m_NumFrames <= HeapSample::MAX_FRAMES);
+
+    //A report too big for the buffer is cut short but still gives its
+    //whole length.
+    const size_t reportLen = Heap::FormatStats(NULL, 0);
+    char* report = (char*) malloc(reportLen + 1);
+    hbverify(reportLen == Heap::FormatStats(report, reportLen + 1));
+    hbassert(reportLen == strlen(report));
+    hbassert(strstr(report, "tag:skiplist bytes:"));
+    hbassert(strstr(report, "sample:sortedset size:200 "));
+    free(report);
+
+    char shortReport[16];
+    hbverify(reportLen == Heap::FormatStats(shortReport, sizeof(shortReport)));
+    hbassert(sizeof(shortReport) - 1 == strlen(shortReport));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -444,10 +2723,49 @@ BlobTest::Test()
     size_t len = hbs->GetData(&data);
     hbassert(len == 3);
     hbassert(0 == memcmp("Foo", data, strlen("Foo")));
-    hbs->Unref();
+
+    //A widely shared value can have more references than fit in a byte.
+    for(int i = 0; i < 1000; ++i)
+    {
+        hbs->Ref();
+    }
+
+    hbassert(1001 == hbs->NumRefs());
+
+    for(int i = 0; i < 1000; ++i)
+    {
+        hbs->Unref();
+    }
+
+    hbassert(1 == hbs->NumRefs());
 
     byte* str;
 
+    //A hashed Blob caches the same hash any other Blob with its data
+    //computes, and patching it in place updates the hash.
+    Blob* hashed = Blob::CreateHashed((const byte*)"Foo", strlen("Foo"));
+    len = hashed->GetData(&data);
+    hbassert(3 == len && 0 == memcmp("Foo", data, len));
+    hbassert(hashed->Hash() == hbs->Hash());
+    hbs->Unref();
+
+    hbs = Blob::Create((const byte*)"Fox", strlen("Fox"));
+    Blob* patch = Blob::Create((const byte*)"x", 1);
+    hbassert(hashed == Blob::Patch(hashed, patch, 2));
+    hbassert(hashed->Hash() == hbs->Hash());
+    hbs->Unref();
+    hashed->Unref();
+    patch->Unref();
+
+    byte encoded[64];
+    hashed = Blob::EncodeHashed(NULL, strlen("Fox"), encoded, sizeof(encoded));
+    hashed->GetData(&str);
+    memcpy(str, "Fox", strlen("Fox"));
+    hashed->CacheHash();
+    hbs = Blob::Create((const byte*)"Fox", strlen("Fox"));
+    hbassert(hashed->Hash() == hbs->Hash());
+    hbs->Unref();
+
     len = 0x7F + 321;
     str = new byte[len];
     for(size_t i = 0; i < len; ++i)
@@ -489,6 +2807,108 @@ BlobTest::Test()
     hbassert(0 == memcmp(str, data, len));
     hbs->Unref();
     delete [] str;
+
+    //Patches within the capacity are made in place, with any gap
+    //zeroed.
+    patch = Blob::Create((const byte*)"cd", 2);
+    hbs = Blob::Create((const byte*)"ab", 2, 8);
+    hbassert(8 == hbs->Capacity());
+    hbassert(hbs == Blob::Patch(hbs, patch, 2));
+    hbassert(hbs == Blob::Patch(hbs, patch, 6));
+    len = hbs->GetData(&data);
+    hbassert(8 == len && 0 == memcmp("abcd\0\0cd", data, len));
+
+    //A Blob with another reference is copied.
+    hbs->Ref();
+    Blob* patched = Blob::Patch(hbs, patch, 0);
+    hbassert(patched && patched != hbs);
+    hbs->GetData(&data);
+    hbassert(0 == memcmp("abcd", data, 4));
+    patched->GetData(&data);
+    hbassert(0 == memcmp("cdcd", data, 4));
+    hbassert(8 == patched->Length() && 8 == patched->Capacity());
+    patched->Unref();
+    hbs->Unref();
+    hbs->Unref();
+
+    //Appending one byte at a time only copies when the capacity runs
+    //out, which it does less often as the Blob grows.
+    hbs = NULL;
+    int numCopies = 0;
+    for(size_t i = 0; i < 100000; ++i)
+    {
+        patched = Blob::Patch(hbs, patch, i);
+        hbassert(patched);
+        hbassert(patched->Length() == i + 2);
+        if(patched != hbs)
+        {
+            ++numCopies;
+            if(hbs)
+            {
+                hbs->Unref();
+            }
+            hbs = patched;
+        }
+    }
+
+    hbassert(numCopies < 20);
+    len = hbs->GetData(&data);
+    for(size_t i = 0; i < len - 1; ++i)
+    {
+        hbassert('c' == data[i]);
+    }
+    hbassert('d' == data[len - 1]);
+    hbs->Unref();
+
+    //Extending a large Blob splits it into segments.
+    const size_t bigLen = Blob::SEGMENTED_MIN_LEN + Blob::SEGMENT_SIZE/2;
+    byte* expected = (byte*) Heap::Alloc(2 * bigLen);
+    byte* actual = (byte*) Heap::Alloc(2 * bigLen);
+    for(size_t i = 0; i < bigLen; ++i)
+    {
+        expected[i] = (byte) (i * 7);
+    }
+
+    Blob* big = Blob::Create(expected, bigLen - 100);
+    hbs = Blob::Create(&expected[bigLen - 100], 100);
+    patched = Blob::Patch(big, hbs, bigLen - 100);
+    hbs->Unref();
+    hbassert(patched && patched != big && patched->IsSegmented());
+    big->Unref();
+    big = patched;
+    hbassert(bigLen == big->Length() && 17 == big->NumSegments());
+    hbassert(bigLen == big->CopyData(actual, 2 * bigLen));
+    hbassert(0 == memcmp(expected, actual, bigLen));
+
+    //Only a shared segment the patch touches is copied.
+    Blob* segment = big->GetSegment(3);
+    Blob* nextSegment = big->GetSegment(4);
+    segment->Ref();
+    const size_t offset = 3 * Blob::SEGMENT_SIZE + 10;
+    hbassert(big == Blob::Patch(big, patch, offset));
+    memcpy(&expected[offset], "cd", 2);
+    hbassert(big->GetSegment(3) != segment && big->GetSegment(4) == nextSegment);
+    segment->GetData(&data);
+    hbassert(0 == memcmp(&expected[offset - 10], data, 10) && 0 != memcmp("cd", &data[10], 2));
+    segment->Unref();
+
+    //A shared segmented Blob gets a new index that shares its segments.
+    big->Ref();
+    patched = Blob::Patch(big, patch, bigLen + 1000);
+    hbassert(patched && patched != big && patched->GetSegment(0) == big->GetSegment(0));
+    hbassert(bigLen == big->Length() && bigLen + 1002 == patched->Length());
+    big->Unref();
+    big->Unref();
+    big = patched;
+    memset(&expected[bigLen], 0, 1000);
+    memcpy(&expected[bigLen + 1000], "cd", 2);
+    hbassert(bigLen + 1002 == big->CopyData(actual, 2 * bigLen));
+    hbassert(0 == memcmp(expected, actual, bigLen + 1002));
+    big->Unref();
+
+    Heap::Free(expected);
+    Heap::Free(actual);
+    patch->Unref();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -12,6 +12,16 @@
 #include <inttypes.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HB_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if _MSC_VER
+#include <intrin.h>
+#include <xmmintrin.h>
+#endif
+
 namespace honeybase
 {
 
@@ -46,7 +56,13 @@ typedef u8          byte;
 #define HB_DEBUGONLY(a)
 #endif
 
-#define hbverify(cond) ((cond) || (__debugbreak(),false))
+#if _MSC_VER
+#define hbdebugbreak() __debugbreak()
+#else
+#define hbdebugbreak() __builtin_trap()
+#endif
+
+#define hbverify(cond) ((cond) || (hbdebugbreak(),false))
 
 #if HB_ASSERT
 #define hbassert(cond) (void)(hbverify(cond))
@@ -56,6 +72,37 @@ typedef u8          byte;
 
 #define hbarraylen(a) (sizeof(a)/sizeof((a)[0]))
 
+//Hint that addr will be read soon.  Never faults.
+#if _MSC_VER
+#define hbprefetch(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define hbprefetch(addr) __builtin_prefetch(addr)
+#endif
+
+//Index of the lowest set bit.  bits must not be 0.
+inline unsigned LowestBit(const u32 bits)
+{
+#if _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+//Index of the highest set bit.  bits must not be 0.
+inline unsigned HighestBit(const u32 bits)
+{
+#if _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, bits);
+    return index;
+#else
+    return 31 - __builtin_clz(bits);
+#endif
+}
+
 #define hb_static_assert(cond) typedef char static_assertion_##__LINE__[(cond)?1:-1]
 
 unsigned Rand();
@@ -63,6 +110,13 @@ unsigned Rand(const unsigned min, const unsigned max);
 
 size_t Base64Encode(const byte* bytes, const size_t numBytes, char* buf, const size_t bufSize);
 
+//Atomic updates for counters shared by the network threads.  Both
+//return the new value.
+size_t AtomicIncrement(volatile size_t* value);
+size_t AtomicDecrement(volatile size_t* value);
+s32 AtomicIncrement(volatile s32* value);
+s32 AtomicDecrement(volatile s32* value);
+
 enum ValueType
 {
     VALUETYPE_INT,
@@ -100,12 +154,50 @@ class Blob
 {
 public:
 
+    //Patch() splits a value it would otherwise copy into segments of
+    //SEGMENT_SIZE bytes once it's at least SEGMENTED_MIN_LEN long.
+    //Each segment is a Blob of its own, so patching a segmented value
+    //copies only the segments the patch touches, and only if they're
+    //shared.  GetData() can't be used on a segmented Blob; read it a
+    //segment at a time with GetSegment(), or with CopyData().
+    static const size_t SEGMENT_SIZE        = 64*1024;
+    static const size_t SEGMENTED_MIN_LEN   = 1024*1024;
+
     static Blob* Create(const size_t stringLen);
     static Blob* Create(const byte* string, const size_t stringLen);
+
+    //Creates a Blob with room for its data to grow to capacity bytes
+    //without moving.
+    static Blob* Create(const byte* string, const size_t stringLen, const size_t capacity);
+
     static size_t Size(const size_t len);
 
-    /*static Blob* Encode(const byte* src, const size_t srcLen,
-                        byte* dst, const size_t dstSize);*/
+    //Like Create(), Encode() and Size(), but with room ahead of the
+    //length to cache the hash of the data, for Blobs used as keys.  If
+    //string is NULL the hash is computed by CacheHash() once the data
+    //has been written.
+    static Blob* CreateHashed(const byte* string, const size_t stringLen);
+    static Blob* EncodeHashed(const byte* src, const size_t srcLen,
+                                byte* dst, const size_t dstSize);
+    static size_t HashedSize(const size_t len);
+
+    //Writes patch into blob at offset and returns the result.  Bytes
+    //between the old end and an offset past it are zero.  blob may be
+    //NULL, meaning empty.  blob is changed in place if nothing else
+    //references it and it has the capacity; otherwise it's left alone
+    //and a new Blob is returned, with room to grow if the patch
+    //extended it, so a run of appends copies the data a logarithmic
+    //number of times.  A segmented blob is changed in place unless
+    //it's shared or has no room for more segments.  Returns NULL if the
+    //new Blob couldn't be allocated.
+    static Blob* Patch(Blob* blob, const Blob* patch, const size_t offset);
+
+    //Builds a Blob in dstSize bytes of caller supplied memory, which
+    //must be at least Size(srcLen).  src may be NULL.  The Blob isn't
+    //counted by GlobalBlobCount(), and its owner must never release
+    //its last reference.
+    static Blob* Encode(const byte* src, const size_t srcLen,
+                        byte* dst, const size_t dstSize);
 
     size_t GetData(const byte** data) const;
     size_t GetData(byte** data);
@@ -114,6 +206,36 @@ public:
 
     size_t Length() const;
 
+    //Length the data can grow to in place.
+    size_t Capacity() const;
+
+    bool IsSegmented() const;
+
+    //1 if the Blob isn't segmented.
+    size_t NumSegments() const;
+
+    //Returns the Blob holding the index'th segment, which isn't
+    //segmented itself.  A Blob that isn't segmented is its own only
+    //segment.
+    Blob* GetSegment(const size_t index);
+
+    //For defragmenting.  If nothing else references blob and
+    //Heap::ShouldMove() says to, moves it to a fuller span and returns
+    //its new address, which the one reference must be changed to.
+    //Otherwise returns blob.  blob must have been made by Create() or
+    //Patch(), not Encode().
+    static Blob* Move(Blob* blob);
+
+    //Hash64() of the data.  Hash tables hash Blob keys with this, so a
+    //key made by CreateHashed() is only hashed once however many tables
+    //it's looked up in.  The Blob mustn't be segmented.
+    u64 Hash() const;
+
+    //Computes the cached hash of a Blob made by CreateHashed() or
+    //EncodeHashed().  Call after writing its data, before anything else
+    //can see it.
+    void CacheHash();
+
     //Blob* Dup() const;
 
     void Ref() const;
@@ -139,14 +261,67 @@ protected:
 
 private:
 
+    //Follows the header of a segmented Blob, aligned for its members.
+    class SegmentIndex
+    {
+    public:
+        size_t m_Len;
+        size_t m_NumSegments;
+        size_t m_MaxSegments;
+        Blob* m_Segments[1];
+    };
+
     //static Blob* Dup(const Blob* string);
     static void Destroy(Blob* blob);
 
-    mutable s8 m_RefCount;
+    //Creates an empty segmented Blob with room for maxSegments segments.
+    static Blob* CreateSegmented(const size_t maxSegments);
+
+    //Patch() for a result that's segmented.  blob may be NULL,
+    //segmented or not.
+    static Blob* PatchSegmented(Blob* blob,
+                                const byte* patchData, const size_t patchLen,
+                                const size_t offset);
+
+    SegmentIndex* GetIndex() const;
+
+    //Writes len bytes of src at offset in a segmented Blob, or zeros if
+    //src is NULL.  offset must be at most the current length, so every
+    //segment but the last is full.  Shared segments are copied first.
+    //Returns false if a segment couldn't be allocated, in which case
+    //the write may be partly done.
+    bool WriteSegments(size_t offset, const byte* src, size_t len);
+
+    //Data past the current length isn't changed.  len must be at most
+    //Capacity(), and the Blob must have been created with a capacity.
+    void SetLength(const size_t len);
+
+    //Returns where the capacity or length is encoded.
+    const byte* GetHeader() const;
+
+    //Changed atomically, so a Blob can be shared by containers and
+    //replies on different threads.
+    mutable volatile s32 m_RefCount;
+
+    //Set if the Blob was created with a capacity, which is stored ahead
+    //of the length.  The length is then always encoded in as many bytes
+    //as the capacity, so changing it doesn't move the data.
+    u8 m_HasCapacity;
+
+    //Set if bytes holds a SegmentIndex instead of the data.
+    u8 m_IsSegmented;
+
+    //Set if bytes starts with the hash of the data, unaligned.  Such a
+    //Blob has no capacity and is never segmented.
+    u8 m_HasHash;
+
     byte bytes[1];
 
     Blob()
     : m_RefCount(1)
+    , m_HasCapacity(0)
+    , m_IsSegmented(0)
+    , m_HasHash(0)
     {}
     ~Blob(){}
     Blob(const Blob&);
@@ -230,18 +405,200 @@ private:
     char m_Channel[64];
 };
 
+//Which part of the server an allocation belongs to, so the heap can say
+//what its memory is made of.
+enum HeapTag
+{
+    HEAPTAG_OTHER,
+    HEAPTAG_BLOB,
+    HEAPTAG_DICT,
+    HEAPTAG_BTREE,
+    HEAPTAG_SKIPLIST,
+    HEAPTAG_SORTEDSET,
+    HEAPTAG_COMMAND,
+    HEAPTAG_NETWORK,
+    HEAPTAG_COUNT
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  HeapTagStats
+///////////////////////////////////////////////////////////////////////////////
+class HeapTagStats
+{
+public:
+
+    //Bytes in live allocations, counting what each really takes: its
+    //size class, its huge pages, or what malloc gave it.
+    size_t m_Bytes;
+
+    //Live allocations.
+    size_t m_NumAllocs;
+
+    //Allocations made since the process started.
+    u64 m_TotalAllocs;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  HeapSample
+//
+//  A sampled allocation.  The frames are return addresses, innermost
+//  first, to be resolved with addr2line or a debugger.
+///////////////////////////////////////////////////////////////////////////////
+class HeapSample
+{
+public:
+
+    static const size_t MAX_FRAMES  = 16;
+
+    size_t m_Size;
+    HeapTag m_Tag;
+    size_t m_NumFrames;
+    void* m_Frames[MAX_FRAMES];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  HeapClassStats
+///////////////////////////////////////////////////////////////////////////////
+class HeapClassStats
+{
+public:
+
+    size_t m_ObjectSize;
+
+    //Spans holding objects of the class.
+    size_t m_NumSpans;
+
+    //Objects that fit in those spans.
+    size_t m_NumObjects;
+
+    //Objects allocated, including free ones cached by a thread.
+    size_t m_NumUsed;
+
+    //Objects moved by Heap::Move(), and spans those moves emptied.
+    u64 m_NumMoved;
+    u64 m_NumSpansEmptied;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //  Heap
+//
+//  Allocations up to MAX_SLAB_SIZE bytes are rounded up to one of
+//  NUM_SIZE_CLASSES sizes and carved from 64KB spans that each hold
+//  objects of a single size, with no header per object.  Each thread
+//  caches a few free objects of each size and only takes a lock to
+//  move a batch of them to or from the shared lists.
+//
+//  Spans come from one range of address space reserved up front, which
+//  is how Free() tells them from larger blocks.  If the range runs out,
+//  small allocations come from malloc.
+//
+//  Blocks of HUGE_PAGE_SIZE or more, like the hash tables' slot arrays,
+//  come in whole huge pages from a second range, so walking them at
+//  random doesn't miss the TLB on every access.  Blocks in between come
+//  from malloc.  Both ranges ask the OS for transparent huge pages
+//  where it has them.
+//
+//  Every allocation is counted against a HeapTag, and in a histogram of
+//  requested sizes.  The counters are kept per thread, so counting
+//  doesn't share cache lines or take locks; reading them adds up every
+//  thread's.  Free() must be given the tag the memory was allocated
+//  with.
 ///////////////////////////////////////////////////////////////////////////////
 class Heap
 {
 public:
 
-	static void* ZAlloc(size_t size);
+    static const size_t MAX_SLAB_SIZE       = 8192;
+    static const size_t NUM_SIZE_CLASSES    = 32;
+    static const size_t HUGE_PAGE_SIZE      = 2*1024*1024;
+
+    //Bucket i of the size histogram counts requests of up to 2^i bytes.
+    static const size_t NUM_SIZE_BUCKETS    = 32;
+
+    //Most recent samples kept.
+    static const size_t MAX_SAMPLES         = 256;
+
+    static void* ZAlloc(size_t size, const HeapTag tag = HEAPTAG_OTHER);
+
+    static void* Alloc(size_t size, const HeapTag tag = HEAPTAG_OTHER);
+
+    static void Free(void* mem, const HeapTag tag = HEAPTAG_OTHER);
+
+    //Sets the size of the range huge blocks come from, which otherwise
+    //defaults to 256GB of address space on 64 bit.  Must be called
+    //before the first huge block is allocated, and returns false if it
+    //wasn't or the range couldn't be reserved.
+    //
+    //With explicitHugePages the whole range is allocated up front from
+    //the OS's pool of huge pages, which is easier to get before memory
+    //fragments: hugetlb pages on Linux, or large pages on Windows,
+    //which need the process to hold SeLockMemoryPrivilege.  If there
+    //aren't enough, it falls back to ordinary pages.
+    static bool Reserve(const size_t size, const bool explicitHugePages);
+
+    //True if huge blocks come from explicit huge pages.
+    static bool HasExplicitHugePages();
+
+    //Gives the free objects cached by the calling thread back to the
+    //shared lists.  It's done when a thread exits; calling it earlier
+    //makes the class stats show only objects that are really in use.
+    static void FlushThreadCache();
+
+    static void GetClassStats(const size_t sizeClass, HeapClassStats* stats);
+
+    //Fraction of the memory in spans, including empty spans kept for
+    //reuse, that isn't holding allocated objects.
+    static double GetFragmentation();
+
+    //Bytes in spans that aren't holding allocated objects, not counting
+    //empty spans.
+    static size_t GetFragmentedBytes();
+
+    //Defragmenting is done by whatever holds the pointers, since only
+    //it can change them.  It asks ShouldMove() about each allocation
+    //and passes the ones it should to Move().
+    //
+    //True if mem is a span object in a span that's emptier than the
+    //average for its size, so moving it helps empty the span.
+    static bool ShouldMove(const void* mem);
 
-	static void* Alloc(size_t size);
+    //Copies the object at mem, which must be the start of a span object,
+    //into a fuller span of the same size and frees it.  Returns the new
+    //address, or NULL if there wasn't a fuller span with room, in which
+    //case mem is left alone.  Objects cached by threads keep their span
+    //from emptying; FlushThreadCache() first.
+    static void* Move(void* mem);
 
-	static void Free(void* mem);
+    static void GetTagStats(const HeapTag tag, HeapTagStats* stats);
+
+    static const char* GetTagName(const HeapTag tag);
+
+    //Sets counts[i] to the number of allocations made since the process
+    //started that asked for more than 2^(i-1) and at most 2^i bytes.
+    static void GetSizeHistogram(u64 counts[NUM_SIZE_BUCKETS]);
+
+    //Records the call stack of 1 in every rate allocations made by each
+    //thread.  0, the default, stops sampling.
+    static void SetSampleRate(const size_t rate);
+
+    static size_t GetSampleRate();
+
+    //Copies up to maxSamples of the most recent samples, newest first,
+    //and returns how many it copied.
+    static size_t GetSamples(HeapSample* samples, const size_t maxSamples);
+
+    //Writes a text report of all of the above to buf, one item per
+    //line, truncated to fit bufSize including the terminating 0.
+    //Returns the length of the whole report, so a caller can tell it
+    //was truncated when that's bufSize or more.
+    static size_t FormatStats(char* buf, const size_t bufSize);
+};
+
+class HeapTest
+{
+public:
+
+    static void Test();
 };
 
 class BlobTest
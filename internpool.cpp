@@ -0,0 +1,279 @@
+#include "internpool.h"
+
+#include "hash.h"
+
+#include <new>
+#include <string.h>
+
+namespace honeybase
+{
+
+static const u64 HASH_SALT      = 0x1b873593cc9e2d51ull;
+
+//Grow when 3/4 full.
+static inline size_t
+MaxLoad(const size_t capacity)
+{
+    return capacity - capacity/4;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  InternPool
+///////////////////////////////////////////////////////////////////////////////
+InternPool*
+InternPool::Create()
+{
+    InternPool* pool = (InternPool*) Heap::ZAlloc(sizeof(InternPool), HEAPTAG_DICT);
+    if(pool)
+    {
+        new (pool) InternPool();
+
+        //A salt per pool as well as the per process seed, as in
+        //IntHashTable.
+        const u64 salt = HASH_SALT;
+        pool->m_Salt = Hash64(&salt, sizeof(salt), (u64)(size_t)pool);
+
+        if(!pool->Resize())
+        {
+            Destroy(pool);
+            pool = NULL;
+        }
+    }
+
+    return pool;
+}
+
+void
+InternPool::Destroy(InternPool* pool)
+{
+    if(pool)
+    {
+        for(size_t i = 0; i < pool->m_Capacity; ++i)
+        {
+            if(pool->m_Entries[i].m_Blob)
+            {
+                pool->m_Entries[i].m_Blob->Unref();
+            }
+        }
+
+        if(pool->m_Entries)
+        {
+            Heap::Free(pool->m_Entries, HEAPTAG_DICT);
+        }
+
+        pool->~InternPool();
+        Heap::Free(pool, HEAPTAG_DICT);
+    }
+}
+
+Blob*
+InternPool::Intern(Blob* blob)
+{
+    if(blob->IsSegmented())
+    {
+        return blob;
+    }
+
+    const byte* data;
+    const size_t len = blob->GetData(&data);
+    if(len > MAX_LEN)
+    {
+        return blob;
+    }
+
+    const u64 hash = Hash64(data, len, m_Salt);
+
+    size_t freeSlot;
+    const size_t index = Find(hash, data, len, &freeSlot);
+    if(NOT_FOUND != index)
+    {
+        ++m_Stats.m_NumHits;
+        return m_Entries[index].m_Blob;
+    }
+
+    if(m_Stats.m_NumBlobs + 1 > MaxLoad(m_Capacity))
+    {
+        //Failing to resize just leaves blob unshared.
+        if(!Resize())
+        {
+            return blob;
+        }
+
+        Find(hash, data, len, &freeSlot);
+    }
+
+    blob->Ref();
+    m_Entries[freeSlot].m_Hash = hash;
+    m_Entries[freeSlot].m_Blob = blob;
+
+    ++m_Stats.m_NumBlobs;
+    m_Stats.m_NumBytes += len;
+    ++m_Stats.m_NumMisses;
+
+    return blob;
+}
+
+void
+InternPool::Release(Blob* blob)
+{
+    if(blob->IsSegmented())
+    {
+        return;
+    }
+
+    const byte* data;
+    const size_t len = blob->GetData(&data);
+    if(len > MAX_LEN)
+    {
+        return;
+    }
+
+    const u64 hash = Hash64(data, len, m_Salt);
+    const size_t mask = m_Capacity - 1;
+    for(size_t i = hash & mask; m_Entries[i].m_Blob; i = (i + 1) & mask)
+    {
+        if(blob == m_Entries[i].m_Blob)
+        {
+            Remove(i);
+            --m_Stats.m_NumBlobs;
+            m_Stats.m_NumBytes -= len;
+            blob->Unref();
+            return;
+        }
+    }
+}
+
+void
+InternPool::GetStats(Stats* stats) const
+{
+    *stats = m_Stats;
+}
+
+//private:
+
+size_t
+InternPool::Find(const u64 hash, const byte* data, const size_t len, size_t* freeSlot) const
+{
+    const size_t mask = m_Capacity - 1;
+    for(size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const Entry* entry = &m_Entries[i];
+        if(!entry->m_Blob)
+        {
+            *freeSlot = i;
+            return NOT_FOUND;
+        }
+
+        if(hash == entry->m_Hash)
+        {
+            const byte* entryData;
+            if(len == entry->m_Blob->GetData(&entryData)
+                && 0 == memcmp(data, entryData, len))
+            {
+                return i;
+            }
+        }
+    }
+}
+
+bool
+InternPool::Resize()
+{
+    //A Blob's last other reference may be released on another thread
+    //at any time, so some counted here may be dropped below.  None can
+    //gain a reference, since only the pool hands them out.
+    size_t numLive = 0;
+    for(size_t i = 0; i < m_Capacity; ++i)
+    {
+        if(m_Entries[i].m_Blob && m_Entries[i].m_Blob->NumRefs() > 1)
+        {
+            ++numLive;
+        }
+    }
+
+    size_t newCapacity = INITIAL_CAPACITY;
+    while(newCapacity < 2 * (numLive + 1))
+    {
+        newCapacity *= 2;
+    }
+
+    Entry* newEntries = (Entry*) Heap::ZAlloc(newCapacity * sizeof(Entry), HEAPTAG_DICT);
+    if(!newEntries)
+    {
+        return false;
+    }
+
+    Entry* oldEntries = m_Entries;
+    const size_t oldCapacity = m_Capacity;
+
+    m_Entries = newEntries;
+    m_Capacity = newCapacity;
+
+    const size_t mask = newCapacity - 1;
+    for(size_t i = 0; i < oldCapacity; ++i)
+    {
+        Blob* blob = oldEntries[i].m_Blob;
+        if(!blob)
+        {
+            continue;
+        }
+
+        if(blob->NumRefs() > 1)
+        {
+            size_t j = oldEntries[i].m_Hash & mask;
+            while(m_Entries[j].m_Blob)
+            {
+                j = (j + 1) & mask;
+            }
+
+            m_Entries[j] = oldEntries[i];
+        }
+        else
+        {
+            --m_Stats.m_NumBlobs;
+            m_Stats.m_NumBytes -= blob->Length();
+            blob->Unref();
+        }
+    }
+
+    if(oldEntries)
+    {
+        Heap::Free(oldEntries, HEAPTAG_DICT);
+    }
+
+    return true;
+}
+
+//Moves back each following entry whose home slot is at or before the
+//hole, so every entry stays reachable from its home slot without
+//passing an empty one.
+void
+InternPool::Remove(size_t hole)
+{
+    const size_t mask = m_Capacity - 1;
+    for(size_t i = (hole + 1) & mask; m_Entries[i].m_Blob; i = (i + 1) & mask)
+    {
+        const size_t home = m_Entries[i].m_Hash & mask;
+        if(((i - home) & mask) >= ((i - hole) & mask))
+        {
+            m_Entries[hole] = m_Entries[i];
+            hole = i;
+        }
+    }
+
+    m_Entries[hole].m_Blob = NULL;
+}
+
+InternPool::InternPool()
+: m_Entries(NULL)
+, m_Capacity(0)
+, m_Salt(0)
+{
+    memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+InternPool::~InternPool()
+{
+}
+
+}   //namespace honeybase
@@ -0,0 +1,96 @@
+#ifndef __HB_INTERNPOOL_H__
+#define __HB_INTERNPOOL_H__
+
+#include "hb.h"
+
+namespace honeybase
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//  InternPool
+//
+//  Set of Blobs holding at most one Blob per distinct value, so
+//  containers given equal values can share a single Blob instead of
+//  each keeping a copy.  The pool holds a reference to each of its
+//  Blobs.  Blob::Patch() copies a Blob that has more than one
+//  reference, so a pooled Blob isn't changed while anything else can
+//  see it.
+//
+//  Blobs that only the pool references are dropped when they're
+//  released, or when the pool would otherwise have to grow.
+//
+//  Not thread safe.  Its Blobs can still be referenced from any thread.
+///////////////////////////////////////////////////////////////////////////////
+class InternPool
+{
+public:
+
+    //Longer values aren't interned.  They cost more to hash and
+    //compare, and are less likely to repeat.
+    static const size_t MAX_LEN = 4096;
+
+    class Stats
+    {
+    public:
+        //Blobs in the pool and the length of their data.
+        size_t m_NumBlobs;
+        size_t m_NumBytes;
+
+        //Calls to Intern() that found an equal Blob, and that added one.
+        u64 m_NumHits;
+        u64 m_NumMisses;
+    };
+
+    static InternPool* Create();
+    static void Destroy(InternPool* pool);
+
+    //Returns the pooled Blob equal to blob, first adding blob if there
+    //isn't one.  A segmented Blob, or one longer than MAX_LEN, is
+    //returned as is.  Whoever keeps the result must reference it.
+    Blob* Intern(Blob* blob);
+
+    //Drops blob from the pool if it's there.  Call when the only other
+    //reference is about to be released.
+    void Release(Blob* blob);
+
+    void GetStats(Stats* stats) const;
+
+private:
+
+    class Entry
+    {
+    public:
+        u64 m_Hash;
+        Blob* m_Blob;
+    };
+
+    //Must be a power of 2.
+    static const size_t INITIAL_CAPACITY = 64;
+
+    static const size_t NOT_FOUND       = ~size_t(0);
+
+    //Returns the slot holding a Blob equal to data, or NOT_FOUND.  Sets
+    //*freeSlot to the empty slot where such a Blob would go.
+    size_t Find(const u64 hash, const byte* data, const size_t len, size_t* freeSlot) const;
+
+    //Drops the Blobs only the pool references, then sizes the table
+    //so it's at most half full.
+    bool Resize();
+
+    void Remove(size_t hole);
+
+    Entry* m_Entries;
+    size_t m_Capacity;
+    u64 m_Salt;
+
+    Stats m_Stats;
+
+    InternPool();
+    ~InternPool();
+    InternPool(const InternPool&);
+    InternPool& operator=(const InternPool&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_INTERNPOOL_H__
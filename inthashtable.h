@@ -0,0 +1,325 @@
+#ifndef __HB_INTHASHTABLE_H__
+#define __HB_INTHASHTABLE_H__
+
+#include "hb.h"
+#include "hash.h"
+
+#include <new>
+
+namespace honeybase
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//  IntHashTable
+//
+//  Hash table from 64 bit integer keys to values of type V, for when the
+//  key type is known up front.  Entries are a key and a value stored
+//  flat in one array with linear probing, so there's no allocation per
+//  entry and no type tags; a key is hashed with a multiply instead of
+//  Hash64().  Deleting shifts the following entries back rather than
+//  leaving tombstones.
+//
+//  V is copied bitwise and never released, so a V holding a Blob must
+//  be referenced by something else for as long as it's in the table.
+///////////////////////////////////////////////////////////////////////////////
+template<typename V>
+class IntHashTable
+{
+public:
+
+    static IntHashTable* Create()
+    {
+        IntHashTable* table = (IntHashTable*) Heap::ZAlloc(sizeof(IntHashTable), HEAPTAG_DICT);
+        if(table)
+        {
+            new (table) IntHashTable();
+
+            //A salt per table as well as the per process seed, so one
+            //table's layout says nothing about another's.
+            const u64 salt = HASH_SALT;
+            table->m_Salt = Hash64(&salt, sizeof(salt), (u64)(size_t)table);
+        }
+
+        return table;
+    }
+
+    static void Destroy(IntHashTable* table)
+    {
+        if(table)
+        {
+            table->~IntHashTable();
+            Heap::Free(table, HEAPTAG_DICT);
+        }
+    }
+
+    bool Set(const s64 key, const V& value)
+    {
+        if(EMPTY_KEY == key)
+        {
+            m_EmptyKeyValue = value;
+            m_HasEmptyKey = true;
+            return true;
+        }
+
+        size_t index;
+        if(!Probe(key, &index))
+        {
+            if((m_NumEntries + 1) > MaxLoad(m_Capacity))
+            {
+                if(!Resize(m_Capacity ? m_Capacity * 2 : INITIAL_CAPACITY))
+                {
+                    return false;
+                }
+
+                Probe(key, &index);
+            }
+
+            m_Entries[index].m_Key = key;
+            ++m_NumEntries;
+        }
+
+        m_Entries[index].m_Value = value;
+        return true;
+    }
+
+    bool Clear(const s64 key)
+    {
+        if(EMPTY_KEY == key)
+        {
+            const bool hadKey = m_HasEmptyKey;
+            m_HasEmptyKey = false;
+            return hadKey;
+        }
+
+        size_t hole;
+        if(!Probe(key, &hole))
+        {
+            return false;
+        }
+
+        //Move back each following entry whose home slot is at or before
+        //the hole, so every entry stays reachable from its home slot
+        //without passing an empty one.
+        const size_t mask = m_Capacity - 1;
+        for(size_t i = (hole + 1) & mask; EMPTY_KEY != m_Entries[i].m_Key; i = (i + 1) & mask)
+        {
+            const size_t home = Index(m_Entries[i].m_Key);
+            if(((i - home) & mask) >= ((i - hole) & mask))
+            {
+                m_Entries[hole] = m_Entries[i];
+                hole = i;
+            }
+        }
+
+        m_Entries[hole].m_Key = EMPTY_KEY;
+        --m_NumEntries;
+
+        //Shrink below 1 entry per 8 slots, to half full.  Growing is at
+        //3/4 full, so a table doesn't flip between the two.
+        if(m_Capacity > m_MinCapacity && m_NumEntries < m_Capacity/8)
+        {
+            size_t newCapacity = m_MinCapacity;
+            while(newCapacity < m_NumEntries*2)
+            {
+                newCapacity *= 2;
+            }
+
+            //Failing to shrink just leaves the table bigger.
+            Resize(newCapacity);
+        }
+
+        return true;
+    }
+
+    bool Find(const s64 key, V* value) const
+    {
+        if(EMPTY_KEY == key)
+        {
+            if(m_HasEmptyKey)
+            {
+                *value = m_EmptyKeyValue;
+            }
+
+            return m_HasEmptyKey;
+        }
+
+        size_t index;
+        if(Probe(key, &index))
+        {
+            *value = m_Entries[index].m_Value;
+            return true;
+        }
+
+        return false;
+    }
+
+    //Sizes the table to hold numItems items without growing.  It won't
+    //shrink below that size until Reserve() is called with a smaller
+    //count.  Returns false if the entries couldn't be allocated.
+    bool Reserve(const size_t numItems)
+    {
+        size_t capacity = INITIAL_CAPACITY;
+        while(MaxLoad(capacity) < numItems)
+        {
+            capacity *= 2;
+        }
+
+        m_MinCapacity = capacity;
+
+        return capacity <= m_Capacity || Resize(capacity);
+    }
+
+    size_t Count() const
+    {
+        return m_NumEntries + (m_HasEmptyKey ? 1 : 0);
+    }
+
+    //Bytes allocated for the entries.
+    size_t GetEntryBytes() const
+    {
+        return m_Capacity * sizeof(Entry);
+    }
+
+private:
+
+    class Entry
+    {
+    public:
+        s64 m_Key;
+        V m_Value;
+    };
+
+    //Marks an empty slot.  An item with this key is kept outside the
+    //array.
+    static const s64 EMPTY_KEY          = (s64)0x8000000000000000ull;
+
+    //Must be a power of 2.
+    static const size_t INITIAL_CAPACITY = 16;
+
+    //2^64 divided by the golden ratio.
+    static const u64 MULTIPLIER         = 0x9e3779b97f4a7c15ull;
+
+    static const u64 HASH_SALT          = 0xa0761d6478bd642full;
+
+    //Grow when 3/4 full.
+    static size_t MaxLoad(const size_t capacity)
+    {
+        return capacity - capacity/4;
+    }
+
+    //Multiplying spreads the low bits of the key into the high bits of
+    //the product, which pick the slot.
+    size_t Index(const s64 key) const
+    {
+        return (size_t)((((u64)key ^ m_Salt) * MULTIPLIER) >> m_Shift);
+    }
+
+    //Sets *index to key's slot and returns true if it's in the table,
+    //otherwise sets it to the empty slot where key would go, or to 0 if
+    //there are no slots yet.
+    bool Probe(const s64 key, size_t* index) const
+    {
+        if(!m_Entries)
+        {
+            *index = 0;
+            return false;
+        }
+
+        const size_t mask = m_Capacity - 1;
+        for(size_t i = Index(key);; i = (i + 1) & mask)
+        {
+            if(key == m_Entries[i].m_Key)
+            {
+                *index = i;
+                return true;
+            }
+
+            if(EMPTY_KEY == m_Entries[i].m_Key)
+            {
+                *index = i;
+                return false;
+            }
+        }
+    }
+
+    bool Resize(const size_t newCapacity)
+    {
+        hbassert(newCapacity > 0 && 0 == (newCapacity & (newCapacity-1)));
+        hbassert(m_NumEntries <= MaxLoad(newCapacity));
+
+        Entry* newEntries = (Entry*) Heap::Alloc(newCapacity * sizeof(Entry), HEAPTAG_DICT);
+        if(!newEntries)
+        {
+            return false;
+        }
+
+        for(size_t i = 0; i < newCapacity; ++i)
+        {
+            newEntries[i].m_Key = EMPTY_KEY;
+        }
+
+        Entry* oldEntries = m_Entries;
+        const size_t oldCapacity = m_Capacity;
+
+        m_Entries = newEntries;
+        m_Capacity = newCapacity;
+        m_Shift = 64;
+        for(size_t i = newCapacity; i > 1; i /= 2)
+        {
+            --m_Shift;
+        }
+
+        for(size_t i = 0; i < oldCapacity; ++i)
+        {
+            if(EMPTY_KEY != oldEntries[i].m_Key)
+            {
+                size_t index;
+                Probe(oldEntries[i].m_Key, &index);
+                m_Entries[index] = oldEntries[i];
+            }
+        }
+
+        if(oldEntries)
+        {
+            Heap::Free(oldEntries, HEAPTAG_DICT);
+        }
+
+        return true;
+    }
+
+    Entry* m_Entries;
+    size_t m_Capacity;
+    size_t m_MinCapacity;
+    size_t m_NumEntries;
+    unsigned m_Shift;
+    u64 m_Salt;
+
+    bool m_HasEmptyKey;
+    V m_EmptyKeyValue;
+
+    IntHashTable()
+    : m_Entries(NULL)
+    , m_Capacity(0)
+    , m_MinCapacity(INITIAL_CAPACITY)
+    , m_NumEntries(0)
+    , m_Shift(64)
+    , m_Salt(0)
+    , m_HasEmptyKey(false)
+    {
+    }
+
+    ~IntHashTable()
+    {
+        if(m_Entries)
+        {
+            Heap::Free(m_Entries, HEAPTAG_DICT);
+        }
+    }
+
+    IntHashTable(const IntHashTable&);
+    IntHashTable& operator=(const IntHashTable&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_INTHASHTABLE_H__
@@ -17,6 +17,10 @@ void TestMemMappedFile();
 
 int main(int /*argc*/, char** /*argv*/)
 {
+    //Heap::Reserve(size_t(4) << 30, true);
+
+    //HashTable::SetInternValues(true);
+
     //Network::Startup(4321);
 
     //TestMemMappedFile();
@@ -40,6 +44,45 @@ int main(int /*argc*/, char** /*argv*/)
     s_Log.Debug("total: %f", sw.GetElapsed());
     hbassert(0 == Blob::GlobalBlobCount());*/
 
+    /*s_Log.Debug("SPEED DICT LOAD");
+    sw.Restart();
+    {
+        HashTableSpeedTest test(keyType, valueType);
+        test.LoadKeys(NUMKEYS);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+    hbassert(0 == Blob::GlobalBlobCount());*/
+
+    /*s_Log.Debug("SPEED DICT SWISS");
+    sw.Restart();
+    {
+        HashTableSpeedTest test(keyType, valueType, HASHTABLE_SWISS);
+        test.AddKeys(NUMKEYS, keyOrder);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+    hbassert(0 == Blob::GlobalBlobCount());*/
+
+    /*s_Log.Debug("SPEED INT DICT");
+    sw.Restart();
+    {
+        IntHashTableSpeedTest test;
+        test.AddKeys(NUMKEYS, keyOrder);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+    hbassert(0 == Blob::GlobalBlobCount());*/
+
+    /*s_Log.Debug("SPEED HEAP");
+    sw.Restart();
+    {
+        HeapSpeedTest test;
+        test.Churn(NUMKEYS, 5);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());*/
+
     /*s_Log.Debug("SPEED BTREEE");
     sw.Restart();
     {
@@ -71,6 +114,61 @@ int main(int /*argc*/, char** /*argv*/)
     s_Log.Debug("total: %f", sw.GetElapsed());
     hbassert(0 == Blob::GlobalBlobCount());*/
 
+    /*s_Log.Debug("SPEED HASH");
+    sw.Restart();
+    {
+        HashSpeedTest test;
+        test.Hash(NUMKEYS, 8, 32, 10);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());*/
+
+    /*s_Log.Debug("SPEED COMMAND PARSE");
+    sw.Restart();
+    {
+        CommandSpeedTest test;
+        test.Parse(NUMKEYS, 256);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+    hbassert(0 == Blob::GlobalBlobCount());*/
+
+    /*s_Log.Debug("SPEED NETWORK EPOLL");
+    sw.Restart();
+    {
+        NetworkSpeedTest test(NETWORK_ENGINE_EPOLL, 4321, 1);
+        test.SetGet(NUMKEYS, 16, 32, 32);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+
+    s_Log.Debug("SPEED NETWORK IOURING");
+    sw.Restart();
+    {
+        NetworkSpeedTest test(NETWORK_ENGINE_IOURING, 4321, 1);
+        test.SetGet(NUMKEYS, 16, 32, 32);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+
+    s_Log.Debug("SPEED NETWORK IOURING SHARDED");
+    sw.Restart();
+    {
+        NetworkSpeedTest test(NETWORK_ENGINE_IOURING, 4321, 0);
+        test.SetGet(NUMKEYS, 16, 32, 32);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+
+    s_Log.Debug("SPEED NETWORK LARGE VALUES");
+    sw.Restart();
+    {
+        NetworkSpeedTest test(NETWORK_ENGINE_EPOLL, 4321, 1);
+        test.SetGet(NUMKEYS / 100, 16, 4, 64 * 1024);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());*/
+
     /*s_Log.Debug("DICT");
     sw.Restart();
     {
@@ -81,6 +179,16 @@ int main(int /*argc*/, char** /*argv*/)
     s_Log.Debug("total: %f", sw.GetElapsed());
     hbassert(0 == Blob::GlobalBlobCount());*/
 
+    /*s_Log.Debug("INT DICT");
+    sw.Restart();
+    {
+        IntHashTableTest test;
+        test.Test(NUMKEYS);
+    }
+    sw.Stop();
+    s_Log.Debug("total: %f", sw.GetElapsed());
+    hbassert(0 == Blob::GlobalBlobCount());*/
+
     /*s_Log.Debug("BTREEE");
     sw.Restart();
     {
@@ -121,23 +229,81 @@ int main(int /*argc*/, char** /*argv*/)
 
 void TestCommands()
 {
-    const char cmdStr1[] = {"*3\r\n$3\r\nset\r\n$3\r\nfoo\r\n$3\r\nbar\r\n*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n"};
+    const char cmdStr1[] = {"*3\r\n$3\r\nset\r\n$3\r\nfoo\r\n$3\r\nbar\r\n*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n"
+                            "*2\r\n$3\r\nGeT\r\n$3\r\nfoo\r\n*2\r\n$3\r\nset\r\n$3\r\nfoo\r\n"
+                            "*2\r\n$4\r\ngets\r\n$3\r\nfoo\r\n"
+                            "*5\r\n$4\r\nmset\r\n$3\r\nfoo\r\n$1\r\n1\r\n$3\r\nbar\r\n$1\r\n2\r\n"
+                            "*4\r\n$4\r\nmget\r\n$3\r\nfoo\r\n$3\r\nbaz\r\n$3\r\nbar\r\n"
+                            "*4\r\n$4\r\nmset\r\n$3\r\nfoo\r\n$1\r\n1\r\n$3\r\nbar\r\n"
+                            "*3\r\n$6\r\nappend\r\n$3\r\nfoo\r\n$2\r\nxy\r\n"
+                            "*4\r\n$8\r\nsetrange\r\n$3\r\nfoo\r\n$1\r\n5\r\n$1\r\nz\r\n"
+                            "*4\r\n$8\r\nsetrange\r\n$3\r\nfoo\r\n$2\r\n-1\r\n$1\r\nz\r\n"
+                            "*3\r\n$6\r\nappend\r\n$3\r\nnew\r\n$2\r\nab\r\n"
+                            "*1\r\n$8\r\nMEMSTATS\r\n"
+                            "*3\r\n$8\r\nmemstats\r\n$10\r\nSampleRate\r\n$1\r\n0\r\n"
+                            "*2\r\n$8\r\nmemstats\r\n$3\r\nfoo\r\n"};
+
+    //Command names match case insensitively, and arity is checked.
+    const CommandExecResult expected[] =
+    {
+        EXECRESULT_OK, EXECRESULT_BULK, EXECRESULT_BULK, EXECRESULT_ERROR, EXECRESULT_ERROR,
+        EXECRESULT_OK, EXECRESULT_MULTIBULK, EXECRESULT_ERROR,
+        EXECRESULT_INTEGER, EXECRESULT_INTEGER, EXECRESULT_ERROR, EXECRESULT_INTEGER,
+        EXECRESULT_BULK, EXECRESULT_OK, EXECRESULT_ERROR
+    };
+
+    //Lengths returned by append and setrange.
+    const s64 expectedLengths[] = {3, 6, 2};
+    int numLengths = 0;
 
     HashTable* ht = HashTable::Create();
 
     Command cmd;
     Error err;
+    int numCmds = 0;
 
     for(int i = 0; i < (int)strlen(cmdStr1);)
     {
         i += cmd.Parse((u8*)&cmdStr1[i], 1, &err);
         if(cmd.IsComplete())
         {
-            cmd.Exec(ht, &err);
+            const CommandExecResult result = cmd.Exec(ht, &err);
+            hbverify(expected[numCmds++] == result);
+
+            //mget foo baz bar
+            if(EXECRESULT_MULTIBULK == result)
+            {
+                hbverify(3 == cmd.m_ResultC);
+                hbverify(cmd.m_ResultV[0].m_Blob && !cmd.m_ResultV[1].m_Blob && cmd.m_ResultV[2].m_Blob);
+            }
+            else if(EXECRESULT_INTEGER == result)
+            {
+                hbverify(expectedLengths[numLengths++] == cmd.m_ResultV[0].m_Int);
+            }
+            //memstats
+            else if(EXECRESULT_BULK == result && cmd.m_ResultBlob)
+            {
+                const byte* report;
+                hbverify(cmd.m_ResultV[0].m_Blob == cmd.m_ResultBlob);
+                hbverify(cmd.m_ResultBlob->GetData(&report) > 4 && 0 == memcmp("tag:", report, 4));
+            }
+
             cmd.Reset();
         }
     }
 
+    hbverify(hbarraylen(expected) == numCmds);
+    hbverify(hbarraylen(expectedLengths) == numLengths);
+
+    //"1" with "xy" appended, then "z" written past the end.
+    Value key, value;
+    ValueType valueType;
+    key.m_Blob = Blob::Create((const byte*)"foo", 3);
+    hbverify(ht->Find(key, VALUETYPE_BLOB, &value, &valueType));
+    const byte* data;
+    hbverify(6 == value.m_Blob->GetData(&data) && 0 == memcmp("1xy\0\0z", data, 6));
+    key.m_Blob->Unref();
+
     ht->Unref();
 }
 
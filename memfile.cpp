@@ -1,5 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 
+#if _MSC_VER
+
 #include <windows.h>
 
 void TestMemMappedFile()
@@ -69,4 +71,6 @@ void TestMemMappedFile()
     }
 
     CloseHandle(hFile);
-}
\ No newline at end of file
+}
+
+#endif  //_MSC_VER
\ No newline at end of file
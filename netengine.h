@@ -0,0 +1,228 @@
+#ifndef __HB_NETENGINE_H__
+#define __HB_NETENGINE_H__
+
+#include "hb.h"
+
+#if defined(__linux__)
+
+#include "connection.h"
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace honeybase
+{
+
+class EpollClient;
+class RecvBufInfo;
+class Shard;
+class UringClient;
+
+//Event loops behind Network::Startup() on Linux.  Each shard runs its
+//own engine on its own thread:
+//
+//  Init()      opens the listener, reusePort lets every shard bind
+//              the same port.
+//  Run()       serves clients until Stop() is called.
+//  Cleanup()   closes the clients.  It must wait until every shard
+//              has stopped, since a client's command may still be in
+//              flight on another shard.
+//  Stop()      may be called from any thread.
+
+//Opens a listening socket for the engines.  Returns -1 on failure.
+int OpenListener(const unsigned listenPort, const bool nonBlocking, const bool reusePort);
+
+//Fills iovs with the connection's unsent replies for a single vectored
+//send.  Returns the number of entries used.
+int GatherWriteData(const Connection* conn, iovec* iovs, const int maxIovs);
+
+///////////////////////////////////////////////////////////////////////////////
+//  EpollEngine
+///////////////////////////////////////////////////////////////////////////////
+class EpollEngine
+{
+public:
+
+    static EpollEngine* Create(Shard* shard);
+    static void Destroy(EpollEngine* engine);
+
+    bool Init(const unsigned listenPort, const bool reusePort);
+
+    void Run();
+
+    void Cleanup();
+
+    void Stop();
+
+private:
+
+    void AcceptClients();
+
+    bool Flush(EpollClient* client);
+
+    bool Service(EpollClient* client);
+
+    void Close(EpollClient* client);
+
+    void DestroyClosed();
+
+    void LinkClient(EpollClient* client);
+
+    void UnlinkClient(EpollClient* client);
+
+    Shard* m_Shard;
+
+    ReadBufferPool m_ReadBufPool;
+
+    int m_Epoll;
+    int m_Listener;
+    volatile bool m_Running;
+
+    //All open clients are linked so Cleanup() can close them.
+    EpollClient* m_Clients;
+
+    //Clients closed during the current batch of events.
+    EpollClient* m_Closed;
+
+    EpollEngine();
+    ~EpollEngine();
+    EpollEngine(const EpollEngine&);
+    EpollEngine& operator=(const EpollEngine&);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  IoRing
+//
+//  Minimal io_uring wrapper over the raw system calls.
+///////////////////////////////////////////////////////////////////////////////
+class IoRing
+{
+public:
+
+    IoRing();
+
+    bool Init(const unsigned entries);
+
+    void Cleanup();
+
+    //Returns a zeroed SQE, submitting queued SQEs first if the
+    //submission queue is full.
+    io_uring_sqe* GetSqe();
+
+    //Submits queued SQEs and waits for at least waitNr completions.
+    int SubmitAndWait(const unsigned waitNr);
+
+    io_uring_cqe* PeekCqe();
+
+    void AdvanceCq();
+
+    bool RegisterBufRing(io_uring_buf_ring* bufRing,
+                        const unsigned numEntries,
+                        const u16 groupId);
+
+    int m_Fd;
+
+private:
+
+    unsigned* m_SqHead;
+    unsigned* m_SqTail;
+    unsigned m_SqMask;
+    unsigned m_SqEntries;
+    io_uring_sqe* m_Sqes;
+    unsigned m_SqeTail;
+
+    unsigned* m_CqHead;
+    unsigned* m_CqTail;
+    unsigned m_CqMask;
+    io_uring_cqe* m_Cqes;
+
+    void* m_SqRing;
+    size_t m_SqRingSize;
+    void* m_CqRing;
+    size_t m_CqRingSize;
+    size_t m_SqesSize;
+
+    IoRing(const IoRing&);
+    IoRing& operator=(const IoRing&);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  UringEngine
+///////////////////////////////////////////////////////////////////////////////
+class UringEngine
+{
+public:
+
+    static bool IsSupported();
+
+    static UringEngine* Create(Shard* shard);
+    static void Destroy(UringEngine* engine);
+
+    bool Init(const unsigned listenPort, const bool reusePort);
+
+    void Run();
+
+    void Cleanup();
+
+    void Stop();
+
+private:
+
+    void ProvideRecvBuf(const u16 bufId);
+
+    void ArmAccept();
+
+    void ArmWake();
+
+    bool ArmRecv(UringClient* client);
+
+    void PauseRecv(UringClient* client);
+
+    void CloseIfIdle(UringClient* client);
+
+    void BeginClose(UringClient* client);
+
+    void Drain(UringClient* client);
+
+    void Flush(UringClient* client);
+
+    void OnAccept(const io_uring_cqe* cqe);
+
+    void OnRecv(UringClient* client, const io_uring_cqe* cqe);
+
+    void OnSend(UringClient* client, const io_uring_cqe* cqe);
+
+    void OnWake();
+
+    void LinkClient(UringClient* client);
+
+    void UnlinkClient(UringClient* client);
+
+    Shard* m_Shard;
+
+    ReadBufferPool m_ReadBufPool;
+
+    IoRing m_Ring;
+    int m_Listener;
+    volatile bool m_Running;
+
+    io_uring_buf_ring* m_BufRing;
+    byte* m_RecvBufs;
+    RecvBufInfo* m_RecvBufInfo;
+    u16 m_BufRingTail;
+
+    //All open clients are linked so Cleanup() can close them.
+    UringClient* m_Clients;
+
+    UringEngine();
+    ~UringEngine();
+    UringEngine(const UringEngine&);
+    UringEngine& operator=(const UringEngine&);
+};
+
+}   //namespace honeybase
+
+#endif  //__linux__
+
+#endif  //__HB_NETENGINE_H__
@@ -0,0 +1,520 @@
+#include "netengine.h"
+
+#if defined(__linux__)
+
+#include "connection.h"
+#include "netshard.h"
+
+#include <errno.h>
+#include <new>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace honeybase
+{
+
+static Log s_Log("network");
+
+static const int MAX_EVENTS     = 256;
+static const int MAX_SEND_IOVS  = 64;
+
+//Replies queued this deep are sent before reading any further.
+static const size_t MAX_QUEUED_REPLY_BYTES  = 64 * 1024;
+
+///////////////////////////////////////////////////////////////////////////////
+//  EpollClient
+///////////////////////////////////////////////////////////////////////////////
+class EpollClient
+{
+public:
+
+    static EpollClient* Create(const int skt, ReadBufferPool* readBufPool);
+    static void Destroy(EpollClient* client);
+
+    int m_Skt;
+    Connection m_Conn;
+    ShardMsg m_Msg;
+
+    //Set once the client is closed.  It's freed after the current batch
+    //of events, or once a command in flight on another shard comes back.
+    bool m_Closing  : 1;
+
+    EpollClient* m_Prev;
+    EpollClient* m_Next;
+
+private:
+
+    EpollClient();
+    ~EpollClient();
+    EpollClient(const EpollClient&);
+    EpollClient& operator=(const EpollClient&);
+};
+
+EpollClient*
+EpollClient::Create(const int skt, ReadBufferPool* readBufPool)
+{
+    EpollClient* client = (EpollClient*) Heap::Alloc(sizeof(EpollClient), HEAPTAG_NETWORK);
+    if(client)
+    {
+        new(client) EpollClient();
+        client->m_Skt = skt;
+        client->m_Conn.SetReadBufferPool(readBufPool);
+        client->m_Msg.m_Conn = &client->m_Conn;
+        client->m_Msg.m_Client = client;
+    }
+
+    return client;
+}
+
+void
+EpollClient::Destroy(EpollClient* client)
+{
+    if(client)
+    {
+        if(client->m_Skt >= 0)
+        {
+            //Closing the socket also removes it from the epoll set.
+            close(client->m_Skt);
+            client->m_Skt = -1;
+        }
+
+        client->~EpollClient();
+        Heap::Free(client, HEAPTAG_NETWORK);
+    }
+}
+
+EpollClient::EpollClient()
+: m_Skt(-1)
+, m_Closing(false)
+, m_Prev(NULL)
+, m_Next(NULL)
+{
+}
+
+EpollClient::~EpollClient()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  EpollEngine
+///////////////////////////////////////////////////////////////////////////////
+EpollEngine*
+EpollEngine::Create(Shard* shard)
+{
+    EpollEngine* engine = (EpollEngine*) Heap::Alloc(sizeof(EpollEngine), HEAPTAG_NETWORK);
+    if(engine)
+    {
+        new(engine) EpollEngine();
+        engine->m_Shard = shard;
+    }
+
+    return engine;
+}
+
+void
+EpollEngine::Destroy(EpollEngine* engine)
+{
+    if(engine)
+    {
+        engine->Cleanup();
+        engine->~EpollEngine();
+        Heap::Free(engine, HEAPTAG_NETWORK);
+    }
+}
+
+bool
+EpollEngine::Init(const unsigned listenPort, const bool reusePort)
+{
+    m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(m_Epoll < 0)
+    {
+        s_Log.Error("epoll_create1 failed: %d", errno);
+        return false;
+    }
+
+    m_Listener = OpenListener(listenPort, true, reusePort);
+    if(m_Listener < 0)
+    {
+        return false;
+    }
+
+    //A NULL data pointer marks the listener, the shard marks its wakeup
+    //event.  Everything else is an EpollClient.
+    epoll_event ev;
+    ev.events = EPOLLIN|EPOLLET;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Listener, &ev) < 0)
+    {
+        return false;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = m_Shard;
+    if(epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Shard->GetWakeFd(), &ev) < 0)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+void
+EpollEngine::Run()
+{
+    epoll_event events[MAX_EVENTS];
+    bool moving = false;
+
+    while(m_Running)
+    {
+        m_Shard->Flush();
+
+        const int numEvents = epoll_wait(m_Epoll, events, MAX_EVENTS, moving ? 0 : -1);
+        if(numEvents < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+
+            s_Log.Error("epoll_wait failed: %d", errno);
+            break;
+        }
+
+        for(int i = 0; i < numEvents; ++i)
+        {
+            void* ptr = events[i].data.ptr;
+            if(NULL == ptr)
+            {
+                AcceptClients();
+            }
+            else if(m_Shard == ptr)
+            {
+                m_Shard->Poll();
+
+                ShardMsg* msg;
+                while(NULL != (msg = m_Shard->PopCompleted()))
+                {
+                    EpollClient* client = (EpollClient*) msg->m_Client;
+                    if(client->m_Closing || !Service(client))
+                    {
+                        Close(client);
+                    }
+                }
+            }
+            else
+            {
+                EpollClient* client = (EpollClient*) ptr;
+                if(client->m_Closing)
+                {
+                    continue;
+                }
+
+                if((events[i].events & EPOLLERR)
+                    || !Service(client))
+                {
+                    Close(client);
+                }
+            }
+        }
+
+        DestroyClosed();
+
+        moving = m_Shard->MoveItems(0 == numEvents);
+    }
+
+    m_Running = false;
+}
+
+void
+EpollEngine::Cleanup()
+{
+    while(m_Clients)
+    {
+        EpollClient* client = m_Clients;
+        UnlinkClient(client);
+        EpollClient::Destroy(client);
+    }
+
+    if(m_Listener >= 0)
+    {
+        close(m_Listener);
+        m_Listener = -1;
+    }
+
+    if(m_Epoll >= 0)
+    {
+        close(m_Epoll);
+        m_Epoll = -1;
+    }
+}
+
+void
+EpollEngine::Stop()
+{
+    m_Running = false;
+    m_Shard->Wake();
+}
+
+//private:
+
+EpollEngine::EpollEngine()
+: m_Shard(NULL)
+, m_Epoll(-1)
+, m_Listener(-1)
+, m_Running(true)
+, m_Clients(NULL)
+, m_Closed(NULL)
+{
+}
+
+EpollEngine::~EpollEngine()
+{
+}
+
+void
+EpollEngine::AcceptClients()
+{
+    while(true)
+    {
+        const int skt = accept4(m_Listener, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if(skt < 0)
+        {
+            if(EINTR == errno || ECONNABORTED == errno)
+            {
+                continue;
+            }
+
+            if(EAGAIN != errno && EWOULDBLOCK != errno)
+            {
+                s_Log.Error("accept failed: %d", errno);
+            }
+
+            return;
+        }
+
+        const int noDelay = 1;
+        setsockopt(skt, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        EpollClient* client = EpollClient::Create(skt, &m_ReadBufPool);
+        if(!client)
+        {
+            close(skt);
+            continue;
+        }
+
+        LinkClient(client);
+
+        //Edge triggered, so reads and writes always run until EAGAIN.
+        epoll_event ev;
+        ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+        ev.data.ptr = client;
+        if(epoll_ctl(m_Epoll, EPOLL_CTL_ADD, skt, &ev) < 0)
+        {
+            s_Log.Error("epoll_ctl failed: %d", errno);
+            Close(client);
+        }
+    }
+}
+
+//Sends pending replies until they're gone or the socket is full,
+//gathering as many as fit in one sendmsg() per call.
+//Returns false if the connection should be closed.
+bool
+EpollEngine::Flush(EpollClient* client)
+{
+    Connection* conn = &client->m_Conn;
+    while(conn->HasPendingWrite())
+    {
+        iovec iovs[MAX_SEND_IOVS];
+        msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iovs;
+        hdr.msg_iovlen = GatherWriteData(conn, iovs, MAX_SEND_IOVS);
+
+        const ssize_t numSent = sendmsg(client->m_Skt, &hdr, MSG_NOSIGNAL);
+        if(numSent > 0)
+        {
+            conn->CommitWrite(numSent);
+        }
+        else if(numSent < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        else if(numSent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            //Wait for EPOLLOUT.
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//Runs on every readiness edge, and when a command comes back from
+//another shard.  Reads the socket until it's drained, running every
+//complete command as it arrives, then sends all of the replies at
+//once.  Reading stops early if the client isn't taking its replies,
+//and resumes on EPOLLOUT.
+//Returns false if the connection should be closed.
+bool
+EpollEngine::Service(EpollClient* client)
+{
+    Connection* conn = &client->m_Conn;
+
+    if(!Flush(client))
+    {
+        return false;
+    }
+
+    //Reading resumes when the shard that owns the key is done with it.
+    if(client->m_Msg.m_InFlight)
+    {
+        return true;
+    }
+
+    while(true)
+    {
+        while(conn->ParseNext())
+        {
+            if(!m_Shard->Exec(&client->m_Msg))
+            {
+                return Flush(client);
+            }
+        }
+
+        if(conn->HasFailed())
+        {
+            Flush(client);
+            return false;
+        }
+
+        if(conn->GetPendingWriteLen() >= MAX_QUEUED_REPLY_BYTES)
+        {
+            if(!Flush(client))
+            {
+                return false;
+            }
+
+            if(conn->HasPendingWrite())
+            {
+                return true;
+            }
+        }
+
+        size_t space;
+        byte* buf = conn->GetReadSpace(&space);
+        if(!buf)
+        {
+            Flush(client);
+            return false;
+        }
+        hbassert(space > 0);
+
+        const ssize_t numRead = recv(client->m_Skt, buf, space, 0);
+        if(numRead > 0)
+        {
+            conn->CommitRead(numRead);
+        }
+        else if(0 == numRead)
+        {
+            //Replies to what was read still go out if they can.
+            Flush(client);
+            return false;
+        }
+        else if(EINTR == errno)
+        {
+            continue;
+        }
+        else if(EAGAIN == errno || EWOULDBLOCK == errno)
+        {
+            conn->OnIdle();
+            break;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return Flush(client);
+}
+
+void
+EpollEngine::Close(EpollClient* client)
+{
+    //Stop listening to the socket now.
+    client->m_Closing = true;
+    if(client->m_Skt >= 0)
+    {
+        close(client->m_Skt);
+        client->m_Skt = -1;
+    }
+
+    if(client->m_Msg.m_InFlight)
+    {
+        //Another shard still has the connection.  Close it again when
+        //the command comes back.
+        return;
+    }
+
+    //Later events in the current batch may still point at the client,
+    //so it's freed once the batch is done.
+    UnlinkClient(client);
+    client->m_Next = m_Closed;
+    m_Closed = client;
+}
+
+void
+EpollEngine::DestroyClosed()
+{
+    while(m_Closed)
+    {
+        EpollClient* client = m_Closed;
+        m_Closed = client->m_Next;
+        EpollClient::Destroy(client);
+    }
+}
+
+void
+EpollEngine::LinkClient(EpollClient* client)
+{
+    client->m_Prev = NULL;
+    client->m_Next = m_Clients;
+    if(m_Clients)
+    {
+        m_Clients->m_Prev = client;
+    }
+    m_Clients = client;
+}
+
+void
+EpollEngine::UnlinkClient(EpollClient* client)
+{
+    if(client->m_Prev)
+    {
+        client->m_Prev->m_Next = client->m_Next;
+    }
+    else
+    {
+        m_Clients = client->m_Next;
+    }
+
+    if(client->m_Next)
+    {
+        client->m_Next->m_Prev = client->m_Prev;
+    }
+
+    client->m_Prev = client->m_Next = NULL;
+}
+
+}   //namespace honeybase
+
+#endif  //__linux__
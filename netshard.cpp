@@ -0,0 +1,472 @@
+#include "netshard.h"
+
+#if defined(__linux__)
+
+#include "connection.h"
+#include "dict.h"
+#include "error.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <new>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace honeybase
+{
+
+static Log s_Log("shard");
+
+static const size_t QUEUE_CAPACITY      = 512;
+
+//Time spent rehashing or defragmenting between batches of events, and
+//when there were none.  The first is short so it doesn't add much
+//latency to commands that are waiting.
+static const unsigned MOVE_BUSY_US      = 50;
+static const unsigned MOVE_IDLE_US      = 1000;
+
+//A defrag pass starts when at least this many bytes, and this fraction
+//of the heap's span memory, aren't holding objects.
+static const size_t DEFRAG_MIN_BYTES    = 4 * 1024 * 1024;
+static const double DEFRAG_MIN_FRACTION = 0.1;
+
+//Checking the heap takes every size class's lock, so it's only done
+//once in this many calls to MoveItems().
+static const unsigned DEFRAG_CHECK_INTERVAL = 1024;
+
+//For keys with a hash tag, which are hashed on the tag alone.
+static const u64 SHARD_HASH_SALT        = 0x9747b28c;
+
+///////////////////////////////////////////////////////////////////////////////
+//  ShardGroup
+///////////////////////////////////////////////////////////////////////////////
+ShardGroup*
+ShardGroup::Create(const unsigned numShards)
+{
+    hbassert(numShards > 0);
+
+    ShardGroup* group = (ShardGroup*) Heap::ZAlloc(sizeof(ShardGroup), HEAPTAG_NETWORK);
+    if(!group)
+    {
+        return NULL;
+    }
+
+    new(group) ShardGroup();
+
+    const unsigned numQueues = numShards * numShards;
+    group->m_Shards = (Shard*) Heap::ZAlloc(numShards * sizeof(Shard), HEAPTAG_NETWORK);
+    group->m_Queues = (SpscQueue<ShardMsg>*) Heap::ZAlloc(numQueues * sizeof(SpscQueue<ShardMsg>), HEAPTAG_NETWORK);
+    group->m_Blocked = (int*) Heap::ZAlloc(numQueues * sizeof(int), HEAPTAG_NETWORK);
+    if(!group->m_Shards || !group->m_Queues || !group->m_Blocked)
+    {
+        Destroy(group);
+        return NULL;
+    }
+
+    for(unsigned i = 0; i < numShards; ++i)
+    {
+        new(&group->m_Shards[i]) Shard();
+    }
+
+    for(unsigned i = 0; i < numQueues; ++i)
+    {
+        new(&group->m_Queues[i]) SpscQueue<ShardMsg>();
+    }
+
+    group->m_NumShards = numShards;
+
+    for(unsigned i = 0; i < numShards; ++i)
+    {
+        if(!group->m_Shards[i].Init(group, i))
+        {
+            Destroy(group);
+            return NULL;
+        }
+
+        for(unsigned j = 0; j < numShards; ++j)
+        {
+            if(i != j && !group->GetQueue(i, j)->Init(QUEUE_CAPACITY))
+            {
+                Destroy(group);
+                return NULL;
+            }
+        }
+    }
+
+    return group;
+}
+
+void
+ShardGroup::Destroy(ShardGroup* group)
+{
+    if(group)
+    {
+        const unsigned numQueues = group->m_NumShards * group->m_NumShards;
+
+        if(group->m_Queues)
+        {
+            for(unsigned i = 0; i < numQueues; ++i)
+            {
+                group->m_Queues[i].~SpscQueue<ShardMsg>();
+            }
+
+            Heap::Free(group->m_Queues, HEAPTAG_NETWORK);
+        }
+
+        if(group->m_Shards)
+        {
+            for(unsigned i = 0; i < group->m_NumShards; ++i)
+            {
+                group->m_Shards[i].Cleanup();
+                group->m_Shards[i].~Shard();
+            }
+
+            Heap::Free(group->m_Shards, HEAPTAG_NETWORK);
+        }
+
+        if(group->m_Blocked)
+        {
+            Heap::Free(group->m_Blocked, HEAPTAG_NETWORK);
+        }
+
+        group->~ShardGroup();
+        Heap::Free(group, HEAPTAG_NETWORK);
+    }
+}
+
+Shard*
+ShardGroup::GetShard(const unsigned index)
+{
+    hbassert(index < m_NumShards);
+    return &m_Shards[index];
+}
+
+unsigned
+ShardGroup::GetOwner(const Blob* key) const
+{
+    if(1 == m_NumShards)
+    {
+        return 0;
+    }
+
+    const byte* data;
+    const size_t len = key->GetData(&data);
+
+    const byte* open = (const byte*) memchr(data, '{', len);
+    if(open)
+    {
+        const size_t tagOffset = open - data + 1;
+        const byte* close = (const byte*) memchr(&data[tagOffset], '}', len - tagOffset);
+        if(close && close > &data[tagOffset])
+        {
+            const byte* tag = &data[tagOffset];
+            return (unsigned)(Hash64(tag, close - tag, SHARD_HASH_SALT) % m_NumShards);
+        }
+    }
+
+    //The key's hash is cached when it's parsed, and the dict uses it
+    //too.  The dict picks a slot with the low bits, so the shard is
+    //picked with the high ones to keep them independent.
+    return (unsigned)((key->Hash() >> 32) % m_NumShards);
+}
+
+//private:
+
+ShardGroup::ShardGroup()
+: m_NumShards(0)
+, m_Shards(NULL)
+, m_Queues(NULL)
+, m_Blocked(NULL)
+{
+}
+
+ShardGroup::~ShardGroup()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Shard
+///////////////////////////////////////////////////////////////////////////////
+bool
+Shard::Exec(ShardMsg* msg)
+{
+    const Command& cmd = msg->m_Conn->GetCommand();
+    const int numKeys = cmd.GetNumKeys();
+    const unsigned owner = (numKeys > 0) ? m_Group->GetOwner(cmd.GetKey(0)) : m_Index;
+
+    for(int i = 1; i < numKeys; ++i)
+    {
+        if(m_Group->GetOwner(cmd.GetKey(i)) != owner)
+        {
+            Error err;
+            err.SetFailed(ERROR_CROSS_SHARD_KEYS,
+                        "keys in '%s' belong to different shards", cmd.m_Spec->m_Name);
+            msg->m_Conn->Reject(err);
+            return true;
+        }
+    }
+
+    if(owner == m_Index)
+    {
+        msg->m_Conn->Exec(m_Dict);
+        return true;
+    }
+
+    msg->m_Origin = m_Index;
+    msg->m_InFlight = true;
+    Send(owner, msg);
+
+    return false;
+}
+
+void
+Shard::Poll()
+{
+    u64 count;
+    while(read(m_WakeFd, &count, sizeof(count)) > 0)
+    {
+    }
+
+    for(unsigned from = 0; from < m_Group->m_NumShards; ++from)
+    {
+        if(from == m_Index)
+        {
+            continue;
+        }
+
+        SpscQueue<ShardMsg>* queue = m_Group->GetQueue(from, m_Index);
+        ShardMsg* msg;
+        while(NULL != (msg = queue->Pop()))
+        {
+            if(msg->m_Origin == m_Index)
+            {
+                msg->m_Next = NULL;
+                if(m_CompletedTail)
+                {
+                    m_CompletedTail->m_Next = msg;
+                }
+                else
+                {
+                    m_CompletedHead = msg;
+                }
+                m_CompletedTail = msg;
+            }
+            else
+            {
+                msg->m_Conn->ExecForwarded(m_Dict);
+                Send(msg->m_Origin, msg);
+            }
+        }
+
+        if(__atomic_exchange_n(m_Group->GetBlocked(from, m_Index), 0, __ATOMIC_SEQ_CST))
+        {
+            m_Group->GetShard(from)->Wake();
+        }
+    }
+}
+
+ShardMsg*
+Shard::PopCompleted()
+{
+    ShardMsg* msg = m_CompletedHead;
+    if(msg)
+    {
+        m_CompletedHead = msg->m_Next;
+        if(!m_CompletedHead)
+        {
+            m_CompletedTail = NULL;
+        }
+
+        msg->m_Next = NULL;
+        msg->m_InFlight = false;
+        msg->m_Conn->CompleteForward();
+    }
+
+    return msg;
+}
+
+void
+Shard::Flush()
+{
+    for(unsigned to = 0; to < m_Group->m_NumShards; ++to)
+    {
+        Outbox* outbox = &m_Outboxes[to];
+        SpscQueue<ShardMsg>* queue = m_Group->GetQueue(m_Index, to);
+
+        while(outbox->m_Head)
+        {
+            if(!queue->Push(outbox->m_Head))
+            {
+                //Have the consumer wake us once it makes room, then
+                //retry in case it already has.
+                __atomic_store_n(m_Group->GetBlocked(m_Index, to), 1, __ATOMIC_SEQ_CST);
+                if(!queue->Push(outbox->m_Head))
+                {
+                    break;
+                }
+            }
+
+            outbox->m_Head = outbox->m_Head->m_Next;
+            outbox->m_NeedsWake = true;
+        }
+
+        if(!outbox->m_Head)
+        {
+            outbox->m_Tail = NULL;
+        }
+
+        if(outbox->m_NeedsWake)
+        {
+            outbox->m_NeedsWake = false;
+            m_Group->GetShard(to)->Wake();
+        }
+    }
+}
+
+void
+Shard::Wake()
+{
+    const u64 one = 1;
+    if(write(m_WakeFd, &one, sizeof(one)) < 0 && EAGAIN != errno)
+    {
+        s_Log.Error("failed to wake shard %u: %d", m_Index, errno);
+    }
+}
+
+bool
+Shard::MoveItems(const bool idle)
+{
+    const unsigned microseconds = idle ? MOVE_IDLE_US : MOVE_BUSY_US;
+
+    if(m_Dict->RehashFor(microseconds))
+    {
+        return true;
+    }
+
+    if(!m_Defragging)
+    {
+        if(++m_NumSinceDefragCheck < DEFRAG_CHECK_INTERVAL)
+        {
+            return false;
+        }
+
+        m_NumSinceDefragCheck = 0;
+
+        m_DefragStartBytes = Heap::GetFragmentedBytes();
+        if(m_DefragStartBytes < m_DefragFloor + DEFRAG_MIN_BYTES
+            || Heap::GetFragmentation() < DEFRAG_MIN_FRACTION)
+        {
+            return false;
+        }
+
+        //Objects in this thread's cache would keep their spans from
+        //emptying.
+        Heap::FlushThreadCache();
+    }
+
+    m_Defragging = m_Dict->DefragFor(microseconds);
+
+    if(!m_Defragging)
+    {
+        //Another pass may get further if this one did a lot.
+        const size_t endBytes = Heap::GetFragmentedBytes();
+        m_DefragFloor = (endBytes + DEFRAG_MIN_BYTES <= m_DefragStartBytes) ? 0 : endBytes;
+    }
+
+    return m_Defragging;
+}
+
+//private:
+
+Shard::Shard()
+: m_Group(NULL)
+, m_Index(0)
+, m_Dict(NULL)
+, m_WakeFd(-1)
+, m_NumSinceDefragCheck(0)
+, m_Defragging(false)
+, m_DefragStartBytes(0)
+, m_DefragFloor(0)
+, m_Outboxes(NULL)
+, m_CompletedHead(NULL)
+, m_CompletedTail(NULL)
+{
+}
+
+Shard::~Shard()
+{
+}
+
+bool
+Shard::Init(ShardGroup* group, const unsigned index)
+{
+    m_Group = group;
+    m_Index = index;
+
+    m_Dict = HashTable::Create();
+    if(!m_Dict)
+    {
+        return false;
+    }
+
+    m_WakeFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(m_WakeFd < 0)
+    {
+        s_Log.Error("eventfd failed: %d", errno);
+        return false;
+    }
+
+    m_Outboxes = (Outbox*) Heap::ZAlloc(group->m_NumShards * sizeof(Outbox), HEAPTAG_NETWORK);
+    return NULL != m_Outboxes;
+}
+
+void
+Shard::Cleanup()
+{
+    if(m_Dict)
+    {
+        m_Dict->Unref();
+        m_Dict = NULL;
+    }
+
+    if(m_WakeFd >= 0)
+    {
+        close(m_WakeFd);
+        m_WakeFd = -1;
+    }
+
+    if(m_Outboxes)
+    {
+        Heap::Free(m_Outboxes, HEAPTAG_NETWORK);
+        m_Outboxes = NULL;
+    }
+}
+
+void
+Shard::Send(const unsigned to, ShardMsg* msg)
+{
+    Outbox* outbox = &m_Outboxes[to];
+
+    //Once something is waiting for space everything after it waits
+    //too, so messages arrive in the order they were sent.
+    if(!outbox->m_Head && m_Group->GetQueue(m_Index, to)->Push(msg))
+    {
+        outbox->m_NeedsWake = true;
+        return;
+    }
+
+    msg->m_Next = NULL;
+    if(outbox->m_Tail)
+    {
+        outbox->m_Tail->m_Next = msg;
+    }
+    else
+    {
+        outbox->m_Head = msg;
+    }
+    outbox->m_Tail = msg;
+}
+
+}   //namespace honeybase
+
+#endif  //__linux__
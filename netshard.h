@@ -0,0 +1,196 @@
+#ifndef __HB_NETSHARD_H__
+#define __HB_NETSHARD_H__
+
+#include "hb.h"
+#include "spscqueue.h"
+
+namespace honeybase
+{
+
+class Connection;
+class HashTable;
+class Shard;
+
+///////////////////////////////////////////////////////////////////////////////
+//  ShardMsg
+//
+//  A command sent to the shard that owns its key, and sent back once
+//  its reply is ready.  A connection has at most one command in flight,
+//  so the network engines embed one of these in each client.
+///////////////////////////////////////////////////////////////////////////////
+class ShardMsg
+{
+public:
+
+    ShardMsg()
+    : m_Conn(NULL)
+    , m_Client(NULL)
+    , m_Origin(0)
+    , m_Next(NULL)
+    , m_InFlight(false)
+    {
+    }
+
+    Connection* m_Conn;
+
+    //The engine's client, for resuming it when the reply is ready.
+    void* m_Client;
+
+    //Index of the shard the connection belongs to.
+    unsigned m_Origin;
+
+    //Links messages waiting for queue space or to be completed.
+    ShardMsg* m_Next;
+
+    //Only touched by the originating shard.
+    bool m_InFlight;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  ShardGroup
+//
+//  The shards that split the keyspace between them.  Each ordered pair
+//  of shards gets its own single producer, single consumer queue, which
+//  carries both forwarded commands and their completions.
+///////////////////////////////////////////////////////////////////////////////
+class ShardGroup
+{
+    friend class Shard;
+
+public:
+
+    static ShardGroup* Create(const unsigned numShards);
+    static void Destroy(ShardGroup* group);
+
+    unsigned GetNumShards() const
+    {
+        return m_NumShards;
+    }
+
+    Shard* GetShard(const unsigned index);
+
+    //Only the part of the key between the first '{' and the next '}'
+    //is hashed, if that part isn't empty, so keys that share a tag
+    //like "{user1}" always have the same owner.
+    unsigned GetOwner(const Blob* key) const;
+
+private:
+
+    SpscQueue<ShardMsg>* GetQueue(const unsigned from, const unsigned to)
+    {
+        return &m_Queues[from * m_NumShards + to];
+    }
+
+    //Set by a producer that found its queue full, so the consumer
+    //wakes it once there's room.
+    int* GetBlocked(const unsigned from, const unsigned to)
+    {
+        return &m_Blocked[from * m_NumShards + to];
+    }
+
+    unsigned m_NumShards;
+    Shard* m_Shards;
+    SpscQueue<ShardMsg>* m_Queues;
+    int* m_Blocked;
+
+    ShardGroup();
+    ~ShardGroup();
+    ShardGroup(const ShardGroup&);
+    ShardGroup& operator=(const ShardGroup&);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  Shard
+//
+//  One slice of the keyspace, owned by the thread that runs its network
+//  engine.  Only that thread touches the shard's dict.
+///////////////////////////////////////////////////////////////////////////////
+class Shard
+{
+    friend class ShardGroup;
+
+public:
+
+    unsigned GetIndex() const
+    {
+        return m_Index;
+    }
+
+    //The engine waits for this to become readable, then calls Poll().
+    int GetWakeFd() const
+    {
+        return m_WakeFd;
+    }
+
+    //Runs the connection's parsed command if this shard owns its keys.
+    //Otherwise sends it to the owner and returns false; msg comes back
+    //from PopCompleted() once the reply has been queued.  A command
+    //whose keys have different owners is rejected with an error.
+    bool Exec(ShardMsg* msg);
+
+    //Runs commands sent by other shards and collects completed ones.
+    void Poll();
+
+    ShardMsg* PopCompleted();
+
+    //Pushes messages that are waiting for queue space and wakes the
+    //shards that were sent anything.  Call before blocking.
+    void Flush();
+
+    //Thread safe.
+    void Wake();
+
+    //Moves some of the dict's items if it's being resized, or out of
+    //emptier heap spans if the heap is fragmented, for longer when the
+    //engine is idle than between batches of events.  Returns true if
+    //there's more to move, in which case the engine should poll for
+    //events rather than block.
+    bool MoveItems(const bool idle);
+
+private:
+
+    class Outbox
+    {
+    public:
+        ShardMsg* m_Head;
+        ShardMsg* m_Tail;
+        bool m_NeedsWake;
+    };
+
+    bool Init(ShardGroup* group, const unsigned index);
+
+    void Cleanup();
+
+    void Send(const unsigned to, ShardMsg* msg);
+
+    ShardGroup* m_Group;
+    unsigned m_Index;
+    HashTable* m_Dict;
+    int m_WakeFd;
+
+    //Calls to MoveItems() since the heap's fragmentation was checked.
+    unsigned m_NumSinceDefragCheck;
+    bool m_Defragging;
+
+    //Heap::GetFragmentedBytes() when the current defrag pass started.
+    size_t m_DefragStartBytes;
+
+    //Heap::GetFragmentedBytes() when the last defrag pass finished, if
+    //it didn't reclaim much.  The next pass waits for more than that,
+    //so passes that can't help don't run over and over.
+    size_t m_DefragFloor;
+
+    Outbox* m_Outboxes;
+
+    ShardMsg* m_CompletedHead;
+    ShardMsg* m_CompletedTail;
+
+    Shard();
+    ~Shard();
+    Shard(const Shard&);
+    Shard& operator=(const Shard&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_NETSHARD_H__
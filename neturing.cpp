@@ -0,0 +1,1031 @@
+#include "netengine.h"
+
+#if defined(__linux__)
+
+#include "connection.h"
+#include "netshard.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <new>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace honeybase
+{
+
+static Log s_Log("uring");
+
+static const unsigned RING_ENTRIES      = 4096;
+static const unsigned NUM_RECV_BUFS     = 1024;     //Must be a power of 2
+static const unsigned RECV_BUF_SIZE     = 8192;
+static const u16 RECV_BUF_GROUP         = 0;
+static const int MAX_SEND_IOVS          = 64;
+
+//Replies queued this deep are sent before any more input is run.
+static const size_t MAX_QUEUED_REPLY_BYTES  = 64 * 1024;
+
+//A client holding this many receive buffers stops receiving until it
+//has run them, so one slow client can't use up the shared buffers.
+static const unsigned MAX_HELD_RECV_BUFS    = 8;
+
+//The low bits of an SQE's user_data identify the operation, the rest
+//points at the UringClient it belongs to, if any.
+enum UringOp
+{
+    UOP_ACCEPT,
+    UOP_WAKE,
+    UOP_RECV,
+    UOP_SEND,
+    UOP_CANCEL,
+
+    UOP_MASK    = 0x07
+};
+
+static inline u64
+MakeUserData(const void* ptr, const UringOp op)
+{
+    hbassert(0 == ((u64)ptr & UOP_MASK));
+    return (u64)ptr | op;
+}
+
+template<typename T>
+static inline T
+LoadAcquire(const T* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+static inline void
+StoreRelease(T* p, const T value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  IoRing
+///////////////////////////////////////////////////////////////////////////////
+IoRing::IoRing()
+: m_Fd(-1)
+, m_SqHead(NULL)
+, m_SqTail(NULL)
+, m_SqMask(0)
+, m_SqEntries(0)
+, m_Sqes(NULL)
+, m_SqeTail(0)
+, m_CqHead(NULL)
+, m_CqTail(NULL)
+, m_CqMask(0)
+, m_Cqes(NULL)
+, m_SqRing(MAP_FAILED)
+, m_SqRingSize(0)
+, m_CqRing(MAP_FAILED)
+, m_CqRingSize(0)
+, m_SqesSize(0)
+{
+}
+
+bool
+IoRing::Init(const unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE
+                    | IORING_SETUP_CLAMP
+                    | IORING_SETUP_SINGLE_ISSUER
+                    | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+
+    m_Fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(m_Fd < 0 && EINVAL == errno)
+    {
+        //Older kernels don't know the task run flags.
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        m_Fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+
+    if(m_Fd < 0)
+    {
+        return false;
+    }
+
+    m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(m_CqRingSize > m_SqRingSize)
+        {
+            m_SqRingSize = m_CqRingSize;
+        }
+        m_CqRingSize = 0;
+    }
+
+    m_SqRing = mmap(NULL, m_SqRingSize, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, m_Fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == m_SqRing)
+    {
+        return false;
+    }
+
+    if(m_CqRingSize)
+    {
+        m_CqRing = mmap(NULL, m_CqRingSize, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, m_Fd, IORING_OFF_CQ_RING);
+        if(MAP_FAILED == m_CqRing)
+        {
+            return false;
+        }
+    }
+
+    m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_Sqes = (io_uring_sqe*) mmap(NULL, m_SqesSize, PROT_READ|PROT_WRITE,
+                                    MAP_SHARED|MAP_POPULATE, m_Fd, IORING_OFF_SQES);
+    if(MAP_FAILED == (void*)m_Sqes)
+    {
+        m_Sqes = NULL;
+        return false;
+    }
+
+    byte* sq = (byte*) m_SqRing;
+    byte* cq = m_CqRingSize ? (byte*) m_CqRing : sq;
+
+    m_SqHead = (unsigned*) (sq + params.sq_off.head);
+    m_SqTail = (unsigned*) (sq + params.sq_off.tail);
+    m_SqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    m_SqEntries = params.sq_entries;
+    m_SqeTail = *m_SqTail;
+
+    //SQEs are always used in order, so the index array is the identity.
+    unsigned* sqArray = (unsigned*) (sq + params.sq_off.array);
+    for(unsigned i = 0; i < m_SqEntries; ++i)
+    {
+        sqArray[i] = i;
+    }
+
+    m_CqHead = (unsigned*) (cq + params.cq_off.head);
+    m_CqTail = (unsigned*) (cq + params.cq_off.tail);
+    m_CqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    m_Cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void
+IoRing::Cleanup()
+{
+    if(m_Sqes)
+    {
+        munmap(m_Sqes, m_SqesSize);
+        m_Sqes = NULL;
+    }
+
+    if(MAP_FAILED != m_CqRing)
+    {
+        munmap(m_CqRing, m_CqRingSize);
+        m_CqRing = MAP_FAILED;
+    }
+
+    if(MAP_FAILED != m_SqRing)
+    {
+        munmap(m_SqRing, m_SqRingSize);
+        m_SqRing = MAP_FAILED;
+    }
+
+    if(m_Fd >= 0)
+    {
+        close(m_Fd);
+        m_Fd = -1;
+    }
+}
+
+io_uring_sqe*
+IoRing::GetSqe()
+{
+    if(m_SqeTail - LoadAcquire(m_SqHead) >= m_SqEntries)
+    {
+        SubmitAndWait(0);
+        if(m_SqeTail - LoadAcquire(m_SqHead) >= m_SqEntries)
+        {
+            return NULL;
+        }
+    }
+
+    io_uring_sqe* sqe = &m_Sqes[m_SqeTail & m_SqMask];
+    ++m_SqeTail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int
+IoRing::SubmitAndWait(const unsigned waitNr)
+{
+    const unsigned toSubmit = m_SqeTail - *m_SqTail;
+    StoreRelease(m_SqTail, m_SqeTail);
+
+    const unsigned flags = waitNr ? IORING_ENTER_GETEVENTS : 0;
+    const int ret = syscall(__NR_io_uring_enter, m_Fd, toSubmit, waitNr, flags, NULL, 0);
+    return (ret < 0) ? -errno : ret;
+}
+
+io_uring_cqe*
+IoRing::PeekCqe()
+{
+    const unsigned head = *m_CqHead;
+    if(head != LoadAcquire(m_CqTail))
+    {
+        return &m_Cqes[head & m_CqMask];
+    }
+
+    return NULL;
+}
+
+void
+IoRing::AdvanceCq()
+{
+    StoreRelease(m_CqHead, *m_CqHead + 1);
+}
+
+bool
+IoRing::RegisterBufRing(io_uring_buf_ring* bufRing,
+                        const unsigned numEntries,
+                        const u16 groupId)
+{
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64) bufRing;
+    reg.ring_entries = numEntries;
+    reg.bgid = groupId;
+
+    return 0 == syscall(__NR_io_uring_register, m_Fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  RecvBufInfo
+///////////////////////////////////////////////////////////////////////////////
+class RecvBufInfo
+{
+public:
+    //Bytes the kernel received into the buffer.
+    u32 m_Len;
+
+    //Next buffer held by the same client, or -1.
+    int m_Next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//  UringClient
+///////////////////////////////////////////////////////////////////////////////
+class UringClient
+{
+public:
+
+    static UringClient* Create(const int skt, ReadBufferPool* readBufPool);
+    static void Destroy(UringClient* client);
+
+    int m_Skt;
+    Connection m_Conn;
+    ShardMsg m_Msg;
+
+    //The vectored send in flight, if any.  Only one is in flight at a
+    //time so replies stay in order.
+    iovec m_SendIovs[MAX_SEND_IOVS];
+    msghdr m_SendHdr;
+
+    //Receive buffers not yet fed to the connection, oldest first.
+    //They pile up while a command is in flight on another shard, or
+    //while the client isn't taking its replies.
+    int m_HeldHead;
+    int m_HeldTail;
+    u32 m_HeldOffset;
+    unsigned m_NumHeld;
+
+    bool m_RecvArmed    : 1;
+    //Set when the recv was cancelled because too many buffers are held.
+    bool m_RecvPaused   : 1;
+    bool m_Sending      : 1;
+    bool m_Closing      : 1;
+
+    UringClient* m_Prev;
+    UringClient* m_Next;
+
+private:
+
+    UringClient();
+    ~UringClient();
+    UringClient(const UringClient&);
+    UringClient& operator=(const UringClient&);
+};
+
+UringClient*
+UringClient::Create(const int skt, ReadBufferPool* readBufPool)
+{
+    UringClient* client = (UringClient*) Heap::Alloc(sizeof(UringClient), HEAPTAG_NETWORK);
+    if(client)
+    {
+        new(client) UringClient();
+        client->m_Skt = skt;
+        client->m_Conn.SetReadBufferPool(readBufPool);
+        client->m_Msg.m_Conn = &client->m_Conn;
+        client->m_Msg.m_Client = client;
+    }
+
+    return client;
+}
+
+void
+UringClient::Destroy(UringClient* client)
+{
+    if(client)
+    {
+        if(client->m_Skt >= 0)
+        {
+            close(client->m_Skt);
+            client->m_Skt = -1;
+        }
+
+        client->~UringClient();
+        Heap::Free(client, HEAPTAG_NETWORK);
+    }
+}
+
+UringClient::UringClient()
+: m_Skt(-1)
+, m_HeldHead(-1)
+, m_HeldTail(-1)
+, m_HeldOffset(0)
+, m_NumHeld(0)
+, m_RecvArmed(false)
+, m_RecvPaused(false)
+, m_Sending(false)
+, m_Closing(false)
+, m_Prev(NULL)
+, m_Next(NULL)
+{
+}
+
+UringClient::~UringClient()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  UringEngine
+///////////////////////////////////////////////////////////////////////////////
+bool
+UringEngine::IsSupported()
+{
+    //Provided buffer rings arrived shortly before multishot recv, so
+    //a ring that accepts one can run this engine.
+    IoRing ring;
+    bool supported = false;
+    if(ring.Init(8))
+    {
+        void* bufRing = mmap(NULL, 8 * sizeof(io_uring_buf), PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(MAP_FAILED != bufRing)
+        {
+            supported = ring.RegisterBufRing((io_uring_buf_ring*) bufRing, 8, 0);
+            ring.Cleanup();
+            munmap(bufRing, 8 * sizeof(io_uring_buf));
+        }
+    }
+
+    ring.Cleanup();
+
+    return supported;
+}
+
+UringEngine*
+UringEngine::Create(Shard* shard)
+{
+    UringEngine* engine = (UringEngine*) Heap::Alloc(sizeof(UringEngine), HEAPTAG_NETWORK);
+    if(engine)
+    {
+        new(engine) UringEngine();
+        engine->m_Shard = shard;
+    }
+
+    return engine;
+}
+
+void
+UringEngine::Destroy(UringEngine* engine)
+{
+    if(engine)
+    {
+        engine->Cleanup();
+        engine->~UringEngine();
+        Heap::Free(engine, HEAPTAG_NETWORK);
+    }
+}
+
+bool
+UringEngine::Init(const unsigned listenPort, const bool reusePort)
+{
+    if(!m_Ring.Init(RING_ENTRIES))
+    {
+        s_Log.Error("io_uring_setup failed: %d", errno);
+        return false;
+    }
+
+    //The provided buffer ring is shared by every connection's
+    //multishot recv, so memory doesn't grow with the client count.
+    const size_t bufRingSize = NUM_RECV_BUFS * sizeof(io_uring_buf);
+    void* bufRing = mmap(NULL, bufRingSize, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == bufRing)
+    {
+        return false;
+    }
+
+    m_BufRing = (io_uring_buf_ring*) bufRing;
+    m_BufRingTail = 0;
+
+    m_RecvBufs = (byte*) Heap::Alloc(NUM_RECV_BUFS * RECV_BUF_SIZE, HEAPTAG_NETWORK);
+    m_RecvBufInfo = (RecvBufInfo*) Heap::Alloc(NUM_RECV_BUFS * sizeof(RecvBufInfo), HEAPTAG_NETWORK);
+    if(!m_RecvBufs || !m_RecvBufInfo)
+    {
+        return false;
+    }
+
+    if(!m_Ring.RegisterBufRing(m_BufRing, NUM_RECV_BUFS, RECV_BUF_GROUP))
+    {
+        s_Log.Error("failed to register the receive buffer ring: %d", errno);
+        return false;
+    }
+
+    for(unsigned i = 0; i < NUM_RECV_BUFS; ++i)
+    {
+        ProvideRecvBuf((u16)i);
+    }
+
+    m_Listener = OpenListener(listenPort, false, reusePort);
+    if(m_Listener < 0)
+    {
+        return false;
+    }
+
+    ArmAccept();
+    ArmWake();
+
+    return true;
+}
+
+void
+UringEngine::Run()
+{
+    bool moving = false;
+
+    while(m_Running)
+    {
+        m_Shard->Flush();
+
+        const int ret = m_Ring.SubmitAndWait(moving ? 0 : 1);
+        if(ret < 0 && -EINTR != ret && -EAGAIN != ret && -EBUSY != ret)
+        {
+            s_Log.Error("io_uring_enter failed: %d", -ret);
+            break;
+        }
+
+        bool idle = true;
+        io_uring_cqe* cqe;
+        while(NULL != (cqe = m_Ring.PeekCqe()))
+        {
+            idle = false;
+
+            const UringOp op = (UringOp) (cqe->user_data & UOP_MASK);
+            UringClient* client = (UringClient*) (cqe->user_data & ~(u64)UOP_MASK);
+
+            switch(op)
+            {
+            case UOP_ACCEPT:
+                OnAccept(cqe);
+                break;
+            case UOP_WAKE:
+                OnWake();
+                break;
+            case UOP_RECV:
+                OnRecv(client, cqe);
+                break;
+            case UOP_SEND:
+                OnSend(client, cqe);
+                break;
+            case UOP_CANCEL:
+                //The cancelled recv completes on its own.
+                break;
+            default:
+                hbassert(false);
+                break;
+            }
+
+            m_Ring.AdvanceCq();
+        }
+
+        moving = m_Shard->MoveItems(idle);
+    }
+
+    m_Running = false;
+}
+
+void
+UringEngine::Cleanup()
+{
+    //Closing the ring cancels everything still in flight before the
+    //buffers those operations point at are released.
+    for(UringClient* client = m_Clients; client; client = client->m_Next)
+    {
+        if(client->m_Skt >= 0)
+        {
+            close(client->m_Skt);
+            client->m_Skt = -1;
+        }
+    }
+
+    m_Ring.Cleanup();
+
+    while(m_Clients)
+    {
+        UringClient* client = m_Clients;
+        UnlinkClient(client);
+        UringClient::Destroy(client);
+    }
+
+    if(m_RecvBufs)
+    {
+        Heap::Free(m_RecvBufs, HEAPTAG_NETWORK);
+        m_RecvBufs = NULL;
+    }
+
+    if(m_RecvBufInfo)
+    {
+        Heap::Free(m_RecvBufInfo, HEAPTAG_NETWORK);
+        m_RecvBufInfo = NULL;
+    }
+
+    if(m_BufRing)
+    {
+        munmap(m_BufRing, NUM_RECV_BUFS * sizeof(io_uring_buf));
+        m_BufRing = NULL;
+    }
+
+    if(m_Listener >= 0)
+    {
+        close(m_Listener);
+        m_Listener = -1;
+    }
+}
+
+void
+UringEngine::Stop()
+{
+    m_Running = false;
+    m_Shard->Wake();
+}
+
+//private:
+
+UringEngine::UringEngine()
+: m_Shard(NULL)
+, m_Listener(-1)
+, m_Running(true)
+, m_BufRing(NULL)
+, m_RecvBufs(NULL)
+, m_RecvBufInfo(NULL)
+, m_BufRingTail(0)
+, m_Clients(NULL)
+{
+}
+
+UringEngine::~UringEngine()
+{
+}
+
+void
+UringEngine::ProvideRecvBuf(const u16 bufId)
+{
+    //Index the entries directly; the header's flexible bufs[] member
+    //isn't laid out at offset 0 when compiled as C++.
+    io_uring_buf* buf = (io_uring_buf*) m_BufRing + (m_BufRingTail & (NUM_RECV_BUFS-1));
+    buf->addr = (u64) &m_RecvBufs[bufId * RECV_BUF_SIZE];
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bufId;
+    ++m_BufRingTail;
+    StoreRelease(&m_BufRing->tail, m_BufRingTail);
+}
+
+void
+UringEngine::ArmAccept()
+{
+    io_uring_sqe* sqe = m_Ring.GetSqe();
+    if(sqe)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = m_Listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = MakeUserData(NULL, UOP_ACCEPT);
+    }
+}
+
+void
+UringEngine::ArmWake()
+{
+    io_uring_sqe* sqe = m_Ring.GetSqe();
+    if(sqe)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = m_Shard->GetWakeFd();
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = MakeUserData(NULL, UOP_WAKE);
+    }
+}
+
+bool
+UringEngine::ArmRecv(UringClient* client)
+{
+    io_uring_sqe* sqe = m_Ring.GetSqe();
+    if(!sqe)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->m_Skt;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUF_GROUP;
+    sqe->user_data = MakeUserData(client, UOP_RECV);
+    client->m_RecvArmed = true;
+    client->m_RecvPaused = false;
+    return true;
+}
+
+//Cancels the client's multishot recv.  Drain() arms it again once the
+//client has given back all of the buffers it holds.
+void
+UringEngine::PauseRecv(UringClient* client)
+{
+    if(client->m_RecvPaused)
+    {
+        return;
+    }
+
+    io_uring_sqe* sqe = m_Ring.GetSqe();
+    if(!sqe)
+    {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MakeUserData(client, UOP_RECV);
+    sqe->user_data = MakeUserData(NULL, UOP_CANCEL);
+    client->m_RecvPaused = true;
+}
+
+//Frees the client once neither the kernel nor another shard holds
+//a reference to it.
+void
+UringEngine::CloseIfIdle(UringClient* client)
+{
+    if(client->m_Closing
+        && !client->m_RecvArmed
+        && !client->m_Sending
+        && !client->m_Msg.m_InFlight)
+    {
+        while(client->m_HeldHead >= 0)
+        {
+            const u16 bufId = (u16) client->m_HeldHead;
+            client->m_HeldHead = m_RecvBufInfo[bufId].m_Next;
+            ProvideRecvBuf(bufId);
+        }
+        client->m_NumHeld = 0;
+
+        UnlinkClient(client);
+        UringClient::Destroy(client);
+    }
+}
+
+void
+UringEngine::BeginClose(UringClient* client)
+{
+    if(!client->m_Closing)
+    {
+        client->m_Closing = true;
+
+        //Completes the outstanding multishot recv.  Sends already in
+        //flight, such as an error reply, still go out.
+        shutdown(client->m_Skt, SHUT_RD);
+    }
+
+    CloseIfIdle(client);
+}
+
+//Feeds the client's held receive buffers to its connection and runs
+//every complete command in them, then sends all of the replies at
+//once.  Stops early while a command is in flight on another shard,
+//or once enough replies are queued; OnSend() picks up from there.
+void
+UringEngine::Drain(UringClient* client)
+{
+    Connection* conn = &client->m_Conn;
+
+    while(!client->m_Msg.m_InFlight
+        && conn->GetPendingWriteLen() < MAX_QUEUED_REPLY_BYTES)
+    {
+        while(conn->ParseNext())
+        {
+            if(!m_Shard->Exec(&client->m_Msg))
+            {
+                break;
+            }
+        }
+
+        if(client->m_Msg.m_InFlight
+            || conn->HasFailed()
+            || client->m_HeldHead < 0)
+        {
+            break;
+        }
+
+        const u16 bufId = (u16) client->m_HeldHead;
+        const RecvBufInfo* info = &m_RecvBufInfo[bufId];
+
+        size_t space;
+        byte* buf = conn->GetReadSpace(&space);
+        if(!buf)
+        {
+            break;
+        }
+        hbassert(space > 0);
+
+        size_t len = info->m_Len - client->m_HeldOffset;
+        if(len > space)
+        {
+            len = space;
+        }
+
+        memcpy(buf, &m_RecvBufs[bufId * RECV_BUF_SIZE + client->m_HeldOffset], len);
+        conn->CommitRead(len);
+        client->m_HeldOffset += len;
+
+        if(client->m_HeldOffset == info->m_Len)
+        {
+            client->m_HeldHead = info->m_Next;
+            if(client->m_HeldHead < 0)
+            {
+                client->m_HeldTail = -1;
+            }
+            client->m_HeldOffset = 0;
+            --client->m_NumHeld;
+            ProvideRecvBuf(bufId);
+        }
+    }
+
+    if(client->m_HeldHead < 0)
+    {
+        conn->OnIdle();
+    }
+
+    Flush(client);
+
+    //A recv that ran out of buffers is re-armed once this client has
+    //given back all of the ones it held.
+    if(!client->m_RecvArmed && !client->m_Closing && client->m_HeldHead < 0)
+    {
+        ArmRecv(client);
+    }
+}
+
+//Submits the pending replies as one vectored send.
+void
+UringEngine::Flush(UringClient* client)
+{
+    Connection* conn = &client->m_Conn;
+    if(client->m_Sending || !conn->HasPendingWrite())
+    {
+        return;
+    }
+
+    io_uring_sqe* sqe = m_Ring.GetSqe();
+    if(!sqe)
+    {
+        return;
+    }
+
+    memset(&client->m_SendHdr, 0, sizeof(client->m_SendHdr));
+    client->m_SendHdr.msg_iov = client->m_SendIovs;
+    client->m_SendHdr.msg_iovlen = GatherWriteData(conn, client->m_SendIovs, MAX_SEND_IOVS);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->m_Skt;
+    sqe->addr = (u64) &client->m_SendHdr;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = MakeUserData(client, UOP_SEND);
+
+    client->m_Sending = true;
+}
+
+void
+UringEngine::OnAccept(const io_uring_cqe* cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        ArmAccept();
+    }
+
+    if(cqe->res < 0)
+    {
+        if(-ENFILE == cqe->res || -EMFILE == cqe->res)
+        {
+            s_Log.Error("accept failed: %d", -cqe->res);
+        }
+        return;
+    }
+
+    const int skt = cqe->res;
+    const int noDelay = 1;
+    setsockopt(skt, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    UringClient* client = UringClient::Create(skt, &m_ReadBufPool);
+    if(!client)
+    {
+        close(skt);
+        return;
+    }
+
+    LinkClient(client);
+
+    if(!ArmRecv(client))
+    {
+        UnlinkClient(client);
+        UringClient::Destroy(client);
+    }
+}
+
+void
+UringEngine::OnRecv(UringClient* client, const io_uring_cqe* cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        client->m_RecvArmed = false;
+    }
+
+    if(cqe->res > 0 && !client->m_Closing)
+    {
+        hbassert(cqe->flags & IORING_CQE_F_BUFFER);
+
+        //Hold the buffer behind any the client is already holding.
+        const u16 bufId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        m_RecvBufInfo[bufId].m_Len = cqe->res;
+        m_RecvBufInfo[bufId].m_Next = -1;
+        if(client->m_HeldTail >= 0)
+        {
+            m_RecvBufInfo[client->m_HeldTail].m_Next = bufId;
+        }
+        else
+        {
+            client->m_HeldHead = bufId;
+        }
+        client->m_HeldTail = bufId;
+        ++client->m_NumHeld;
+
+        Drain(client);
+
+        if(client->m_Conn.HasFailed())
+        {
+            BeginClose(client);
+            return;
+        }
+
+        if(client->m_RecvArmed && client->m_NumHeld >= MAX_HELD_RECV_BUFS)
+        {
+            PauseRecv(client);
+        }
+    }
+    else if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        ProvideRecvBuf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    if(!client->m_RecvArmed)
+    {
+        //Out of receive buffers, paused, or the kernel ended the
+        //multishot recv.  A client still holding buffers re-arms when
+        //Drain() is done with them.
+        if(!client->m_Closing
+            && (-ENOBUFS == cqe->res || -ECANCELED == cqe->res || cqe->res > 0)
+            && (client->m_HeldHead >= 0 || ArmRecv(client)))
+        {
+            return;
+        }
+
+        BeginClose(client);
+    }
+    else if(cqe->res <= 0 && !client->m_Closing)
+    {
+        BeginClose(client);
+    }
+}
+
+void
+UringEngine::OnSend(UringClient* client, const io_uring_cqe* cqe)
+{
+    client->m_Sending = false;
+
+    if(cqe->res > 0)
+    {
+        client->m_Conn.CommitWrite(cqe->res);
+    }
+    else if(cqe->res < 0)
+    {
+        BeginClose(client);
+        return;
+    }
+
+    if(client->m_Closing)
+    {
+        //Whatever is left of the replies still goes out.
+        Flush(client);
+        CloseIfIdle(client);
+        return;
+    }
+
+    //Runs any input that was held back while replies were queued.
+    Drain(client);
+
+    if(client->m_Conn.HasFailed())
+    {
+        BeginClose(client);
+    }
+}
+
+void
+UringEngine::OnWake()
+{
+    ArmWake();
+
+    m_Shard->Poll();
+
+    ShardMsg* msg;
+    while(NULL != (msg = m_Shard->PopCompleted()))
+    {
+        UringClient* client = (UringClient*) msg->m_Client;
+        if(client->m_Closing)
+        {
+            //The reply still goes out if the socket can take it.
+            Flush(client);
+            CloseIfIdle(client);
+            continue;
+        }
+
+        Drain(client);
+
+        if(client->m_Conn.HasFailed())
+        {
+            BeginClose(client);
+        }
+    }
+}
+
+void
+UringEngine::LinkClient(UringClient* client)
+{
+    client->m_Prev = NULL;
+    client->m_Next = m_Clients;
+    if(m_Clients)
+    {
+        m_Clients->m_Prev = client;
+    }
+    m_Clients = client;
+}
+
+void
+UringEngine::UnlinkClient(UringClient* client)
+{
+    if(client->m_Prev)
+    {
+        client->m_Prev->m_Next = client->m_Next;
+    }
+    else
+    {
+        m_Clients = client->m_Next;
+    }
+
+    if(client->m_Next)
+    {
+        client->m_Next->m_Prev = client->m_Prev;
+    }
+
+    client->m_Prev = client->m_Next = NULL;
+}
+
+}   //namespace honeybase
+
+#endif  //__linux__
@@ -1,11 +1,14 @@
 #include "network.h"
 
 #include "command.h"
+#include "connection.h"
 #include "dict.h"
 #include "error.h"
 
 #include <stdio.h>
 
+#if _MSC_VER
+
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
 #endif
@@ -30,7 +33,6 @@ public:
     Client()
         : m_State(STATE_ACCEPT)
         , m_Skt(INVALID_SOCKET)
-        , m_BufLen(0)
     {
     }
 
@@ -83,15 +85,16 @@ public:
 
     void Close()
     {
-        m_Cmd.Reset();
+        //Close the socket first, a pending recv may be reading into
+        //the connection's current argument.
         if(INVALID_SOCKET != m_Skt)
         {
             int err = closesocket(m_Skt);
             m_Skt = INVALID_SOCKET;
         }
+        m_Conn.Reset();
 
         m_State = STATE_ACCEPT;
-        m_BufLen = 0;
     }
 
     bool Reopen()
@@ -109,15 +112,56 @@ public:
     State m_State;
     SOCKET m_Skt;
     OVERLAPPED m_Overlapped;
-    Command m_Cmd;
+    Connection m_Conn;
     byte m_LocalAndRemoteAddr[2*(sizeof(sockaddr_in)+16)];
-    size_t m_BufLen;
-    byte m_ReadBuf[256];
 };
 
 static const int MAX_CLIENTS    = 2;
+static ReadBufferPool s_ReadBufPool;
 static Client s_Clients[MAX_CLIENTS];
 
+//Most replies sent with a single WSASend().
+static const int MAX_SEND_BUFS  = 64;
+
+//Sends all of the connection's queued replies, gathering as many as
+//fit into each call.
+static bool
+SendReplies(Client* client)
+{
+    Connection* conn = &client->m_Conn;
+
+    while(conn->HasPendingWrite())
+    {
+        WSABUF wsaBufs[MAX_SEND_BUFS];
+        DWORD bufCount = 0;
+        size_t offset = 0;
+
+        for(; bufCount < MAX_SEND_BUFS; ++bufCount)
+        {
+            const byte* data;
+            const size_t len = conn->GetWriteData(offset, &data);
+            if(0 == len)
+            {
+                break;
+            }
+
+            wsaBufs[bufCount].buf = (char*)data;
+            wsaBufs[bufCount].len = (ULONG)len;
+            offset += len;
+        }
+
+        DWORD numBytesSent;
+        if(SOCKET_ERROR == WSASend(client->m_Skt, wsaBufs, bufCount, &numBytesSent, 0, NULL, NULL))
+        {
+            return false;
+        }
+
+        conn->CommitWrite(numBytesSent);
+    }
+
+    return true;
+}
+
 bool
 Network::Startup(const unsigned listenPort)
 {
@@ -181,6 +225,7 @@ Network::Startup(const unsigned listenPort)
 
         for(int i = 0; i < MAX_CLIENTS; ++i)
         {
+            s_Clients[i].m_Conn.SetReadBufferPool(&s_ReadBufPool);
             if(!s_Clients[i].Open())
             {
                 Shutdown();
@@ -224,107 +269,40 @@ Network::Startup(const unsigned listenPort)
                 }
                 break;
             case Client::STATE_RECV:
-                if(!completed || (completed && 0 == bytesTransferred))
-                {
-                    client->Reopen();
-                    continue;
-                }
-
-                Error err;
-                DWORD numBytesSent;
-                WSABUF wsaBufs[3];
-                unsigned bufCount;
-                client->m_BufLen += bytesTransferred;
-                const size_t bytesConsumed = client->m_Cmd.Parse(client->m_ReadBuf, bytesTransferred, &err);
-                if(0 == bytesConsumed)
                 {
-                    wsaBufs[0].buf = "-ERR ";
-                    wsaBufs[0].len = sizeof("-ERR ")-1;
-                    wsaBufs[1].buf = (char*)err.GetText();
-                    wsaBufs[1].len = strlen(wsaBufs[1].buf);
-                    wsaBufs[2].buf = "\r\n";
-                    wsaBufs[2].len = 2;
-                    bufCount = 3;
-
-                    WSASend(client->m_Skt, wsaBufs, bufCount, &numBytesSent, 0, NULL, NULL);
-
-                    client->Reopen();
-                    continue;
-                }
-                else if(client->m_Cmd.IsComplete())
-                {
-                    const CommandExecResult result =
-                        client->m_Cmd.Exec(dict, &err);
-                    if(EXECRESULT_ERROR == result)
+                    if(!completed || (completed && 0 == bytesTransferred))
                     {
-                        wsaBufs[0].buf = "-ERR";
-                        wsaBufs[0].len = sizeof("-ERR")-1;
-                        wsaBufs[1].buf = (char*)err.GetText();
-                        wsaBufs[1].len = strlen(wsaBufs[1].buf);
-                        wsaBufs[2].buf = "\r\n";
-                        wsaBufs[2].len = 2;
-                        bufCount = 3;
+                        client->Reopen();
+                        continue;
                     }
-                    else if(EXECRESULT_OK == result)
+
+                    //Run every complete command that arrived, then send
+                    //all of the replies together.
+                    Connection* conn = &client->m_Conn;
+                    conn->CommitRead(bytesTransferred);
+                    while(conn->ParseNext())
                     {
-                        wsaBufs[0].buf = "+OK\r\n";
-                        wsaBufs[0].len = sizeof("+OK\r\n")-1;
-                        bufCount = 1;
+                        conn->Exec(dict);
                     }
-                    else if(EXECRESULT_BULK == result)
+
+                    if(!SendReplies(client) || conn->HasFailed())
                     {
-                        char lenBuf[64];
-                        char valBuf[64];
-                        const byte* blobData;
-                        if(1 == client->m_Cmd.m_ResultC)
-                        {
-                            switch(client->m_Cmd.m_ResultT[0])
-                            {
-                            case VALUETYPE_INT:
-                                sprintf(valBuf, "%"PRId64, client->m_Cmd.m_ResultV[0].m_Int);
-                                wsaBufs[1].buf = valBuf;
-                                wsaBufs[1].len = strlen(valBuf);
-                                break;
-                            case VALUETYPE_DOUBLE:
-                                sprintf(valBuf, "%f", client->m_Cmd.m_ResultV[0].m_Double);
-                                wsaBufs[1].buf = valBuf;
-                                wsaBufs[1].len = strlen(valBuf);
-                                break;
-                            case VALUETYPE_BLOB:
-                                wsaBufs[1].len = client->m_Cmd.m_ResultV[0].m_Blob->GetData(&blobData);
-                                wsaBufs[1].buf = (char*)blobData;
-                                break;
-                            }
-                            sprintf(lenBuf, "$%d\r\n", wsaBufs[1].len);
-                            wsaBufs[0].buf = lenBuf;
-                            wsaBufs[0].len = strlen(lenBuf);
-                            wsaBufs[2].buf = "\r\n";
-                            wsaBufs[2].len = 2;
-                            bufCount = 3;
-                        }
-                        else
-                        {
-                            wsaBufs[0].buf = "$-1\r\n";
-                            wsaBufs[0].len = strlen(wsaBufs[0].buf);
-                            bufCount = 1;
-                        }
+                        client->Reopen();
+                        continue;
                     }
-
-                    WSASend(client->m_Skt, wsaBufs, bufCount, &numBytesSent, 0, NULL, NULL);
-
-                    client->m_Cmd.Reset();
-                }
-                client->m_BufLen -= bytesConsumed;
-                if(client->m_BufLen > 0)
-                {
-                    memmove(client->m_ReadBuf, &client->m_ReadBuf[bytesConsumed], client->m_BufLen);
                 }
                 break;
             }
 
+            size_t readSpace;
             WSABUF wsaBuf;
-            wsaBuf.buf = (char*)&client->m_ReadBuf[client->m_BufLen];
-            wsaBuf.len = sizeof(client->m_ReadBuf) - client->m_BufLen;
+            wsaBuf.buf = (char*)client->m_Conn.GetReadSpace(&readSpace);
+            wsaBuf.len = (ULONG)readSpace;
+            if(!wsaBuf.buf)
+            {
+                client->Reopen();
+                continue;
+            }
 
             DWORD flags = 0;
 
@@ -335,6 +313,23 @@ Network::Startup(const unsigned listenPort)
     return true;
 }
 
+bool
+Network::Startup(const unsigned listenPort, const NetworkEngine engine)
+{
+    return Startup(listenPort, engine, 1);
+}
+
+bool
+Network::Startup(const unsigned listenPort, const NetworkEngine engine, const unsigned numShards)
+{
+    if(NETWORK_ENGINE_DEFAULT != engine || numShards > 1)
+    {
+        return false;
+    }
+
+    return Startup(listenPort);
+}
+
 void
 Network::Shutdown()
 {
@@ -361,3 +356,380 @@ Network::Shutdown()
 }
 
 }   //namespace honeybase
+
+#elif defined(__linux__)
+
+#include "connection.h"
+#include "netengine.h"
+#include "netshard.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace honeybase
+{
+
+static Log s_Log("network");
+
+static const int LISTEN_BACKLOG = SOMAXCONN;
+
+///////////////////////////////////////////////////////////////////////////////
+//  ShardRunner
+//
+//  Runs one shard's engine on its own thread.
+///////////////////////////////////////////////////////////////////////////////
+class ShardRunner
+{
+public:
+    Shard* m_Shard;
+    EpollEngine* m_Epoll;
+    UringEngine* m_Uring;
+    pthread_t m_Thread;
+
+    //CPU the thread is pinned to, or -1.
+    int m_Cpu;
+};
+
+static ShardRunner* s_Runners = NULL;
+static unsigned s_NumRunners = 0;
+static unsigned s_ListenPort = 0;
+
+//Shards meet twice: nobody serves until every shard is listening,
+//and nobody frees its clients while another shard may still be
+//running one of their commands.
+static pthread_mutex_t s_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_Cond = PTHREAD_COND_INITIALIZER;
+static unsigned s_NumThreads = 0;
+static unsigned s_NumInitialized = 0;
+static unsigned s_NumStopped = 0;
+static unsigned s_NumFailed = 0;
+
+static void
+Rendezvous(unsigned* numArrived, const bool failed)
+{
+    pthread_mutex_lock(&s_Mutex);
+
+    ++*numArrived;
+    if(failed)
+    {
+        ++s_NumFailed;
+    }
+
+    pthread_cond_broadcast(&s_Cond);
+    while(*numArrived < s_NumThreads)
+    {
+        pthread_cond_wait(&s_Cond, &s_Mutex);
+    }
+
+    pthread_mutex_unlock(&s_Mutex);
+}
+
+static bool
+HasFailed()
+{
+    pthread_mutex_lock(&s_Mutex);
+    const bool failed = s_NumFailed > 0;
+    pthread_mutex_unlock(&s_Mutex);
+    return failed;
+}
+
+static void*
+RunShard(void* arg)
+{
+    ShardRunner* runner = (ShardRunner*) arg;
+    const bool reusePort = s_NumRunners > 1;
+
+    if(runner->m_Cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(runner->m_Cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    const bool initialized = runner->m_Epoll
+                            ? runner->m_Epoll->Init(s_ListenPort, reusePort)
+                            : runner->m_Uring->Init(s_ListenPort, reusePort);
+
+    Rendezvous(&s_NumInitialized, !initialized);
+
+    if(!HasFailed())
+    {
+        if(runner->m_Epoll)
+        {
+            runner->m_Epoll->Run();
+        }
+        else
+        {
+            runner->m_Uring->Run();
+        }
+
+        //The keys this shard owns are gone, so stop the rest too.
+        Network::Shutdown();
+    }
+
+    Rendezvous(&s_NumStopped, false);
+
+    if(runner->m_Epoll)
+    {
+        runner->m_Epoll->Cleanup();
+    }
+    else
+    {
+        runner->m_Uring->Cleanup();
+    }
+
+    return NULL;
+}
+
+//Picks the CPU for each shard from the CPUs this thread may run on.
+static void
+AssignCpus(ShardRunner* runners, const unsigned numRunners)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if(numRunners < 2
+        || sched_getaffinity(0, sizeof(cpus), &cpus) < 0
+        || 0 == CPU_COUNT(&cpus))
+    {
+        for(unsigned i = 0; i < numRunners; ++i)
+        {
+            runners[i].m_Cpu = -1;
+        }
+
+        return;
+    }
+
+    int cpu = -1;
+    for(unsigned i = 0; i < numRunners; ++i)
+    {
+        do
+        {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        }
+        while(!CPU_ISSET(cpu, &cpus));
+
+        runners[i].m_Cpu = cpu;
+    }
+}
+
+static void
+DestroyRunners(ShardRunner* runners, const unsigned numRunners)
+{
+    for(unsigned i = 0; i < numRunners; ++i)
+    {
+        EpollEngine::Destroy(runners[i].m_Epoll);
+        UringEngine::Destroy(runners[i].m_Uring);
+    }
+
+    Heap::Free(runners, HEAPTAG_NETWORK);
+}
+
+int
+OpenListener(const unsigned listenPort, const bool nonBlocking, const bool reusePort)
+{
+    const int flags = SOCK_STREAM|SOCK_CLOEXEC|(nonBlocking ? SOCK_NONBLOCK : 0);
+    const int skt = socket(AF_INET, flags, IPPROTO_TCP);
+    if(skt < 0)
+    {
+        s_Log.Error("socket failed: %d", errno);
+        return -1;
+    }
+
+    const int one = 1;
+    setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    //The kernel spreads new connections across all the listeners.
+    if(reusePort && setsockopt(skt, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        s_Log.Error("SO_REUSEPORT failed: %d", errno);
+        close(skt);
+        return -1;
+    }
+
+    sockaddr_in listenAddr;
+    memset(&listenAddr, 0, sizeof(listenAddr));
+    listenAddr.sin_family = AF_INET;
+    listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listenAddr.sin_port = htons(listenPort);
+    if(bind(skt, (sockaddr*)&listenAddr, sizeof(listenAddr)) < 0
+        || listen(skt, LISTEN_BACKLOG) < 0)
+    {
+        s_Log.Error("failed to listen on port %u: %d", listenPort, errno);
+        close(skt);
+        return -1;
+    }
+
+    return skt;
+}
+
+int
+GatherWriteData(const Connection* conn, iovec* iovs, const int maxIovs)
+{
+    int numIovs = 0;
+    size_t offset = 0;
+    while(numIovs < maxIovs)
+    {
+        const byte* data;
+        const size_t len = conn->GetWriteData(offset, &data);
+        if(0 == len)
+        {
+            break;
+        }
+
+        iovs[numIovs].iov_base = (void*) data;
+        iovs[numIovs].iov_len = len;
+        ++numIovs;
+        offset += len;
+    }
+
+    return numIovs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  Network
+///////////////////////////////////////////////////////////////////////////////
+bool
+Network::Startup(const unsigned listenPort)
+{
+    return Startup(listenPort, NETWORK_ENGINE_DEFAULT, 1);
+}
+
+bool
+Network::Startup(const unsigned listenPort, const NetworkEngine engine)
+{
+    return Startup(listenPort, engine, 1);
+}
+
+bool
+Network::Startup(const unsigned listenPort, const NetworkEngine engine, const unsigned numShards)
+{
+    if(s_Runners)
+    {
+        return false;
+    }
+
+    if(NETWORK_ENGINE_IOURING == engine && !UringEngine::IsSupported())
+    {
+        s_Log.Error("io_uring is not supported by this kernel");
+        return false;
+    }
+
+    unsigned numRunners = numShards;
+    if(0 == numRunners)
+    {
+        const long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numRunners = (numCpus > 0) ? (unsigned)numCpus : 1;
+    }
+
+    ShardGroup* group = ShardGroup::Create(numRunners);
+    if(!group)
+    {
+        return false;
+    }
+
+    ShardRunner* runners = (ShardRunner*) Heap::ZAlloc(numRunners * sizeof(ShardRunner), HEAPTAG_NETWORK);
+    if(!runners)
+    {
+        ShardGroup::Destroy(group);
+        return false;
+    }
+
+    for(unsigned i = 0; i < numRunners; ++i)
+    {
+        ShardRunner* runner = &runners[i];
+        runner->m_Shard = group->GetShard(i);
+
+        if(NETWORK_ENGINE_IOURING == engine)
+        {
+            runner->m_Uring = UringEngine::Create(runner->m_Shard);
+        }
+        else
+        {
+            runner->m_Epoll = EpollEngine::Create(runner->m_Shard);
+        }
+
+        if(!runner->m_Uring && !runner->m_Epoll)
+        {
+            DestroyRunners(runners, numRunners);
+            ShardGroup::Destroy(group);
+            return false;
+        }
+    }
+
+    AssignCpus(runners, numRunners);
+
+    s_ListenPort = listenPort;
+    s_NumThreads = numRunners;
+    s_NumInitialized = s_NumStopped = s_NumFailed = 0;
+    s_NumRunners = numRunners;
+    s_Runners = runners;
+
+    for(unsigned i = 1; i < numRunners; ++i)
+    {
+        if(0 != pthread_create(&runners[i].m_Thread, NULL, RunShard, &runners[i]))
+        {
+            s_Log.Error("failed to start shard %u: %d", i, errno);
+
+            pthread_mutex_lock(&s_Mutex);
+            s_NumThreads = i;
+            ++s_NumFailed;
+            pthread_cond_broadcast(&s_Cond);
+            pthread_mutex_unlock(&s_Mutex);
+            break;
+        }
+    }
+
+    //Shard 0 runs on the calling thread, which gets its affinity back
+    //when it's done.
+    cpu_set_t callerCpus;
+    const bool restoreCpus = runners[0].m_Cpu >= 0
+                            && 0 == pthread_getaffinity_np(pthread_self(), sizeof(callerCpus), &callerCpus);
+
+    RunShard(&runners[0]);
+
+    if(restoreCpus)
+    {
+        pthread_setaffinity_np(pthread_self(), sizeof(callerCpus), &callerCpus);
+    }
+
+    for(unsigned i = 1; i < s_NumThreads; ++i)
+    {
+        pthread_join(runners[i].m_Thread, NULL);
+    }
+
+    const bool succeeded = 0 == s_NumFailed;
+
+    s_Runners = NULL;
+    s_NumRunners = 0;
+
+    DestroyRunners(runners, numRunners);
+    ShardGroup::Destroy(group);
+
+    return succeeded;
+}
+
+void
+Network::Shutdown()
+{
+    ShardRunner* runners = s_Runners;
+    for(unsigned i = 0; runners && i < s_NumRunners; ++i)
+    {
+        if(runners[i].m_Epoll)
+        {
+            runners[i].m_Epoll->Stop();
+        }
+        else
+        {
+            runners[i].m_Uring->Stop();
+        }
+    }
+}
+
+}   //namespace honeybase
+
+#endif  //_MSC_VER
\ No newline at end of file
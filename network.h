@@ -3,11 +3,27 @@
 
 namespace honeybase
 {
+
+enum NetworkEngine
+{
+    NETWORK_ENGINE_DEFAULT,     //IOCP on Windows, epoll on Linux
+    NETWORK_ENGINE_EPOLL,
+    NETWORK_ENGINE_IOURING
+};
+
 class Network
 {
 public:
     static bool Startup(const unsigned listenPort);
 
+    static bool Startup(const unsigned listenPort, const NetworkEngine engine);
+
+    //Splits the keyspace into numShards shards, each served by its own
+    //thread with its own listener on listenPort.  Commands are run by
+    //the shard that owns their key.  0 starts one shard per CPU.
+    //Only a single shard is supported on Windows.
+    static bool Startup(const unsigned listenPort, const NetworkEngine engine, const unsigned numShards);
+
     static void Shutdown();
 };
 }
@@ -41,7 +41,7 @@ SkipNode::Create(const int maxHeight)
     if(!node)
     {
         const size_t size = (sizeof(SkipNode) + (sizeof(SkipNode*)*(height-1)));
-        node = (SkipNode*)Heap::ZAlloc(size);
+        node = (SkipNode*)Heap::ZAlloc(size, HEAPTAG_SKIPLIST);
 
         if(node)
         {
@@ -86,7 +86,7 @@ SkipList::SkipList(const ValueType keyType)
 SkipList*
 SkipList::Create(const ValueType keyType)
 {
-    SkipList* skiplist = (SkipList*) Heap::ZAlloc(sizeof(SkipList));
+    SkipList* skiplist = (SkipList*) Heap::ZAlloc(sizeof(SkipList), HEAPTAG_SKIPLIST);
     if(skiplist)
     {
         new (skiplist) SkipList(keyType);
@@ -105,7 +105,7 @@ SkipList::Destroy(SkipList* skiplist)
             skiplist->Delete(skiplist->m_Head[0]->m_Items[0].m_Key,
                             skiplist->m_Head[0]->m_Items[0].m_KeyType);
         }
-        Heap::Free(skiplist);
+        Heap::Free(skiplist, HEAPTAG_SKIPLIST);
     }
 }
 
@@ -417,6 +417,62 @@ SkipList::GetUtilization() const
     return (m_Capacity > 0 ) ? (double)m_Count/m_Capacity : 0;
 }
 
+size_t
+SkipList::Defrag()
+{
+    size_t numMoved = 0;
+
+    //links[i][i] is the link at level i that points at the current node.
+    SkipNode** links[MAX_HEIGHT];
+
+    for(int i = 0; i < MAX_HEIGHT; ++i)
+    {
+        links[i] = m_Head;
+    }
+
+    //Nodes are returned to their pool rather than the heap, so only
+    //nodes in the list are ever moved.
+    for(SkipNode* cur = m_Head[0]; cur; cur = cur->m_Links[0])
+    {
+        if(Heap::ShouldMove(cur))
+        {
+            SkipNode* moved = (SkipNode*) Heap::Move(cur);
+            if(moved)
+            {
+                for(int i = 0; i < moved->m_Height; ++i)
+                {
+                    hbassert(links[i][i] == cur);
+                    links[i][i] = moved;
+                }
+
+                cur = moved;
+                ++numMoved;
+            }
+        }
+
+        for(int i = 0; i < cur->m_NumItems; ++i)
+        {
+            SkipItem* item = &cur->m_Items[i];
+            if(VALUETYPE_BLOB == item->m_ValueType)
+            {
+                Blob* value = Blob::Move(item->m_Value.m_Blob);
+                if(value != item->m_Value.m_Blob)
+                {
+                    item->m_Value.m_Blob = value;
+                    ++numMoved;
+                }
+            }
+        }
+
+        for(int i = 0; i < cur->m_Height; ++i)
+        {
+            links[i] = cur->m_Links;
+        }
+    }
+
+    return numMoved;
+}
+
 void
 SkipList::Validate() const
 {
@@ -75,6 +75,11 @@ public:
 
     double GetUtilization() const;
 
+    //Moves nodes, and Blob values nothing else references, out of
+    //heap spans that are emptier than most.  Returns the number of
+    //allocations moved.
+    size_t Defrag();
+
     void Validate() const;
     
 private:
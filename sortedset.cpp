@@ -1,6 +1,6 @@
 #include "sortedset.h"
 
-#include <new.h>
+#include <new>
 
 namespace honeybase
 {
@@ -8,7 +8,7 @@ namespace honeybase
 SortedSet*
 SortedSet::Create(const ValueType keyType)
 {
-    SortedSet* set = (SortedSet*) Heap::ZAlloc(sizeof(SortedSet));
+    SortedSet* set = (SortedSet*) Heap::ZAlloc(sizeof(SortedSet), HEAPTAG_SORTEDSET);
     if(set)
     {
         new (set) SortedSet();
@@ -19,9 +19,16 @@ SortedSet::Create(const ValueType keyType)
             set->m_Ht = HashTable::Create();
         }
 
-        if(!set->m_Bt || !set->m_Ht)
+        if(set->m_Ht && VALUETYPE_BLOB != keyType)
+        {
+            set->m_IntHt = IntHashTable<Value>::Create();
+        }
+
+        if(!set->m_Bt || !set->m_Ht
+            || (VALUETYPE_BLOB != keyType && !set->m_IntHt))
         {
             SortedSet::Destroy(set);
+            set = NULL;
         }
     }
 
@@ -34,15 +41,37 @@ SortedSet::Destroy(SortedSet* set)
     if(set)
     {
         set->~SortedSet();
-        Heap::Free(set);
+        Heap::Free(set, HEAPTAG_SORTEDSET);
     }
 }
 
 bool
 SortedSet::Set(const Value& key, const ValueType keyType, const Value& score)
 {
+    if(VALUETYPE_INT == keyType && m_IntHt)
+    {
+        Value oldScore;
+        if(m_IntHt->Find(key.m_Int, &oldScore))
+        {
+            hbverify(m_Bt->Delete(oldScore, key, keyType));
+        }
+
+        if(hbverify(m_Bt->Insert(score, key, keyType)))
+        {
+            if(m_IntHt->Set(key.m_Int, score))
+            {
+                return true;
+            }
+
+            m_Bt->Delete(score, key, keyType);
+        }
+
+        m_IntHt->Clear(key.m_Int);
+        return false;
+    }
+
     HashTable::Slot* slot;
-    u32 hash;
+    u64 hash;
     HtItem** pitem = m_Ht->Find(key, keyType, &slot, &hash);
 
     hbassert(pitem);
@@ -57,16 +86,7 @@ SortedSet::Set(const Value& key, const ValueType keyType, const Value& score)
 
         if(hbverify(m_Bt->Insert(score, key, (ValueType) keyType)))
         {
-            if(VALUETYPE_BLOB == m_Bt->GetKeyType())
-            {
-                item->m_Value.m_Blob->Unref();
-                item->m_Value.m_Blob = score.m_Blob;
-                item->m_Value.m_Blob->Ref();
-            }
-            else
-            {
-                item->m_Value = score;
-            }
+            item->SetValue(score, (ValueType)m_Bt->GetKeyType());
 
             return true;
         }
@@ -101,10 +121,26 @@ bool
 SortedSet::Clear(const Value& key, const ValueType keyType)
 {
     Value value;
+
+    if(VALUETYPE_INT == keyType && m_IntHt)
+    {
+        if(m_IntHt->Find(key.m_Int, &value))
+        {
+            m_IntHt->Clear(key.m_Int);
+            return m_Bt->Delete(value, key, keyType);
+        }
+
+        return false;
+    }
+
+    const u64 hash = m_Ht->HashKey(key, keyType);
     ValueType valueTyoe;
-    if(m_Ht->Find(key, keyType, &value, &valueTyoe))
+    if(m_Ht->Find(key, keyType, hash, &value, &valueTyoe))
     {
-        return m_Bt->Delete(value, key, keyType);
+        //Delete from the tree before the score's released.
+        const bool deleted = m_Bt->Delete(value, key, keyType);
+        m_Ht->Clear(key, keyType, hash);
+        return deleted;
     }
 
     return false;
@@ -124,7 +160,7 @@ SortedSet::Find(const Value& score, Value* key, ValueType* keyType) const
 u64
 SortedSet::Count() const
 {
-    return m_Ht->Count();
+    return m_Ht->Count() + (m_IntHt ? m_IntHt->Count() : 0);
 }
 
 double
@@ -138,6 +174,7 @@ SortedSet::GetUtilization() const
 SortedSet::SortedSet()
     : m_Bt(NULL)
     , m_Ht(NULL)
+    , m_IntHt(NULL)
 {
 }
 
@@ -152,6 +189,8 @@ SortedSet::~SortedSet()
     {
         m_Ht->Unref();
     }
+
+    IntHashTable<Value>::Destroy(m_IntHt);
 }
 
 }   //namespace honeybase
\ No newline at end of file
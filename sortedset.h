@@ -3,6 +3,7 @@
 
 #include "btree.h"
 #include "dict.h"
+#include "inthashtable.h"
 
 namespace honeybase
 {
@@ -42,7 +43,11 @@ private:
     SortedSet& operator=(const SortedSet&);
 
     BTree* m_Bt;
+
+    //Scores by member.  Int members go in m_IntHt unless the scores
+    //are Blobs, which it can't hold references to.
     HashTable* m_Ht;
+    IntHashTable<Value>* m_IntHt;
 };
 
 }   //namespace honeybase
@@ -0,0 +1,114 @@
+#ifndef __HB_SPSCQUEUE_H__
+#define __HB_SPSCQUEUE_H__
+
+#include "hb.h"
+
+namespace honeybase
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//  SpscQueue
+//
+//  Bounded lock free queue of pointers with exactly one producer thread
+//  and one consumer thread.  The producer and consumer indices live on
+//  separate cache lines, and each side keeps a cached copy of the other
+//  side's index so it only touches the shared line when it has to.
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+class SpscQueue
+{
+public:
+
+    SpscQueue()
+    : m_Items(NULL)
+    , m_Mask(0)
+    , m_Tail(0)
+    , m_HeadCache(0)
+    , m_Head(0)
+    , m_TailCache(0)
+    {
+    }
+
+    ~SpscQueue()
+    {
+        if(m_Items)
+        {
+            Heap::Free(m_Items, HEAPTAG_NETWORK);
+        }
+    }
+
+    //capacity must be a power of 2.
+    bool Init(const size_t capacity)
+    {
+        hbassert(capacity > 0 && 0 == (capacity & (capacity-1)));
+        hbassert(!m_Items);
+
+        m_Items = (T**) Heap::ZAlloc(capacity * sizeof(T*), HEAPTAG_NETWORK);
+        m_Mask = capacity - 1;
+        return NULL != m_Items;
+    }
+
+    //Producer only.  Returns false if the queue is full.
+    bool Push(T* item)
+    {
+        const size_t tail = m_Tail;
+        if(tail - m_HeadCache > m_Mask)
+        {
+            m_HeadCache = __atomic_load_n(&m_Head, __ATOMIC_ACQUIRE);
+            if(tail - m_HeadCache > m_Mask)
+            {
+                return false;
+            }
+        }
+
+        m_Items[tail & m_Mask] = item;
+        __atomic_store_n(&m_Tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //Consumer only.  Returns NULL if the queue is empty.
+    T* Pop()
+    {
+        const size_t head = m_Head;
+        if(head == m_TailCache)
+        {
+            m_TailCache = __atomic_load_n(&m_Tail, __ATOMIC_ACQUIRE);
+            if(head == m_TailCache)
+            {
+                return NULL;
+            }
+        }
+
+        T* item = m_Items[head & m_Mask];
+        __atomic_store_n(&m_Head, head + 1, __ATOMIC_RELEASE);
+        return item;
+    }
+
+private:
+
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    T** m_Items;
+    size_t m_Mask;
+
+    byte m_Pad0[CACHE_LINE_SIZE];
+
+    //Written by the producer.
+    size_t m_Tail;
+    size_t m_HeadCache;
+
+    byte m_Pad1[CACHE_LINE_SIZE];
+
+    //Written by the consumer.
+    size_t m_Head;
+    size_t m_TailCache;
+
+    byte m_Pad2[CACHE_LINE_SIZE];
+
+    SpscQueue(const SpscQueue&);
+    SpscQueue& operator=(const SpscQueue&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_SPSCQUEUE_H__
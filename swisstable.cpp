@@ -0,0 +1,601 @@
+#include "swisstable.h"
+
+#include "hash.h"
+
+#include <new>
+#include <string.h>
+
+namespace honeybase
+{
+
+//Control bytes of full slots hold the top 7 bits of the item's hash,
+//so only the markers have the high bit set.
+static const u8 CTRL_EMPTY      = 0x80;
+static const u8 CTRL_DELETED    = 0xFE;
+
+static const u64 HASH_SALT      = 0x3c6ef372fe94f82bull;
+
+//Number of keys FindMany() and SetMany() hash and prefetch before
+//probing, as in HashTable.
+static const size_t PREFETCH_BATCH_SIZE = 16;
+
+static inline u8
+HashTag(const u64 hash)
+{
+    return (u8)(hash >> 57);
+}
+
+//Leave an eighth of the slots free so probe sequences stay short.
+static inline size_t
+MaxLoad(const size_t capacity)
+{
+    return capacity - capacity/8;
+}
+
+//Returns a bit for each of the 16 control bytes in group equal to ctrl.
+static inline u32
+MatchCtrl(const u8* group, const u8 ctrl)
+{
+#if HB_SSE2
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)ctrl)));
+#else
+    u32 bits = 0;
+    for(int i = 0; i < 16; ++i)
+    {
+        if(ctrl == group[i])
+        {
+            bits |= 1u << i;
+        }
+    }
+    return bits;
+#endif
+}
+
+//Returns a bit for each empty or deleted slot in group.
+static inline u32
+MatchFree(const u8* group)
+{
+#if HB_SSE2
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    u32 bits = 0;
+    for(int i = 0; i < 16; ++i)
+    {
+        if(group[i] & 0x80)
+        {
+            bits |= 1u << i;
+        }
+    }
+    return bits;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  SwissTable
+///////////////////////////////////////////////////////////////////////////////
+SwissTable*
+SwissTable::Create()
+{
+    SwissTable* table = (SwissTable*) Heap::ZAlloc(sizeof(SwissTable), HEAPTAG_DICT);
+    if(table)
+    {
+        new (table) SwissTable();
+        if(!table->Resize(INITIAL_CAPACITY))
+        {
+            table->Unref();
+            table = NULL;
+        }
+    }
+
+    return table;
+}
+
+bool
+SwissTable::Set(const Value& key, const ValueType keyType,
+                const Value& value, const ValueType valueType)
+{
+    return Set(key, keyType, value, valueType, HashKey(key, keyType));
+}
+
+bool
+SwissTable::Clear(const Value& key, const ValueType keyType)
+{
+    const size_t index = Find(key, keyType, HashKey(key, keyType));
+    if(NOT_FOUND == index)
+    {
+        return false;
+    }
+
+    Item* item = &m_Items[index];
+    if(VALUETYPE_BLOB == item->m_KeyType)
+    {
+        item->m_Key.m_Blob->Unref();
+    }
+
+    if(VALUETYPE_BLOB == item->m_ValueType)
+    {
+        item->m_Value.m_Blob->Unref();
+    }
+
+    //A group with an empty slot has never been full, so no probe has
+    //had to go past it and the slot can be marked empty.
+    if(MatchCtrl(&m_Ctrl[index & ~(GROUP_SIZE-1)], CTRL_EMPTY))
+    {
+        m_Ctrl[index] = CTRL_EMPTY;
+    }
+    else
+    {
+        m_Ctrl[index] = CTRL_DELETED;
+        ++m_NumDeleted;
+    }
+
+    --m_Count;
+
+    return true;
+}
+
+bool
+SwissTable::Find(const Value& key, const ValueType keyType,
+                Value* value, ValueType* valueType)
+{
+    const size_t index = Find(key, keyType, HashKey(key, keyType));
+    if(NOT_FOUND != index)
+    {
+        *value = m_Items[index].m_Value;
+        *valueType = m_Items[index].m_ValueType;
+        return true;
+    }
+
+    return false;
+}
+
+size_t
+SwissTable::FindMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    Value* values, ValueType* valueTypes,
+                    bool* found)
+{
+    u64 hashes[PREFETCH_BATCH_SIZE];
+    size_t numFound = 0;
+
+    for(size_t first = 0; first < numKeys; first += PREFETCH_BATCH_SIZE)
+    {
+        const size_t count = (numKeys - first < PREFETCH_BATCH_SIZE)
+                            ? numKeys - first
+                            : PREFETCH_BATCH_SIZE;
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = HashKey(keys[first+i], keyType);
+            PrefetchGroup(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            PrefetchItem(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            const size_t k = first + i;
+            const size_t index = Find(keys[k], keyType, hashes[i]);
+
+            if(NOT_FOUND != index)
+            {
+                values[k] = m_Items[index].m_Value;
+                valueTypes[k] = m_Items[index].m_ValueType;
+                found[k] = true;
+                ++numFound;
+            }
+            else
+            {
+                found[k] = false;
+            }
+        }
+    }
+
+    return numFound;
+}
+
+bool
+SwissTable::SetMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    const Value* values, const ValueType valueType)
+{
+    u64 hashes[PREFETCH_BATCH_SIZE];
+
+    for(size_t first = 0; first < numKeys; first += PREFETCH_BATCH_SIZE)
+    {
+        const size_t count = (numKeys - first < PREFETCH_BATCH_SIZE)
+                            ? numKeys - first
+                            : PREFETCH_BATCH_SIZE;
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            hashes[i] = HashKey(keys[first+i], keyType);
+            PrefetchGroup(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            PrefetchItem(hashes[i]);
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            const size_t k = first + i;
+            if(!Set(keys[k], keyType, values[k], valueType, hashes[i]))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool
+SwissTable::Patch(const Value& key, const ValueType keyType,
+                    const size_t numPatches,
+                    const Blob** patches,
+                    const size_t* offsets)
+{
+    hbassert(numPatches > 0);
+
+    const u64 hash = HashKey(key, keyType);
+    size_t index = Find(key, keyType, hash);
+
+    Blob* oldBlob = NULL;
+    if(NOT_FOUND != index)
+    {
+        if(!hbverify(VALUETYPE_BLOB == m_Items[index].m_ValueType))
+        {
+            return false;
+        }
+
+        oldBlob = m_Items[index].m_Value.m_Blob;
+    }
+
+    //Patches after the first that needs a new Blob go into that Blob.
+    Blob* blob = oldBlob;
+    for(size_t i = 0; i < numPatches; ++i)
+    {
+        Blob* patched = Blob::Patch(blob, patches[i], offsets[i]);
+        if(!patched)
+        {
+            if(blob != oldBlob)
+            {
+                blob->Unref();
+            }
+
+            return false;
+        }
+
+        if(blob != oldBlob && patched != blob)
+        {
+            blob->Unref();
+        }
+
+        blob = patched;
+    }
+
+    if(blob == oldBlob)
+    {
+        return true;
+    }
+
+    if(NOT_FOUND != index)
+    {
+        oldBlob->Unref();
+        m_Items[index].m_Value.m_Blob = blob;
+        return true;
+    }
+
+    index = Insert(hash);
+    if(NOT_FOUND == index)
+    {
+        blob->Unref();
+        return false;
+    }
+
+    Item* item = &m_Items[index];
+    if(VALUETYPE_BLOB == keyType)
+    {
+        key.m_Blob->Ref();
+    }
+
+    item->m_Key = key;
+    item->m_KeyType = keyType;
+    item->m_Value.m_Blob = blob;
+    item->m_ValueType = VALUETYPE_BLOB;
+    item->m_Hash = (u32)hash;
+
+    return true;
+}
+
+size_t
+SwissTable::Count() const
+{
+    return m_Count;
+}
+
+void
+SwissTable::Ref() const
+{
+    hbassert(m_RefCount > 0);
+    ++m_RefCount;
+}
+
+void
+SwissTable::Unref()
+{
+    hbassert(m_RefCount > 0);
+    --m_RefCount;
+    if(0 == m_RefCount)
+    {
+        Destroy(this);
+    }
+}
+
+//private:
+
+SwissTable::SwissTable()
+    : m_Ctrl(NULL)
+    , m_Items(NULL)
+    , m_Capacity(0)
+    , m_GroupMask(0)
+    , m_Count(0)
+    , m_NumDeleted(0)
+    , m_RefCount(1)
+    , m_HashSalt(HASH_SALT)
+{
+}
+
+SwissTable::~SwissTable()
+{
+}
+
+void
+SwissTable::Destroy(SwissTable* table)
+{
+    if(table)
+    {
+        hbassert(0 == table->m_RefCount);
+
+        for(size_t i = 0; i < table->m_Capacity; ++i)
+        {
+            if(table->m_Ctrl[i] & 0x80)
+            {
+                continue;
+            }
+
+            Item* item = &table->m_Items[i];
+            if(VALUETYPE_BLOB == item->m_KeyType)
+            {
+                item->m_Key.m_Blob->Unref();
+            }
+
+            if(VALUETYPE_BLOB == item->m_ValueType)
+            {
+                item->m_Value.m_Blob->Unref();
+            }
+        }
+
+        if(table->m_Ctrl)
+        {
+            Heap::Free(table->m_Ctrl, HEAPTAG_DICT);
+            Heap::Free(table->m_Items, HEAPTAG_DICT);
+        }
+
+        table->~SwissTable();
+        Heap::Free(table, HEAPTAG_DICT);
+    }
+}
+
+u64
+SwissTable::HashKey(const Value& key, const ValueType keyType) const
+{
+    switch(keyType)
+    {
+    case VALUETYPE_INT:
+    case VALUETYPE_DOUBLE:
+        return Hash64(&key.m_Int, sizeof(key.m_Int), m_HashSalt);
+    case VALUETYPE_BLOB:
+        return key.m_Blob->Hash();
+    }
+
+    hbassert(false);
+    return 0;
+}
+
+//Groups are probed in triangular steps, which visits every group once
+//when the number of groups is a power of 2.
+size_t
+SwissTable::Find(const Value& key, const ValueType keyType, const u64 hash) const
+{
+    const u8 tag = HashTag(hash);
+    size_t group = hash & m_GroupMask;
+
+    for(size_t probe = 1; probe <= m_GroupMask + 1; ++probe)
+    {
+        const u8* ctrl = &m_Ctrl[group * GROUP_SIZE];
+
+        for(u32 bits = MatchCtrl(ctrl, tag); bits; bits &= bits - 1)
+        {
+            const size_t index = group * GROUP_SIZE + LowestBit(bits);
+            const Item* item = &m_Items[index];
+            if((u32)hash == item->m_Hash
+                && keyType == item->m_KeyType
+                && item->m_Key.EQ(keyType, key))
+            {
+                return index;
+            }
+        }
+
+        if(MatchCtrl(ctrl, CTRL_EMPTY))
+        {
+            break;
+        }
+
+        group = (group + probe) & m_GroupMask;
+    }
+
+    return NOT_FOUND;
+}
+
+bool
+SwissTable::Set(const Value& key, const ValueType keyType,
+                const Value& value, const ValueType valueType,
+                const u64 hash)
+{
+    size_t index = Find(key, keyType, hash);
+    if(NOT_FOUND == index)
+    {
+        index = Insert(hash);
+        if(NOT_FOUND == index)
+        {
+            return false;
+        }
+
+        Item* item = &m_Items[index];
+        if(VALUETYPE_BLOB == keyType)
+        {
+            key.m_Blob->Ref();
+        }
+
+        item->m_Key = key;
+        item->m_KeyType = keyType;
+        item->m_ValueType = VALUETYPE_INT;
+        item->m_Hash = (u32)hash;
+    }
+
+    Item* item = &m_Items[index];
+
+    //Ref before unref in case the value is the same Blob.
+    if(VALUETYPE_BLOB == valueType)
+    {
+        value.m_Blob->Ref();
+    }
+
+    if(VALUETYPE_BLOB == item->m_ValueType)
+    {
+        item->m_Value.m_Blob->Unref();
+    }
+
+    item->m_Value = value;
+    item->m_ValueType = valueType;
+
+    return true;
+}
+
+size_t
+SwissTable::Insert(const u64 hash)
+{
+    if(m_Count + m_NumDeleted >= MaxLoad(m_Capacity))
+    {
+        //Grow if at least half the load is live items, otherwise just
+        //get rid of the deleted ones.
+        const size_t newCapacity =
+            (m_Count >= MaxLoad(m_Capacity)/2) ? m_Capacity * 2 : m_Capacity;
+
+        if(!Resize(newCapacity) && m_Count >= m_Capacity)
+        {
+            return NOT_FOUND;
+        }
+    }
+
+    const size_t index = FindFreeSlot(hash);
+    if(CTRL_DELETED == m_Ctrl[index])
+    {
+        --m_NumDeleted;
+    }
+
+    m_Ctrl[index] = HashTag(hash);
+    ++m_Count;
+
+    return index;
+}
+
+size_t
+SwissTable::FindFreeSlot(const u64 hash) const
+{
+    hbassert(m_Count < m_Capacity);
+
+    size_t group = hash & m_GroupMask;
+
+    for(size_t probe = 1;; ++probe)
+    {
+        const u32 bits = MatchFree(&m_Ctrl[group * GROUP_SIZE]);
+        if(bits)
+        {
+            return group * GROUP_SIZE + LowestBit(bits);
+        }
+
+        group = (group + probe) & m_GroupMask;
+    }
+}
+
+bool
+SwissTable::Resize(const size_t newCapacity)
+{
+    hbassert(newCapacity >= GROUP_SIZE && 0 == (newCapacity & (newCapacity-1)));
+
+    u8* newCtrl = (u8*) Heap::Alloc(newCapacity, HEAPTAG_DICT);
+    Item* newItems = (Item*) Heap::Alloc(newCapacity * sizeof(Item), HEAPTAG_DICT);
+    if(!newCtrl || !newItems)
+    {
+        Heap::Free(newCtrl, HEAPTAG_DICT);
+        Heap::Free(newItems, HEAPTAG_DICT);
+        return false;
+    }
+
+    memset(newCtrl, CTRL_EMPTY, newCapacity);
+
+    u8* oldCtrl = m_Ctrl;
+    Item* oldItems = m_Items;
+    const size_t oldCapacity = m_Capacity;
+
+    m_Ctrl = newCtrl;
+    m_Items = newItems;
+    m_Capacity = newCapacity;
+    m_GroupMask = newCapacity / GROUP_SIZE - 1;
+    m_NumDeleted = 0;
+
+    for(size_t i = 0; i < oldCapacity; ++i)
+    {
+        if(!(oldCtrl[i] & 0x80))
+        {
+            const size_t index = FindFreeSlot(oldItems[i].m_Hash);
+            m_Ctrl[index] = oldCtrl[i];
+            m_Items[index] = oldItems[i];
+        }
+    }
+
+    if(oldCtrl)
+    {
+        Heap::Free(oldCtrl, HEAPTAG_DICT);
+        Heap::Free(oldItems, HEAPTAG_DICT);
+    }
+
+    return true;
+}
+
+void
+SwissTable::PrefetchGroup(const u64 hash) const
+{
+    hbprefetch(&m_Ctrl[(hash & m_GroupMask) * GROUP_SIZE]);
+}
+
+void
+SwissTable::PrefetchItem(const u64 hash) const
+{
+    const size_t group = hash & m_GroupMask;
+    const u32 bits = MatchCtrl(&m_Ctrl[group * GROUP_SIZE], HashTag(hash));
+    if(bits)
+    {
+        hbprefetch(&m_Items[group * GROUP_SIZE + LowestBit(bits)]);
+    }
+}
+
+}   //namespace honeybase
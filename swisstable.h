@@ -0,0 +1,129 @@
+#ifndef __HB_SWISSTABLE_H__
+#define __HB_SWISSTABLE_H__
+
+#include "hb.h"
+
+namespace honeybase
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//  SwissTable
+//
+//  Open addressing hash table with the same interface as HashTable.
+//  Items are stored inline in one array, with a parallel array holding
+//  one control byte per item: 7 bits of the item's hash, or a marker
+//  for an empty or deleted slot.  A lookup compares a whole group of 16
+//  control bytes at once and only looks at the items whose bits match,
+//  so a miss usually reads a single cache line and a hit one more.
+//
+//  Unlike HashTable it grows all at once, so a Set() that grows the
+//  table takes time proportional to its size.
+///////////////////////////////////////////////////////////////////////////////
+class SwissTable
+{
+public:
+
+    static SwissTable* Create();
+
+    bool Set(const Value& key, const ValueType keyType,
+            const Value& value, const ValueType valueType);
+
+    bool Clear(const Value& key, const ValueType keyType);
+
+    bool Find(const Value& key, const ValueType keyType,
+                Value* value, ValueType* valueType);
+
+    //See HashTable::FindMany().
+    size_t FindMany(const size_t numKeys,
+                    const Value* keys, const ValueType keyType,
+                    Value* values, ValueType* valueTypes,
+                    bool* found);
+
+    //See HashTable::SetMany().
+    bool SetMany(const size_t numKeys,
+                const Value* keys, const ValueType keyType,
+                const Value* values, const ValueType valueType);
+
+    //Writes each patch into the key's Blob value at its offset,
+    //extending the value as needed.  Bytes between the old end and an
+    //offset past it are zero.  The key is created if it doesn't exist.
+    bool Patch(const Value& key, const ValueType keyType,
+                const size_t numPatches,
+                const Blob** patches,
+                const size_t* offsets);
+
+    size_t Count() const;
+
+    void Ref() const;
+    void Unref();
+
+private:
+
+    class Item
+    {
+    public:
+        Value m_Key;
+        Value m_Value;
+
+        //Low bits of the hash, kept so growing the table doesn't have to
+        //rehash the keys.  Enough to pick a group in any table that
+        //fits in memory.
+        u32 m_Hash;
+
+        ValueType m_KeyType     : 4;
+        ValueType m_ValueType   : 4;
+    };
+
+    static const size_t GROUP_SIZE          = 16;
+
+    //Must be a power of 2 and a multiple of GROUP_SIZE.
+    static const size_t INITIAL_CAPACITY    = 256;
+
+    static const size_t NOT_FOUND           = ~size_t(0);
+
+    static void Destroy(SwissTable* table);
+
+    u64 HashKey(const Value& key, const ValueType keyType) const;
+
+    //Returns the index of the key's item, or NOT_FOUND.
+    size_t Find(const Value& key, const ValueType keyType, const u64 hash) const;
+
+    bool Set(const Value& key, const ValueType keyType,
+            const Value& value, const ValueType valueType,
+            const u64 hash);
+
+    //Claims a slot for a new item with the given hash, growing the
+    //table if it's too full.  Returns the slot's index, or NOT_FOUND
+    //if the table is full and couldn't grow.
+    size_t Insert(const u64 hash);
+
+    //Returns the first empty or deleted slot in hash's probe sequence.
+    size_t FindFreeSlot(const u64 hash) const;
+
+    bool Resize(const size_t newCapacity);
+
+    void PrefetchGroup(const u64 hash) const;
+
+    //Prefetches the first item in hash's first group whose control
+    //byte matches.  The group should have been prefetched already.
+    void PrefetchItem(const u64 hash) const;
+
+    u8* m_Ctrl;
+    Item* m_Items;
+    size_t m_Capacity;
+    size_t m_GroupMask;
+
+    size_t m_Count;
+    size_t m_NumDeleted;
+    mutable int m_RefCount;
+    u64 m_HashSalt;
+
+    SwissTable();
+    ~SwissTable();
+    SwissTable(const SwissTable&);
+    SwissTable& operator=(const SwissTable&);
+};
+
+}   //namespace honeybase
+
+#endif  //__HB_SWISSTABLE_H__
@@ -1,12 +1,28 @@
 #include "tests.h"
 
 #include "btree.h"
+#include "command.h"
 #include "dict.h"
+#include "error.h"
+#include "hash.h"
+#include "inthashtable.h"
 #include "skiplist.h"
 #include "sortedset.h"
+#include "swisstable.h"
 
 #include <algorithm>
 #include <functional>
+#include <stdio.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 namespace honeybase
 {
@@ -288,16 +304,20 @@ KV::DestroyKeys(KV* kv, const int numKeys)
 ///////////////////////////////////////////////////////////////////////////////
 //  HashTableTest
 ///////////////////////////////////////////////////////////////////////////////
-HashTableTest::HashTableTest(const ValueType keyType, const ValueType valueType)
+HashTableTest::HashTableTest(const ValueType keyType,
+                                const ValueType valueType,
+                                const HashTableEngine engine)
 : m_KeyType(keyType)
 , m_ValueType(valueType)
+, m_Engine(engine)
 {
 }
 
+template<typename T>
 void
 HashTableTest::Test(const int numKeys)
 {
-    HashTable* ht = HashTable::Create();
+    T* ht = T::Create();
     Value value;
     ValueType valueType;
 
@@ -322,6 +342,364 @@ HashTableTest::Test(const int numKeys)
 
     hbverify(0 == ht->Count());
 
+    //Set half the keys in a batch, then look them all up in a batch.
+    Value* keys = new Value[numKeys];
+    Value* values = new Value[numKeys];
+    ValueType* valueTypes = new ValueType[numKeys];
+    bool* found = new bool[numKeys];
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i] = kv[i].m_Key;
+        values[i] = kv[i].m_Value;
+    }
+
+    hbverify(ht->SetMany(numKeys/2, keys, m_KeyType, values, m_ValueType));
+    hbverify((size_t)numKeys/2 == ht->FindMany(numKeys, keys, m_KeyType, values, valueTypes, found));
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(found[i] == (i < numKeys/2));
+        hbverify(!found[i] || EQ(values[i], valueTypes[i], kv[i].m_Value, m_ValueType));
+    }
+
+    for(int i = 0; i < numKeys/2; ++i)
+    {
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+    }
+
+    hbverify(0 == ht->Count());
+
+    //Delete most of the keys so the table shrinks, checking the rest
+    //can still be found while they're moved.
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Set(kv[i].m_Key, m_KeyType, kv[i].m_Value, m_ValueType));
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        if(i % 16)
+        {
+            hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+        }
+
+        const int j = (int)Rand(0, i + 1);
+        hbverify(ht->Find(kv[j].m_Key, m_KeyType, &value, &valueType) == (0 == j % 16));
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType) == (0 == i % 16));
+        hbverify(0 != i % 16 || EQ(value, valueType, kv[i].m_Value, m_ValueType));
+    }
+
+    for(int i = 0; i < numKeys; i += 16)
+    {
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+    }
+
+    hbverify(0 == ht->Count());
+
+    delete [] found;
+    delete [] valueTypes;
+    delete [] values;
+    delete [] keys;
+
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableTest::Test(const int numKeys)
+{
+    if(HASHTABLE_SWISS == m_Engine)
+    {
+        Test<SwissTable>(numKeys);
+    }
+    else
+    {
+        Test<HashTable>(numKeys);
+        TestRehashFor(numKeys);
+        TestLoadMany(numKeys);
+        TestDefragFor(numKeys);
+        TestInternValues(numKeys);
+    }
+}
+
+void
+HashTableTest::TestRehashFor(const int numKeys)
+{
+    HashTable* ht = HashTable::Create();
+    Value value;
+    ValueType valueType;
+    HashTable::RehashStats stats;
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, KEYORDER_RANDOM, numKeys);
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        ht->Set(kv[i].m_Key, m_KeyType, kv[i].m_Value, m_ValueType);
+    }
+
+    //Finish any resize without writing.
+    while(ht->RehashFor(10))
+    {
+        ht->GetRehashStats(&stats);
+        hbverify(stats.m_SlotsRemaining > 0);
+    }
+
+    hbverify(!ht->IsRehashing());
+    ht->GetRehashStats(&stats);
+    hbverify(0 == stats.m_SlotsRemaining);
+    hbverify(0 == stats.m_NumShrinks);
+    hbverify(numKeys < 512 || stats.m_NumGrows > 0);
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType));
+        hbverify(EQ(value, valueType, kv[i].m_Value, m_ValueType));
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+    }
+
+    hbverify(!ht->RehashFor(1000000));
+    ht->GetRehashStats(&stats);
+    hbverify(numKeys < 4096 || stats.m_NumShrinks > 0);
+
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableTest::TestLoadMany(const int numKeys)
+{
+    HashTable* ht = HashTable::Create();
+    Value value;
+    ValueType valueType;
+    HashTable::RehashStats stats;
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, KEYORDER_RANDOM, numKeys);
+
+    Value* keys = new Value[numKeys];
+    Value* values = new Value[numKeys];
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i] = kv[i].m_Key;
+        values[i] = kv[i].m_Value;
+    }
+
+    //Load half the keys into a reserved table, which shouldn't need
+    //to resize, then the other half without reserving.
+    hbverify(ht->Reserve(numKeys/2));
+    hbverify(!ht->IsRehashing());
+    ht->GetRehashStats(&stats);
+    const u64 numGrows = stats.m_NumGrows;
+
+    hbverify(ht->LoadMany(numKeys/2, keys, m_KeyType, values, m_ValueType));
+    ht->GetRehashStats(&stats);
+    hbverify(numGrows == stats.m_NumGrows);
+
+    hbverify(ht->LoadMany(numKeys - numKeys/2, &keys[numKeys/2], m_KeyType, &values[numKeys/2], m_ValueType));
+    hbverify((size_t)numKeys == ht->Count());
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType));
+        hbverify(EQ(value, valueType, kv[i].m_Value, m_ValueType));
+    }
+
+    //The reserved size holds after the keys are deleted, until the
+    //reservation is dropped.  Each key is hashed once for both the
+    //lookup and the delete.
+    for(int i = 0; i < numKeys; ++i)
+    {
+        const u64 hash = ht->HashKey(kv[i].m_Key, m_KeyType);
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, hash, &value, &valueType));
+        hbverify(EQ(value, valueType, kv[i].m_Value, m_ValueType));
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType, hash));
+        hbverify(!ht->Find(kv[i].m_Key, m_KeyType, hash, &value, &valueType));
+    }
+
+    ht->RehashFor(1000000);
+    ht->GetRehashStats(&stats);
+    const u64 numShrinks = stats.m_NumShrinks;
+
+    hbverify(ht->Reserve(0));
+    hbverify(ht->Set(kv[0].m_Key, m_KeyType, kv[0].m_Value, m_ValueType));
+    ht->GetRehashStats(&stats);
+    hbverify(numKeys < 1024 || stats.m_NumShrinks > numShrinks);
+    hbverify(ht->Clear(kv[0].m_Key, m_KeyType));
+
+    delete [] values;
+    delete [] keys;
+
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableTest::TestDefragFor(const int numKeys)
+{
+    HashTable* ht = HashTable::Create();
+    Value value;
+    ValueType valueType;
+    HashTable::DefragStats stats;
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, KEYORDER_RANDOM, numKeys);
+
+    //Blob values are copied so the table holds their only reference,
+    //otherwise they can't be moved.
+    for(int i = 0; i < numKeys; ++i)
+    {
+        value = kv[i].m_Value;
+        if(VALUETYPE_BLOB == m_ValueType)
+        {
+            const byte* data;
+            const size_t len = kv[i].m_Value.m_Blob->GetData(&data);
+            value.m_Blob = Blob::Create(data, len);
+        }
+
+        hbverify(ht->Set(kv[i].m_Key, m_KeyType, value, m_ValueType));
+
+        if(VALUETYPE_BLOB == m_ValueType)
+        {
+            value.m_Blob->Unref();
+        }
+    }
+
+    //Deleting most of the keys leaves the spans holding what's left
+    //mostly empty.
+    for(int i = 0; i < numKeys; ++i)
+    {
+        if(i % 8)
+        {
+            hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+        }
+    }
+
+    //Nothing moves while the table is shrinking.
+    while(ht->RehashFor(1000000))
+    {
+    }
+
+    Heap::FlushThreadCache();
+
+    while(ht->DefragFor(10))
+    {
+    }
+
+    ht->GetDefragStats(&stats);
+    hbverify(1 == stats.m_NumPasses);
+    hbverify(numKeys < 4096 || stats.m_ItemsMoved > 0);
+    hbverify(numKeys < 4096 || VALUETYPE_BLOB != m_ValueType || stats.m_BlobsMoved > 0);
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType) == (0 == i % 8));
+        hbverify(0 != i % 8 || EQ(value, valueType, kv[i].m_Value, m_ValueType));
+    }
+
+    for(int i = 0; i < numKeys; i += 8)
+    {
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+    }
+
+    hbverify(0 == ht->Count());
+
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableTest::TestInternValues(const int numKeys)
+{
+    //Every key gets its own copy of one of a few values.
+    const int NUM_VALUES = 8;
+    const size_t VALUE_LEN = 200;
+
+    if(VALUETYPE_BLOB != m_ValueType || numKeys <= NUM_VALUES)
+    {
+        return;
+    }
+
+    HashTable::SetInternValues(true);
+    HashTable* ht = HashTable::Create();
+    HashTable::SetInternValues(false);
+
+    Value value;
+    ValueType valueType;
+    InternPool::Stats stats;
+
+    byte valueData[NUM_VALUES][VALUE_LEN];
+    for(int i = 0; i < NUM_VALUES; ++i)
+    {
+        memset(valueData[i], 'a' + i, VALUE_LEN);
+    }
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, KEYORDER_RANDOM, numKeys);
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        value.m_Blob = Blob::Create(valueData[i % NUM_VALUES], VALUE_LEN);
+        hbverify(ht->Set(kv[i].m_Key, m_KeyType, value, VALUETYPE_BLOB));
+        value.m_Blob->Unref();
+    }
+
+    ht->GetInternStats(&stats);
+    hbverify(NUM_VALUES == stats.m_NumBlobs);
+    hbverify(NUM_VALUES * VALUE_LEN == stats.m_NumBytes);
+    hbverify((u64)numKeys - NUM_VALUES == stats.m_NumHits);
+
+    //Keys with equal values share a Blob.
+    Blob* shared[NUM_VALUES];
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType));
+        if(i < NUM_VALUES)
+        {
+            shared[i] = value.m_Blob;
+        }
+
+        hbverify(shared[i % NUM_VALUES] == value.m_Blob);
+    }
+
+    //Patching a shared value copies it.
+    const byte patchData[] = "patched";
+    Blob* patch = Blob::Create(patchData, sizeof(patchData));
+    const Blob* patches[] = {patch};
+    const size_t offsets[] = {0};
+    hbverify(ht->Patch(kv[0].m_Key, m_KeyType, 1, patches, offsets));
+    patch->Unref();
+
+    const byte* data;
+    hbverify(ht->Find(kv[0].m_Key, m_KeyType, &value, &valueType));
+    hbverify(shared[0] != value.m_Blob);
+    hbverify(VALUE_LEN == value.m_Blob->GetData(&data));
+    hbverify(0 == memcmp(patchData, data, sizeof(patchData)));
+
+    hbverify(ht->Find(kv[NUM_VALUES].m_Key, m_KeyType, &value, &valueType));
+    hbverify(VALUE_LEN == value.m_Blob->GetData(&data));
+    hbverify(0 == memcmp(valueData[0], data, VALUE_LEN));
+
+    //A value leaves the pool with its last key.
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Clear(kv[i].m_Key, m_KeyType));
+    }
+
+    ht->GetInternStats(&stats);
+    hbverify(0 == stats.m_NumBlobs);
+    hbverify(0 == stats.m_NumBytes);
+
     ht->Unref();
 
     KV::DestroyKeys(kv, numKeys);
@@ -335,13 +713,14 @@ struct KV_Patch
     char m_Test[SECTION_LEN*3];
 };
 
+template<typename T>
 void
 HashTableTest::TestMergeIntKeys(const int numKeys, const int numIterations)
 {
     char alphabet[1024];
     CreateRandomString(alphabet, sizeof(alphabet));
 
-    HashTable* ht = HashTable::Create();
+    T* ht = T::Create();
     Value value;
     ValueType valueType;
 
@@ -362,7 +741,7 @@ HashTableTest::TestMergeIntKeys(const int numKeys, const int numIterations)
         p = kv;
         for(int i = 0; i < numKeys; ++i, ++p)
         {
-            const unsigned offset = Rand(0, KV_Patch::SECTION_LEN-1);
+            const size_t offset = Rand(0, KV_Patch::SECTION_LEN-1);
             const unsigned len = Rand(1, KV_Patch::SECTION_LEN);
             if(offset+len > p->m_FinalLen)
             {
@@ -383,6 +762,29 @@ HashTableTest::TestMergeIntKeys(const int numKeys, const int numIterations)
             memcpy(&p->m_Test[offset], &alphabet[abOffset], len);
         }
 
+        //Append to every value, the way APPEND does.
+        if(iter == numIterations-1)
+        {
+            p = kv;
+            for(int i = 0; i < numKeys; ++i, ++p)
+            {
+                for(int j = 0; j < 4; ++j)
+                {
+                    const unsigned len = 32;
+                    const size_t offset = p->m_FinalLen;
+                    const unsigned abOffset = Rand() % (sizeof(alphabet) - len);
+                    Blob* blob = Blob::Create((byte*)&alphabet[abOffset], len);
+                    const Blob* value = blob;
+
+                    hbverify(ht->Patch(p->m_Key, VALUETYPE_INT, 1, &value, &offset));
+                    blob->Unref();
+
+                    memcpy(&p->m_Test[offset], &alphabet[abOffset], len);
+                    p->m_FinalLen += len;
+                }
+            }
+        }
+
         //std::random_shuffle(&kv[0], &kv[numKeys]);
 
         //Check they've been added
@@ -412,10 +814,24 @@ HashTableTest::TestMergeIntKeys(const int numKeys, const int numIterations)
     delete [] kv;
 }
 
+void
+HashTableTest::TestMergeIntKeys(const int numKeys, const int numIterations)
+{
+    if(HASHTABLE_SWISS == m_Engine)
+    {
+        TestMergeIntKeys<SwissTable>(numKeys, numIterations);
+    }
+    else
+    {
+        TestMergeIntKeys<HashTable>(numKeys, numIterations);
+    }
+}
+
+template<typename T>
 void
 HashTableTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
 {
-    HashTable* ht = HashTable::Create();
+    T* ht = T::Create();
     Value value;
     ValueType valueType;
 
@@ -476,10 +892,24 @@ HashTableTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
     KV::DestroyKeys(kv, numKeys);
 }
 
+void
+HashTableTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
+{
+    if(HASHTABLE_SWISS == m_Engine)
+    {
+        AddKeys<SwissTable>(numKeys, keyOrder);
+    }
+    else
+    {
+        AddKeys<HashTable>(numKeys, keyOrder);
+    }
+}
+
+template<typename T>
 void
 HashTableTest::AddDeleteKeys(const int numKeys, const TestKeyOrder keyOrder)
 {
-    HashTable* ht = HashTable::Create();
+    T* ht = T::Create();
     Value value;
     ValueType valueType;
 
@@ -522,67 +952,402 @@ HashTableTest::AddDeleteKeys(const int numKeys, const TestKeyOrder keyOrder)
         }
     }
 
-    ht->Unref();
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableTest::AddDeleteKeys(const int numKeys, const TestKeyOrder keyOrder)
+{
+    if(HASHTABLE_SWISS == m_Engine)
+    {
+        AddDeleteKeys<SwissTable>(numKeys, keyOrder);
+    }
+    else
+    {
+        AddDeleteKeys<HashTable>(numKeys, keyOrder);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  HashTableSpeedTest
+///////////////////////////////////////////////////////////////////////////////
+HashTableSpeedTest::HashTableSpeedTest(const ValueType keyType,
+                                        const ValueType valueType,
+                                        const HashTableEngine engine)
+: m_KeyType(keyType)
+, m_ValueType(valueType)
+, m_Engine(engine)
+{
+}
+
+template<typename T>
+void
+HashTableSpeedTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
+{
+    T* ht = T::Create();
+    Value value;
+    ValueType valueType;
+
+    StopWatch sw;
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, keyOrder, numKeys);
+
+    Blob::sm_StopWatch.Clear();
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        ht->Set(kv[i].m_Key, m_KeyType, kv[i].m_Value, m_ValueType);
+    }
+    sw.Stop();
+    s_Log.Debug("set: %f", sw.GetElapsed());
+    s_Log.Debug("compare: %f", Blob::sm_StopWatch.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    //std::random_shuffle(&kv[0], &kv[numKeys]);
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType);
+    }
+    sw.Stop();
+    s_Log.Debug("find: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    //The same lookups in batches, the way MGET makes them.
+    static const int FIND_MANY_BATCH_SIZE = 100;
+    Value* keys = new Value[numKeys];
+    Value values[FIND_MANY_BATCH_SIZE];
+    ValueType valueTypes[FIND_MANY_BATCH_SIZE];
+    bool found[FIND_MANY_BATCH_SIZE];
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i] = kv[i].m_Key;
+    }
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; i += FIND_MANY_BATCH_SIZE)
+    {
+        const int count = std::min(FIND_MANY_BATCH_SIZE, numKeys - i);
+        ht->FindMany(count, &keys[i], m_KeyType, values, valueTypes, found);
+    }
+    sw.Stop();
+    s_Log.Debug("find many: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    delete [] keys;
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        ht->Clear(kv[i].m_Key, m_KeyType);
+    }
+    sw.Stop();
+    s_Log.Debug("delete: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    ht->Unref();
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+void
+HashTableSpeedTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
+{
+    if(HASHTABLE_SWISS == m_Engine)
+    {
+        AddKeys<SwissTable>(numKeys, keyOrder);
+    }
+    else
+    {
+        AddKeys<HashTable>(numKeys, keyOrder);
+    }
+}
+
+void
+HashTableSpeedTest::LoadKeys(const int numKeys)
+{
+    StopWatch sw;
+
+    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, KEYORDER_RANDOM, numKeys);
+
+    Value* keys = new Value[numKeys];
+    Value* values = new Value[numKeys];
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        keys[i] = kv[i].m_Key;
+        values[i] = kv[i].m_Value;
+    }
+
+    HashTable* ht = HashTable::Create();
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        ht->Set(kv[i].m_Key, m_KeyType, kv[i].m_Value, m_ValueType);
+    }
+    sw.Stop();
+    s_Log.Debug("set: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+    ht->Unref();
+
+    ht = HashTable::Create();
+    sw.Restart();
+    ht->Reserve(numKeys);
+    ht->LoadMany(numKeys, keys, m_KeyType, values, m_ValueType);
+    sw.Stop();
+    s_Log.Debug("reserve and load: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+    ht->Unref();
+
+    delete [] values;
+    delete [] keys;
+
+    KV::DestroyKeys(kv, numKeys);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  IntHashTableTest
+///////////////////////////////////////////////////////////////////////////////
+void
+IntHashTableTest::Test(const int numKeys)
+{
+    IntHashTable<Value>* ht = IntHashTable<Value>::Create();
+    Value value;
+
+    KV* kv = KV::CreateKeys(VALUETYPE_INT, 0, VALUETYPE_INT, 0, KEYORDER_RANDOM, numKeys);
+
+    //Spread the keys over the whole range, including the one that
+    //marks empty slots.
+    kv[0].m_Key.m_Int = (s64)0x8000000000000000ull;
+    for(int i = 1; i < numKeys; ++i)
+    {
+        kv[i].m_Key.m_Int = (s64)(kv[i].m_Key.m_Int * 0x9e3779b97f4a7c15ull);
+    }
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Set(kv[i].m_Key.m_Int, kv[i].m_Value));
+    }
+
+    hbverify((size_t)numKeys == ht->Count());
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Find(kv[i].m_Key.m_Int, &value));
+        hbverify(value.m_Int == kv[i].m_Value.m_Int);
+    }
+
+    //Overwrite every other key, then delete most of them so the table
+    //shrinks, checking the rest can still be found.
+    for(int i = 0; i < numKeys; i += 2)
+    {
+        kv[i].m_Value.m_Int = ~kv[i].m_Value.m_Int;
+        hbverify(ht->Set(kv[i].m_Key.m_Int, kv[i].m_Value));
+    }
+
+    hbverify((size_t)numKeys == ht->Count());
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        if(i % 16)
+        {
+            hbverify(ht->Clear(kv[i].m_Key.m_Int));
+            hbverify(!ht->Clear(kv[i].m_Key.m_Int));
+        }
+
+        const int j = (int)Rand(0, i + 1);
+        hbverify(ht->Find(kv[j].m_Key.m_Int, &value) == (0 == j % 16));
+        hbverify(0 != j % 16 || value.m_Int == kv[j].m_Value.m_Int);
+    }
+
+    for(int i = 0; i < numKeys; i += 16)
+    {
+        hbverify(ht->Clear(kv[i].m_Key.m_Int));
+    }
+
+    hbverify(0 == ht->Count());
+
+    //A reserved table doesn't shrink.
+    hbverify(ht->Reserve(numKeys));
+    const size_t reservedBytes = ht->GetEntryBytes();
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Set(kv[i].m_Key.m_Int, kv[i].m_Value));
+    }
+
+    hbverify(reservedBytes == ht->GetEntryBytes());
+
+    for(int i = 0; i < numKeys; ++i)
+    {
+        hbverify(ht->Clear(kv[i].m_Key.m_Int));
+    }
+
+    hbverify(reservedBytes == ht->GetEntryBytes());
+
+    IntHashTable<Value>::Destroy(ht);
 
     KV::DestroyKeys(kv, numKeys);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//  HashTableSpeedTest
+//  IntHashTableSpeedTest
 ///////////////////////////////////////////////////////////////////////////////
-HashTableSpeedTest::HashTableSpeedTest(const ValueType keyType, const ValueType valueType)
-: m_KeyType(keyType)
-, m_ValueType(valueType)
-{
-}
-
 void
-HashTableSpeedTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
+IntHashTableSpeedTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder)
 {
-    HashTable* ht = HashTable::Create();
+    StopWatch sw;
     Value value;
     ValueType valueType;
 
-    StopWatch sw;
+    KV* kv = KV::CreateKeys(VALUETYPE_INT, 0, VALUETYPE_INT, 0, keyOrder, numKeys);
 
-    KV* kv = KV::CreateKeys(m_KeyType, KEY_SIZE_BLOB, m_ValueType, VALUE_SIZE_BLOB, keyOrder, numKeys);
+    HashTable* ht = HashTable::Create();
 
-    Blob::sm_StopWatch.Clear();
     sw.Restart();
     for(int i = 0; i < numKeys; ++i)
     {
-        ht->Set(kv[i].m_Key, m_KeyType, kv[i].m_Value, m_ValueType);
+        ht->Set(kv[i].m_Key, VALUETYPE_INT, kv[i].m_Value, VALUETYPE_INT);
     }
     sw.Stop();
-    s_Log.Debug("set: %f", sw.GetElapsed());
-    s_Log.Debug("compare: %f", Blob::sm_StopWatch.GetElapsed());
+    s_Log.Debug("HashTable set: %f", sw.GetElapsed());
     s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
 
-    //std::random_shuffle(&kv[0], &kv[numKeys]);
-
     sw.Restart();
     for(int i = 0; i < numKeys; ++i)
     {
-        ht->Find(kv[i].m_Key, m_KeyType, &value, &valueType);
+        ht->Find(kv[i].m_Key, VALUETYPE_INT, &value, &valueType);
     }
     sw.Stop();
-    s_Log.Debug("find: %f", sw.GetElapsed());
+    s_Log.Debug("HashTable find: %f", sw.GetElapsed());
     s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
 
     sw.Restart();
     for(int i = 0; i < numKeys; ++i)
     {
-        ht->Clear(kv[i].m_Key, m_KeyType);
+        ht->Clear(kv[i].m_Key, VALUETYPE_INT);
     }
     sw.Stop();
-    s_Log.Debug("delete: %f", sw.GetElapsed());
+    s_Log.Debug("HashTable delete: %f", sw.GetElapsed());
     s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
 
     ht->Unref();
 
+    IntHashTable<Value>* iht = IntHashTable<Value>::Create();
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        iht->Set(kv[i].m_Key.m_Int, kv[i].m_Value);
+    }
+    sw.Stop();
+    s_Log.Debug("IntHashTable set: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+    s_Log.Debug("bytes/entry: %f", iht->GetEntryBytes()/(double)numKeys);
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        iht->Find(kv[i].m_Key.m_Int, &value);
+    }
+    sw.Stop();
+    s_Log.Debug("IntHashTable find: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    sw.Restart();
+    for(int i = 0; i < numKeys; ++i)
+    {
+        iht->Clear(kv[i].m_Key.m_Int);
+    }
+    sw.Stop();
+    s_Log.Debug("IntHashTable delete: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
+
+    IntHashTable<Value>::Destroy(iht);
+
     KV::DestroyKeys(kv, numKeys);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//  HeapSpeedTest
+///////////////////////////////////////////////////////////////////////////////
+void
+HeapSpeedTest::Churn(const int numObjects, const int numRounds)
+{
+    //Sizes of the small objects the dicts and trees allocate.
+    static const size_t SIZES[] = {40, 48, 64, 96, 128, 200};
+
+    StopWatch sw;
+    void** objects = new void*[numObjects];
+    size_t* sizes = new size_t[numObjects];
+    int* victims = new int[numObjects];
+
+    for(int i = 0; i < numObjects; ++i)
+    {
+        sizes[i] = SIZES[Rand() % hbarraylen(SIZES)];
+        victims[i] = Rand() % numObjects;
+    }
+
+    //Both allocators replace random objects with the same sequence.
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        const bool heap = (0 == pass);
+
+        sw.Restart();
+        for(int i = 0; i < numObjects; ++i)
+        {
+            objects[i] = heap ? Heap::Alloc(sizes[i]) : malloc(sizes[i]);
+        }
+
+        for(int round = 0; round < numRounds; ++round)
+        {
+            for(int i = 0; i < numObjects; ++i)
+            {
+                const int victim = victims[i];
+                if(heap)
+                {
+                    Heap::Free(objects[victim]);
+                    objects[victim] = Heap::Alloc(sizes[i]);
+                }
+                else
+                {
+                    free(objects[victim]);
+                    objects[victim] = malloc(sizes[i]);
+                }
+            }
+        }
+
+        if(heap)
+        {
+            s_Log.Debug("Heap fragmentation: %f", Heap::GetFragmentation());
+        }
+
+        for(int i = 0; i < numObjects; ++i)
+        {
+            if(heap)
+            {
+                Heap::Free(objects[i]);
+            }
+            else
+            {
+                free(objects[i]);
+            }
+        }
+        sw.Stop();
+
+        s_Log.Debug("%s churn: %f", heap ? "Heap" : "malloc", sw.GetElapsed());
+        s_Log.Debug("ops/sec: %f", (numObjects * (2.0 * numRounds + 2)) / sw.GetElapsed());
+    }
+
+    delete [] victims;
+    delete [] sizes;
+    delete [] objects;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //  BTreeTest
 ///////////////////////////////////////////////////////////////////////////////
@@ -625,6 +1390,14 @@ BTreeTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder, const bool un
 
     btree->Validate();
 
+    //Moving nodes and values mustn't lose any keys.
+    sw.Restart();
+    const size_t numMoved = btree->Defrag();
+    sw.Stop();
+    s_Log.Debug("defrag: %f, %u moved", sw.GetElapsed(), (unsigned)numMoved);
+
+    btree->Validate();
+
     std::random_shuffle(&kv[0], &kv[numKeys]);
 
     sw.Restart();
@@ -909,6 +1682,14 @@ SkipListTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder, const bool
     s_Log.Debug("insert: %f", sw.GetElapsed());
     s_Log.Debug("ops/sec: %f", numKeys/sw.GetElapsed());
 
+    //Moving nodes and values mustn't lose any keys.
+    sw.Restart();
+    const size_t numMoved = skiplist->Defrag();
+    sw.Stop();
+    s_Log.Debug("defrag: %f, %u moved", sw.GetElapsed(), (unsigned)numMoved);
+
+    skiplist->Validate();
+
     std::random_shuffle(&kv[0], &kv[numKeys]);
 
     sw.Restart();
@@ -1129,6 +1910,8 @@ SortedSetTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder, const boo
 
     s_Log.Debug("utilization: %f", set->GetUtilization());
 
+    hbverify((u64)numKeys == set->Count());
+
     if(KEYORDER_RANDOM == keyOrder)
     {
         std::sort(&kv[0], &kv[numKeys]);
@@ -1154,6 +1937,8 @@ SortedSetTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder, const boo
     }
     sw.Stop();
 
+    hbverify(0 == set->Count());
+
     SortedSet::Destroy(set);
 
     KV::DestroyKeys(kv, numKeys);
@@ -1213,4 +1998,330 @@ SortedSetSpeedTest::AddKeys(const int numKeys, const TestKeyOrder keyOrder, cons
     KV::DestroyKeys(kv, numKeys);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//  CommandSpeedTest
+///////////////////////////////////////////////////////////////////////////////
+void
+CommandSpeedTest::Parse(const int numCmds, const int maxValueSize)
+{
+    const size_t maxCmdLen = 64 + maxValueSize;
+    byte* stream = new byte[numCmds * maxCmdLen];
+    char* value = new char[maxValueSize + 1];
+    memset(value, 'v', maxValueSize);
+    value[maxValueSize] = '\0';
+
+    size_t len = 0;
+    for(int i = 0; i < numCmds; ++i)
+    {
+        char key[32];
+        const int keyLen = sprintf(key, "key:%u", Rand());
+
+        if(Rand() & 1)
+        {
+            const int valueLen = (int)Rand(1, maxValueSize);
+            len += sprintf((char*)&stream[len],
+                            "*3\r\n$3\r\nset\r\n$%d\r\n%s\r\n$%d\r\n%.*s\r\n",
+                            keyLen, key, valueLen, valueLen, value);
+        }
+        else
+        {
+            len += sprintf((char*)&stream[len],
+                            "*2\r\n$3\r\nget\r\n$%d\r\n%s\r\n",
+                            keyLen, key);
+        }
+    }
+
+    Parse(stream, len, 1);
+
+    delete [] value;
+    delete [] stream;
+}
+
+void
+CommandSpeedTest::ParseCapture(const char* fileName, const int numIterations)
+{
+    FILE* fp = fopen(fileName, "rb");
+    if(!hbverify(fp))
+    {
+        return;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    const size_t len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    byte* stream = new byte[len];
+    hbverify(len == fread(stream, 1, len, fp));
+    fclose(fp);
+
+    Parse(stream, len, numIterations);
+
+    delete [] stream;
+}
+
+void
+CommandSpeedTest::Parse(const byte* stream, const size_t len, const int numIterations)
+{
+    StopWatch sw;
+    int numCmds[2] = {0, 0};
+
+    for(int fast = 0; fast < 2; ++fast)
+    {
+        Command::sm_FastParse = (0 != fast);
+
+        Command cmd;
+        Error err;
+
+        sw.Restart();
+        for(int i = 0; i < numIterations; ++i)
+        {
+            for(size_t pos = 0; pos < len;)
+            {
+                pos += cmd.Parse(&stream[pos], len - pos, &err);
+                if(!hbverify(err.Succeeded()))
+                {
+                    break;
+                }
+
+                if(cmd.IsComplete())
+                {
+                    ++numCmds[fast];
+                    cmd.Reset();
+                }
+            }
+        }
+        sw.Stop();
+
+        s_Log.Debug("%s: %f", fast ? "fast" : "incremental", sw.GetElapsed());
+        s_Log.Debug("cmds/sec: %f", numCmds[fast]/sw.GetElapsed());
+    }
+
+    Command::sm_FastParse = true;
+
+    hbverify(numCmds[0] == numCmds[1]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  HashSpeedTest
+///////////////////////////////////////////////////////////////////////////////
+void
+HashSpeedTest::Hash(const int numKeys, const int minKeyLen, const int maxKeyLen, const int numIterations)
+{
+    //All the keys in one buffer so the timing is of the hashes and not
+    //of cache misses.
+    size_t* offsets = new size_t[numKeys + 1];
+    byte* keys = new byte[numKeys * maxKeyLen];
+
+    offsets[0] = 0;
+    for(int i = 0; i < numKeys; ++i)
+    {
+        const size_t keyLen = Rand(minKeyLen, maxKeyLen);
+        for(size_t j = 0; j < keyLen; ++j)
+        {
+            keys[offsets[i] + j] = (byte)Rand();
+        }
+
+        offsets[i + 1] = offsets[i] + keyLen;
+    }
+
+    StopWatch sw;
+    u64 sum = 0;
+
+    sw.Restart();
+    for(int n = 0; n < numIterations; ++n)
+    {
+        for(int i = 0; i < numKeys; ++i)
+        {
+            sum += MurmurHash2(&keys[offsets[i]], (int)(offsets[i + 1] - offsets[i]), n);
+        }
+    }
+    sw.Stop();
+    s_Log.Debug("murmur2: %f", sw.GetElapsed());
+    s_Log.Debug("hashes/sec: %f", numKeys*(double)numIterations/sw.GetElapsed());
+
+    for(int k = 0; k < HASHKERNEL_COUNT; ++k)
+    {
+        const HashKernel kernel = (HashKernel)k;
+        if(!IsHashKernelSupported(kernel))
+        {
+            s_Log.Debug("%s: not supported", GetHashKernelName(kernel));
+            continue;
+        }
+
+        sw.Restart();
+        for(int n = 0; n < numIterations; ++n)
+        {
+            for(int i = 0; i < numKeys; ++i)
+            {
+                sum += Hash64(kernel, &keys[offsets[i]], offsets[i + 1] - offsets[i], n);
+            }
+        }
+        sw.Stop();
+        s_Log.Debug("%s: %f", GetHashKernelName(kernel), sw.GetElapsed());
+        s_Log.Debug("hashes/sec: %f", numKeys*(double)numIterations/sw.GetElapsed());
+    }
+
+    //Keeps the compiler from dropping the hashes.
+    s_Log.Debug("sum: %llx", (unsigned long long)sum);
+
+    delete [] keys;
+    delete [] offsets;
+}
+
+#if defined(__linux__)
+
+///////////////////////////////////////////////////////////////////////////////
+//  NetworkSpeedTest
+///////////////////////////////////////////////////////////////////////////////
+class NetServerThreadArgs
+{
+public:
+    unsigned m_Port;
+    NetworkEngine m_Engine;
+    unsigned m_NumShards;
+    bool m_Result;
+};
+
+static void*
+NetServerThread(void* arg)
+{
+    NetServerThreadArgs* args = (NetServerThreadArgs*) arg;
+    args->m_Result = Network::Startup(args->m_Port, args->m_Engine, args->m_NumShards);
+    return NULL;
+}
+
+static int
+NetConnect(const unsigned port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    //Retry while the server thread is still starting up.
+    for(int i = 0; i < 200; ++i)
+    {
+        const int skt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(skt < 0)
+        {
+            return -1;
+        }
+
+        if(0 == connect(skt, (sockaddr*)&addr, sizeof(addr)))
+        {
+            const int noDelay = 1;
+            setsockopt(skt, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            return skt;
+        }
+
+        close(skt);
+        usleep(10*1000);
+    }
+
+    return -1;
+}
+
+NetworkSpeedTest::NetworkSpeedTest(const NetworkEngine engine, const unsigned port, const unsigned numShards)
+: m_Engine(engine)
+, m_Port(port)
+, m_NumShards(numShards)
+{
+}
+
+void
+NetworkSpeedTest::SetGet(const int numOps, const int numClients, const int pipelineDepth, const int valueSize)
+{
+    NetServerThreadArgs args;
+    args.m_Port = m_Port;
+    args.m_Engine = m_Engine;
+    args.m_NumShards = m_NumShards;
+    args.m_Result = false;
+
+    pthread_t serverThread;
+    hbverify(0 == pthread_create(&serverThread, NULL, NetServerThread, &args));
+
+    int* skts = new int[numClients];
+    for(int i = 0; i < numClients; ++i)
+    {
+        skts[i] = NetConnect(m_Port);
+        hbverify(skts[i] >= 0);
+    }
+
+    //Each pipelined command pair sets a key and reads it back.
+    const int numPairs = pipelineDepth / 2 > 0 ? pipelineDepth / 2 : 1;
+    const int numRounds = numOps / (numClients * numPairs * 2);
+
+    //"+OK\r\n" for the set, "$<valueSize>\r\n<value>\r\n" for the get.
+    char lenBuf[32];
+    const size_t pairReplySize =
+        5 + snprintf(lenBuf, sizeof(lenBuf), "$%d\r\n", valueSize) + valueSize + 2;
+
+    const size_t replySize = numPairs * pairReplySize;
+    char* request = new char[numPairs * (128 + valueSize)];
+    char* reply = new char[replySize];
+
+    char* value = new char[valueSize + 1];
+    memset(value, 'v', valueSize);
+    value[valueSize] = '\0';
+
+    StopWatch sw;
+
+    sw.Restart();
+    for(int round = 0; round < numRounds; ++round)
+    {
+        for(int c = 0; c < numClients; ++c)
+        {
+            size_t len = 0;
+            for(int i = 0; i < numPairs; ++i)
+            {
+                char key[16];
+                snprintf(key, sizeof(key), "key:%06d", (round * numPairs + i) % 1000000);
+                len += sprintf(&request[len],
+                                "*3\r\n$3\r\nset\r\n$10\r\n%s\r\n$%d\r\n%s\r\n"
+                                "*2\r\n$3\r\nget\r\n$10\r\n%s\r\n",
+                                key, valueSize, value, key);
+            }
+
+            hbverify(send(skts[c], request, len, MSG_NOSIGNAL) == (ssize_t)len);
+        }
+
+        for(int c = 0; c < numClients; ++c)
+        {
+            size_t len = 0;
+            while(len < replySize)
+            {
+                const ssize_t numRead = recv(skts[c], &reply[len], replySize - len, 0);
+                hbverify(numRead > 0);
+                len += numRead;
+            }
+
+            hbverify('+' == reply[0]);
+            hbverify('$' == reply[5]);
+        }
+    }
+    sw.Stop();
+
+    const int numCmds = numRounds * numClients * numPairs * 2;
+    s_Log.Debug("commands: %d", numCmds);
+    s_Log.Debug("set/get: %f", sw.GetElapsed());
+    s_Log.Debug("ops/sec: %f", numCmds/sw.GetElapsed());
+
+    for(int i = 0; i < numClients; ++i)
+    {
+        close(skts[i]);
+    }
+
+    Network::Shutdown();
+    pthread_join(serverThread, NULL);
+    hbverify(args.m_Result);
+
+    delete [] value;
+    delete [] reply;
+    delete [] request;
+    delete [] skts;
+}
+
+#endif  //__linux__
+
 }   //namespace honeybase
\ No newline at end of file
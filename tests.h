@@ -1,4 +1,5 @@
 #include "hb.h"
+#include "network.h"
 
 namespace honeybase
 {
@@ -10,6 +11,12 @@ enum TestKeyOrder
     KEYORDER_DESCENDING
 };
 
+enum HashTableEngine
+{
+    HASHTABLE_CHAINED,
+    HASHTABLE_SWISS
+};
+
 class KV
 {
 public:
@@ -64,7 +71,9 @@ class HashTableTest
 {
 public:
 
-    HashTableTest(const ValueType keyType, const ValueType valueType);
+    HashTableTest(const ValueType keyType,
+                    const ValueType valueType,
+                    const HashTableEngine engine = HASHTABLE_CHAINED);
 
     void Test(const int numKeys);
 
@@ -76,24 +85,77 @@ public:
 
 private:
 
+    template<typename T> void Test(const int numKeys);
+
+    template<typename T> void TestMergeIntKeys(const int numKeys, const int numIterations);
+
+    template<typename T> void AddKeys(const int numKeys, const TestKeyOrder keyOrder);
+
+    template<typename T> void AddDeleteKeys(const int numKeys, const TestKeyOrder keyOrder);
+
+    //HashTable only.
+    void TestRehashFor(const int numKeys);
+
+    //HashTable only.
+    void TestLoadMany(const int numKeys);
+
+    //HashTable only.
+    void TestDefragFor(const int numKeys);
+
+    //HashTable only.
+    void TestInternValues(const int numKeys);
+
     const ValueType m_KeyType;
     const ValueType m_ValueType;
+    const HashTableEngine m_Engine;
 };
 
 class HashTableSpeedTest
 {
 public:
 
-    HashTableSpeedTest(const ValueType keyType, const ValueType valueType);
+    HashTableSpeedTest(const ValueType keyType,
+                        const ValueType valueType,
+                        const HashTableEngine engine = HASHTABLE_CHAINED);
 
     void AddKeys(const int numKeys, const TestKeyOrder keyOrder);
 
+    //Compares Set() into a new table with Reserve() and LoadMany().
+    //HashTable only.
+    void LoadKeys(const int numKeys);
+
     //void AddDeleteRandomKeys(const int numKeys);
 
 private:
 
+    template<typename T> void AddKeys(const int numKeys, const TestKeyOrder keyOrder);
+
     const ValueType m_KeyType;
     const ValueType m_ValueType;
+    const HashTableEngine m_Engine;
+};
+
+class IntHashTableTest
+{
+public:
+
+    void Test(const int numKeys);
+};
+
+//Compares IntHashTable with HashTable on the same int keys.
+class IntHashTableSpeedTest
+{
+public:
+
+    void AddKeys(const int numKeys, const TestKeyOrder keyOrder);
+};
+
+//Compares Heap with malloc on small objects being replaced at random.
+class HeapSpeedTest
+{
+public:
+
+    void Churn(const int numObjects, const int numRounds);
 };
 
 class BTreeTest
@@ -194,4 +256,56 @@ private:
     const ValueType m_ValueType;
 };
 
+//Command::Parse() benchmark.  Times the same command stream with the
+//incremental state machine alone and with the whole command fast path.
+class CommandSpeedTest
+{
+public:
+
+    //Parses a generated stream of numCmds set and get commands with
+    //values of up to maxValueSize bytes.
+    void Parse(const int numCmds, const int maxValueSize);
+
+    //Parses a raw capture of client traffic numIterations times.
+    void ParseCapture(const char* fileName, const int numIterations);
+
+private:
+
+    void Parse(const byte* stream, const size_t len, const int numIterations);
+};
+
+//Hash64() benchmark.  Times MurmurHash2 and each kernel the CPU
+//supports over the same keys.
+class HashSpeedTest
+{
+public:
+
+    //Hashes numKeys keys of minKeyLen to maxKeyLen bytes, numIterations
+    //times over.
+    void Hash(const int numKeys, const int minKeyLen, const int maxKeyLen, const int numIterations);
+};
+
+#if defined(__linux__)
+
+//Loopback benchmark for the network engines.  Starts a server with
+//numShards shards on its own thread, then drives numClients
+//connections that each send pipelineDepth set/get commands with
+//valueSize byte values per round trip.
+class NetworkSpeedTest
+{
+public:
+
+    NetworkSpeedTest(const NetworkEngine engine, const unsigned port, const unsigned numShards);
+
+    void SetGet(const int numOps, const int numClients, const int pipelineDepth, const int valueSize);
+
+private:
+
+    const NetworkEngine m_Engine;
+    const unsigned m_Port;
+    const unsigned m_NumShards;
+};
+
+#endif  //__linux__
+
 }   //namespace honeybase
\ No newline at end of file